@@ -9,20 +9,33 @@
 #include "RV32_asm_D.hpp"
 #include "RV32_asm_F.hpp"
 #include "RV32_asm_I.hpp"
+#include "RV32_asm_listing.hpp"
 #include "RV32_asm_M.hpp"
+#include "RV32_asm_object.hpp"
+#include "RV32_asm_peephole.hpp"
+#include "RV32_asm_schedule.hpp"
 #include "RV32_asm_float.hpp"
 
+#include <array>
+
 ////////////////////////////////////////////////////////////////////////////////
 // ライブラリの定義
 
 namespace RV32_asm {
 
 class Generator : public virtual Base {
-  static void clear_cache() {
+  static void clear_cache(const unsigned char *p, size_t size) {
+    (void)p;  // RISC-V の Linux 以外では使わない
+    (void)size;
 #if TARGET == TARGET_RISCV
 #if COMPILER == COMPILER_GCC
+#ifdef __linux__
+    // 他のハートの命令キャッシュもカーネル経由で同期する
+    __builtin___clear_cache((char *)p, (char *)p + size);
+#else
     asm volatile("fence.i" ::: "memory");
 #endif
+#endif
 #endif
   }
 
@@ -33,41 +46,221 @@ class Generator : public virtual Base {
   // コード生成関数
 
   void dw(uint32_t word) {
-    env << [=](Env &e) { e.dw(word, ".long"); };
+    env.dw(word, ".long");
   }
 
   void dh(unsigned int hw) {
-    env << [=](Env &e) { e.dh(hw, ".word"); };
+    env.dh(hw, ".word");
+  }
+
+  // StaticGenerator でコンパイル時に生成した命令列を埋め込む
+  template <size_t N>
+  void dh(const std::array<uint16_t, N> &code) {
+    for (size_t i = 0; i < N; ++i) {
+      env.dh(code[i], ".word");
+    }
+  }
+  template <size_t N>
+  void dw(const std::array<uint32_t, N> &code) {
+    for (size_t i = 0; i < N; ++i) {
+      env.dw(code[i], ".long");
+    }
+  }
+
+  // loadConst() で使った定数のリテラルプールを現在の位置に置く
+  // 呼ばなかった場合は、コードの末尾にまとめて置く。
+  // 実行が流れ込まないように、 ret や j の後で呼ぶこと。
+  void literalPool() { env.flushLiterals(); }
+
+  // 次の命令を n バイト境界に揃える(n は 2 - 128 の2の冪)
+  // 詰め物は最少の命令数になるように、 c.nop を高々1つと残りを nop で埋める。
+  // c.nop が入るのは 16 ビットの命令や dh() の後で境界がずれている場合だけ。
+  // generate() / publish() は関数の先頭も n バイト境界に置く。
+  void align(uint32_t n) { env.alignCode(n); }
+
+  // align() / alignLoop() で揃えた最大の境界(揃えていない場合は 1)
+  // コードを自分で配置する場合は、先頭をこの境界に置く。
+  uint32_t getCodeAlign() const { return env.getCodeAlign(); }
+
+  // ループの先頭を setLoopAlign() で指定した境界(既定は 16 バイト)に揃える
+  // ループの先頭のラベルを定義する直前に呼ぶ。
+  void alignLoop() { env.alignLoop(); }
+
+  // alignLoop() で揃える境界を n バイトにする(1 の場合は揃えない)
+  // backward が true の場合は、以降に記述する後方への分岐・ジャンプの飛び先も
+  // 同じ境界に揃える(直接書き込みモードでは揃えられない)。
+  // reset() / beginFunction() で既定に戻るので、関数ごとに指定する。
+  void setLoopAlign(uint32_t n, bool backward = false) {
+    env.setLoopAlign(n, backward);
   }
 
+  // beginCold() から endCold() までに記述した命令を、めったに実行しない
+  // cold の命令としてコードの末尾(リテラルプールの前)にまとめて置く
+  // hot の命令は cold の命令が無いものとして続けて実行されるので、
+  // cold の命令には分岐で入り、最後は j や ret で抜けること。
+  // hot の命令が連続して並ぶので、 cold への分岐も含めて配置時に最短の
+  // 形式(圧縮命令)が選ばれる。入れ子にはできない。
+  // 直接書き込みモードでは移動できないので、 cold の命令を飛び越す j を置く。
+  void beginCold() { env.beginCold(); }
+  void endCold() { env.endCold(); }
+
   // 生成したコードをテンプレートで指定された関数ポインタとして返す
+  // コード領域に収まらない場合など、エラーの場合は NULL を返す
   template <typename T>
   T generate() {
-    auto p = alloc.getMemory();
-    size_t code_size = env.generate(p, alloc.getSize());
-    clear_cache();
-#if IN_DEBUG_MODE
-    printf("%d byte code generated at %p.\n", (int)code_size, p);
-    for (size_t i = 0; i < code_size; ++i) {
-      printf("%02x%s", p[i], (i % 16) == 15 ? "\n" : " ");
+    return (T)build(NULL);
+  }
+
+  // 生成したコードを共有のコード領域 arena に配置し、関数ポインタとして返す
+  // 不要になったら arena.release() で領域を返却すること
+  template <typename T>
+  T generate(CodeArena &arena) {
+    return (T)build(arena, false);
+  }
+
+  // 生成したコードを arena に配置して handle に公開する
+  // 別々のスレッドの生成器から、同じ arena に同時に配置できる。
+  // 配置した領域は arena が破棄されるまで解放されない。
+  // 生成に失敗した場合は handle を変更せずに false を返す。
+  template <typename T>
+  bool publish(CodeArena &arena, CodeHandle<T> &handle) {
+    T fn = (T)build(arena, true);
+    if (fn == NULL) {
+      return false;
     }
-    puts("");
-#endif
-    return (T)p;
+    handle.publish(fn);
+    return true;
   }
 
   // 生成したコードを返す
-  const unsigned char *getCode(size_t *pSize) {
-    auto p = alloc.getMemory();
-    size_t code_size = env.generate(p, alloc.getSize());
-    clear_cache();
-#if IN_DEBUG_MODE
-    printf("%d byte code generated at %p.\n", (int)code_size, p);
-    for (size_t i = 0; i < code_size; ++i) {
-      printf("%02x%s", p[i], (i % 16) == 15 ? "\n" : " ");
+  // コード領域に収まらない場合など、エラーの場合は NULL を返す
+  const unsigned char *getCode(size_t *pSize) { return build(pSize); }
+
+  // 記述した命令に覗き穴最適化をかけて、削除した命令の数を返す
+  // (RV32_asm_peephole.hpp)
+  // 命令を記述し終えてからコードを生成するまでの間に呼ぶ。
+  // 直接書き込みモードでは何もしない。
+  size_t peephole() { return internal::Peephole(env).run(); }
+
+  // 記述した命令を lat の待ち時間に合わせて並べ替えて、
+  // 見積もりで減ったサイクル数を返す(RV32_asm_schedule.hpp)
+  // peephole() と同じく、命令を記述し終えてからコードを生成するまでの間に呼ぶ。
+  // 直接書き込みモードでは何もしない。
+  size_t schedule(const Latency &lat = LATENCY_IN_ORDER_DUAL) {
+    return internal::Scheduler(env, lat).run();
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // ファイルへの書き出し(RV32_asm_object.hpp)
+  // いずれも生成したコードを getCode() と同じ領域に作ってから書き出す。
+  // 失敗した場合は false を返す。
+
+  // ELF32 の再配置可能オブジェクトとして fd に書き出す
+  // コードの先頭が name という関数になり、名前付きのラベルもシンボルになる
+  // ("." で始まるラベルは局所シンボル)。
+  // 定義していないラベルへの参照は外部シンボルへの再配置になる。
+  // その場合、分岐は圧縮しない通常の長さの命令で生成する。
+  bool writeObject(int fd, const char *name,
+                   FloatAbi abi = FLOAT_ABI_SOFT) {
+    std::vector<Relocation> relocs;
+    size_t size = 0;
+    const unsigned char *code = build(&size, true, &relocs);
+    if (code == NULL) {
+      return false;
+    }
+    if (!internal::writeElfObject(fd, code, size, name, env, relocs,
+                                  uint32_t(abi))) {
+      env.setError(ERR_UNDEFINED_LABEL);
+      return false;
+    }
+    return true;
+  }
+
+  // コードのバイト列をそのまま fd に書き出す
+  bool writeBinary(int fd) {
+    size_t size = 0;
+    const unsigned char *code = build(&size);
+    return code != NULL && internal::writeRawBinary(fd, code, size);
+  }
+
+  // コードを base 番地に置く Intel HEX の形式で fd に書き出す
+  bool writeHex(int fd, uint32_t base = 0) {
+    size_t size = 0;
+    const unsigned char *code = build(&size);
+    return code != NULL && internal::writeIntelHex(fd, code, size, base);
+  }
+
+ private:
+  unsigned char *build(CodeArena &arena, bool bump) {
+    // 直接書き込みモードでは自前の領域に生成したコードをコピーする
+    // (PC相対の命令しか使わないので、そのまま移動できる)
+    const unsigned char *src = NULL;
+    size_t code_size = 0;
+    if (env.isDirect()) {
+      src = build(&code_size, false);
+      if (src == NULL) {
+        return NULL;
+      }
+    } else {
+      code_size = env.prepare();
+      if (env.getError() != ERR_NONE) {
+        return NULL;
+      }
+    }
+    // align() で揃えた境界がずれないように、先頭もその境界に置く
+    const size_t align = std::max(env.getCodeAlign(), uint32_t(16));
+    CodeArena::Block block = bump ? arena.reserve(code_size, align)
+                                  : arena.allocate(code_size, align);
+    if (block.exec == NULL) {
+      env.setError(ERR_CANT_ALLOC);
+      return NULL;
+    }
+    arena.beginWrite(block);
+    size_t written = code_size;
+    if (src != NULL) {
+      memcpy(block.code, src, code_size);
+    } else {
+      written = env.generate(block.code, block.size);
+    }
+    arena.endWrite(block);
+    if (written != code_size || env.getError() != ERR_NONE) {
+      // 定義されていないラベルなどで生成できなかった
+      // reserve() で予約した領域は返却できないので、使わずに捨てる
+      if (!bump) {
+        arena.release(block.exec);
+      }
+      return NULL;
+    }
+    clear_cache(block.exec, code_size);
+    if (env.getListing() != NULL) {
+      env.getListing()->generated(block.exec, code_size);
+    }
+    return block.exec;
+  }
+
+  // listing が false の場合は sink に生成の完了を通知しない
+  // relocs を指定した場合は、定義されていないラベルへの参照を relocs に返す
+  unsigned char *build(size_t *pSize, bool listing = true,
+                       std::vector<Relocation> *relocs = NULL) {
+    if (pSize != NULL) {
+      *pSize = 0;
+    }
+    if (!alloc.makeWritable()) {
+      return NULL;
+    }
+    // 自動拡張する場合は、配置が確定した時点で必要なサイズだけ確保する
+    // (領域が足りない場合は env.generate() がエラーにする)
+    alloc.reserve(env.prepare(), 0);
+    size_t code_size =
+        env.generate(alloc.getMemory(), alloc.getSize(), relocs);
+    if (env.getError() != ERR_NONE || !alloc.makeExecutable()) {
+      return NULL;
+    }
+    auto p = alloc.getExecMemory();
+    clear_cache(p, code_size);
+    if (listing && env.getListing() != NULL) {
+      env.getListing()->generated(p, code_size);
     }
-    puts("");
-#endif
     if (pSize != NULL) {
       *pSize = code_size;
     }
@@ -79,8 +272,9 @@ class Generator : public virtual Base {
 template <char... Cs>
 struct ISA32 : virtual public Base,
                public CodeGenerator32Float<typename RV32<Cs...>::type> {
-  ISA32(size_t size = DEFAULT_MAX_CODE_SIZE, void *ptr = NULL) {
-    alloc.allocate(size, ptr);
+  ISA32(size_t size = DEFAULT_MAX_CODE_SIZE, void *ptr = NULL,
+        ProtectMode mode = PROTECT_NONE) {
+    alloc.allocate(size, ptr, mode);
   }
 };
 // よく使われそうな命令セットの組み合わせのクラスの定義
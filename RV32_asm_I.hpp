@@ -13,148 +13,87 @@ class CodeGenerator32I : public virtual Base, public T {
  public:
   CodeGenerator32I() : T() {}
 
-  //////////////////////////////////////////////////////////////////
-  // 各命令タイプのオペコード組み立て用補助関数
-  
  protected:
-  constexpr static uint32_t R_(int opcode, int funct7, int funct3,
-                               const Reg &rd, const Reg &rs1, const Reg &rs2) {
-    uint32_t op = (uint32_t(funct7 & 0x7f) << 25) | (rs2.getIdx() << 20) |
-                  (rs1.getIdx() << 15) | ((funct3 & 0x7) << 12) |
-                  (rd.getIdx() << 7) | (opcode & 0x7f);
-    return op;
-  }
-  constexpr static uint32_t I_(int opcode, int funct3, const Reg &rd,
-                               const Reg &rs1, address_offset_t imm) {
-    assert(-4096 <= imm && imm <= 4095);
-    uint32_t op = (uint32_t(imm & 0xfff) << 20) | (rs1.getIdx() << 15) |
-                  ((funct3 & 0x7) << 12) | (rd.getIdx() << 7) | (opcode & 0x7f);
-    return op;
-  }
-
-  constexpr static uint32_t S_(int opcode, int funct3, const Reg &rs1,
-                               const Reg &rs2, address_offset_t imm) {
-    assert(-4096 <= imm && imm <= 4095);
-    uint32_t op = (uint32_t(imm & 0xfe0) << 20) | (rs2.getIdx() << 20) |
-                  (rs1.getIdx() << 15) | ((funct3 & 0x7) << 12) |
-                  ((imm & 0x1f) << 7) | (opcode & 0x7f);
-    return op;
-  }
-
-  constexpr static uint32_t B_(int opcode, int funct3, const Reg &rs1,
-                               const Reg &rs2, address_offset_t imm) {
-    assert((imm & 1) == 0 && -8192 <= imm && imm <= 8190);
-    const uint32_t tmp = imm & 0x00001fff;
-    uint32_t op = ((tmp >> 12) & 1) << 31 | ((tmp >> 5) & 0x3f) << 25 |
-                  (rs2.getIdx() << 20) | (rs1.getIdx() << 15) |
-                  ((funct3 & 0x7) << 12) | ((tmp >> 1) & 0xf) << 8 |
-                  ((tmp >> 11) & 1) << 7 | (opcode & 0x7f);
-    return op;
-  }
-
-  constexpr static uint32_t U_(int opcode, const Reg &rd,
-                               address_offset_t imm) {
-    assert((imm & 0xfff) == 0);
-    uint32_t op =
-        uint32_t(imm & 0xfffff000) | (rd.getIdx() << 7) | (opcode & 0x7f);
-    return op;
-  }
-
   //////////////////////////////////////////////////////////////////
   // 各命令タイプのオペコード組み立て・登録関数
-
-  static address_offset_t u2j(address_offset_t imm) {
-    uint32_t tmp = (uint32_t)imm;
-    return (((tmp >> 20) & 0x1) << 19    // 1
-            | ((tmp >> 1) & 0x3ff) << 9  // 10
-            | ((tmp >> 11) & 0x1) << 8   // 1
-            | ((tmp >> 12) & 0xff)       // 8
-            )
-           << 12;
-    return address_offset_t(tmp);
-  }
+  // (オペコード組み立て用の補助関数 R_, I_, ... は Format で定義)
 
   void R(int opcode, int funct7, int funct3, const Reg &rd, const Reg &rs1,
          const Reg &rs2, const char *msg = "") {
-    env << [=](Env &e) { e.dw(R_(opcode, funct7, funct3, rd, rs1, rs2), msg); };
+    env.dw(R_(opcode, funct7, funct3, rd, rs1, rs2), msg);
   }
   void I(int opcode, int funct3, const Reg &rd, const Reg &rs1,
          address_offset_t imm, const char *msg = "") {
-    env << [=](Env &e) { e.dw(I_(opcode, funct3, rd, rs1, imm), msg); };
+    env.dw(I_(opcode, funct3, rd, rs1, imm), msg);
   }
   void S(int opcode, int funct3, const Reg &rs1, const Reg &rs2,
          address_offset_t imm, const char *msg = "") {
-    env << [=](Env &e) { e.dw(S_(opcode, funct3, rs1, rs2, imm), msg); };
+    env.dw(S_(opcode, funct3, rs1, rs2, imm), msg);
   }
   void B(int opcode, int funct3, const Reg &rs1, const Reg &rs2,
          address_offset_t imm, const char *msg = "") {
-    env << [=](Env &e) { e.dw(S_(opcode, funct3, rs1, rs2, imm), msg); };
+    env.dw(B_(opcode, funct3, rs1, rs2, imm), msg);
   }
   void B(int opcode, int funct3, const Reg &rs1, const Reg &rs2,
          const Label &label, const char *msg = "") {
-    env << [=](Env &e) {
-      address_offset_t imm = label.getOffset(e);
-      e.dw(S_(opcode, funct3, rs1, rs2, imm), msg);
-    };
+    env.ref(FIX_BRANCH, B_(opcode, funct3, rs1, rs2, 0), 0, label, msg);
   }
   void U(int opcode, const Reg &rd, address_offset_t imm,
          const char *msg = "") {
-    env << [=](Env &e) { e.dw(U_(opcode, rd, imm), msg); };
+    env.dw(U_(opcode, rd, imm), msg);
   }
   void U(int opcode, const Reg &rd, const Label &label, const char *msg = "") {
-    env << [=](Env &e) { e.dw(U_(opcode, rd, label.getOffset(e)), msg); };
+    env.ref(FIX_AUIPC, U_(opcode, rd, 0), 0, label, msg);
   }
   void J(int opcode, const Reg &rd, address_offset_t imm,
          const char *msg = "") {
-    env << [=](Env &e) { e.dw(U_(opcode, rd, u2j(imm)), msg); };
+    env.dw(U_(opcode, rd, u2j(imm)), msg);
   }
   void J(int opcode, const Reg &rd, const Label &label, const char *msg = "") {
-    env << [=](Env &e) {
-      address_offset_t imm = label.getOffset(e);
-      e.dw(U_(opcode, rd, u2j(imm)), msg);
-    };
+    env.ref(FIX_JAL, U_(opcode, rd, 0), 0, label, msg);
   }
 
   // 疑似命令callの実装
   void pi_call(const Label &label, const char *msg = "") {
     // ラベルのオフセット値が確定しないと命令が生成できないので
     // 他の疑似命令と異なりこのレベルで実装している
-    env << [=](Env &e) {
-      address_offset_t offset = label.getOffset(e);
-      address_offset_t hi = (offset & 0xfffff000) + ((offset & 0x0800) << 1);
-      address_offset_t lo = offset & 0x00000fff;
-      if (offset & 0x00000800) {  //符号拡張
-        lo |= 0xfffff000;
-      }
-      assert(hi + lo == offset);
-#if IN_DEBUG_MODE
-      printf("off:%08x(%d)\n HI:%08x\n LO:%08x(%d)\n+++:%08x\n", offset, offset,
-             hi, lo, lo, hi + lo);
-#endif
-      e.dw(U_(0b0010111, x1, hi), "CALL(AUIPC)");
-      e.dw(I_(0b1100111, 0b000, x1, x1, lo), "CALL(JALR)");
-    };
+    // cop には jalr 命令の rd を指定する
+    env.ref(FIX_CALL, U_(0b0010111, x1, 0), x1.getIdx(), label, "CALL");
   }
 
   // 疑似命令tailの実装
   void pi_tail(const Label &label, const char *msg = "") {
     // ラベルのオフセット値が確定しないと命令が生成できないので
     // 他の疑似命令と異なりこのレベルで実装している
-    env << [=](Env &e) {
-      address_offset_t offset = label.getOffset(e);
-      address_offset_t hi = (offset & 0xfffff000) + ((offset & 0x0800) << 1);
-      address_offset_t lo = offset & 0x00000fff;
-      if (offset & 0x00000800) {  //符号拡張
-        lo |= 0xfffff000;
+    env.ref(FIX_CALL, U_(0b0010111, x6, 0), x0.getIdx(), label, "TAIL");
+  }
+
+  // planLi() で求めた命令の並びで li 疑似命令を生成する
+  // 各命令は圧縮命令の生成器では圧縮命令になる
+  void li(const Reg &rd, const LiPlan &plan) {
+    for (int i = 0; i < plan.count; ++i) {
+      const int32_t imm = plan.imm[i];
+      switch (plan.step[i]) {
+        case LI_ADDI0:
+          addi(rd, zero, imm);
+          break;
+        case LI_LUI:
+          lui(rd, uint32_t(imm));
+          break;
+        case LI_ADDI:
+          addi(rd, rd, imm);
+          break;
+        case LI_SLLI:
+          slli(rd, rd, imm);
+          break;
+        case LI_SRLI:
+          srli(rd, rd, imm);
+          break;
+        case LI_SRAI:
+          srai(rd, rd, imm);
+          break;
       }
-      assert(hi + lo == offset);
-#if IN_DEBUG_MODE
-      printf("off:%08x(%d)\n HI:%08x\n LO:%08x(%d)\n+++:%08x\n", offset, offset,
-             hi, lo, lo, hi + lo);
-#endif
-      e.dw(U_(0b0010111, x6, hi), "TAIL(AUIPC)");
-      e.dw(I_(0b1100111, 0b000, x0, x6, lo), "TAIL(JALR)");
-    };
+    }
   }
 
   //////////////////////////////////////////////////////////////////
@@ -271,7 +210,7 @@ class CodeGenerator32I : public virtual Base, public T {
 
   // LHU
   void lhu(const Reg &rd, const OffsetReg32 &or1) {
-    I(0b0000011, 0b100, rd, or1.getReg(), or1.getOffset(), "LHU");
+    I(0b0000011, 0b101, rd, or1.getReg(), or1.getOffset(), "LHU");
   }
 
   // SB
@@ -437,21 +376,15 @@ or(const Reg &rd, const Reg &rs1, const Reg &rs2) {
 
   // li
   virtual void li(const Reg &rd, uint32_t imm) {
-    // addi命令は即値を12ビットの「符号付き」整数として扱うので注意
-    address_offset_t hi = (imm & 0xfffff000) + ((imm & 0x0800) << 1);
-    address_offset_t lo = imm & 0x00000fff;
-
-    // immの上位20ビットが非0ならluiで上位20ビットをセット
-    if (hi != 0) {
-      lui(rd, hi >> 12);
-      // immの下位12ビットが非0ならaddiで下位12ビットをセット
-      if (lo != 0) {
-        addi(rd, rd, lo);
-      }
-    } else {
-      // 上位20ビットは0だったので下位12ビットをaddiでセット
-      addi(rd, zero, lo);
-    }
+    li(rd, planLi(imm, false, false));
+  }
+
+  // value をリテラルプールに置いて auipc + lw で読み込む
+  // 32ビットの整数は li でも2命令以内で作れるので、コードの長さは縮まない。
+  // 主に浮動小数点数の定数(CodeGenerator32Float の loadConst)で使う。
+  void loadConst(const Reg &rd, uint32_t value) {
+    env.loadLiteral(value, 4, U_(0b0010111, rd, 0),
+                    Env::loadOp(0b0000011, 0b010, rd.getIdx()), "AUIPC");
   }
 
   // mv
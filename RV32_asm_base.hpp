@@ -1,24 +1,6 @@
 #ifndef RV32_ASM_BASE_HPP_INCLUDED
 #define RV32_ASM_BASE_HPP_INCLUDED
 
-////////////////////////////////////////////////////////////////////////////////
-// デバッグモードの判定
-
-// デバッグモードの設定
-// マクロ DEBUG が存在すればその値で判定、
-// 存在しない場合は、マクロ NDEBUG が定義されていたら
-// デバッグモードにする。それら以外の状態では通常モードになる。
-#ifdef DEBUG
-#define IN_DEBUG_MODE DEBUG
-#endif
-#ifndef IN_DEBUG_MODE
-#if NDEBUG
-#define IN_DEBUG_MODE 0
-#else
-#define IN_DEBUG_MODE 1
-#endif
-#endif
-
 ////////////////////////////////////////////////////////////////////////////////
 // コンパイル環境の確認
 
@@ -64,16 +46,26 @@
 ////////////////////////////////////////////////////////////////////////////////
 // ヘッダのインクルード
 
-#if IN_DEBUG_MODE
-#include <cstdio>  // デバッグ用
-#endif
 #include <assert.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <functional>
-#include <list>
-#include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+// mmap でコード領域を確保できる環境か
+#if defined(__unix__) || defined(__APPLE__)
+#define RV32_ASM_USE_MMAP 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define RV32_ASM_USE_MMAP 0
+#endif
 
 // xx.y のような名前の命令を定義するためのマクロ定義
 // 手法として、 xx という変数に y
@@ -81,10 +73,27 @@
 // に該当するクラスの用意が若干面倒なので、
 // マクロですこし簡単に書けるようにした。
 // 使用例は↓のコメントを参照。
+//
+// xx に該当するオブジェクトは参照などのメンバーを持たない空のオブジェクトで、
+// 親の生成器のオブジェクトは自分のアドレスから型ごとに1つのオフセットを
+// 引いて求める。(オフセットはコンストラクタで記録する)
+#define DOT_CLASS_PARENT(klass)                                               \
+  friend self_t;                                                              \
+  typedef ::RV32_asm::internal::DotOffset<klass> offset_t;                    \
+  void setParent(self_t &p) {                                                 \
+    offset_t::value.store(                                                    \
+        reinterpret_cast<char *>(this) - reinterpret_cast<char *>(&p),        \
+        std::memory_order_relaxed);                                           \
+  }                                                                           \
+  self_t &parent() {                                                          \
+    return *reinterpret_cast<self_t *>(                                       \
+        reinterpret_cast<char *>(this) -                                      \
+        offset_t::value.load(std::memory_order_relaxed));                     \
+  }
+
 #define DOT_CLASS_SETUP(klass)              \
-  friend self_t;                            \
-  self_t &parent;                           \
-  klass(self_t &parent) : parent(parent) {} \
+  DOT_CLASS_PARENT(klass)                   \
+  klass(self_t &p) { setParent(p); }        \
                                             \
  public:
 
@@ -102,6 +111,30 @@ enum {
   VERSION = 0x0100 /* 0xABCD = A.BC(D) */
 };
 
+// エラーコード
+enum Error {
+  ERR_NONE = 0,
+  ERR_CODE_IS_TOO_BIG,  // コード領域に収まらない
+  ERR_CANT_ALLOC,       // コード領域を確保できない
+  ERR_CANT_PROTECT,     // コード領域の保護属性を変更できない
+  ERR_UNDEFINED_LABEL,  // 定義されていないラベルを参照している
+  ERR_LABEL_IS_TOO_FAR,  // 直接書き込みモードで、分岐先が命令の範囲外
+};
+
+// ISA32 のコンストラクタの ptr に指定すると、コード領域を自動的に拡張する
+// その場合 size は初期サイズとして扱う
+static void *const AutoGrow = (void *)1;
+
+// コード領域の確保方法と保護属性
+// PROTECT_NONE 以外は mmap でページ単位に確保する。
+// mmap が使えない環境では PROTECT_NONE として扱う。
+enum ProtectMode {
+  PROTECT_NONE = 0,  // new で確保し、保護属性は変更しない
+  PROTECT_RWX,       // 読み書き実行可能な領域を確保する
+  PROTECT_WX,        // 書き込み中は RW 、generate() で RX に切り替える
+  PROTECT_DUAL,      // memfd を RW と RX の2か所にマップする(Linux のみ)
+};
+
 // クラスの前方宣言
 class Base;
 class Generator;
@@ -114,6 +147,17 @@ class FReg;
 
 class Env;
 class Label;
+class Peephole;
+class Scheduler;
+
+// xx.y 型の命令のオブジェクトから親の生成器を求めるためのオフセット
+// (DOT_CLASS_SETUP で使う)
+template <typename Dot>
+struct DotOffset {
+  static std::atomic<std::ptrdiff_t> value;
+};
+template <typename Dot>
+std::atomic<std::ptrdiff_t> DotOffset<Dot>::value(0);
 class Allocator;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -126,7 +170,7 @@ class Operand {
 
  public:
   constexpr int getIdx() const { return idx_; }
-  Operand(int idx = 0) : idx_(idx) {}
+  constexpr Operand(int idx = 0) : idx_(idx) {}
 };
 
 class OffsetReg32 : public Operand {
@@ -134,7 +178,7 @@ class OffsetReg32 : public Operand {
   const address_offset_t offset;
 
  public:
-  OffsetReg32(const Reg &reg, address_offset_t offset)
+  constexpr OffsetReg32(const Reg &reg, address_offset_t offset)
       : reg(reg), offset(offset) {}
 
   constexpr int getIdx()
@@ -147,21 +191,25 @@ class OffsetReg32 : public Operand {
 class Reg : public Operand {
   unsigned int cidx : 4;  // C命令セットで使用するレジスタ番号
  public:
-  Reg() : Operand(), cidx(15) {}
-  Reg(int idx) : Operand(idx), cidx(15) {}
-  Reg(int idx, int cidx) : Operand(idx), cidx(cidx) {}
-  OffsetReg32 operator[](address_offset_t offset) const {
+  constexpr Reg() : Operand(), cidx(15) {}
+  constexpr Reg(int idx) : Operand(idx), cidx(15) {}
+  constexpr Reg(int idx, int cidx) : Operand(idx), cidx(cidx) {}
+  constexpr OffsetReg32 operator[](address_offset_t offset) const {
     return OffsetReg32(*this, offset);
   }
-  OffsetReg32 operator()(address_offset_t offset) const {
+  constexpr OffsetReg32 operator()(address_offset_t offset) const {
     return OffsetReg32(*this, offset);
   }
-  Reg operator()() const { return *this; }
+  constexpr Reg operator()() const { return *this; }
 
-  bool operator==(const Reg &o) const { return this->getIdx() == o.getIdx(); }
-  bool operator!=(const Reg &o) const { return this->getIdx() != o.getIdx(); }
-  bool isCReg() const { return cidx != 15; }
-  int getCIdx() const { return cidx; }
+  constexpr bool operator==(const Reg &o) const {
+    return this->getIdx() == o.getIdx();
+  }
+  constexpr bool operator!=(const Reg &o) const {
+    return this->getIdx() != o.getIdx();
+  }
+  constexpr bool isCReg() const { return cidx != 15; }
+  constexpr int getCIdx() const { return cidx; }
 };
 
 constexpr int OffsetReg32::getIdx() const { return reg.getIdx(); }
@@ -169,28 +217,903 @@ constexpr int OffsetReg32::getIdx() const { return reg.getIdx(); }
 class FReg : public Operand {
   unsigned int cidx : 4;  // C命令セットで使用するレジスタ番号
  public:
-  FReg(int idx) : Operand(idx), cidx(15) {}
-  FReg(int idx, int cidx) : Operand(idx), cidx(cidx) {}
+  constexpr FReg(int idx) : Operand(idx), cidx(15) {}
+  constexpr FReg(int idx, int cidx) : Operand(idx), cidx(cidx) {}
+
+  constexpr bool operator==(const FReg &o) const {
+    return this->getIdx() == o.getIdx();
+  }
+  constexpr bool operator!=(const FReg &o) const {
+    return this->getIdx() != o.getIdx();
+  }
+  constexpr bool isCReg() const { return cidx != 15; }
+  constexpr int getCIdx() const { return cidx; }
+};
+
+// レジスタの定数
+// C++14 では static constexpr なメンバー変数を参照渡しするとクラス外での
+// 定義が必要になるので、テンプレートにしてヘッダファイルだけで定義する。
+template <typename Dummy = void>
+struct Registers {
+  // レジスタ
+  static constexpr Reg x0 = Reg(0);
+  static constexpr Reg x1 = Reg(1);
+  static constexpr Reg x2 = Reg(2);
+  static constexpr Reg x3 = Reg(3);
+  static constexpr Reg x4 = Reg(4);
+  static constexpr Reg x5 = Reg(5);
+  static constexpr Reg x6 = Reg(6);
+  static constexpr Reg x7 = Reg(7);
+  static constexpr Reg x8 = Reg(8, 0);
+  static constexpr Reg x9 = Reg(9, 1);
+  static constexpr Reg x10 = Reg(10, 2);
+  static constexpr Reg x11 = Reg(11, 3);
+  static constexpr Reg x12 = Reg(12, 4);
+  static constexpr Reg x13 = Reg(13, 5);
+  static constexpr Reg x14 = Reg(14, 6);
+  static constexpr Reg x15 = Reg(15, 7);
+  static constexpr Reg x16 = Reg(16);
+  static constexpr Reg x17 = Reg(17);
+  static constexpr Reg x18 = Reg(18);
+  static constexpr Reg x19 = Reg(19);
+  static constexpr Reg x20 = Reg(20);
+  static constexpr Reg x21 = Reg(21);
+  static constexpr Reg x22 = Reg(22);
+  static constexpr Reg x23 = Reg(23);
+  static constexpr Reg x24 = Reg(24);
+  static constexpr Reg x25 = Reg(25);
+  static constexpr Reg x26 = Reg(26);
+  static constexpr Reg x27 = Reg(27);
+  static constexpr Reg x28 = Reg(28);
+  static constexpr Reg x29 = Reg(29);
+  static constexpr Reg x30 = Reg(30);
+  static constexpr Reg x31 = Reg(31);
+
+  // レジスタの別名
+  static constexpr Reg zero = Reg(0);
+  static constexpr Reg ra = Reg(1);
+  static constexpr Reg sp = Reg(2);
+  static constexpr Reg gp = Reg(3);
+  static constexpr Reg tp = Reg(4);
+  static constexpr Reg t0 = Reg(5);
+  static constexpr Reg t1 = Reg(6);
+  static constexpr Reg t2 = Reg(7);
+  static constexpr Reg s0 = Reg(8, 0);
+  static constexpr Reg fp = Reg(8, 0);
+  static constexpr Reg s1 = Reg(9, 1);
+  static constexpr Reg a0 = Reg(10, 2);
+  static constexpr Reg a1 = Reg(11, 3);
+  static constexpr Reg a2 = Reg(12, 4);
+  static constexpr Reg a3 = Reg(13, 5);
+  static constexpr Reg a4 = Reg(14, 6);
+  static constexpr Reg a5 = Reg(15, 7);
+  static constexpr Reg a6 = Reg(16);
+  static constexpr Reg a7 = Reg(17);
+  static constexpr Reg s2 = Reg(18);
+  static constexpr Reg s3 = Reg(19);
+  static constexpr Reg s4 = Reg(20);
+  static constexpr Reg s5 = Reg(21);
+  static constexpr Reg s6 = Reg(22);
+  static constexpr Reg s7 = Reg(23);
+  static constexpr Reg s8 = Reg(24);
+  static constexpr Reg s9 = Reg(25);
+  static constexpr Reg s10 = Reg(26);
+  static constexpr Reg s11 = Reg(27);
+  static constexpr Reg t3 = Reg(28);
+  static constexpr Reg t4 = Reg(29);
+  static constexpr Reg t5 = Reg(30);
+  static constexpr Reg t6 = Reg(31);
+
+  // 浮動小数点レジスタ
+  static constexpr FReg f0 = FReg(0);
+  static constexpr FReg f1 = FReg(1);
+  static constexpr FReg f2 = FReg(2);
+  static constexpr FReg f3 = FReg(3);
+  static constexpr FReg f4 = FReg(4);
+  static constexpr FReg f5 = FReg(5);
+  static constexpr FReg f6 = FReg(6);
+  static constexpr FReg f7 = FReg(7);
+  static constexpr FReg f8 = FReg(8, 0);
+  static constexpr FReg f9 = FReg(9, 1);
+  static constexpr FReg f10 = FReg(10, 2);
+  static constexpr FReg f11 = FReg(11, 3);
+  static constexpr FReg f12 = FReg(12, 4);
+  static constexpr FReg f13 = FReg(13, 5);
+  static constexpr FReg f14 = FReg(14, 6);
+  static constexpr FReg f15 = FReg(15, 7);
+  static constexpr FReg f16 = FReg(16);
+  static constexpr FReg f17 = FReg(17);
+  static constexpr FReg f18 = FReg(18);
+  static constexpr FReg f19 = FReg(19);
+  static constexpr FReg f20 = FReg(20);
+  static constexpr FReg f21 = FReg(21);
+  static constexpr FReg f22 = FReg(22);
+  static constexpr FReg f23 = FReg(23);
+  static constexpr FReg f24 = FReg(24);
+  static constexpr FReg f25 = FReg(25);
+  static constexpr FReg f26 = FReg(26);
+  static constexpr FReg f27 = FReg(27);
+  static constexpr FReg f28 = FReg(28);
+  static constexpr FReg f29 = FReg(29);
+  static constexpr FReg f30 = FReg(30);
+  static constexpr FReg f31 = FReg(31);
+  static constexpr FReg ft0 = FReg(0);
+  static constexpr FReg ft1 = FReg(1);
+  static constexpr FReg ft2 = FReg(2);
+  static constexpr FReg ft3 = FReg(3);
+  static constexpr FReg ft4 = FReg(4);
+  static constexpr FReg ft5 = FReg(5);
+  static constexpr FReg ft6 = FReg(6);
+  static constexpr FReg ft7 = FReg(7);
+  static constexpr FReg fs0 = FReg(8, 0);
+  static constexpr FReg fs1 = FReg(9, 1);
+  static constexpr FReg fa0 = FReg(10, 2);
+  static constexpr FReg fa1 = FReg(11, 3);
+  static constexpr FReg fa2 = FReg(12, 4);
+  static constexpr FReg fa3 = FReg(13, 5);
+  static constexpr FReg fa4 = FReg(14, 6);
+  static constexpr FReg fa5 = FReg(15, 7);
+  static constexpr FReg fa6 = FReg(16);
+  static constexpr FReg fa7 = FReg(17);
+  static constexpr FReg fs2 = FReg(18);
+  static constexpr FReg fs3 = FReg(19);
+  static constexpr FReg fs4 = FReg(20);
+  static constexpr FReg fs5 = FReg(21);
+  static constexpr FReg fs6 = FReg(22);
+  static constexpr FReg fs7 = FReg(23);
+  static constexpr FReg fs8 = FReg(24);
+  static constexpr FReg fs9 = FReg(25);
+  static constexpr FReg fs10 = FReg(26);
+  static constexpr FReg fs11 = FReg(27);
+  static constexpr FReg ft8 = FReg(28);
+  static constexpr FReg ft9 = FReg(29);
+  static constexpr FReg ft10 = FReg(30);
+  static constexpr FReg ft11 = FReg(31);
+};
+template <typename D>
+constexpr Reg Registers<D>::x0;
+template <typename D>
+constexpr Reg Registers<D>::x1;
+template <typename D>
+constexpr Reg Registers<D>::x2;
+template <typename D>
+constexpr Reg Registers<D>::x3;
+template <typename D>
+constexpr Reg Registers<D>::x4;
+template <typename D>
+constexpr Reg Registers<D>::x5;
+template <typename D>
+constexpr Reg Registers<D>::x6;
+template <typename D>
+constexpr Reg Registers<D>::x7;
+template <typename D>
+constexpr Reg Registers<D>::x8;
+template <typename D>
+constexpr Reg Registers<D>::x9;
+template <typename D>
+constexpr Reg Registers<D>::x10;
+template <typename D>
+constexpr Reg Registers<D>::x11;
+template <typename D>
+constexpr Reg Registers<D>::x12;
+template <typename D>
+constexpr Reg Registers<D>::x13;
+template <typename D>
+constexpr Reg Registers<D>::x14;
+template <typename D>
+constexpr Reg Registers<D>::x15;
+template <typename D>
+constexpr Reg Registers<D>::x16;
+template <typename D>
+constexpr Reg Registers<D>::x17;
+template <typename D>
+constexpr Reg Registers<D>::x18;
+template <typename D>
+constexpr Reg Registers<D>::x19;
+template <typename D>
+constexpr Reg Registers<D>::x20;
+template <typename D>
+constexpr Reg Registers<D>::x21;
+template <typename D>
+constexpr Reg Registers<D>::x22;
+template <typename D>
+constexpr Reg Registers<D>::x23;
+template <typename D>
+constexpr Reg Registers<D>::x24;
+template <typename D>
+constexpr Reg Registers<D>::x25;
+template <typename D>
+constexpr Reg Registers<D>::x26;
+template <typename D>
+constexpr Reg Registers<D>::x27;
+template <typename D>
+constexpr Reg Registers<D>::x28;
+template <typename D>
+constexpr Reg Registers<D>::x29;
+template <typename D>
+constexpr Reg Registers<D>::x30;
+template <typename D>
+constexpr Reg Registers<D>::x31;
+template <typename D>
+constexpr Reg Registers<D>::zero;
+template <typename D>
+constexpr Reg Registers<D>::ra;
+template <typename D>
+constexpr Reg Registers<D>::sp;
+template <typename D>
+constexpr Reg Registers<D>::gp;
+template <typename D>
+constexpr Reg Registers<D>::tp;
+template <typename D>
+constexpr Reg Registers<D>::t0;
+template <typename D>
+constexpr Reg Registers<D>::t1;
+template <typename D>
+constexpr Reg Registers<D>::t2;
+template <typename D>
+constexpr Reg Registers<D>::s0;
+template <typename D>
+constexpr Reg Registers<D>::fp;
+template <typename D>
+constexpr Reg Registers<D>::s1;
+template <typename D>
+constexpr Reg Registers<D>::a0;
+template <typename D>
+constexpr Reg Registers<D>::a1;
+template <typename D>
+constexpr Reg Registers<D>::a2;
+template <typename D>
+constexpr Reg Registers<D>::a3;
+template <typename D>
+constexpr Reg Registers<D>::a4;
+template <typename D>
+constexpr Reg Registers<D>::a5;
+template <typename D>
+constexpr Reg Registers<D>::a6;
+template <typename D>
+constexpr Reg Registers<D>::a7;
+template <typename D>
+constexpr Reg Registers<D>::s2;
+template <typename D>
+constexpr Reg Registers<D>::s3;
+template <typename D>
+constexpr Reg Registers<D>::s4;
+template <typename D>
+constexpr Reg Registers<D>::s5;
+template <typename D>
+constexpr Reg Registers<D>::s6;
+template <typename D>
+constexpr Reg Registers<D>::s7;
+template <typename D>
+constexpr Reg Registers<D>::s8;
+template <typename D>
+constexpr Reg Registers<D>::s9;
+template <typename D>
+constexpr Reg Registers<D>::s10;
+template <typename D>
+constexpr Reg Registers<D>::s11;
+template <typename D>
+constexpr Reg Registers<D>::t3;
+template <typename D>
+constexpr Reg Registers<D>::t4;
+template <typename D>
+constexpr Reg Registers<D>::t5;
+template <typename D>
+constexpr Reg Registers<D>::t6;
+template <typename D>
+constexpr FReg Registers<D>::f0;
+template <typename D>
+constexpr FReg Registers<D>::f1;
+template <typename D>
+constexpr FReg Registers<D>::f2;
+template <typename D>
+constexpr FReg Registers<D>::f3;
+template <typename D>
+constexpr FReg Registers<D>::f4;
+template <typename D>
+constexpr FReg Registers<D>::f5;
+template <typename D>
+constexpr FReg Registers<D>::f6;
+template <typename D>
+constexpr FReg Registers<D>::f7;
+template <typename D>
+constexpr FReg Registers<D>::f8;
+template <typename D>
+constexpr FReg Registers<D>::f9;
+template <typename D>
+constexpr FReg Registers<D>::f10;
+template <typename D>
+constexpr FReg Registers<D>::f11;
+template <typename D>
+constexpr FReg Registers<D>::f12;
+template <typename D>
+constexpr FReg Registers<D>::f13;
+template <typename D>
+constexpr FReg Registers<D>::f14;
+template <typename D>
+constexpr FReg Registers<D>::f15;
+template <typename D>
+constexpr FReg Registers<D>::f16;
+template <typename D>
+constexpr FReg Registers<D>::f17;
+template <typename D>
+constexpr FReg Registers<D>::f18;
+template <typename D>
+constexpr FReg Registers<D>::f19;
+template <typename D>
+constexpr FReg Registers<D>::f20;
+template <typename D>
+constexpr FReg Registers<D>::f21;
+template <typename D>
+constexpr FReg Registers<D>::f22;
+template <typename D>
+constexpr FReg Registers<D>::f23;
+template <typename D>
+constexpr FReg Registers<D>::f24;
+template <typename D>
+constexpr FReg Registers<D>::f25;
+template <typename D>
+constexpr FReg Registers<D>::f26;
+template <typename D>
+constexpr FReg Registers<D>::f27;
+template <typename D>
+constexpr FReg Registers<D>::f28;
+template <typename D>
+constexpr FReg Registers<D>::f29;
+template <typename D>
+constexpr FReg Registers<D>::f30;
+template <typename D>
+constexpr FReg Registers<D>::f31;
+template <typename D>
+constexpr FReg Registers<D>::ft0;
+template <typename D>
+constexpr FReg Registers<D>::ft1;
+template <typename D>
+constexpr FReg Registers<D>::ft2;
+template <typename D>
+constexpr FReg Registers<D>::ft3;
+template <typename D>
+constexpr FReg Registers<D>::ft4;
+template <typename D>
+constexpr FReg Registers<D>::ft5;
+template <typename D>
+constexpr FReg Registers<D>::ft6;
+template <typename D>
+constexpr FReg Registers<D>::ft7;
+template <typename D>
+constexpr FReg Registers<D>::fs0;
+template <typename D>
+constexpr FReg Registers<D>::fs1;
+template <typename D>
+constexpr FReg Registers<D>::fa0;
+template <typename D>
+constexpr FReg Registers<D>::fa1;
+template <typename D>
+constexpr FReg Registers<D>::fa2;
+template <typename D>
+constexpr FReg Registers<D>::fa3;
+template <typename D>
+constexpr FReg Registers<D>::fa4;
+template <typename D>
+constexpr FReg Registers<D>::fa5;
+template <typename D>
+constexpr FReg Registers<D>::fa6;
+template <typename D>
+constexpr FReg Registers<D>::fa7;
+template <typename D>
+constexpr FReg Registers<D>::fs2;
+template <typename D>
+constexpr FReg Registers<D>::fs3;
+template <typename D>
+constexpr FReg Registers<D>::fs4;
+template <typename D>
+constexpr FReg Registers<D>::fs5;
+template <typename D>
+constexpr FReg Registers<D>::fs6;
+template <typename D>
+constexpr FReg Registers<D>::fs7;
+template <typename D>
+constexpr FReg Registers<D>::fs8;
+template <typename D>
+constexpr FReg Registers<D>::fs9;
+template <typename D>
+constexpr FReg Registers<D>::fs10;
+template <typename D>
+constexpr FReg Registers<D>::fs11;
+template <typename D>
+constexpr FReg Registers<D>::ft8;
+template <typename D>
+constexpr FReg Registers<D>::ft9;
+template <typename D>
+constexpr FReg Registers<D>::ft10;
+template <typename D>
+constexpr FReg Registers<D>::ft11;
+
+// 各命令タイプのオペコード組み立て用補助関数
+class Format {
+ protected:
+  constexpr static uint32_t R_(int opcode, int funct7, int funct3,
+                               const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    uint32_t op = (uint32_t(funct7 & 0x7f) << 25) | (rs2.getIdx() << 20) |
+                  (rs1.getIdx() << 15) | ((funct3 & 0x7) << 12) |
+                  (rd.getIdx() << 7) | (opcode & 0x7f);
+    return op;
+  }
+  constexpr static uint32_t I_(int opcode, int funct3, const Reg &rd,
+                               const Reg &rs1, address_offset_t imm) {
+    assert(-4096 <= imm && imm <= 4095);
+    uint32_t op = (uint32_t(imm & 0xfff) << 20) | (rs1.getIdx() << 15) |
+                  ((funct3 & 0x7) << 12) | (rd.getIdx() << 7) | (opcode & 0x7f);
+    return op;
+  }
+
+  constexpr static uint32_t S_(int opcode, int funct3, const Reg &rs1,
+                               const Reg &rs2, address_offset_t imm) {
+    assert(-4096 <= imm && imm <= 4095);
+    uint32_t op = (uint32_t(imm & 0xfe0) << 20) | (rs2.getIdx() << 20) |
+                  (rs1.getIdx() << 15) | ((funct3 & 0x7) << 12) |
+                  ((imm & 0x1f) << 7) | (opcode & 0x7f);
+    return op;
+  }
+
+  constexpr static uint32_t B_(int opcode, int funct3, const Reg &rs1,
+                               const Reg &rs2, address_offset_t imm) {
+    assert((imm & 1) == 0 && -4096 <= imm && imm <= 4094);
+    const uint32_t tmp = imm & 0x00001fff;
+    uint32_t op = ((tmp >> 12) & 1) << 31 | ((tmp >> 5) & 0x3f) << 25 |
+                  (rs2.getIdx() << 20) | (rs1.getIdx() << 15) |
+                  ((funct3 & 0x7) << 12) | ((tmp >> 1) & 0xf) << 8 |
+                  ((tmp >> 11) & 1) << 7 | (opcode & 0x7f);
+    return op;
+  }
+
+  constexpr static uint32_t U_(int opcode, const Reg &rd,
+                               address_offset_t imm) {
+    assert((imm & 0xfff) == 0);
+    uint32_t op =
+        uint32_t(imm & 0xfffff000) | (rd.getIdx() << 7) | (opcode & 0x7f);
+    return op;
+  }
+
+  constexpr static address_offset_t u2j(address_offset_t imm) {
+    uint32_t tmp = (uint32_t)imm;
+    return (((tmp >> 20) & 0x1) << 19    // 1
+            | ((tmp >> 1) & 0x3ff) << 9  // 10
+            | ((tmp >> 11) & 0x1) << 8   // 1
+            | ((tmp >> 12) & 0xff)       // 8
+            )
+           << 12;
+  }
+
+  // li 疑似命令で使う命令の並び
+  // 先頭の命令で LI_ADDI0 / LI_LUI を使って値を作り、2番目の命令で調整する
+  enum LiStep { LI_ADDI0, LI_LUI, LI_ADDI, LI_SLLI, LI_SRLI, LI_SRAI };
+  struct LiPlan {
+    int count;
+    uint8_t step[2];
+    int32_t imm[2];
+  };
+
+  // imm を作る最も短い命令の並びを求める
+  // compressed が true なら圧縮命令になる長さで比べる
+  // (creg は rd が c.srli / c.srai を使える x8 - x15 か)。
+  // 長さが同じなら命令数の少ない方、次に lui + addi を選ぶ。
+  constexpr static LiPlan planLi(uint32_t imm, bool compressed, bool creg) {
+    LiPlan best = {0, {0, 0}, {0, 0}};
+    int bestSize = 0;
+
+    // 1命令で作れる場合(作れなければ0を返す)
+    struct One {
+      constexpr static int size(uint32_t v, bool c, uint8_t &step,
+                                int32_t &imm) {
+        const int32_t s = int32_t(v);
+        if (-2048 <= s && s <= 2047) {
+          step = LI_ADDI0;
+          imm = s;
+          return (c && -32 <= s && s <= 31) ? 2 : 4;
+        }
+        if ((v & 0xfff) == 0) {
+          step = LI_LUI;
+          imm = int32_t(v >> 12);
+          return (c && (s >> 17) >= -1 && (s >> 17) <= 0) ? 2 : 4;  // c.lui
+        }
+        return 0;
+      }
+    };
+    // 候補が短ければ best を置き換える
+    struct Pick {
+      constexpr static void run(LiPlan &best, int &bestSize, int size,
+                                const LiPlan &plan) {
+        if (bestSize == 0 || size < bestSize ||
+            (size == bestSize && plan.count < best.count)) {
+          best = plan;
+          bestSize = size;
+        }
+      }
+    };
+
+    LiPlan p = {1, {0, 0}, {0, 0}};
+    int size = One::size(imm, compressed, p.step[0], p.imm[0]);
+    if (size != 0) {
+      return p;
+    }
+
+    // lui + addi
+    // addi の即値は符号付きなので、下位12ビットが負数になる場合は
+    // 上位20ビットに1を足しておく
+    const int32_t lo = int32_t((imm & 0xfff) ^ 0x800) - 0x800;
+    p.count = 2;
+    p.step[1] = LI_ADDI;
+    p.imm[1] = lo;
+    size = One::size(imm - uint32_t(lo), compressed, p.step[0], p.imm[0]) +
+           ((compressed && -32 <= lo && lo <= 31) ? 2 : 4);
+    Pick::run(best, bestSize, size, p);
+
+    // (値 >> k) を作ってから slli で戻す
+    const int shiftSize = compressed ? 2 : 4;
+    for (int k = 1; k < 32 && ((imm >> (k - 1)) & 1) == 0; ++k) {
+      const int n = One::size(uint32_t(int32_t(imm) >> k), compressed,
+                              p.step[0], p.imm[0]);
+      p.step[1] = LI_SLLI;
+      p.imm[1] = k;
+      if (n != 0) {
+        Pick::run(best, bestSize, n + shiftSize, p);
+      }
+    }
+
+    // (値 << k) の下位を 0 または 1 で埋めたものを作ってから
+    // srli / srai で戻す
+    const int rshiftSize = (compressed && creg) ? 2 : 4;
+    for (int k = 1; k < 32; ++k) {
+      const uint32_t base = imm << k;
+      const uint32_t fills[2] = {base, base | ((1u << k) - 1)};
+      for (uint32_t v : fills) {
+        const int n = One::size(v, compressed, p.step[0], p.imm[0]);
+        if (n == 0) {
+          continue;
+        }
+        p.imm[1] = k;
+        if ((v >> k) == imm) {
+          p.step[1] = LI_SRLI;
+          Pick::run(best, bestSize, n + rshiftSize, p);
+        } else if (uint32_t(int32_t(v) >> k) == imm) {
+          p.step[1] = LI_SRAI;
+          Pick::run(best, bestSize, n + rshiftSize, p);
+        }
+      }
+    }
+    return best;
+  }
+
+  // 圧縮命令の選択
+  // 実行時の生成器(RV32_asm_C.hpp)と StaticGenerator で共通に使う。
+  // 圧縮命令で表せない場合は op が 0 の CInsn を返す。
+  struct CInsn {
+    uint16_t op;
+    const char *msg;
+  };
+
+  // c.mv / c.add
+  constexpr static CInsn cAdd(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    if (rd.getIdx() != 0 && rs1.getIdx() == 0 && rs2.getIdx() != 0) {
+      return {uint16_t((0b100 << 13) | (rd.getIdx() << 7) |
+                       (rs2.getIdx() << 2) | 0b10),
+              "C.MV"};
+    }
+    if (rd == rs1 && rd.getIdx() != 0 && rs2.getIdx() != 0) {
+      return {uint16_t((0b100 << 13) | (0b1 << 12) | (rd.getIdx() << 7) |
+                       (rs2.getIdx() << 2) | 0b10),
+              "C.ADD"};
+    }
+    return {0, NULL};
+  }
+
+  // c.addi4spn / c.addi16sp / c.addi / c.li / c.mv
+  constexpr static CInsn cAddi(const Reg &rd, const Reg &rs1, int32_t imm) {
+    const int SP = 2;
+    if (rd.isCReg() && rs1.getIdx() == SP && imm != 0 &&
+        (imm & 0x3fc) == imm) {
+      const int nzuimm = ((imm & 0x3c0) >> 4) | ((imm & 0x030) << 2) |
+                         ((imm & 0x008) >> 3) | ((imm & 0x004) >> 1);
+      return {uint16_t((nzuimm << 5) | (rd.getCIdx() << 2) | 0b00),
+              "C.ADDI4SPN"};
+    }
+    if (rd.getIdx() == SP && rs1.getIdx() == SP && imm != 0 && -512 <= imm &&
+        imm <= 496 && (imm % 16) == 0) {
+      // c.addi16sp で表せる動作の一部は c.addi でも表せるが
+      // c.addi16sp を優先して使うようにしたいので先に判定する
+      const int32_t u = imm & 0x3f0;
+      return {uint16_t((0b011 << 13) | ((u & 0x200) << 3) | (SP << 7) |
+                       ((u & 0x010) << 2) | ((u & 0x040) >> 1) |
+                       ((u & 0x180) >> 4) | ((u & 0x020) >> 3) | 0b01),
+              "C.ADDI16SP"};
+    }
+    if (rd == rs1 && rd.getIdx() != 0 && imm != 0 && -32 <= imm &&
+        imm <= 31) {
+      return {uint16_t((0b000 << 13) | ((imm & 0x20) << 7) |
+                       (rd.getIdx() << 7) | ((imm & 0x1f) << 2) | 0b01),
+              "C.ADDI"};
+    }
+    if (rd.getIdx() != 0 && rs1.getIdx() == 0 && -32 <= imm && imm <= 31) {
+      return {uint16_t((0b010 << 13) | ((imm & 0x20) << 7) |
+                       (rd.getIdx() << 7) | ((imm & 0x1f) << 2) | 0b01),
+              "C.LI"};
+    }
+    if (imm == 0) {
+      return cAdd(rd, Reg(0), rs1);  // mv
+    }
+    return {0, NULL};
+  }
+
+  // c.lui(imm は lui と同じく上位20ビットの値)
+  constexpr static CInsn cLui(const Reg &rd, uint32_t imm) {
+    if (rd.getIdx() == 0 || rd.getIdx() == 2 || imm == 0 ||
+        (31 < imm && imm < 0xfffe0)) {
+      return {0, NULL};
+    }
+    return {uint16_t((0b011 << 13) | ((imm & 0x20) << 7) | (rd.getIdx() << 7) |
+                     ((imm & 0x1f) << 2) | 0b01),
+            "C.LUI"};
+  }
+
+  // c.lw / c.lwsp
+  constexpr static CInsn cLw(const Reg &rd, const OffsetReg32 &or1) {
+    const address_offset_t off = or1.getOffset();
+    if (rd.isCReg() && or1.getReg().isCReg() && (off & 0x7c) == off) {
+      return {uint16_t((0b010 << 13) | (or1.getReg().getCIdx() << 7) |
+                       (rd.getCIdx() << 2) | ((off & 0x40) >> 1) |
+                       ((off & 0x38) << 7) | ((off & 0x04) << 4)),
+              "C.LW"};
+    }
+    if (rd.getIdx() != 0 && or1.getIdx() == 2 && (off & 0xfc) == off) {
+      return {uint16_t((0b010 << 13) | ((off & 0x20) << 7) |
+                       (rd.getIdx() << 7) | ((off & 0x1c) << 2) |
+                       ((off & 0xc0) >> 4) | 0b10),
+              "C.LWSP"};
+    }
+    return {0, NULL};
+  }
+
+  // c.sw / c.swsp
+  constexpr static CInsn cSw(const Reg &rs2, const OffsetReg32 &or1) {
+    const address_offset_t off = or1.getOffset();
+    if (rs2.isCReg() && or1.getReg().isCReg() && (off & 0x7c) == off) {
+      return {uint16_t((0b110 << 13) | (or1.getReg().getCIdx() << 7) |
+                       (rs2.getCIdx() << 2) | ((off & 0x40) >> 1) |
+                       ((off & 0x38) << 7) | ((off & 0x04) << 4)),
+              "C.SW"};
+    }
+    if (or1.getIdx() == 2 && (off & 0xfc) == off) {
+      return {uint16_t((0b110 << 13) | ((off & 0x3c) << 7) |
+                       ((off & 0xc0) << 1) | (rs2.getIdx() << 2) | 0b10),
+              "C.SWSP"};
+    }
+    return {0, NULL};
+  }
+
+  // c.slli
+  constexpr static CInsn cSlli(const Reg &rd, const Reg &rs1, int32_t imm) {
+    if (rd != rs1 || rd.getIdx() == 0 || imm == 0) {
+      return {0, NULL};
+    }
+    return {uint16_t((rd.getIdx() << 7) | ((imm & 0x1f) << 2) | 0b10),
+            "C.SLLI"};
+  }
+
+  // c.srli / c.srai / c.andi(funct2 は 0b00 / 0b01 / 0b10)
+  constexpr static CInsn cShiftAndi(int funct2, const Reg &rd, const Reg &rs1,
+                                    int32_t imm, const char *msg) {
+    if (rd != rs1 || !rd.isCReg()) {
+      return {0, NULL};
+    }
+    if (funct2 == 0b10 ? (imm < -32 || 31 < imm) : imm == 0) {
+      return {0, NULL};
+    }
+    return {uint16_t((0b100 << 13) | ((imm & 0x20) << 7) | (funct2 << 10) |
+                     (rd.getCIdx() << 7) | ((imm & 0x1f) << 2) | 0b01),
+            msg};
+  }
+
+  // c.sub / c.xor / c.or / c.and
+  constexpr static CInsn cArith(int funct2, const Reg &rd, const Reg &rs1,
+                                const Reg &rs2, const char *msg) {
+    if (rd != rs1 || !rd.isCReg() || !rs2.isCReg()) {
+      return {0, NULL};
+    }
+    return {uint16_t((0b100011 << 10) | (rd.getCIdx() << 7) | (funct2 << 5) |
+                     (rs2.getCIdx() << 2) | 0b01),
+            msg};
+  }
+
+  // c.jr / c.jalr
+  constexpr static CInsn cJalr(const Reg &rd, const OffsetReg32 &or1) {
+    if (rd.getIdx() > 1 || or1.getOffset() != 0 || or1.getIdx() == 0) {
+      return {0, NULL};
+    }
+    const char *msg =
+        (rd.getIdx() == 1) ? "C.JALR" : (or1.getIdx() == 1) ? "C.RET" : "C.JR";
+    return {uint16_t((0b100 << 13) | (rd.getIdx() << 12) | (or1.getIdx() << 7) |
+                     0b10),
+            msg};
+  }
+};
+
+// ラベルの識別子
+typedef uint32_t label_id_t;
+
+// 命令レコードの種別
+// ラベルを参照しない命令はオペコードをそのまま書き出すだけで済むが、
+// ラベルを参照する命令はコード生成時にオフセットを埋め込む必要がある。
+enum FixupKind {
+  FIX_NONE32 = 0,  // 32ビット命令（ラベル参照なし）
+  FIX_NONE16,      // 16ビット命令（ラベル参照なし）
+  FIX_BRANCH,      // B形式の分岐命令(beq, bne, ...)
+  FIX_JAL,         // J形式のジャンプ命令(jal)
+  FIX_AUIPC,       // U形式のPC相対命令(auipc)
+  FIX_CALL,        // auipc + jalr の2命令(call, tail)
+  FIX_CJ,          // c.j / c.jal 、範囲外なら jal
+  FIX_CBZ,         // c.beqz / c.bnez 、範囲外なら beq / bne
+  FIX_LOAD,        // auipc + ロード命令の2命令(リテラルプールからの読み込み)
+  FIX_ALIGN,       // 境界に揃えるための詰め物(label に境界のバイト数)
+};
+
+// 定義されていないラベルへの参照(外部参照)
+// オブジェクトファイルに書き出す場合は再配置として出力する。
+struct Relocation {
+  address_offset_t offset;  // 参照する命令のオフセット
+  label_id_t label;         // 参照するラベルの識別子
+  uint8_t kind;             // FixupKind
+  uint8_t size;             // 命令のバイト数
+};
+
+// ラベル
+// newLabel() で確保した整数の識別子を持つハンドルとして使うか、
+// 従来通りラベル名の文字列から暗黙に変換して使う。
+// 文字列から変換した場合は、命令の登録時に一度だけ識別子に変換する。
+// 文字列はコピーせずにポインタを保持するだけなので、
+// 命令の引数として渡す以外の用途で保持しないこと。
+class Label {
+  friend class Env;
+  enum Type { LABEL_NONE, LABEL_ID, LABEL_NAME, LABEL_OFFSET };
+
+  Type type;
+  label_id_t id;
+  const char *name;
+  address_offset_t force_offset;
+
+  Label(Type type, label_id_t id, const char *name, address_offset_t offset)
+      : type(type), id(id), name(name), force_offset(offset) {}
+
+ public:
+  Label() : Label(LABEL_NONE, 0, NULL, 0) {}
+  Label(const char *label) : Label(LABEL_NAME, 0, label, 0) {
+    if (label == NULL) {
+      type = LABEL_NONE;
+    }
+  }
+  explicit Label(const std::string &label)
+      : Label(LABEL_NAME, 0, label.c_str(), 0) {}
+  explicit Label(address_offset_t offset)
+      : Label(LABEL_OFFSET, 0, NULL, offset) {}
+
+  // newLabel() で確保したハンドルか
+  bool isValid() const { return type == LABEL_ID; }
+  // ラベル名ではなくオフセット値を直接指定されているか
+  bool isOffset() const { return type == LABEL_OFFSET; }
+  address_offset_t getOffset() const { return force_offset; }
+  label_id_t getId() const { return id; }
+  const char *getName() const { return name; }
+};
+
+// 命令1つ分の情報
+// 命令毎にラムダ式を保持するとヒープ確保と間接呼び出しが多くなるので、
+// 固定サイズのレコードとして vector にまとめて保持する。
+struct Insn {
+  uint32_t op;              // 32ビット命令のオペコード(ラベル参照の即値部分は0)
+  address_offset_t offset;  // 配置後の先頭からのオフセット
+  label_id_t label;         // 参照するラベルの識別子
+  uint16_t cop;             // 16ビット命令のオペコード(同上)
+  uint8_t kind;             // FixupKind
+  uint8_t size;             // 命令のバイト数
+  const char *msg;          // ニーモニック(デバッグ表示用)
+};
+
+// 生成した命令1つ分の情報
+// ListingSink に渡される。 bytes はコールバックの間だけ有効。
+// オペランドの文字列が必要な場合は、 RV32_asm_listing.hpp の
+// formatInsn() / formatOperands() で code から組み立てる。
+struct ListingRecord {
+  address_offset_t offset;     // 先頭からのオフセット
+  const unsigned char *bytes;  // 書き込んだ命令のバイト列
+  int size;                    // 命令のバイト数(2 または 4)
+  uint32_t code;               // 命令のオペコード
+  const char *mnemonic;        // ニーモニック
+};
+
+// 生成した命令とラベルを受け取るためのインターフェース
+// setListing() で生成器に設定すると、命令をコード領域に書き込むたびに呼ばれる。
+// 記録モードでは generate() の時点で呼ばれるので、
+// オフセットは配置後の値になる。
+// 直接書き込みモードでは、前方参照の命令はラベルの定義時に埋めた内容で
+// 同じオフセットに対してもう一度呼ばれる。
+// 設定していない場合のコストは、書き込みごとのポインタの比較だけ。
+class ListingSink {
+ public:
+  virtual ~ListingSink() {}
 
-  bool operator==(const FReg &o) const { return this->getIdx() == o.getIdx(); }
-  bool operator!=(const FReg &o) const { return this->getIdx() != o.getIdx(); }
-  bool isCReg() const { return cidx != 15; }
-  int getCIdx() const { return cidx; }
+  // 命令を書き込んだ
+  virtual void insn(const ListingRecord &rec) = 0;
+
+  // ラベルを定義した(名前の無いラベルの場合は name が NULL)
+  virtual void label(label_id_t, const char *, address_offset_t) {}
+
+  // コードの生成が完了した
+  virtual void generated(const unsigned char *, size_t) {}
 };
 
 class Env {
-  typedef std::map<std::string, address_offset_t> LabelMap;
-  typedef std::function<void(Env &)> InsnGen_type;
-  address_offset_t offset;
-  LabelMap labels;
-  std::list<InsnGen_type> insns;
-  bool inGenerate;
+  friend class Peephole;   // 記録した命令を書き換える
+  friend class Scheduler;  // 記録した命令を並べ替える
+  typedef std::unordered_map<std::string, label_id_t> LabelMap;
+  enum { UNDEFINED_POS = 0xffffffff, NO_FIXUP = 0xffffffff };
+  enum { COLD_POS = 0x80000000 };  // cold の命令列の中の位置を表すビット
+  enum {
+    NOP = 0x00000013,  // addi zero, zero, 0
+    C_NOP = 0x0001,    // c.nop
+    LOOP_ALIGN = 16,   // alignLoop() で揃える既定の境界
+  };
+  enum { UNDEFINED_OFFSET = -1 };
+
+  // 直接書き込みモードで未解決の前方参照
+  struct Fixup {
+    Insn insn;
+    uint32_t next;  // 同じラベルを参照する次の Fixup
+  };
+
+  // リテラルプールに置く値
+  struct Literal {
+    uint64_t value;
+    int size;  // 4 または 8
+    label_id_t label;
+  };
+
+  address_offset_t offset;  // 配置前の(最短の命令長で見積もった)オフセット
+  LabelMap labelIds;                            // ラベル名 -> 識別子
+  std::vector<uint32_t> labelPos;               // 識別子 -> 定義位置の命令番号
+  std::vector<address_offset_t> labelOffsets;   // 識別子 -> オフセット
+  std::vector<const std::string *> labelNames;  // 識別子 -> ラベル名
+  std::vector<Insn> insns;
+  size_t relaxCount;  // 配置によって長さが変わる命令の数
+  bool laidOut;       // layout() 済みか
+  std::vector<Literal> literals;  // まだ配置していないリテラル
+  // beginCold() から endCold() までの命令は、記録中は insns と入れ替えた
+  // aside に記録し、 flushCold() で hot の命令列の後ろにまとめて移す。
+  // cold の中で定義したラベルの位置には COLD_POS を立てておく。
+  std::vector<Insn> aside;  // 記録していない方(hot / cold)の命令列
+  bool cold;                // cold の命令を記録中か
+  label_id_t coldSkip;      // 直接書き込みモードで cold の命令を飛び越す先
+  uint32_t loopAlign;  // alignLoop() で揃える境界のバイト数
+  bool alignBackward;  // 後方分岐の飛び先を loopAlign に揃えるか
+  uint32_t codeAlign;  // コードの先頭を揃える必要がある境界のバイト数
+  Error error;
   Base *pGen;
+  Allocator *alloc;
+
+  // 直接書き込みモード
+  // 命令を記録せずにその場でコード領域に書き込み、
+  // 前方参照だけを Fixup として覚えておいてラベルの定義時に埋める
+  bool direct;
+  std::vector<Fixup> fixups;
+  std::vector<uint32_t> labelFixups;  // 識別子 -> 最初の Fixup
+  size_t pendingFixups;               // 未解決の Fixup の数
 
   // 生成したコードを入れる領域
+  unsigned char *top;
   unsigned char *code;
   size_t remining;
 
+  ListingSink *sink;  // 設定されていなければ NULL
+
   void write32(uint32_t dw) {
     assert(4 <= this->remining);
     this->remining -= 4;
@@ -213,165 +1136,1560 @@ class Env {
     *(this->code++) = b;
   }
 
+  void push(uint32_t op, uint16_t cop, FixupKind kind, int size,
+            label_id_t label, const char *msg) {
+    if (direct) {
+      if (remining < size_t(size) && !expand(size)) {
+        // 収まらない場合はオフセットだけ進めて、エラーにしておく
+        error = ERR_CODE_IS_TOO_BIG;
+        offset += size;
+        return;
+      }
+      if (size == 2) {
+        out16(cop, msg);
+      } else {
+        out32(op, msg);
+      }
+    } else {
+      const Insn insn = {op,           offset,        label, cop,
+                         uint8_t(kind), uint8_t(size), msg};
+      insns.push_back(insn);
+      laidOut = false;
+    }
+    offset += size;
+  }
+
+  // 直接書き込みモードでコード領域が足りない場合に拡張する
+  // 前方参照の Fixup はオフセットで覚えているので、領域が移動しても問題ない
+  bool expand(size_t size);
+
+  // ラベル名を識別子に変換する
+  // 初めて使われた名前の場合は新しい識別子を割り当てる
+  label_id_t getLabelId(const char *s) {
+    auto result =
+        labelIds.insert(std::make_pair(std::string(s), label_id_t(0)));
+    if (result.second) {
+      result.first->second = newLabelId();
+      labelNames.back() = &result.first->first;
+    }
+    return result.first->second;
+  }
+
+  label_id_t newLabelId() {
+    labelPos.push_back(UNDEFINED_POS);
+    labelOffsets.push_back(UNDEFINED_OFFSET);
+    labelNames.push_back(NULL);
+    if (direct) {
+      labelFixups.push_back(NO_FIXUP);
+    }
+    return label_id_t(labelPos.size() - 1);
+  }
+
+  // ラベルを識別子に変換する
+  label_id_t resolve(const Label &label) {
+    switch (label.type) {
+      case Label::LABEL_ID:
+        assert(label.id < labelPos.size());
+        return label.id;
+      case Label::LABEL_NAME:
+        return getLabelId(label.name);
+      default:
+        assert(false);
+        return newLabelId();
+    }
+  }
+
+  // 命令番号に対応するオフセット
+  address_offset_t offsetOf(uint32_t pos) const {
+    assert(pos != UNDEFINED_POS && pos <= insns.size());
+    if (pos == insns.size()) {
+      return insns.empty() ? 0 : insns.back().offset + insns.back().size;
+    }
+    return insns[pos].offset;
+  }
+
+  // 各命令のオフセットを計算する
+  address_offset_t assignOffsets() {
+    address_offset_t pc = 0;
+    for (Insn &insn : insns) {
+      insn.offset = pc;
+      if (insn.kind == FIX_ALIGN) {
+        insn.size = uint8_t(paddingFor(pc, insn.label));
+      }
+      pc += insn.size;
+    }
+    return pc;
+  }
+
+  // 分岐命令の緩和
+  // 圧縮命令・短い分岐命令の長さから始めて、オフセットが範囲外の命令だけを
+  // 長い形式に置き換えることを、全ての命令が範囲内に収まるまで繰り返す。
+  // 境界に揃える詰め物は配置のたびに計算し直すので縮むこともあるが、
+  // 繰り返しを続けるのは分岐命令を伸ばした時だけで、分岐命令は縮めない。
+  // 各分岐命令が伸びられる回数は高々2回なので、必ず停止する。
+  void layout() {
+    laidOut = true;
+    address_offset_t end = assignOffsets();
+    bool changed = (relaxCount != 0);
+    while (changed) {
+      changed = false;
+      for (Insn &insn : insns) {
+        if (isRelaxable(insn.kind)) {
+          // 外部参照は、ラベルまでの距離によらない通常の長さにする
+          const int size =
+              (labelPos[insn.label] == UNDEFINED_POS)
+                  ? externalSize(insn.kind)
+                  : sizeFor(insn.kind,
+                            offsetOf(labelPos[insn.label]) - insn.offset);
+          if (insn.size < size) {
+            insn.size = size;
+            changed = true;
+          }
+        }
+      }
+      if (changed) {
+        end = assignOffsets();
+      }
+    }
+
+    labelOffsets.resize(labelPos.size());
+    for (size_t i = 0; i < labelPos.size(); ++i) {
+      labelOffsets[i] = (labelPos[i] != UNDEFINED_POS)
+                            ? offsetOf(labelPos[i])
+                            : address_offset_t(end);
+    }
+    offset = end;
+  }
+
+  void out16(uint16_t op, const char *msg) {
+    write16(op);
+    if (sink != NULL) {
+      list(2, op, msg);
+    }
+  }
+
+  void out32(uint32_t op, const char *msg) {
+    write32(op);
+    if (sink != NULL) {
+      list(4, op, msg);
+    }
+  }
+
+  // 書き込んだ直後の命令を sink に渡す
+  void list(int size, uint32_t op, const char *msg) {
+    const ListingRecord rec = {address_offset_t(code - top) - size,
+                               code - size, size, op, msg};
+    sink->insn(rec);
+  }
+
+  // 記録モードで、命令番号 pos の位置に定義されたラベルを sink に渡す
+  // order は (命令番号, 識別子) を命令番号順に並べたもの
+  size_t listLabels(const std::vector<std::pair<uint32_t, label_id_t> > &order,
+                    size_t i, uint32_t pos) {
+    for (; i < order.size() && order[i].first == pos; ++i) {
+      const label_id_t id = order[i].second;
+      sink->label(id, getLabelName(id), labelOffsets[id]);
+    }
+    return i;
+  }
+
+  // 直接書き込みモードでラベルを参照する命令を書き込む
+  void refDirect(Insn insn) {
+    const address_offset_t target = labelOffsets[insn.label];
+    if (target != UNDEFINED_OFFSET) {
+      // 後方参照はオフセットが確定しているので最短の形式で書き込める
+      insn.size = sizeFor(insn.kind, target - offset);
+      if (!fits(insn, target - offset)) {
+        error = ERR_LABEL_IS_TOO_FAR;
+        offset += insn.size;
+        return;
+      }
+      encode(insn, target - offset, [this](uint32_t op, int size,
+                                           const char *msg) {
+        push(op, op, size == 2 ? FIX_NONE16 : FIX_NONE32, size, 0, msg);
+      });
+      return;
+    }
+
+    // 前方参照は後から長さを変えられないので、通常の長さの形式で場所を確保する
+    // (条件分岐は ±4KiB 、ジャンプは ±1MiB の範囲内に限られ、
+    //  届かない場合は patchFixups() で ERR_LABEL_IS_TOO_FAR にする)
+    insn.size = externalSize(insn.kind);
+    const Fixup fixup = {insn, labelFixups[insn.label]};
+    labelFixups[insn.label] = uint32_t(fixups.size());
+    fixups.push_back(fixup);
+    ++pendingFixups;
+    encode(insn, 0, [this](uint32_t op, int size, const char *msg) {
+      push(op, op, FIX_NONE32, size, 0, msg);
+    });
+  }
+
+  // 直接書き込みモードで、ラベルを参照している前方参照を埋める
+  void patchFixups(label_id_t id) {
+    uint32_t idx = labelFixups[id];
+    labelFixups[id] = NO_FIXUP;
+    while (idx != NO_FIXUP) {
+      const Fixup &fixup = fixups[idx];
+      unsigned char *p = top + fixup.insn.offset;
+      if (!fits(fixup.insn, offset - fixup.insn.offset)) {
+        // 場所を確保した形式では届かない(長さを変えられないのでエラーにする)
+        error = ERR_LABEL_IS_TOO_FAR;
+      }
+      if (error == ERR_NONE) {
+        encode(fixup.insn, offset - fixup.insn.offset,
+               [this, &p](uint32_t op, int size, const char *msg) {
+                 for (int i = 0; i < size; ++i) {
+                   *p++ = (unsigned char)(op >> (i * 8));
+                 }
+                 if (sink != NULL) {
+                   const ListingRecord rec = {address_offset_t(p - top) - size,
+                                              p - size, size, op, msg};
+                   sink->insn(rec);
+                 }
+               });
+      }
+      idx = fixup.next;
+      --pendingFixups;
+    }
+    if (pendingFixups == 0) {
+      fixups.clear();
+    }
+  }
+
  public:
-  Env(Base *pGen)
+  Env(Base *pGen, Allocator *alloc)
       : offset(0),
-        labels(),
+        labelIds(),
+        labelPos(),
+        labelOffsets(),
+        labelNames(),
         insns(),
-        inGenerate(false),
+        relaxCount(0),
+        laidOut(false),
+        literals(),
+        aside(),
+        cold(false),
+        coldSkip(0),
+        loopAlign(LOOP_ALIGN),
+        alignBackward(false),
+        codeAlign(1),
+        error(ERR_NONE),
         pGen(pGen),
+        alloc(alloc),
+        direct(false),
+        fixups(),
+        labelFixups(),
+        pendingFixups(0),
+        top(NULL),
         code(NULL),
-        remining(0) {}
+        remining(0),
+        sink(NULL) {}
+
+  // 直接書き込みモードを開始する
+  // 命令を登録する前に呼び出すこと
+  void beginDirect();
+  bool isDirect() const { return direct; }
+  // align() で揃えた最大の境界(コードの先頭をこの境界に置く必要がある)
+  uint32_t getCodeAlign() const { return codeAlign; }
+  Error getError() const { return error; }
+
+  // 記録した命令とラベルを全て破棄して、構築直後の状態に戻す
+  // 各バッファは clear() するだけなので確保済みの容量はそのまま残り、
+  // 同じ規模の関数を繰り返し生成する場合はメモリの確保が起きない。
+  void reset() {
+    offset = 0;
+    labelIds.clear();
+    labelPos.clear();
+    labelOffsets.clear();
+    labelNames.clear();
+    insns.clear();
+    relaxCount = 0;
+    laidOut = false;
+    literals.clear();
+    aside.clear();
+    cold = false;
+    loopAlign = LOOP_ALIGN;
+    alignBackward = false;
+    codeAlign = 1;
+    error = ERR_NONE;
+    direct = false;
+    fixups.clear();
+    labelFixups.clear();
+    pendingFixups = 0;
+    top = NULL;
+    code = NULL;
+    remining = 0;
+  }
+  void setError(Error err) { error = err; }
+  ListingSink *getListing() const { return sink; }
+  void setListing(ListingSink *sink) { this->sink = sink; }
 
-  void AddLabel(const std::string &s) {
-#if IN_DEBUG_MODE
-    printf("%s: %+d\n", s.c_str(), int(offset));
-#endif
-    labels[s] = offset;
+  //////////////////////////////////////////////////////////////////
+  // 即値をオペコードに埋め込む関数
+
+  constexpr static bool inCBRange(address_offset_t imm) {
+    return -256 <= imm && imm <= 254 && (imm & 1) == 0;
+  }
+  constexpr static bool inCJRange(address_offset_t imm) {
+    return -2048 <= imm && imm <= 2046 && (imm & 1) == 0;
+  }
+  constexpr static bool inBRange(address_offset_t imm) {
+    return -4096 <= imm && imm <= 4094 && (imm & 1) == 0;
   }
-  address_offset_t getOffset(const Label &label) const;
-  void operator<<(InsnGen_type ig) {
-    ig(*this);
-    insns.push_back(ig);
+  constexpr static bool inJRange(address_offset_t imm) {
+    return -1048576 <= imm && imm <= 1048574 && (imm & 1) == 0;
   }
 
-  // コードを生成して、codeに書き込み、書き込んだバイト数を返す
-  size_t generate(unsigned char *code, size_t code_size) {
-    this->code = code;
-    this->remining = code_size;
+  // 長さを決めた命令 insn に、オフセット off を埋め込めるか
+  constexpr static bool fits(const Insn &insn, address_offset_t off) {
+    switch (insn.kind) {
+      case FIX_BRANCH:
+        return insn.size == 4 ? inBRange(off) : inJRange(off - 4);
+      case FIX_CBZ:
+        return insn.size == 2   ? inCBRange(off)
+               : insn.size == 4 ? inBRange(off)
+                                : inJRange(off - 2);
+      case FIX_CJ:
+        return insn.size == 2 ? inCJRange(off) : inJRange(off);
+      case FIX_JAL:
+        return inJRange(off);
+      default:
+        return true;  // auipc を使う命令は 32 ビットの範囲に届く
+    }
+  }
 
-    offset = 0;
-    inGenerate = true;
-    for (auto ig : insns) {
-      ig(*this);
+  // オフセットによって命令の長さが変わるか
+  constexpr static bool isRelaxable(int kind) {
+    return kind == FIX_BRANCH || kind == FIX_CJ || kind == FIX_CBZ;
+  }
+
+  // オフセットに応じた、ラベルを参照する命令のバイト数
+  constexpr static int sizeFor(int kind, address_offset_t off) {
+    switch (kind) {
+      case FIX_BRANCH:
+        return inBRange(off) ? 4 : 8;
+      case FIX_CJ:
+        return inCJRange(off) ? 2 : 4;
+      case FIX_CBZ:
+        return inCBRange(off) ? 2 : inBRange(off) ? 4 : 6;
+      case FIX_CALL:
+      case FIX_LOAD:
+        return 8;
+      default:
+        return 4;
     }
-    inGenerate = false;
-    return code_size - remining;
   }
 
-  void dh(unsigned int op, const char *msg = "") {
-    offset += 2;
-
-    if (inGenerate) {
-      write16(op);
-#if IN_DEBUG_MODE
-      printf(
-          "                                                        0x%04x %s\n",
-          op, msg);
-#endif
+  // 配置によらない長さ(直接書き込みモードの前方参照と外部参照で使う)
+  constexpr static int externalSize(int kind) {
+    return (kind == FIX_CALL || kind == FIX_LOAD) ? 8 : 4;
+  }
+
+  // offset の位置から align バイト境界までの詰め物のバイト数
+  constexpr static int paddingFor(address_offset_t offset, uint32_t align) {
+    return int((0 - uint32_t(offset)) & (align - 1));
+  }
+
+  // FIX_LOAD の cop に入れるロード命令の情報
+  // (rd << 10) | (funct3 << 7) | opcode
+  constexpr static uint16_t loadOp(int opcode, int funct3, int rd) {
+    return uint16_t((rd << 10) | (funct3 << 7) | opcode);
+  }
+
+  // FIX_LOAD のロード命令のニーモニック
+  constexpr static const char *loadName(uint16_t cop) {
+    return (cop & 0x7f) == 0b0000011       ? "LW"
+           : ((cop >> 7) & 7) == 0b011 ? "FLD"
+                                       : "FLW";
+  }
+
+  // B形式
+  constexpr static uint32_t fixB(uint32_t op, address_offset_t imm) {
+    assert(inBRange(imm));
+    const uint32_t tmp = imm & 0x00001fff;
+    return op | ((tmp >> 12) & 1) << 31 | ((tmp >> 5) & 0x3f) << 25 |
+           ((tmp >> 1) & 0xf) << 8 | ((tmp >> 11) & 1) << 7;
+  }
+
+  // J形式
+  constexpr static uint32_t fixJ(uint32_t op, address_offset_t imm) {
+    assert(inJRange(imm));
+    const uint32_t tmp = (uint32_t)imm;
+    return op | (((tmp >> 20) & 0x1) << 19     // 1
+                 | ((tmp >> 1) & 0x3ff) << 9   // 10
+                 | ((tmp >> 11) & 0x1) << 8    // 1
+                 | ((tmp >> 12) & 0xff)        // 8
+                 ) << 12;
+  }
+
+  // U形式
+  constexpr static uint32_t fixU(uint32_t op, address_offset_t imm) {
+    assert((imm & 0xfff) == 0);
+    return op | (imm & 0xfffff000);
+  }
+
+  // c.beqz / c.bnez
+  constexpr static uint16_t fixCB(uint16_t op, address_offset_t imm) {
+    assert(inCBRange(imm));
+    imm &= 0x1fe;
+    return op | ((imm & 0x100) << 4) | ((imm & 0x018) << 7) |
+           ((imm & 0x0c0) >> 1) | ((imm & 0x006) << 2) | ((imm & 0x020) >> 3);
+  }
+
+  // c.j / c.jal
+  constexpr static uint16_t fixCJ(uint16_t op, address_offset_t imm) {
+    assert(inCJRange(imm));
+    int im2 =                   //
+        ((imm & 0x800) >> 1) |  //
+        ((imm & 0x400) >> 4) |  //
+        ((imm & 0x300) >> 1) |  //
+        ((imm & 0x080) >> 3) |  //
+        ((imm & 0x040) >> 1) |  //
+        ((imm & 0x020) >> 5) |  //
+        ((imm & 0x010) << 5) |  //
+        (imm & 0x00e);
+    return op | (im2 << 2);
+  }
+
+  // 条件を反転した分岐命令のニーモニック
+  constexpr static const char *invertedName(uint32_t op) {
+    switch ((op >> 12) & 7) {
+      case 0b000:
+        return "BNE";
+      case 0b001:
+        return "BEQ";
+      case 0b100:
+        return "BGE";
+      case 0b101:
+        return "BLT";
+      case 0b110:
+        return "BGEU";
+      case 0b111:
+        return "BLTU";
+      default:
+        return "";
     }
   }
 
+  // ラベルのオフセットを埋め込んだ命令を
+  // out(オペコード, バイト数, ニーモニック) に渡す。
+  // 分岐の緩和で複数の命令に展開される場合は複数回呼び出す。
+  // コンパイル時にも使えるように constexpr にしてある
+  template <typename Out>
+  constexpr static void encode(const Insn &insn, address_offset_t off,
+                               Out out) {
+    switch (insn.kind) {
+      case FIX_BRANCH:
+        if (insn.size == 4) {
+          out(fixB(insn.op, off), 4, insn.msg);
+        } else {
+          // 範囲外なので、条件を反転した分岐命令で jal を飛び越える
+          out(fixB(insn.op ^ (1 << 12), 8), 4, invertedName(insn.op));
+          out(fixJ(0b1101111, off - 4), 4, "J");
+        }
+        break;
+      case FIX_JAL:
+        out(fixJ(insn.op, off), 4, insn.msg);
+        break;
+      case FIX_AUIPC:
+        out(fixU(insn.op, off), 4, insn.msg);
+        break;
+      case FIX_CALL: {
+        // jalr の即値は12ビットの「符号付き」整数なので、
+        // 下位12ビットが負数になる場合は上位20ビットに1を足しておく
+        address_offset_t hi = (off & 0xfffff000) + ((off & 0x0800) << 1);
+        address_offset_t lo = off & 0x00000fff;
+        if (off & 0x00000800) {  //符号拡張
+          lo |= 0xfffff000;
+        }
+        assert(hi + lo == off);
+        // cop には jalr の rd を入れてある
+        const uint32_t rs1 = (insn.op >> 7) & 0x1f;
+        out(insn.op | (hi & 0xfffff000), 4, insn.msg);
+        out((uint32_t(lo & 0xfff) << 20) | (rs1 << 15) | (insn.cop << 7) |
+                0b1100111,
+            4, insn.msg);
+        break;
+      }
+      case FIX_LOAD: {
+        // FIX_CALL と同様に上位20ビットを auipc で足してから、
+        // 下位12ビットをロード命令のオフセットにする
+        const address_offset_t hi = (off + 0x800) & 0xfffff000;
+        const address_offset_t lo = off - hi;
+        const uint32_t rs1 = (insn.op >> 7) & 0x1f;
+        out(insn.op | uint32_t(hi), 4, insn.msg);
+        out((uint32_t(lo & 0xfff) << 20) | (rs1 << 15) |
+                (uint32_t((insn.cop >> 7) & 7) << 12) |
+                (uint32_t(insn.cop >> 10) << 7) | (insn.cop & 0x7f),
+            4, loadName(insn.cop));
+        break;
+      }
+      case FIX_ALIGN: {
+        // 2バイト単位の詰め物は高々1つで、残りは4バイト単位で詰める
+        // 命令の詰め物(nop)の2バイト単位は c.nop になる
+        int rest = insn.size;
+        if (rest & 2) {
+          out(insn.cop, 2, insn.msg[0] == '.' ? insn.msg : "C.NOP");
+          rest -= 2;
+        }
+        for (; rest != 0; rest -= 4) {
+          out(insn.op, 4, insn.msg);
+        }
+        break;
+      }
+      case FIX_CJ:
+        if (insn.size == 2) {
+          out(fixCJ(insn.cop, off), 2, insn.msg);
+        } else {
+          out(fixJ(insn.op, off), 4, "JAL");
+        }
+        break;
+      case FIX_CBZ: {
+        const bool eq = ((insn.op >> 12) & 0x7) == 0;
+        if (insn.size == 2) {
+          out(fixCB(insn.cop, off), 2, insn.msg);
+        } else if (insn.size == 4) {
+          out(fixB(insn.op, off), 4, eq ? "BEQZ" : "BNEZ");
+        } else {
+          // 範囲外なので、条件を反転した分岐命令で jal を飛び越える
+          out(fixCB(insn.cop ^ (1 << 13), 6), 2, eq ? "C.BNEZ" : "C.BEQZ");
+          out(fixJ(0b1101111, off - 2), 4, "J");
+        }
+        break;
+      }
+      default:
+        assert(false);
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 命令・ラベルの登録関数
+
+  // 新しいラベルを確保する
+  // 名前を指定した場合は、同じ名前の文字列のラベルと同じものになる
+  Label newLabel(const char *name = NULL) {
+    label_id_t id = (name != NULL) ? getLabelId(name) : newLabelId();
+    return Label(Label::LABEL_ID, id, NULL, 0);
+  }
+
+  // ラベルを現在の位置に定義する
+  // 分岐の緩和で命令の長さが変わるので、オフセットではなく命令番号で覚えておく
+  void AddLabel(const Label &label) {
+    const label_id_t id = resolve(label);
+    labelPos[id] =
+        uint32_t(insns.size()) | (cold && !direct ? uint32_t(COLD_POS) : 0);
+    if (direct) {
+      labelOffsets[id] = offset;
+      patchFixups(id);
+      if (sink != NULL) {
+        sink->label(id, getLabelName(id), offset);
+      }
+    }
+  }
+
+  // ラベルの数(識別子は 0 から getLabelCount() - 1 まで)
+  size_t getLabelCount() const { return labelPos.size(); }
+
+  // ラベルのオフセット(prepare() の後で有効)
+  // 定義されていないラベルの場合は -1 を返す
+  address_offset_t getLabelOffset(label_id_t id) const {
+    assert(id < labelPos.size());
+    return (labelPos[id] != UNDEFINED_POS) ? labelOffsets[id]
+                                           : address_offset_t(UNDEFINED_OFFSET);
+  }
+
+  // ラベル名を返す(名前の無いラベルの場合は NULL)
+  const char *getLabelName(label_id_t id) const {
+    assert(id < labelNames.size());
+    return labelNames[id] != NULL ? labelNames[id]->c_str() : NULL;
+  }
+
+  // ラベルを参照しない命令の登録
+  void dh(unsigned int op, const char *msg = "") {
+    push(0, op, FIX_NONE16, 2, 0, msg);
+  }
   void dw(uint32_t op, const char *msg = "") {
-    offset += 4;
-
-    if (inGenerate) {
-      write32(op);
-
-#if IN_DEBUG_MODE
-      static const char *tbl[16] = {
-          "0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
-          "1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111",
-      };
-      char buf[64] = {0};
-      sprintf(buf, "%s%s%s%s%s%s%s%s",                     //
-              tbl[(op >> 28) & 15], tbl[(op >> 24) & 15],  //
-              tbl[(op >> 20) & 15], tbl[(op >> 16) & 15],  //
-              tbl[(op >> 12) & 15], tbl[(op >> 8) & 15],   //
-              tbl[(op >> 4) & 15], tbl[(op >> 0) & 15]);
-      char buf2[] = "....... 2[.....] 1[.....] ... D[.....] OP[.......]";
-      char *in = buf;
-      char *out = buf2;
-      while (*out != '\0' && *in != '\0') {
-        if (*out == '.') {
-          *out = *in++;
+    push(op, 0, FIX_NONE32, 4, 0, msg);
+  }
+
+  // ラベルを参照する命令の登録
+  // op, cop にはオフセット部分を0にしたオペコードを指定する
+  void ref(FixupKind kind, uint32_t op, uint16_t cop, const Label &label,
+           const char *msg) {
+    if (label.isOffset()) {
+      // オフセット値を直接指定された場合は、その場で命令を確定させる
+      const address_offset_t off = label.getOffset();
+      const Insn insn = {op,           0,
+                         0,            cop,
+                         uint8_t(kind), uint8_t(sizeFor(kind, off)),
+                         msg};
+      encode(insn, off, [this](uint32_t o, int size, const char *m) {
+        if (size == 2) {
+          dh(o, m);
+        } else {
+          dw(o, m);
+        }
+      });
+      return;
+    }
+
+    if (direct) {
+      const Insn insn = {
+          op, offset, resolve(label), cop, uint8_t(kind), 0, msg};
+      refDirect(insn);
+      return;
+    }
+
+    const label_id_t id = resolve(label);
+    if (alignBackward && (kind == FIX_JAL || isRelaxable(kind))) {
+      alignTarget(id);
+    }
+    // 初めは最短の命令長にしておき、 layout() で必要に応じて伸ばす
+    if (isRelaxable(kind)) {
+      ++relaxCount;
+    }
+    push(op, cop, kind, sizeFor(kind, 0), id, msg);
+  }
+
+  // 定義済みのラベル id の位置(後方分岐の飛び先)に、
+  // loopAlign バイト境界に揃える nop の詰め物を挟む
+  // 既に同じ以上の境界に揃えている場合は何もしない
+  void alignTarget(label_id_t id) {
+    const uint32_t mode = cold ? uint32_t(COLD_POS) : 0;
+    if (labelPos[id] == UNDEFINED_POS || (labelPos[id] & COLD_POS) != mode ||
+        loopAlign < 2) {
+      return;  // 記録中でない方の命令列のラベルは揃えない
+    }
+    codeAlign = std::max(codeAlign, loopAlign);
+    const uint32_t pos = labelPos[id] & ~COLD_POS;
+    if (pos != 0 && insns[pos - 1].kind == FIX_ALIGN &&
+        insns[pos - 1].label >= loopAlign) {
+      return;
+    }
+    const Insn insn = {NOP,                0, loopAlign, C_NOP,
+                       uint8_t(FIX_ALIGN), 0, "NOP"};
+    insns.insert(insns.begin() + pos, insn);
+    for (uint32_t &p : labelPos) {
+      if (p != UNDEFINED_POS && (p & COLD_POS) == mode &&
+          (p & ~COLD_POS) >= pos) {
+        ++p;
+      }
+    }
+    laidOut = false;
+  }
+
+  // 次の命令を align バイト境界に揃える
+  // 詰め物の4バイト単位は fill32 、2バイト単位は fill16 で埋める
+  void align(uint32_t align, uint32_t fill32, uint16_t fill16,
+             const char *msg) {
+    assert(2 <= align && align <= 128 && (align & (align - 1)) == 0);
+    codeAlign = std::max(codeAlign, align);
+    const Insn insn = {fill32,          offset,
+                       align,           fill16,
+                       uint8_t(FIX_ALIGN), uint8_t(paddingFor(offset, align)),
+                       msg};
+    if (direct) {
+      encode(insn, 0, [this](uint32_t op, int size, const char *m) {
+        push(op, op, size == 2 ? FIX_NONE16 : FIX_NONE32, size, 0, m);
+      });
+      return;
+    }
+    // 詰め物の長さは assignOffsets() で配置に合わせて決める
+    push(fill32, fill16, FIX_ALIGN, 0, align, msg);
+  }
+
+  // 次の命令を align バイト境界に揃える nop の詰め物
+  void alignCode(uint32_t align) { this->align(align, NOP, C_NOP, "NOP"); }
+
+  // ループの先頭を loopAlign バイト境界に揃える
+  void alignLoop() {
+    if (loopAlign >= 2) {
+      alignCode(loopAlign);
+    }
+  }
+
+  // alignLoop() と後方分岐の飛び先を揃える境界(1 の場合は揃えない)
+  void setLoopAlign(uint32_t align, bool backward) {
+    assert(1 <= align && align <= 128 && (align & (align - 1)) == 0);
+    loopAlign = align;
+    alignBackward = backward;
+  }
+
+  // value をリテラルプールに置いて、 auipc + ロード命令で読み込む
+  // op には auipc 、 cop には loadOp() で作ったロード命令の情報を指定する
+  // まだ配置していない同じ値のリテラルがあれば、それを共有する
+  void loadLiteral(uint64_t value, int size, uint32_t op, uint16_t cop,
+                   const char *msg) {
+    label_id_t id = UNDEFINED_POS;
+    for (const Literal &l : literals) {
+      if (l.value == value && l.size == size) {
+        id = l.label;
+        break;
+      }
+    }
+    if (id == UNDEFINED_POS) {
+      id = newLabelId();
+      const Literal l = {value, size, id};
+      literals.push_back(l);
+    }
+    ref(FIX_LOAD, op, cop, Label(Label::LABEL_ID, id, NULL, 0), msg);
+  }
+
+  // まだ配置していないリテラルを現在の位置に置く
+  // 8バイトの値から順に並べるので、境界合わせの詰め物は先頭だけで済む
+  void flushLiterals() {
+    if (literals.empty()) {
+      return;
+    }
+    bool wide = false;
+    for (const Literal &l : literals) {
+      wide |= (l.size == 8);
+    }
+    align(wide ? 8 : 4, 0, 0, ".align");
+    for (int size = 8; size >= 4; size -= 4) {
+      for (const Literal &l : literals) {
+        if (l.size != size) {
+          continue;
+        }
+        AddLabel(Label(Label::LABEL_ID, l.label, NULL, 0));
+        dw(uint32_t(l.value), ".long");
+        if (size == 8) {
+          dw(uint32_t(l.value >> 32), ".long");
         }
-        ++out;
       }
-      printf("%s  0x%08x %s\n", buf2, op, msg);
-#endif
     }
+    literals.clear();
   }
-};
 
-class Label {
-  std::string label;
-  address_offset_t force_offset;
+  // 以降の命令を、めったに実行しない cold の命令として記録する
+  // 直接書き込みモードでは移動できないので、 cold の命令を飛び越す j を置く
+  void beginCold() {
+    assert(!cold);
+    cold = true;
+    if (direct) {
+      coldSkip = newLabelId();
+      ref(FIX_JAL, 0x0000006f, 0, Label(Label::LABEL_ID, coldSkip, NULL, 0),
+          "J");
+      return;
+    }
+    insns.swap(aside);
+  }
 
- public:
-  Label(const char *label) : label(label), force_offset(0) {
-    if (label == 0) {
-      label = "";
-      force_offset = 0;
+  // cold の命令の記録を終えて、 hot の命令の続きを記録する
+  void endCold() {
+    assert(cold);
+    cold = false;
+    if (direct) {
+      AddLabel(Label(Label::LABEL_ID, coldSkip, NULL, 0));
+      return;
     }
+    insns.swap(aside);
   }
-  explicit Label(const std::string &label) : label(label), force_offset(0) {}
-  explicit Label(address_offset_t offset) : label(""), force_offset(offset) {}
 
-  address_offset_t getOffset(const Env &e) const {
-    if (label.empty()) {
-      return force_offset;
-    } else {
-      return e.getOffset(*this);
+  // cold の命令を hot の命令の後ろに移して、ラベルの位置を付け替える
+  // 分岐の長さは layout() で移動後の距離に合わせて決まる
+  void flushCold() {
+    if (cold) {
+      endCold();
     }
+    const uint32_t base = uint32_t(insns.size());
+    insns.insert(insns.end(), aside.begin(), aside.end());
+    aside.clear();
+    for (uint32_t &pos : labelPos) {
+      if (pos != UNDEFINED_POS && (pos & COLD_POS) != 0) {
+        pos = base + (pos & ~COLD_POS);
+      }
+    }
+    laidOut = false;
   }
-  std::string getLabel() const { return label; }
-};  // namespace RV32_asm
 
-address_offset_t Env::getOffset(const Label &label) const {
-  auto itr = labels.find(label.getLabel());
-  if (inGenerate) {
-    assert(itr != labels.end());
-    return itr->second - this->offset;
-  } else {
-    return 0;
+  // 命令の配置を確定させて、生成するコードのバイト数を返す
+  // cold の命令は hot の命令の後ろに、その後ろにリテラルプールを置く
+  size_t prepare() {
+    flushCold();
+    flushLiterals();
+    if (!direct && !laidOut) {
+      layout();
+    }
+    return offset;
   }
-}
+
+  // コードを生成して、codeに書き込み、書き込んだバイト数を返す
+  // 領域が足りない場合は何も書き込まずに0を返す
+  // relocs を指定した場合は、定義されていないラベルへの参照をオフセット 0 で
+  // 書き込んで relocs に追加する。指定しない場合はエラーにする。
+  size_t generate(unsigned char *code, size_t code_size,
+                  std::vector<Relocation> *relocs = NULL) {
+    if (direct) {
+      // 既に書き込み済みなので、未解決の参照が無いことだけ確認する
+      assert(code == top);
+      if (pendingFixups != 0) {
+        if (relocs == NULL) {
+          error = ERR_UNDEFINED_LABEL;
+        } else {
+          for (label_id_t id = 0; id < labelFixups.size(); ++id) {
+            for (uint32_t i = labelFixups[id]; i != NO_FIXUP;
+                 i = fixups[i].next) {
+              const Insn &insn = fixups[i].insn;
+              const Relocation r = {insn.offset, id, insn.kind, insn.size};
+              relocs->push_back(r);
+            }
+          }
+        }
+      }
+      return (error == ERR_NONE) ? offset : 0;
+    }
+    if (code_size < prepare()) {
+      error = ERR_CODE_IS_TOO_BIG;
+      return 0;
+    }
+
+    this->top = code;
+    this->code = code;
+    this->remining = code_size;
+
+    // ラベルは定義位置の命令の直前で sink に渡す
+    std::vector<std::pair<uint32_t, label_id_t> > order;
+    size_t next = 0;
+    if (sink != NULL) {
+      for (label_id_t id = 0; id < labelPos.size(); ++id) {
+        if (labelPos[id] != UNDEFINED_POS) {
+          order.push_back(std::make_pair(labelPos[id], id));
+        }
+      }
+      std::sort(order.begin(), order.end());
+    }
+
+    for (const Insn &insn : insns) {
+      if (sink != NULL) {
+        next = listLabels(order, next, uint32_t(&insn - insns.data()));
+      }
+      if (insn.kind == FIX_NONE32) {
+        out32(insn.op, insn.msg);
+      } else if (insn.kind == FIX_NONE16) {
+        out16(insn.cop, insn.msg);
+      } else {
+        address_offset_t off = 0;
+        if (insn.kind == FIX_ALIGN) {
+          // 詰め物はラベルを参照しない
+        } else if (labelPos[insn.label] == UNDEFINED_POS) {
+          if (relocs == NULL) {
+            error = ERR_UNDEFINED_LABEL;
+            return 0;
+          }
+          const Relocation r = {insn.offset, insn.label, insn.kind,
+                                insn.size};
+          relocs->push_back(r);
+        } else {
+          off = labelOffsets[insn.label] - insn.offset;
+        }
+        encode(insn, off, [this](uint32_t op, int size, const char *msg) {
+          if (size == 2) {
+            out16(op, msg);
+          } else {
+            out32(op, msg);
+          }
+        });
+      }
+    }
+    if (sink != NULL) {
+      listLabels(order, next, uint32_t(insns.size()));
+    }
+    return code_size - remining;
+  }
+};
+
+// コード領域の保護属性の切り替えをまとめて行うためのクラス
+// このクラスのオブジェクトが存在する間、同じスレッドの generate() は
+// PROTECT_WX のコード領域をすぐには RX に切り替えず、
+// commit() または破棄の時点で、隣接する領域をまとめて mprotect する。
+// それまでは生成したコードを実行できないので注意すること。
+class ProtectBatch {
+  friend class Allocator;
+  std::vector<Allocator *> pending;
+  ProtectBatch *prev;
+
+  static ProtectBatch *&current() {
+    static thread_local ProtectBatch *batch = NULL;
+    return batch;
+  }
+  void add(Allocator *alloc) { pending.push_back(alloc); }
+  void remove(Allocator *alloc) {
+    auto it = std::find(pending.begin(), pending.end(), alloc);
+    if (it != pending.end()) {
+      pending.erase(it);
+    }
+  }
+
+  ProtectBatch(const ProtectBatch &);
+  void operator=(const ProtectBatch &);
+
+ public:
+  ProtectBatch() : pending(), prev(current()) { current() = this; }
+  ~ProtectBatch() {
+    commit();
+    current() = prev;
+  }
+
+  // 保留している領域を RX に切り替える
+  bool commit();
+};
 
 class Allocator {
+  friend class ProtectBatch;
+
   // 根本の原因は判らないが、spike で動作確認を行っていると
   // メモリに書き込んだ命令をうまく読みだせず落ちる。
   // 試行錯誤した結果、new したメモリ領域から2048バイトにアライメント
   // したメモリを使用するとうまく動いたので対症療法として
   // アライメント処理を追加した。
+  // (mmap で確保する場合はページ境界に揃うので不要)
   const size_t ALIGN = 2048;
 
   size_t size;
   void *ptr;
-  bool self_allocated;  // メモリ確保を自前でやったフラグ
+  void *exec;            // PROTECT_DUAL での実行用の領域
+  size_t mapped;         // mmap で確保したサイズ
+  int fd;                // PROTECT_DUAL で使う memfd
+  ProtectMode mode;
+  bool self_allocated;   // メモリ確保を自前でやったフラグ
+  bool auto_grow;        // 自動拡張するフラグ
+  bool executable;       // PROTECT_WX で RX に切り替えた(予約した)フラグ
+  ProtectBatch *batch;   // RX への切り替えを予約しているバッチ
+  Error error;
+
+  bool isMapped() const { return mode != PROTECT_NONE; }
+
  public:
-  Allocator() : size(0), ptr(NULL), self_allocated(false) {}
+  // ページ単位に切り上げる
+  static size_t roundPage(size_t size) {
+#if RV32_ASM_USE_MMAP
+    static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+#else
+    const size_t page = 4096;
+#endif
+    return (size + page - 1) & ~(page - 1);
+  }
+
+  // この環境で PROTECT_DUAL を使えるか(memfd を作れるか)
+  static bool canMapDual() {
+#if RV32_ASM_USE_MMAP && defined(__linux__) && defined(MFD_CLOEXEC)
+    const int fd = memfd_create("RV32_asm", MFD_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+ private:
+#if RV32_ASM_USE_MMAP
+  bool openMemfd() {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    fd = memfd_create("RV32_asm", MFD_CLOEXEC);
+    return fd >= 0;
+#else
+    return false;
+#endif
+  }
+
+  // size バイト以上の領域を新たにマップする
+  // PROTECT_DUAL の場合、memfd の内容はそのまま残る
+  bool map(size_t size) {
+    const size_t len = roundPage(size);
+    void *p = MAP_FAILED;
+    void *x = MAP_FAILED;
+    if (mode == PROTECT_DUAL) {
+      if (ftruncate(fd, len) == 0) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        x = mmap(NULL, len, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+      }
+    } else {
+      const int prot = PROT_READ | PROT_WRITE |
+                       ((mode == PROTECT_RWX) ? PROT_EXEC : 0);
+      p = x = mmap(NULL, len, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p == MAP_FAILED || x == MAP_FAILED) {
+      if (p != MAP_FAILED) munmap(p, len);
+      if (x != MAP_FAILED && x != p) munmap(x, len);
+      error = ERR_CANT_ALLOC;
+      return false;
+    }
+    this->ptr = p;
+    this->exec = x;
+    this->mapped = len;
+    this->size = len;
+    return true;
+  }
+
+  void unmap(void *p, void *x, size_t len) {
+    if (x != p) {
+      munmap(x, len);
+    }
+    munmap(p, len);
+  }
+
+  // 先頭 used バイトの内容を保ったまま size バイト以上に拡張する
+  bool remap(size_t size, size_t used) {
+    void *old_ptr = this->ptr;
+    void *old_exec = this->exec;
+    const size_t old_len = this->mapped;
+#ifdef MREMAP_MAYMOVE
+    if (mode != PROTECT_DUAL) {
+      const size_t len = roundPage(size);
+      void *p = mremap(old_ptr, old_len, len, MREMAP_MAYMOVE);
+      if (p == MAP_FAILED) {
+        error = ERR_CANT_ALLOC;
+        return false;
+      }
+      this->ptr = this->exec = p;
+      this->mapped = this->size = len;
+      return true;
+    }
+#endif
+    if (!map(size)) {
+      return false;
+    }
+    if (mode != PROTECT_DUAL) {
+      memcpy(this->ptr, old_ptr, used);
+    }
+    unmap(old_ptr, old_exec, old_len);
+    return true;
+  }
+
+  bool protect(int prot) {
+    if (mprotect(ptr, mapped, prot) != 0) {
+      error = ERR_CANT_PROTECT;
+      return false;
+    }
+    return true;
+  }
+#endif
+
+ public:
+  Allocator()
+      : size(0),
+        ptr(NULL),
+        exec(NULL),
+        mapped(0),
+        fd(-1),
+        mode(PROTECT_NONE),
+        self_allocated(false),
+        auto_grow(false),
+        executable(false),
+        batch(NULL),
+        error(ERR_NONE) {}
 
   virtual ~Allocator() {
-    if (self_allocated) {
-      delete[](unsigned char *) this->ptr;
+    if (batch != NULL) {
+      batch->remove(this);
+    }
+    if (!self_allocated) {
+      return;
     }
+#if RV32_ASM_USE_MMAP
+    if (isMapped()) {
+      if (ptr != NULL) {
+        unmap(ptr, exec, mapped);
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+#endif
+    delete[](unsigned char *) this->ptr;
   }
 
-  void allocate(size_t size, void *ptr) {
+  void allocate(size_t size, void *ptr, ProtectMode mode = PROTECT_NONE) {
     this->size = size;
     this->ptr = ptr;
+    this->auto_grow = (ptr == AutoGrow);
+#if !RV32_ASM_USE_MMAP
+    mode = PROTECT_NONE;
+#endif
+    // 呼び出し側が用意した領域の保護属性は変更しない
+    assert(mode == PROTECT_NONE || ptr == NULL || auto_grow);
 
-    if (this->ptr == NULL) {
-      this->ptr = new unsigned char[size + ALIGN];
+    if (this->ptr == NULL || auto_grow) {
       self_allocated = true;
+      this->ptr = NULL;
+      this->mode = mode;
+#if RV32_ASM_USE_MMAP
+      if (isMapped()) {
+        if (mode == PROTECT_DUAL && !openMemfd()) {
+          // memfd が使えない環境では mprotect で切り替える
+          this->mode = PROTECT_WX;
+        }
+        if (size != 0) {
+          map(size);
+        }
+        return;
+      }
+#endif
+      // 自動拡張する場合、初期サイズが0なら必要になるまで確保しない
+      this->ptr = (size != 0) ? new unsigned char[size + ALIGN] : NULL;
+    }
+    assert(this->ptr != NULL || auto_grow);
+  }
+
+  // size バイト以上の領域を確保する
+  // 自動拡張する場合は、先頭 used バイトの内容を保ったまま領域を拡張する
+  bool reserve(size_t size, size_t used) {
+    if (ptr != NULL && size <= this->size) {
+      return true;
+    }
+    if (!auto_grow) {
+      return false;
+    }
+    assert(used <= this->size);
+#if RV32_ASM_USE_MMAP
+    if (isMapped()) {
+      return (ptr == NULL) ? map(size) : remap(size, used);
+    }
+#endif
+    unsigned char *old = getMemory();
+    void *old_ptr = this->ptr;
+    this->ptr = new unsigned char[size + ALIGN];
+    if (used != 0) {
+      memcpy(getMemory(), old, used);
+    }
+    delete[](unsigned char *) old_ptr;
+    this->size = size;
+    return true;
+  }
+
+  // コード領域を書き込み可能にする
+  bool makeWritable() {
+    if (mode != PROTECT_WX || !executable) {
+      return true;
+    }
+    executable = false;
+    if (batch != NULL) {
+      // まだ切り替えていないので予約を取り消すだけでよい
+      batch->remove(this);
+      batch = NULL;
+      return true;
+    }
+#if RV32_ASM_USE_MMAP
+    return protect(PROT_READ | PROT_WRITE);
+#else
+    return true;
+#endif
+  }
+
+  // コード領域を実行可能にする
+  // ProtectBatch が存在する場合は切り替えを予約するだけ
+  bool makeExecutable() {
+    if (mode != PROTECT_WX || executable || ptr == NULL) {
+      return true;
     }
-    assert(this->ptr != NULL);
+    executable = true;
+    ProtectBatch *b = ProtectBatch::current();
+    if (b != NULL) {
+      batch = b;
+      b->add(this);
+      return true;
+    }
+#if RV32_ASM_USE_MMAP
+    return protect(PROT_READ | PROT_EXEC);
+#else
+    return true;
+#endif
   }
 
+  // 書き込み用のアドレス
   unsigned char *getMemory() const {
-    assert(ptr != NULL);
+    if (ptr == NULL) {
+      return NULL;
+    }
+    if (isMapped()) {
+      return (unsigned char *)ptr;
+    }
     // アライメント調整
     intptr_t p = (intptr_t)ptr;
     p = (p + ALIGN - 1) & (~(ALIGN - 1));
     return (unsigned char *)p;
   }
+  // 実行用のアドレス(PROTECT_DUAL 以外は getMemory() と同じ)
+  unsigned char *getExecMemory() const {
+    return (mode == PROTECT_DUAL) ? (unsigned char *)exec : getMemory();
+  }
   size_t getSize() const { return size; }
-};  // namespace internal
+  bool isAutoGrow() const { return auto_grow; }
+  ProtectMode getProtectMode() const { return mode; }
+  Error getError() const { return error; }
+};
+
+inline bool ProtectBatch::commit() {
+  std::sort(pending.begin(), pending.end(),
+            [](const Allocator *a, const Allocator *b) {
+              return (uintptr_t)a->ptr < (uintptr_t)b->ptr;
+            });
+  bool ok = true;
+  size_t i = 0;
+  while (i < pending.size()) {
+    // アドレスが連続している領域はまとめて切り替える
+    unsigned char *begin = (unsigned char *)pending[i]->ptr;
+    unsigned char *end = begin + pending[i]->mapped;
+    size_t j = i + 1;
+    while (j < pending.size() && pending[j]->ptr == end) {
+      end += pending[j]->mapped;
+      ++j;
+    }
+#if RV32_ASM_USE_MMAP
+    const bool r = mprotect(begin, end - begin, PROT_READ | PROT_EXEC) == 0;
+#else
+    const bool r = true;
+#endif
+    for (; i < j; ++i) {
+      pending[i]->batch = NULL;
+      if (!r) {
+        pending[i]->error = ERR_CANT_PROTECT;
+      }
+    }
+    ok = ok && r;
+  }
+  pending.clear();
+  return ok;
+}
+
+inline bool Env::expand(size_t size) {
+  const size_t used = code - top;
+  size_t capacity = alloc->getSize() * 2;
+  if (capacity < used + size) {
+    capacity = used + size;
+  }
+  if (capacity < 256) {
+    capacity = 256;
+  }
+  if (!alloc->reserve(capacity, used)) {
+    return false;
+  }
+  top = alloc->getMemory();
+  code = top + used;
+  remining = alloc->getSize() - used;
+  return true;
+}
+
+inline void Env::beginDirect() {
+  assert(insns.empty() && offset == 0);
+  this->direct = true;
+  alloc->makeWritable();
+  this->top = alloc->getMemory();
+  this->code = this->top;
+  this->remining = (this->top != NULL) ? alloc->getSize() : 0;
+  labelFixups.assign(labelPos.size(), NO_FIXUP);
+}
+
+// 多数の小さな関数を共通のページにまとめて配置するためのコード領域
+// 関数のサイズに応じたサイズクラスごとにページを切り分けて割り当て、
+// release() で返却された領域はフリーリストで再利用する。
+// 2048 バイトを超える関数はページ単位で割り当てる。
+class CodeArena {
+ public:
+  // 割り当てた領域
+  struct Block {
+    unsigned char *code;  // 書き込み用のアドレス
+    unsigned char *exec;  // 実行用のアドレス
+    size_t size;
+  };
+
+ private:
+  // サイズクラスは 16, 32, ... , 2048 バイト
+  enum { MIN_CLASS_SHIFT = 4, NUM_CLASSES = 8, LARGE = 0xff };
+
+  struct Chunk {
+    Allocator alloc;
+    size_t used;                     // 切り出したバイト数
+    std::vector<uint8_t> pageClass;  // ページごとのサイズクラス
+    std::atomic<size_t> bumped;      // reserve() で予約したバイト数
+  };
+
+  // memfd が使えない場合の PROTECT_WX への切り替えも含めて、構築時に決める
+  const ProtectMode mode;
+  const size_t chunkSize;
+  const size_t pageSize;
+  std::vector<Chunk *> chunks;
+  std::vector<Block> freeList[NUM_CLASSES];
+  std::vector<Block> freeLarge;
+  std::unordered_map<const unsigned char *, size_t> large;
+  std::vector<Chunk *> bumpChunks;  // reserve() 用のチャンク
+  std::atomic<Chunk *> bumpChunk;   // reserve() で予約中のチャンク
+  std::mutex mutex;
+
+  CodeArena(const CodeArena &);
+  void operator=(const CodeArena &);
+
+  static int classOf(size_t size) {
+    int cls = 0;
+    while (cls < NUM_CLASSES && (size_t(1) << (cls + MIN_CLASS_SHIFT)) < size) {
+      ++cls;
+    }
+    return cls;
+  }
+
+  Chunk *findChunk(const unsigned char *exec) const {
+    for (Chunk *chunk : chunks) {
+      const unsigned char *top = chunk->alloc.getExecMemory();
+      if (top <= exec && exec < top + chunk->alloc.getSize()) {
+        return chunk;
+      }
+    }
+    return NULL;
+  }
+
+  Chunk *newChunk(size_t size) {
+    Chunk *chunk = new Chunk();
+    chunk->alloc.allocate(std::max(size, chunkSize), NULL, mode);
+    if (chunk->alloc.getMemory() == NULL) {
+      delete chunk;
+      return NULL;
+    }
+    if (chunk->alloc.getProtectMode() != mode) {
+      // 後から memfd を作れなくなった場合など、他の領域と扱いが変わる
+      delete chunk;
+      return NULL;
+    }
+    // PROTECT_WX では書き込む時だけ RW にする
+    chunk->alloc.makeExecutable();
+    chunk->used = 0;
+    return chunk;
+  }
+
+  // size バイト(ページ単位)を切り出す
+  Block takePages(size_t size, uint8_t cls) {
+    Chunk *chunk = chunks.empty() ? NULL : chunks.back();
+    if (chunk == NULL || chunk->used + size > chunk->alloc.getSize()) {
+      chunk = newChunk(size);
+      if (chunk == NULL) {
+        return Block{NULL, NULL, 0};
+      }
+      chunk->pageClass.assign(chunk->alloc.getSize() / pageSize, LARGE);
+      chunks.push_back(chunk);
+    }
+    Block block = {chunk->alloc.getMemory() + chunk->used,
+                   chunk->alloc.getExecMemory() + chunk->used, size};
+    for (size_t i = 0; i < size; i += pageSize) {
+      chunk->pageClass[(chunk->used + i) / pageSize] = cls;
+    }
+    chunk->used += size;
+    return block;
+  }
+
+  Block allocateLarge(size_t size) {
+    size = Allocator::roundPage(size);
+    for (size_t i = 0; i < freeLarge.size(); ++i) {
+      Block block = freeLarge[i];
+      if (block.size < size) {
+        continue;
+      }
+      if (block.size == size) {
+        freeLarge.erase(freeLarge.begin() + i);
+      } else {
+        freeLarge[i].code += size;
+        freeLarge[i].exec += size;
+        freeLarge[i].size -= size;
+        block.size = size;
+      }
+      large[block.exec] = size;
+      return block;
+    }
+    Block block = takePages(size, LARGE);
+    if (block.exec != NULL) {
+      large[block.exec] = size;
+    }
+    return block;
+  }
+
+  // PROTECT_WX でページの保護属性を切り替える
+  void protect(const Block &block, bool writable) {
+#if RV32_ASM_USE_MMAP
+    const uintptr_t mask = ~uintptr_t(pageSize - 1);
+    const uintptr_t begin = uintptr_t(block.code) & mask;
+    const uintptr_t end =
+        (uintptr_t(block.code) + block.size + pageSize - 1) & mask;
+    mprotect((void *)begin, end - begin,
+             PROT_READ | (writable ? PROT_WRITE : PROT_EXEC));
+#endif
+  }
+
+ public:
+  explicit CodeArena(
+      ProtectMode mode = RV32_ASM_USE_MMAP ? PROTECT_DUAL : PROTECT_NONE,
+      size_t chunkSize = 64 * 1024)
+      : mode((mode == PROTECT_DUAL && !Allocator::canMapDual()) ? PROTECT_WX
+                                                                : mode),
+        chunkSize(chunkSize),
+        pageSize(Allocator::roundPage(1)),
+        bumpChunk(NULL) {}
+
+  ~CodeArena() {
+    for (Chunk *chunk : chunks) {
+      delete chunk;
+    }
+    for (Chunk *chunk : bumpChunks) {
+      delete chunk;
+    }
+  }
+
+  // プロセス全体で共有するコード領域
+  static CodeArena &instance() {
+    static CodeArena arena;
+    return arena;
+  }
+
+  // size バイトの領域を align バイト境界(128 以下の2の冪)に割り当てる
+  // 確保できない場合は exec が NULL の Block を返す
+  // サイズクラスの領域はその大きさの境界に並ぶので、 align より小さい
+  // クラスは使わない。
+  Block allocate(size_t size, size_t align = 16) {
+    assert(align <= 128 && (align & (align - 1)) == 0);
+    size = std::max(size, align);
+    std::lock_guard<std::mutex> lock(mutex);
+    const int cls = classOf(size);
+    if (cls == NUM_CLASSES) {
+      return allocateLarge(size);
+    }
+    std::vector<Block> &list = freeList[cls];
+    if (list.empty()) {
+      // 1ページをサイズクラスの大きさに切り分ける
+      const size_t unit = size_t(1) << (cls + MIN_CLASS_SHIFT);
+      Block page = takePages(pageSize, uint8_t(cls));
+      if (page.exec == NULL) {
+        return page;
+      }
+      for (size_t off = pageSize; off != 0; off -= unit) {
+        list.push_back(
+            Block{page.code + off - unit, page.exec + off - unit, unit});
+      }
+    }
+    Block block = list.back();
+    list.pop_back();
+    return block;
+  }
+
+  // size バイトの領域を align バイト境界(128 以下の2の冪)にロックせずに
+  // 予約する
+  // 複数のスレッドから同時に呼び出せる。予約した領域は release() できず、
+  // arena が破棄されるまで解放されない。
+  // チャンクを使い切った時だけ、ロックを取って新しいチャンクに切り替える。
+  // PROTECT_WX の場合は、書き込む間に RW にしても実行中の他の関数に
+  // 影響しないように、ページ単位で予約する。
+  // 予約の単位は 16 バイトなので、 align が 16 より大きい場合は
+  // 境界に合わせるための余白を含めて予約し、その中の境界から使う。
+  Block reserve(size_t size, size_t align = 16) {
+    assert(align <= 128 && (align & (align - 1)) == 0);
+    const size_t slack =
+        (mode == PROTECT_WX || align <= 16) ? 0 : align - 16;
+    const size_t mask = std::max(align, size_t(16)) - 1;
+    size = (mode == PROTECT_WX) ? Allocator::roundPage(size)
+                                : (size + 15) & ~size_t(15);
+    for (;;) {
+      Chunk *chunk = bumpChunk.load(std::memory_order_acquire);
+      if (chunk != NULL) {
+        const size_t off = chunk->bumped.fetch_add(size + slack,
+                                                   std::memory_order_relaxed);
+        if (off + size + slack <= chunk->alloc.getSize()) {
+          const size_t pos = (off + slack) & ~mask;
+          return Block{chunk->alloc.getMemory() + pos,
+                       chunk->alloc.getExecMemory() + pos, size};
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (bumpChunk.load(std::memory_order_relaxed) != chunk) {
+        continue;  // 他のスレッドが切り替えた
+      }
+      Chunk *next = newChunk(size + slack);
+      if (next == NULL) {
+        return Block{NULL, NULL, 0};
+      }
+      next->bumped.store(0, std::memory_order_relaxed);
+      bumpChunks.push_back(next);
+      bumpChunk.store(next, std::memory_order_release);
+    }
+  }
+
+  // allocate() で割り当てた領域を返却する
+  void release(const void *exec) {
+    if (exec == NULL) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    const unsigned char *p = (const unsigned char *)exec;
+    Chunk *chunk = findChunk(p);
+    if (chunk == NULL) {
+      return;  // reserve() で予約した領域は返却できない
+    }
+    const size_t off = p - chunk->alloc.getExecMemory();
+    const uint8_t cls = chunk->pageClass[off / pageSize];
+    Block block = {chunk->alloc.getMemory() + off, (unsigned char *)p, 0};
+    if (cls == LARGE) {
+      auto it = large.find(p);
+      assert(it != large.end());
+      block.size = it->second;
+      large.erase(it);
+      freeLarge.push_back(block);
+    } else {
+      block.size = size_t(1) << (cls + MIN_CLASS_SHIFT);
+      freeList[cls].push_back(block);
+    }
+  }
+
+  // block がページを他の関数と共有していないか
+  // (reserve() の PROTECT_WX と、2048 バイトを超える allocate() の領域)
+  bool ownsPages(const Block &block) const {
+    return (uintptr_t(block.code) & (pageSize - 1)) == 0 &&
+           (block.size & (pageSize - 1)) == 0;
+  }
+
+  // block に書き込む前後に呼び出す
+  // PROTECT_WX の場合は書き込む間だけ該当するページを RW にする。
+  // ページを他の関数と共有する allocate() の小さな領域では、
+  // その間ロックを取り、同じページにある他の関数は実行できない。
+  void beginWrite(const Block &block) {
+    if (mode == PROTECT_WX) {
+      if (!ownsPages(block)) {
+        mutex.lock();
+      }
+      protect(block, true);
+    }
+  }
+  void endWrite(const Block &block) {
+    if (mode == PROTECT_WX) {
+      protect(block, false);
+      if (!ownsPages(block)) {
+        mutex.unlock();
+      }
+    }
+  }
+};
+
+// 生成したコードを他のスレッドに公開するための関数ポインタ
+// publish() する前に書き込んだコードは、get() で取得したスレッドから見える。
+template <typename T>
+class CodeHandle {
+  std::atomic<T> fn;
+
+  CodeHandle(const CodeHandle &);
+  void operator=(const CodeHandle &);
+
+ public:
+  CodeHandle() : fn(NULL) {}
+
+  T get() const { return fn.load(std::memory_order_acquire); }
+  // 関数ポインタを置き換えて、以前の関数ポインタを返す
+  T publish(T f) { return fn.exchange(f, std::memory_order_acq_rel); }
+};
 };  // namespace internal
 using namespace internal;
 
-class Base {
+// レジスタは Registers<> の static constexpr なメンバーなので、
+// 生成器のオブジェクトを作る時に初期化する必要はない。
+class Base : protected Format, public Registers<> {
  protected:
   Allocator alloc;
   Env env;
@@ -380,168 +2698,54 @@ class Base {
   virtual void C(const int op, const char *msg = "") { assert(false); }
 
  public:
-  // レジスタ
-  const Reg x0, x1, x2, x3, x4, x5, x6, x7,    //
-      x8, x9, x10, x11, x12, x13, x14, x15,    //
-      x16, x17, x18, x19, x20, x21, x22, x23,  //
-      x24, x25, x26, x27, x28, x29, x30, x31;
+  Base() : alloc(), env(this, &alloc) {}
 
-  //レジスタの別名
-  const Reg zero, ra, sp, gp, tp, t0, t1,      //
-      t2, s0, fp, s1, a0, a1, a2, a3, a4, a5,  //
-      a6, a7, s2, s3, s4, s5, s6, s7,          //
-      s8, s9, s10, s11, t3, t4, t5, t6;
+  unsigned int getVersion() const { return VERSION; }
 
-  // 浮動小数点レジスタ
-  const FReg f0, f1, f2, f3, f4, f5, f6, f7,   //
-      f8, f9, f10, f11, f12, f13, f14, f15,    //
-      f16, f17, f18, f19, f20, f21, f22, f23,  //
-      f24, f25, f26, f27, f28, f29, f30, f31;
-
-  const FReg ft0, ft1, ft2, ft3, ft4, ft5, ft6, ft7,  //
-      fs0, fs1, fa0, fa1, fa2, fa3, fa4, fa5,         //
-      fa6, fa7, fs2, fs3, fs4, fs5, fs6, fs7,         //
-      fs8, fs9, fs10, fs11, ft8, ft9, ft10, ft11;
-
-  Base()
-      : alloc(),
-        env(this),
-        x0(0),
-        x1(1),
-        x2(2),
-        x3(3),
-        x4(4),
-        x5(5),
-        x6(6),
-        x7(7),
-        x8(8, 0),
-        x9(9, 1),
-        x10(10, 2),
-        x11(11, 3),
-        x12(12, 4),
-        x13(13, 5),
-        x14(14, 6),
-        x15(15, 7),
-        x16(16),
-        x17(17),
-        x18(18),
-        x19(19),
-        x20(20),
-        x21(21),
-        x22(22),
-        x23(23),
-        x24(24),
-        x25(25),
-        x26(26),
-        x27(27),
-        x28(28),
-        x29(29),
-        x30(30),
-        x31(31),  //
-        zero(0),
-        ra(1),
-        sp(2),
-        gp(3),
-        tp(4),
-        t0(5),
-        t1(6),
-        t2(7),
-        s0(8, 0),
-        fp(8, 0),
-        s1(9, 1),
-        a0(10, 2),
-        a1(11, 3),
-        a2(12, 4),
-        a3(13, 5),
-        a4(14, 6),
-        a5(15, 7),
-        a6(16),
-        a7(17),
-        s2(18),
-        s3(19),
-        s4(20),
-        s5(21),
-        s6(22),
-        s7(23),
-        s8(24),
-        s9(25),
-        s10(26),
-        s11(27),
-        t3(28),
-        t4(29),
-        t5(30),
-        t6(31),  //
-        f0(0),
-        f1(1),
-        f2(2),
-        f3(3),
-        f4(4),
-        f5(5),
-        f6(6),
-        f7(7),
-        f8(8, 0),
-        f9(9, 1),
-        f10(10, 2),
-        f11(11, 3),
-        f12(12, 4),
-        f13(13, 5),
-        f14(14, 6),
-        f15(15, 7),
-        f16(16),
-        f17(17),
-        f18(18),
-        f19(19),
-        f20(20),
-        f21(21),
-        f22(22),
-        f23(23),
-        f24(24),
-        f25(25),
-        f26(26),
-        f27(27),
-        f28(28),
-        f29(29),
-        f30(30),
-        f31(31),  //
-        ft0(0),
-        ft1(1),
-        ft2(2),
-        ft3(3),
-        ft4(4),
-        ft5(5),
-        ft6(6),
-        ft7(7),
-        fs0(8, 0),
-        fs1(9, 1),
-        fa0(10, 2),
-        fa1(11, 3),
-        fa2(12, 4),
-        fa3(13, 5),
-        fa4(14, 6),
-        fa5(15, 7),
-        fa6(16),
-        fa7(17),
-        fs2(18),
-        fs3(19),
-        fs4(20),
-        fs5(21),
-        fs6(22),
-        fs7(23),
-        fs8(24),
-        fs9(25),
-        fs10(26),
-        fs11(27),
-        ft8(28),
-        ft9(29),
-        ft10(30),
-        ft11(31) {}
+  // 直接書き込みモードにする
+  // 命令を記録せずに確保済みのコード領域へ直接書き込むので、
+  // コード生成の処理が1回で済む。ただし、前方参照の分岐命令は
+  // 圧縮命令にならず、条件分岐は ±4KiB の範囲内に限られる
+  // (範囲外の場合は ERR_LABEL_IS_TOO_FAR になる)。
+  // 命令を記述する前に呼び出すこと。
+  void beginDirectMode() { env.beginDirect(); }
+
+  // 生成した命令のリストを受け取る sink を設定する(NULL で解除)
+  // reset() しても設定は残る
+  void setListing(ListingSink *sink) { env.setListing(sink); }
+
+  // 生成器を使い回すために、記述した命令とラベルを全て破棄する
+  // 命令の記録用のバッファやコード領域は確保したまま再利用するので、
+  // 1つの生成器で多数の関数を生成する場合に毎回の確保を省ける。
+  // 以前に newLabel() で確保したラベルは無効になる。
+  // また、 getCode() などで得たコードは次の生成で上書きされるので、
+  // 残しておく必要がある場合は CodeArena に配置すること。
+  void reset() { env.reset(); }
+
+  // reset() して新しい関数の記述を始める
+  // direct が true の場合は直接書き込みモードで始める
+  void beginFunction(bool direct = false) {
+    reset();
+    if (direct) {
+      beginDirectMode();
+    }
+  }
 
-  unsigned int getVersion() const { return VERSION; }
+  // 最後に発生したエラー
+  Error getError() const {
+    return (alloc.getError() != ERR_NONE) ? alloc.getError() : env.getError();
+  }
 
   //////////////////////////////////////////////////////////////////
   // ラベル関係の関数
 
-  void L(const std::string &label) { env.AddLabel(label); }
+  // 整数の識別子を持つラベルを確保する
+  // 文字列のラベルと異なり、定義・参照時に名前の検索が不要になる
+  Label newLabel(const char *name = NULL) { return env.newLabel(name); }
+
+  void L(const Label &label) { env.AddLabel(label); }
+  void L(const char *label) { env.AddLabel(Label(label)); }
+  void L(const std::string &label) { env.AddLabel(Label(label)); }
   void inLocalLabel() {}
   void outLocalLabel() {}
 };
@@ -0,0 +1,652 @@
+#ifndef RV32_ASM_DISASM_HPP_INCLUDED
+#define RV32_ASM_DISASM_HPP_INCLUDED
+
+#include <cstdio>
+
+#include "RV32_asm_base.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// 逆アセンブラ
+//
+// RV32IMAFDC の命令を、生成器と同じ名前のニーモニックとオペランドに戻す。
+// 命令の形はマスクと一致する値の表で表し、32ビット命令はオペコードと
+// funct3 、16ビット命令は下位2ビットと funct3 で表を分けておくので、
+// 1命令あたり数回の比較で解釈できる。
+//
+// 使用例
+//   RV32_asm::Disassembler::dump(stdout, code, size);
+//
+//   RV32_asm::Disassembler::Insn insn;
+//   const size_t n = RV32_asm::Disassembler::decode(p, size, insn);
+//   char buf[64];
+//   RV32_asm::Disassembler::operands(buf, sizeof(buf), insn, offset);
+
+namespace RV32_asm {
+
+namespace internal {
+
+inline const char *xName(uint32_t idx) {
+  static const char *const names[32] = {
+      "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2",
+      "s0",   "s1", "a0", "a1", "a2",  "a3",  "a4", "a5",
+      "a6",   "a7", "s2", "s3", "s4",  "s5",  "s6", "s7",
+      "s8",   "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+  };
+  return names[idx & 31];
+}
+
+inline const char *fName(uint32_t idx) {
+  static const char *const names[32] = {
+      "ft0", "ft1", "ft2",  "ft3",  "ft4", "ft5", "ft6",  "ft7",
+      "fs0", "fs1", "fa0",  "fa1",  "fa2", "fa3", "fa4",  "fa5",
+      "fa6", "fa7", "fs2",  "fs3",  "fs4", "fs5", "fs6",  "fs7",
+      "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11",
+  };
+  return names[idx & 31];
+}
+
+// op の lsb ビット目から width ビットを取り出して、 shift ビット左に寄せる
+inline uint32_t bits(uint32_t op, int lsb, int width, int shift = 0) {
+  return ((op >> lsb) & ((1u << width) - 1)) << shift;
+}
+
+// width ビットの値を符号拡張する
+inline int32_t sext(uint32_t v, int width) {
+  const uint32_t m = 1u << (width - 1);
+  return int32_t((v ^ m) - m);
+}
+
+}  // namespace internal
+
+class Disassembler {
+ public:
+  // オペランドの並び
+  enum Format {
+    NONE,
+    // 32ビット命令
+    U,        // rd, imm20
+    J,        // rd, 分岐先
+    I,        // rd, rs1, imm
+    SHIFT,    // rd, rs1, shamt
+    R,        // rd, rs1, rs2
+    LOAD,     // rd, imm(rs1)
+    STORE,    // rs2, imm(rs1)
+    BRANCH,   // rs1, rs2, 分岐先
+    CSR,      // rd, csr, rs1
+    CSRI,     // rd, csr, uimm
+    LR,       // rd, (rs1)
+    AMO,      // rd, rs2, (rs1)
+    FLOAD,    // frd, imm(rs1)
+    FSTORE,   // frs2, imm(rs1)
+    FR4,      // frd, frs1, frs2, frs3
+    FR,       // frd, frs1, frs2
+    FR1,      // frd, frs1
+    FCMP,     // rd, frs1, frs2
+    F2X,      // rd, frs1
+    X2F,      // frd, rs1
+    // 16ビット命令
+    C_ADDI4SPN,  // rd', sp, uimm
+    C_LW,        // rs2', uimm(rs1') (c.lw, c.sw)
+    C_FLW,       // frs2', uimm(rs1') (c.flw, c.fsw)
+    C_FLD,       // frs2', uimm(rs1') (c.fld, c.fsd)
+    C_RI,        // rd, imm (c.addi, c.li)
+    C_J,         // 分岐先
+    C_ADDI16SP,  // sp, imm
+    C_LUI,       // rd, imm
+    C_SHIFTC,    // rd', shamt (c.srli, c.srai)
+    C_ANDI,      // rd', imm
+    C_CA,        // rd', rs2'
+    C_B,         // rs1', 分岐先
+    C_SLLI,      // rd, shamt
+    C_LWSP,      // rd, uimm(sp)
+    C_FLWSP,     // frd, uimm(sp)
+    C_FLDSP,     // frd, uimm(sp)
+    C_JR,        // rs1
+    C_MV,        // rd, rs2 (c.mv, c.add)
+    C_SWSP,      // rs2, uimm(sp)
+    C_FSWSP,     // frs2, uimm(sp)
+    C_FSDSP,     // frs2, uimm(sp)
+  };
+
+  // 解釈した命令
+  struct Insn {
+    const char *mnemonic;  // 解釈できない場合は NULL
+    uint32_t code;
+    int size;  // 命令のバイト数
+    Format format;
+  };
+
+ private:
+  struct Pattern {
+    uint32_t mask;
+    uint32_t match;
+    const char *mnemonic;
+    Format format;
+  };
+
+  // 表のキー(32ビット命令は 256 通り、16ビット命令は 32 通り)
+  static uint32_t key32(uint32_t code) {
+    return (internal::bits(code, 2, 5) << 3) | internal::bits(code, 12, 3);
+  }
+  static uint32_t key16(uint32_t code) {
+    return ((code & 3) << 3) | internal::bits(code, 13, 3);
+  }
+
+  static const Pattern *patterns32(size_t &n) {
+    static const Pattern table[] = {
+        // RV32I
+        {0x0000007f, 0x00000037, "LUI", U},
+        {0x0000007f, 0x00000017, "AUIPC", U},
+        {0x0000007f, 0x0000006f, "JAL", J},
+        {0x0000707f, 0x00000067, "JALR", LOAD},
+        {0x0000707f, 0x00000063, "BEQ", BRANCH},
+        {0x0000707f, 0x00001063, "BNE", BRANCH},
+        {0x0000707f, 0x00004063, "BLT", BRANCH},
+        {0x0000707f, 0x00005063, "BGE", BRANCH},
+        {0x0000707f, 0x00006063, "BLTU", BRANCH},
+        {0x0000707f, 0x00007063, "BGEU", BRANCH},
+        {0x0000707f, 0x00000003, "LB", LOAD},
+        {0x0000707f, 0x00001003, "LH", LOAD},
+        {0x0000707f, 0x00002003, "LW", LOAD},
+        {0x0000707f, 0x00004003, "LBU", LOAD},
+        {0x0000707f, 0x00005003, "LHU", LOAD},
+        {0x0000707f, 0x00000023, "SB", STORE},
+        {0x0000707f, 0x00001023, "SH", STORE},
+        {0x0000707f, 0x00002023, "SW", STORE},
+        {0x0000707f, 0x00000013, "ADDI", I},
+        {0x0000707f, 0x00002013, "SLTI", I},
+        {0x0000707f, 0x00003013, "SLTIU", I},
+        {0x0000707f, 0x00004013, "XORI", I},
+        {0x0000707f, 0x00006013, "ORI", I},
+        {0x0000707f, 0x00007013, "ANDI", I},
+        {0xfe00707f, 0x00001013, "SLLI", SHIFT},
+        {0xfe00707f, 0x00005013, "SRLI", SHIFT},
+        {0xfe00707f, 0x40005013, "SRAI", SHIFT},
+        {0xfe00707f, 0x00000033, "ADD", R},
+        {0xfe00707f, 0x40000033, "SUB", R},
+        {0xfe00707f, 0x00001033, "SLL", R},
+        {0xfe00707f, 0x00002033, "SLT", R},
+        {0xfe00707f, 0x00003033, "SLTU", R},
+        {0xfe00707f, 0x00004033, "XOR", R},
+        {0xfe00707f, 0x00005033, "SRL", R},
+        {0xfe00707f, 0x40005033, "SRA", R},
+        {0xfe00707f, 0x00006033, "OR", R},
+        {0xfe00707f, 0x00007033, "AND", R},
+        {0x0000707f, 0x0000000f, "FENCE", NONE},
+        {0x0000707f, 0x0000100f, "FENCE.I", NONE},
+        {0xffffffff, 0x00000073, "ECALL", NONE},
+        {0xffffffff, 0x00100073, "EBREAK", NONE},
+        {0x0000707f, 0x00001073, "CSRRW", CSR},
+        {0x0000707f, 0x00002073, "CSRRS", CSR},
+        {0x0000707f, 0x00003073, "CSRRC", CSR},
+        {0x0000707f, 0x00005073, "CSRRWI", CSRI},
+        {0x0000707f, 0x00006073, "CSRRSI", CSRI},
+        {0x0000707f, 0x00007073, "CSRRCI", CSRI},
+        // RV32M
+        {0xfe00707f, 0x02000033, "MUL", R},
+        {0xfe00707f, 0x02001033, "MULH", R},
+        {0xfe00707f, 0x02002033, "MULHSU", R},
+        {0xfe00707f, 0x02003033, "MULHU", R},
+        {0xfe00707f, 0x02004033, "DIV", R},
+        {0xfe00707f, 0x02005033, "DIVU", R},
+        {0xfe00707f, 0x02006033, "REM", R},
+        {0xfe00707f, 0x02007033, "REMU", R},
+        // RV32A (aq, rl のビットは見ない)
+        {0xf9f0707f, 0x1000202f, "LR.W", LR},
+        {0xf800707f, 0x1800202f, "SC.W", AMO},
+        {0xf800707f, 0x0800202f, "AMOSWAP.W", AMO},
+        {0xf800707f, 0x0000202f, "AMOADD.W", AMO},
+        {0xf800707f, 0x2000202f, "AMOXOR.W", AMO},
+        {0xf800707f, 0x6000202f, "AMOAND.W", AMO},
+        {0xf800707f, 0x4000202f, "AMOOR.W", AMO},
+        {0xf800707f, 0x8000202f, "AMOMIN.W", AMO},
+        {0xf800707f, 0xa000202f, "AMOMAX.W", AMO},
+        {0xf800707f, 0xc000202f, "AMOMINU.W", AMO},
+        {0xf800707f, 0xe000202f, "AMOMAXU.W", AMO},
+        // RV32F (丸めモードのビットは見ない)
+        {0x0000707f, 0x00002007, "FLW", FLOAD},
+        {0x0000707f, 0x00002027, "FSW", FSTORE},
+        {0x0600007f, 0x00000043, "FMADD.S", FR4},
+        {0x0600007f, 0x00000047, "FMSUB.S", FR4},
+        {0x0600007f, 0x0000004b, "FNMSUB.S", FR4},
+        {0x0600007f, 0x0000004f, "FNMADD.S", FR4},
+        {0xfe00007f, 0x00000053, "FADD.S", FR},
+        {0xfe00007f, 0x08000053, "FSUB.S", FR},
+        {0xfe00007f, 0x10000053, "FMUL.S", FR},
+        {0xfe00007f, 0x18000053, "FDIV.S", FR},
+        {0xfff0007f, 0x58000053, "FSQRT.S", FR1},
+        {0xfe00707f, 0x20000053, "FSGNJ.S", FR},
+        {0xfe00707f, 0x20001053, "FSGNJN.S", FR},
+        {0xfe00707f, 0x20002053, "FSGNJX.S", FR},
+        {0xfe00707f, 0x28000053, "FMIN.S", FR},
+        {0xfe00707f, 0x28001053, "FMAX.S", FR},
+        {0xfff0007f, 0xc0000053, "FCVT.W.S", F2X},
+        {0xfff0007f, 0xc0100053, "FCVT.WU.S", F2X},
+        {0xfff0707f, 0xe0000053, "FMV.X.W", F2X},
+        {0xfe00707f, 0xa0002053, "FEQ.S", FCMP},
+        {0xfe00707f, 0xa0001053, "FLT.S", FCMP},
+        {0xfe00707f, 0xa0000053, "FLE.S", FCMP},
+        {0xfff0707f, 0xe0001053, "FCLASS.S", F2X},
+        {0xfff0007f, 0xd0000053, "FCVT.S.W", X2F},
+        {0xfff0007f, 0xd0100053, "FCVT.S.WU", X2F},
+        {0xfff0707f, 0xf0000053, "FMV.W.X", X2F},
+        // RV32D
+        {0x0000707f, 0x00003007, "FLD", FLOAD},
+        {0x0000707f, 0x00003027, "FSD", FSTORE},
+        {0x0600007f, 0x02000043, "FMADD.D", FR4},
+        {0x0600007f, 0x02000047, "FMSUB.D", FR4},
+        {0x0600007f, 0x0200004b, "FNMSUB.D", FR4},
+        {0x0600007f, 0x0200004f, "FNMADD.D", FR4},
+        {0xfe00007f, 0x02000053, "FADD.D", FR},
+        {0xfe00007f, 0x0a000053, "FSUB.D", FR},
+        {0xfe00007f, 0x12000053, "FMUL.D", FR},
+        {0xfe00007f, 0x1a000053, "FDIV.D", FR},
+        {0xfff0007f, 0x5a000053, "FSQRT.D", FR1},
+        {0xfe00707f, 0x22000053, "FSGNJ.D", FR},
+        {0xfe00707f, 0x22001053, "FSGNJN.D", FR},
+        {0xfe00707f, 0x22002053, "FSGNJX.D", FR},
+        {0xfe00707f, 0x2a000053, "FMIN.D", FR},
+        {0xfe00707f, 0x2a001053, "FMAX.D", FR},
+        {0xfff0007f, 0x40100053, "FCVT.S.D", FR1},
+        {0xfff0007f, 0x42000053, "FCVT.D.S", FR1},
+        {0xfe00707f, 0xa2002053, "FEQ.D", FCMP},
+        {0xfe00707f, 0xa2001053, "FLT.D", FCMP},
+        {0xfe00707f, 0xa2000053, "FLE.D", FCMP},
+        {0xfff0707f, 0xe2001053, "FCLASS.D", F2X},
+        {0xfff0007f, 0xc2000053, "FCVT.W.D", F2X},
+        {0xfff0007f, 0xc2100053, "FCVT.WU.D", F2X},
+        {0xfff0007f, 0xd2000053, "FCVT.D.W", X2F},
+        {0xfff0007f, 0xd2100053, "FCVT.D.WU", X2F},
+    };
+    n = sizeof(table) / sizeof(table[0]);
+    return table;
+  }
+
+  static const Pattern *patterns16(size_t &n) {
+    // 一部のビットが 0 でないことが条件の命令は、マスクのビットが多い
+    // 命令を先に調べることで区別する(c.nop と c.addi など)
+    // mnemonic が NULL のものは予約されている符号で、不正な命令とする
+    static const Pattern table[] = {
+        // C0
+        {0x0000ffe3, 0x00000000, NULL, NONE},  // 不正な命令(即値が 0)
+        {0x0000e003, 0x00000000, "C.ADDI4SPN", C_ADDI4SPN},
+        {0x0000e003, 0x00002000, "C.FLD", C_FLD},
+        {0x0000e003, 0x00004000, "C.LW", C_LW},
+        {0x0000e003, 0x00006000, "C.FLW", C_FLW},
+        {0x0000e003, 0x0000a000, "C.FSD", C_FLD},
+        {0x0000e003, 0x0000c000, "C.SW", C_LW},
+        {0x0000e003, 0x0000e000, "C.FSW", C_FLW},
+        // C1
+        {0x0000ef83, 0x00000001, "C.NOP", NONE},  // rd が zero の c.addi
+        {0x0000e003, 0x00000001, "C.ADDI", C_RI},
+        {0x0000e003, 0x00002001, "C.JAL", C_J},
+        {0x0000e003, 0x00004001, "C.LI", C_RI},
+        {0x0000ffff, 0x00006101, NULL, NONE},  // 即値が 0 の c.addi16sp
+        {0x0000ef83, 0x00006101, "C.ADDI16SP", C_ADDI16SP},
+        {0x0000e003, 0x00006001, "C.LUI", C_LUI},
+        {0x0000ec03, 0x00008001, "C.SRLI", C_SHIFTC},
+        {0x0000ec03, 0x00008401, "C.SRAI", C_SHIFTC},
+        {0x0000ec03, 0x00008801, "C.ANDI", C_ANDI},
+        {0x0000fc63, 0x00008c01, "C.SUB", C_CA},
+        {0x0000fc63, 0x00008c21, "C.XOR", C_CA},
+        {0x0000fc63, 0x00008c41, "C.OR", C_CA},
+        {0x0000fc63, 0x00008c61, "C.AND", C_CA},
+        {0x0000e003, 0x0000a001, "C.J", C_J},
+        {0x0000e003, 0x0000c001, "C.BEQZ", C_B},
+        {0x0000e003, 0x0000e001, "C.BNEZ", C_B},
+        // C2
+        {0x0000e003, 0x00000002, "C.SLLI", C_SLLI},
+        {0x0000e003, 0x00002002, "C.FLDSP", C_FLDSP},
+        {0x0000ef83, 0x00004002, NULL, NONE},  // rd が zero の c.lwsp
+        {0x0000e003, 0x00004002, "C.LWSP", C_LWSP},
+        {0x0000e003, 0x00006002, "C.FLWSP", C_FLWSP},
+        {0x0000ffff, 0x00008002, NULL, NONE},  // rs1 が zero の c.jr
+        {0x0000f07f, 0x00008002, "C.JR", C_JR},
+        {0x0000f003, 0x00008002, "C.MV", C_MV},
+        {0x0000ffff, 0x00009002, "C.EBREAK", NONE},
+        {0x0000f07f, 0x00009002, "C.JALR", C_JR},
+        {0x0000f003, 0x00009002, "C.ADD", C_MV},
+        {0x0000e003, 0x0000a002, "C.FSDSP", C_FSDSP},
+        {0x0000e003, 0x0000c002, "C.SWSP", C_SWSP},
+        {0x0000e003, 0x0000e002, "C.FSWSP", C_FSWSP},
+    };
+    n = sizeof(table) / sizeof(table[0]);
+    return table;
+  }
+
+  // キーごとに、調べるパターンを並べた表
+  struct Table {
+    uint16_t begin[256 + 32 + 1];  // 32ビット命令、16ビット命令の順
+    std::vector<const Pattern *> list;
+
+    static int popcount(uint32_t v) {
+      int n = 0;
+      for (; v != 0; v &= v - 1) {
+        n++;
+      }
+      return n;
+    }
+
+    // キーの部分が合うパターンを、マスクのビットが多い順に登録する
+    void add(const Pattern *p, size_t n, uint32_t keyBits, uint32_t code) {
+      std::vector<const Pattern *> v;
+      for (size_t i = 0; i < n; i++) {
+        if (((code ^ p[i].match) & p[i].mask & keyBits) == 0) {
+          v.push_back(&p[i]);
+        }
+      }
+      std::stable_sort(v.begin(), v.end(),
+                       [](const Pattern *a, const Pattern *b) {
+                         return popcount(a->mask) > popcount(b->mask);
+                       });
+      list.insert(list.end(), v.begin(), v.end());
+    }
+
+    Table() {
+      size_t n32, n16;
+      const Pattern *p32 = patterns32(n32);
+      const Pattern *p16 = patterns16(n16);
+      for (uint32_t key = 0; key < 256; key++) {
+        begin[key] = uint16_t(list.size());
+        add(p32, n32, 0x707f, ((key >> 3) << 2) | 3 | ((key & 7) << 12));
+      }
+      for (uint32_t key = 0; key < 32; key++) {
+        begin[256 + key] = uint16_t(list.size());
+        add(p16, n16, 0xe003, (key >> 3) | ((key & 7) << 13));
+      }
+      begin[256 + 32] = uint16_t(list.size());
+    }
+  };
+
+  static const Table &table() {
+    static const Table t;
+    return t;
+  }
+
+ public:
+  // 命令のオペコード code を解釈する
+  // 下位2ビットが 0b11 の場合は32ビット命令、それ以外は16ビット命令とする
+  // 解釈できない場合は mnemonic を NULL にして false を返す
+  static bool decode(uint32_t code, Insn &insn) {
+    const Table &t = table();
+    uint32_t key;
+    if ((code & 3) == 3) {
+      insn.size = 4;
+      key = key32(code);
+    } else {
+      code &= 0xffff;
+      insn.size = 2;
+      key = 256 + key16(code);
+    }
+    insn.code = code;
+    insn.mnemonic = NULL;
+    insn.format = NONE;
+    for (size_t i = t.begin[key]; i < t.begin[key + 1]; i++) {
+      const Pattern &p = *t.list[i];
+      if ((code & p.mask) == p.match) {
+        insn.mnemonic = p.mnemonic;
+        insn.format = p.format;
+        break;
+      }
+    }
+    return insn.mnemonic != NULL;
+  }
+
+  // p から1命令を解釈する
+  // 戻り値は命令のバイト数(size が足りない場合は 0)
+  // 解釈できない命令の場合も命令のバイト数を返し、 mnemonic は NULL にする
+  static size_t decode(const unsigned char *p, size_t size, Insn &insn) {
+    if (size < 2) {
+      return 0;
+    }
+    uint32_t code = uint32_t(p[0]) | (uint32_t(p[1]) << 8);
+    if ((code & 3) == 3) {
+      if (size < 4) {
+        return 0;
+      }
+      code |= (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    }
+    decode(code, insn);
+    return size_t(insn.size);
+  }
+
+  // insn のオペランドを "a0, a1, 12" のような文字列にして buf に書き込む
+  // pc は命令のアドレス(オフセット)で、分岐先は pc からの相対位置で求めて
+  // 16進数で表す(リストのオフセットと同じ表記)。
+  // 戻り値は snprintf と同じく、書き込もうとした文字数
+  static int operands(char *buf, size_t size, const Insn &insn,
+                      address_offset_t pc) {
+    using internal::bits;
+    using internal::fName;
+    using internal::sext;
+    using internal::xName;
+    const uint32_t op = insn.code;
+    // 32ビット命令
+    const uint32_t rd = bits(op, 7, 5);
+    const uint32_t rs1 = bits(op, 15, 5);
+    const uint32_t rs2 = bits(op, 20, 5);
+    const int32_t immI = sext(bits(op, 20, 12), 12);
+    const int32_t immS = sext(bits(op, 25, 7, 5) | bits(op, 7, 5), 12);
+    // 16ビット命令
+    const uint32_t rdc = bits(op, 7, 3) + 8;  // rd' / rs1'
+    const uint32_t rs2c = bits(op, 2, 3) + 8;
+    const uint32_t rs2C = bits(op, 2, 5);
+    const int32_t imm6 = sext(bits(op, 12, 1, 5) | bits(op, 2, 5), 6);
+    const uint32_t uimmW = bits(op, 10, 3, 3) | bits(op, 6, 1, 2) |
+                           bits(op, 5, 1, 6);  // c.lw, c.sw
+    const uint32_t uimmD = bits(op, 10, 3, 3) | bits(op, 5, 2, 6);  // c.fld
+    switch (insn.format) {
+      case U:
+        return snprintf(buf, size, "%s, 0x%x", xName(rd), op >> 12);
+      case J: {
+        const int32_t imm =
+            sext(bits(op, 31, 1, 20) | bits(op, 12, 8, 12) |
+                     bits(op, 20, 1, 11) | bits(op, 21, 10, 1),
+                 21);
+        return snprintf(buf, size, "%s, 0x%x", xName(rd), uint32_t(pc + imm));
+      }
+      case I:
+        return snprintf(buf, size, "%s, %s, %d", xName(rd), xName(rs1), immI);
+      case SHIFT:
+        return snprintf(buf, size, "%s, %s, %u", xName(rd), xName(rs1), rs2);
+      case R:
+        return snprintf(buf, size, "%s, %s, %s", xName(rd), xName(rs1),
+                        xName(rs2));
+      case LOAD:
+        return snprintf(buf, size, "%s, %d(%s)", xName(rd), immI, xName(rs1));
+      case STORE:
+        return snprintf(buf, size, "%s, %d(%s)", xName(rs2), immS,
+                        xName(rs1));
+      case BRANCH: {
+        const int32_t imm =
+            sext(bits(op, 31, 1, 12) | bits(op, 7, 1, 11) |
+                     bits(op, 25, 6, 5) | bits(op, 8, 4, 1),
+                 13);
+        return snprintf(buf, size, "%s, %s, 0x%x", xName(rs1), xName(rs2),
+                        uint32_t(pc + imm));
+      }
+      case CSR:
+        return snprintf(buf, size, "%s, 0x%x, %s", xName(rd), op >> 20,
+                        xName(rs1));
+      case CSRI:
+        return snprintf(buf, size, "%s, 0x%x, %u", xName(rd), op >> 20, rs1);
+      case LR:
+        return snprintf(buf, size, "%s, (%s)", xName(rd), xName(rs1));
+      case AMO:
+        return snprintf(buf, size, "%s, %s, (%s)", xName(rd), xName(rs2),
+                        xName(rs1));
+      case FLOAD:
+        return snprintf(buf, size, "%s, %d(%s)", fName(rd), immI, xName(rs1));
+      case FSTORE:
+        return snprintf(buf, size, "%s, %d(%s)", fName(rs2), immS,
+                        xName(rs1));
+      case FR4:
+        return snprintf(buf, size, "%s, %s, %s, %s", fName(rd), fName(rs1),
+                        fName(rs2), fName(bits(op, 27, 5)));
+      case FR:
+        return snprintf(buf, size, "%s, %s, %s", fName(rd), fName(rs1),
+                        fName(rs2));
+      case FR1:
+        return snprintf(buf, size, "%s, %s", fName(rd), fName(rs1));
+      case FCMP:
+        return snprintf(buf, size, "%s, %s, %s", xName(rd), fName(rs1),
+                        fName(rs2));
+      case F2X:
+        return snprintf(buf, size, "%s, %s", xName(rd), fName(rs1));
+      case X2F:
+        return snprintf(buf, size, "%s, %s", fName(rd), xName(rs1));
+      case C_ADDI4SPN: {
+        const uint32_t imm = bits(op, 11, 2, 4) | bits(op, 7, 4, 6) |
+                             bits(op, 6, 1, 2) | bits(op, 5, 1, 3);
+        return snprintf(buf, size, "%s, sp, %u", xName(rs2c), imm);
+      }
+      case C_LW:
+        return snprintf(buf, size, "%s, %u(%s)", xName(rs2c), uimmW,
+                        xName(rdc));
+      case C_FLW:
+        return snprintf(buf, size, "%s, %u(%s)", fName(rs2c), uimmW,
+                        xName(rdc));
+      case C_FLD:
+        return snprintf(buf, size, "%s, %u(%s)", fName(rs2c), uimmD,
+                        xName(rdc));
+      case C_RI:
+        return snprintf(buf, size, "%s, %d", xName(rd), imm6);
+      case C_J: {
+        const int32_t off =
+            sext(bits(op, 12, 1, 11) | bits(op, 11, 1, 4) |
+                     bits(op, 9, 2, 8) | bits(op, 8, 1, 10) |
+                     bits(op, 7, 1, 6) | bits(op, 6, 1, 7) |
+                     bits(op, 3, 3, 1) | bits(op, 2, 1, 5),
+                 12);
+        return snprintf(buf, size, "0x%x", uint32_t(pc + off));
+      }
+      case C_ADDI16SP: {
+        const int32_t imm =
+            sext(bits(op, 12, 1, 9) | bits(op, 6, 1, 4) | bits(op, 5, 1, 6) |
+                     bits(op, 3, 2, 7) | bits(op, 2, 1, 5),
+                 10);
+        return snprintf(buf, size, "sp, %d", imm);
+      }
+      case C_LUI:
+        return snprintf(buf, size, "%s, 0x%x", xName(rd),
+                        uint32_t(imm6) & 0xfffff);
+      case C_SHIFTC:
+        return snprintf(buf, size, "%s, %u", xName(rdc), uint32_t(imm6) & 31);
+      case C_ANDI:
+        return snprintf(buf, size, "%s, %d", xName(rdc), imm6);
+      case C_CA:
+        return snprintf(buf, size, "%s, %s", xName(rdc), xName(rs2c));
+      case C_B: {
+        const int32_t off =
+            sext(bits(op, 12, 1, 8) | bits(op, 10, 2, 3) | bits(op, 5, 2, 6) |
+                     bits(op, 3, 2, 1) | bits(op, 2, 1, 5),
+                 9);
+        return snprintf(buf, size, "%s, 0x%x", xName(rdc), uint32_t(pc + off));
+      }
+      case C_SLLI:
+        return snprintf(buf, size, "%s, %u", xName(rd), uint32_t(imm6) & 31);
+      case C_LWSP:
+      case C_FLWSP:
+        return snprintf(buf, size, "%s, %u(sp)",
+                        insn.format == C_FLWSP ? fName(rd) : xName(rd),
+                        bits(op, 12, 1, 5) | bits(op, 4, 3, 2) |
+                            bits(op, 2, 2, 6));
+      case C_FLDSP:
+        return snprintf(buf, size, "%s, %u(sp)", fName(rd),
+                        bits(op, 12, 1, 5) | bits(op, 5, 2, 3) |
+                            bits(op, 2, 3, 6));
+      case C_JR:
+        return snprintf(buf, size, "%s", xName(rd));
+      case C_MV:
+        return snprintf(buf, size, "%s, %s", xName(rd), xName(rs2C));
+      case C_SWSP:
+      case C_FSWSP:
+        return snprintf(buf, size, "%s, %u(sp)",
+                        insn.format == C_FSWSP ? fName(rs2C) : xName(rs2C),
+                        bits(op, 9, 4, 2) | bits(op, 7, 2, 6));
+      case C_FSDSP:
+        return snprintf(buf, size, "%s, %u(sp)", fName(rs2C),
+                        bits(op, 10, 3, 3) | bits(op, 7, 3, 6));
+      default:
+        break;
+    }
+    if (size != 0) {
+      buf[0] = '\0';
+    }
+    return 0;
+  }
+
+  // insn を "ADDI         a0, a0, 1" の形の1行にして buf に書き込む
+  static int format(char *buf, size_t size, const Insn &insn,
+                    address_offset_t pc) {
+    char ops[64];
+    if (insn.mnemonic == NULL) {
+      return snprintf(buf, size, "%s 0x%x", insn.size == 2 ? ".half" : ".long",
+                      insn.code);
+    }
+    operands(ops, sizeof(ops), insn, pc);
+    return snprintf(buf, size, "%-12s %s", insn.mnemonic, ops);
+  }
+
+  // code の size バイトを逆アセンブルして fp に出力する
+  // base は先頭の命令のアドレス(オフセット)
+  static void dump(FILE *fp, const unsigned char *code, size_t size,
+                   address_offset_t base = 0) {
+    char line[96];
+    size_t pos = 0;
+    while (pos < size) {
+      Insn insn;
+      const size_t n = decode(code + pos, size - pos, insn);
+      if (n == 0) {
+        fprintf(fp, "%6x:   %02x\n", base + uint32_t(pos), code[pos]);
+        pos++;
+        continue;
+      }
+      format(line, sizeof(line), insn, base + uint32_t(pos));
+      if (n == 2) {
+        fprintf(fp, "%6x:     %04x  %s\n", base + uint32_t(pos), insn.code,
+                line);
+      } else {
+        fprintf(fp, "%6x: %08x  %s\n", base + uint32_t(pos), insn.code, line);
+      }
+      pos += n;
+    }
+  }
+
+  // 生成器が記録したニーモニック recorded が、 insn の命令と合っているか
+  // 疑似命令の場合は、展開した命令と比べる
+  static bool matches(const char *recorded, const Insn &insn) {
+    static const char *const aliases[][3] = {
+        {"NOP", "ADDI", NULL},         {"MV", "ADDI", NULL},
+        {"NOT", "XORI", NULL},         {"NEG", "SUB", NULL},
+        {"SEQZ", "SLTIU", NULL},       {"SNEZ", "SLTU", NULL},
+        {"SLTZ", "SLT", NULL},         {"SGTZ", "SLT", NULL},
+        {"J", "JAL", NULL},            {"JR", "JALR", NULL},
+        {"RET", "JALR", NULL},         {"CALL", "AUIPC", "JALR"},
+        {"TAIL", "AUIPC", "JALR"},     {"BEQZ", "BEQ", NULL},
+        {"BNEZ", "BNE", NULL},         {"BLEZ", "BGE", NULL},
+        {"BGEZ", "BGE", NULL},         {"BLTZ", "BLT", NULL},
+        {"BGTZ", "BLT", NULL},         {"FMV.S", "FSGNJ.S", NULL},
+        {"FABS.S", "FSGNJX.S", NULL},  {"FNEG.S", "FSGNJN.S", NULL},
+        {"FMV.D", "FSGNJ.D", NULL},    {"FABS.D", "FSGNJX.D", NULL},
+        {"FNEG.D", "FSGNJN.D", NULL},  {"C.RET", "C.JR", NULL},
+    };
+    if (recorded == NULL || insn.mnemonic == NULL) {
+      return false;
+    }
+    if (strcmp(recorded, insn.mnemonic) == 0) {
+      return true;
+    }
+    for (const auto &a : aliases) {
+      if (strcmp(recorded, a[0]) == 0) {
+        return strcmp(insn.mnemonic, a[1]) == 0 ||
+               (a[2] != NULL && strcmp(insn.mnemonic, a[2]) == 0);
+      }
+    }
+    return false;
+  }
+};
+
+};  // namespace RV32_asm
+
+#endif
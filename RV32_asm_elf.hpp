@@ -0,0 +1,285 @@
+#ifndef RV32_ASM_ELF_HPP_INCLUDED
+#define RV32_ASM_ELF_HPP_INCLUDED
+
+#include "RV32_asm_base.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// ELF ファイルの組み立て
+//
+// 生成したコードをデバッガに渡したり、オブジェクトファイルとして
+// 書き出したりするための最小限の定義。
+// セクションを登録してから write() で、ヘッダ、各セクションの内容、
+// セクションヘッダの順に書き出す。
+
+namespace RV32_asm {
+namespace internal {
+namespace elf {
+
+enum {
+  ELFCLASS32 = 1,
+  ELFCLASS64 = 2,
+  ELFDATA2LSB = 1,
+  EV_CURRENT = 1,
+  ET_REL = 1,
+  EM_RISCV = 243,
+  EF_RISCV_RVC = 0x1,
+  EF_RISCV_FLOAT_ABI_DOUBLE = 0x4,
+};
+
+// セクション
+enum {
+  SHN_UNDEF = 0,
+  SHN_ABS = 0xfff1,
+  SHT_NULL = 0,
+  SHT_PROGBITS = 1,
+  SHT_SYMTAB = 2,
+  SHT_STRTAB = 3,
+  SHT_RELA = 4,
+  SHT_NOBITS = 8,
+  SHF_WRITE = 0x1,
+  SHF_ALLOC = 0x2,
+  SHF_EXECINSTR = 0x4,
+  SHF_INFO_LINK = 0x40,
+};
+
+// シンボル
+enum {
+  STB_LOCAL = 0,
+  STB_GLOBAL = 1,
+  STT_NOTYPE = 0,
+  STT_FUNC = 2,
+  STT_SECTION = 3,
+  STT_FILE = 4,
+};
+
+template <class Addr>
+struct Ehdr {
+  uint8_t e_ident[16];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  Addr e_entry;
+  Addr e_phoff;
+  Addr e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+};
+
+template <class Addr>
+struct Shdr {
+  uint32_t sh_name;
+  uint32_t sh_type;
+  Addr sh_flags;
+  Addr sh_addr;
+  Addr sh_offset;
+  Addr sh_size;
+  uint32_t sh_link;
+  uint32_t sh_info;
+  Addr sh_addralign;
+  Addr sh_entsize;
+};
+
+// シンボルはクラスによってメンバーの並びが異なる
+struct Sym32 {
+  uint32_t st_name;
+  uint32_t st_value;
+  uint32_t st_size;
+  uint8_t st_info;
+  uint8_t st_other;
+  uint16_t st_shndx;
+};
+
+struct Sym64 {
+  uint32_t st_name;
+  uint8_t st_info;
+  uint8_t st_other;
+  uint16_t st_shndx;
+  uint64_t st_value;
+  uint64_t st_size;
+};
+
+struct Rela32 {
+  uint32_t r_offset;
+  uint32_t r_info;
+  int32_t r_addend;
+};
+
+inline uint8_t symInfo(int bind, int type) {
+  return uint8_t((bind << 4) | type);
+}
+inline uint32_t relaInfo32(uint32_t sym, uint32_t type) {
+  return (sym << 8) | (type & 0xff);
+}
+
+// 名前を並べた文字列テーブル
+class StringTable {
+  std::string buf;
+
+ public:
+  StringTable() : buf(1, '\0') {}
+
+  // name を追加して、テーブル中の位置を返す
+  uint32_t add(const char *name) {
+    const uint32_t pos = uint32_t(buf.size());
+    buf.append(name);
+    buf.push_back('\0');
+    return pos;
+  }
+  uint32_t add(const std::string &name) { return add(name.c_str()); }
+
+  const char *data() const { return buf.data(); }
+  size_t size() const { return buf.size(); }
+};
+
+// ELF ファイルを組み立てるクラス
+// Addr が uint32_t なら ELF32 、 uint64_t なら ELF64 になる。
+// セクションの内容は登録したポインタから write() の時点で読むので、
+// それまで有効にしておくこと。
+template <class Addr>
+class Builder {
+ public:
+  struct Section {
+    uint32_t name;
+    uint32_t type;
+    Addr flags;
+    Addr addr;
+    const void *data;  // SHT_NOBITS の場合は NULL
+    size_t size;
+    uint32_t link;
+    uint32_t info;
+    Addr align;
+    Addr entsize;
+  };
+
+ private:
+  std::vector<Section> sections;
+  StringTable shstrtab;
+  uint16_t shstrndx;
+
+  static Addr alignUp(Addr v, Addr align) {
+    return align > 1 ? (v + align - 1) / align * align : v;
+  }
+
+ public:
+  Builder() : shstrndx(0) {
+    const Section null = {0, SHT_NULL, 0, 0, NULL, 0, 0, 0, 0, 0};
+    sections.push_back(null);
+  }
+
+  // セクションを追加して、セクション番号を返す
+  uint16_t add(const char *name, uint32_t type, Addr flags, Addr addr,
+               const void *data, size_t size, uint32_t link = 0,
+               uint32_t info = 0, Addr align = 1, Addr entsize = 0) {
+    const Section s = {shstrtab.add(name), type, flags, addr, data,
+                       size, link, info, align, entsize};
+    sections.push_back(s);
+    return uint16_t(sections.size() - 1);
+  }
+
+  Section &operator[](uint16_t idx) { return sections[idx]; }
+
+  // write() で書き出すバイト数
+  size_t size() {
+    finish();
+    Addr pos = sizeof(Ehdr<Addr>);
+    for (size_t i = 1; i < sections.size(); i++) {
+      pos = alignUp(pos, sections[i].align);
+      if (sections[i].type != SHT_NOBITS) {
+        pos += Addr(sections[i].size);
+      }
+    }
+    pos = alignUp(pos, sizeof(Addr));
+    return size_t(pos + sizeof(Shdr<Addr>) * sections.size());
+  }
+
+  // ファイルの内容を先頭から順に out(const void *, size_t) に渡す
+  // out が false を返した場合は中断して false を返す
+  template <class Out>
+  bool write(Out out, uint16_t type, uint16_t machine, uint32_t flags) {
+    static const uint8_t zeros[16] = {0};
+    finish();
+    std::vector<Shdr<Addr> > headers(sections.size());
+    Addr pos = sizeof(Ehdr<Addr>);
+    for (size_t i = 1; i < sections.size(); i++) {
+      const Section &s = sections[i];
+      Shdr<Addr> &h = headers[i];
+      pos = alignUp(pos, s.align);
+      h.sh_name = s.name;
+      h.sh_type = s.type;
+      h.sh_flags = s.flags;
+      h.sh_addr = s.addr;
+      h.sh_offset = pos;
+      h.sh_size = Addr(s.size);
+      h.sh_link = s.link;
+      h.sh_info = s.info;
+      h.sh_addralign = s.align;
+      h.sh_entsize = s.entsize;
+      if (s.type != SHT_NOBITS) {
+        pos += Addr(s.size);
+      }
+    }
+    memset(&headers[0], 0, sizeof(headers[0]));
+    const Addr shoff = alignUp(pos, sizeof(Addr));
+
+    Ehdr<Addr> e;
+    memset(&e, 0, sizeof(e));
+    static const uint8_t magic[] = {0x7f, 'E', 'L', 'F'};
+    memcpy(e.e_ident, magic, sizeof(magic));
+    e.e_ident[4] = sizeof(Addr) == 4 ? ELFCLASS32 : ELFCLASS64;
+    e.e_ident[5] = ELFDATA2LSB;
+    e.e_ident[6] = EV_CURRENT;
+    e.e_type = type;
+    e.e_machine = machine;
+    e.e_version = EV_CURRENT;
+    e.e_shoff = shoff;
+    e.e_flags = flags;
+    e.e_ehsize = sizeof(Ehdr<Addr>);
+    e.e_shentsize = sizeof(Shdr<Addr>);
+    e.e_shnum = uint16_t(sections.size());
+    e.e_shstrndx = shstrndx;
+    if (!out(&e, sizeof(e))) {
+      return false;
+    }
+    pos = sizeof(e);
+    for (size_t i = 1; i < sections.size(); i++) {
+      const Section &s = sections[i];
+      if (s.type == SHT_NOBITS) {
+        continue;
+      }
+      const Addr pad = headers[i].sh_offset - pos;
+      assert(pad <= sizeof(zeros));  // 境界は 16 バイトまで
+      if (pad != 0 && !out(zeros, size_t(pad))) {
+        return false;
+      }
+      if (s.size != 0 && !out(s.data, s.size)) {
+        return false;
+      }
+      pos = headers[i].sh_offset + Addr(s.size);
+    }
+    if (shoff != pos && !out(zeros, size_t(shoff - pos))) {
+      return false;
+    }
+    return out(&headers[0], sizeof(headers[0]) * headers.size());
+  }
+
+ private:
+  // 最後にセクション名のテーブルを追加する
+  void finish() {
+    if (shstrndx == 0) {
+      shstrndx = add(".shstrtab", SHT_STRTAB, 0, 0, NULL, 0);
+    }
+    sections[shstrndx].data = shstrtab.data();
+    sections[shstrndx].size = shstrtab.size();
+  }
+};
+
+}  // namespace elf
+}  // namespace internal
+}  // namespace RV32_asm
+
+#endif
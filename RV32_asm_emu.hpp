@@ -0,0 +1,2326 @@
+#ifndef RV32_ASM_EMU_HPP_INCLUDED
+#define RV32_ASM_EMU_HPP_INCLUDED
+
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#include "RV32_asm_base.hpp"
+#include "RV32_asm_listing.hpp"
+
+// x86-64 のホストでは、よく実行するブロックを x86-64 の命令に変換できる
+#if defined(__x86_64__) && RV32_ASM_USE_MMAP
+#define RV32_ASM_EMU_X64 1
+#include "RV32_asm_emu_x64.hpp"
+#else
+#define RV32_ASM_EMU_X64 0
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// RV32IMAFDC のエミュレータ
+//
+// RISC-V 以外の環境で、生成したコードを実行して動作と速度を確認するためのもの。
+// getCode() で得たコードをゲストのメモリに配置し、レジスタとメモリの
+// マップを用意してから call() で実行する。
+// ゲストから呼び出すホストの関数は addHostCall() で登録する。
+// 命令は分岐までのブロック単位でデコードしてキャッシュしておき、
+// 2回目以降はデコードせずに実行する。
+// x86-64 のホストでは setTranslation(true) で、よく実行するブロックを
+// x86-64 の命令に変換して実行する。
+//
+// 使用例
+//   RV32_asm::Emulator emu;
+//   emu.load(0x10000, code, size);
+//   emu.setStack(0x80000000, 0x10000);
+//   emu.setReg(10, 123);  // a0
+//   emu.call(0x10000);
+//   printf("%u %llu\n", emu.getReg(10), emu.getRetired());
+//
+// 制限
+// * ホストがリトルエンディアンであることを前提にしている
+// * 浮動小数点数の演算はホストの演算で行うので、丸めモードは
+//   整数への変換命令以外では無視され、 fflags も更新しない
+// * 特権命令、 RV32E 、 RV64 の命令には対応しない
+// * 書き込みできる領域のコードを書き換えた場合は flush() を呼ぶか、
+//   ゲストで fence.i を実行すること
+
+namespace RV32_asm {
+
+class Emulator {
+ public:
+  // ゲストから呼び出されるホストの関数
+  // 引数は getReg(10) 以降、戻り値は setReg(10, ...) で受け渡す
+  typedef void (*HostCall)(Emulator &emu, void *user);
+
+  // 実行を停止した理由
+  enum Stop {
+    STOP_RETURN,   // call() で呼び出した関数から戻った
+    STOP_LIMIT,    // 指定された数の命令を実行した
+    STOP_EBREAK,   // ebreak 命令を実行しようとした
+    STOP_ECALL,    // ecall 命令を実行しようとした
+    STOP_ILLEGAL,  // 未対応または不正な命令
+    STOP_FAULT,    // マップされていないアドレスへのアクセス
+  };
+
+  // 命令の種類ごとのサイクル数
+  // 単純なインオーダーのパイプラインを想定した目安の値で、
+  // 生成したコードの良し悪しを比較するためのもの。
+  struct Timing {
+    unsigned int alu;     // 整数演算
+    unsigned int mul;     // 乗算
+    unsigned int div;     // 除算・剰余
+    unsigned int load;    // ロード
+    unsigned int store;   // ストア
+    unsigned int branch;  // 分岐命令(不成立)
+    unsigned int taken;   // 分岐成立・ジャンプの追加分
+    unsigned int fpu;     // 浮動小数点数の演算
+    unsigned int fdiv;    // 浮動小数点数の除算・平方根
+  };
+
+  // call() で呼び出した関数の戻り先
+  // 下位ビットが 0b11 でないので、フェッチ時には2バイトの命令として扱われる
+  enum : uint32_t { RETURN_ADDRESS = 0xfffffff0 };
+
+  // デコード済みの命令
+  struct Decoded {
+    uint16_t op;      // Op
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t rs3;
+    uint8_t rm;       // 丸めモード
+    uint8_t size;     // 命令のバイト数
+    int32_t imm;      // 即値(CSR 命令の場合は CSR の番号)
+    uint32_t cycles;  // Timing から求めたサイクル数
+  };
+
+  // 命令の種類
+  enum Op {
+    OP_ILLEGAL,
+    // RV32I
+    OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SB, OP_SH, OP_SW,
+    OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI,
+    OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU,
+    OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+    OP_FENCE, OP_FENCE_I, OP_ECALL, OP_EBREAK,
+    OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+    // RV32M
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU,
+    OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    // RV32A
+    OP_LR_W, OP_SC_W,
+    OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+    OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+    // RV32F
+    OP_FLW, OP_FSW,
+    OP_FMADD_S, OP_FMSUB_S, OP_FNMSUB_S, OP_FNMADD_S,
+    OP_FADD_S, OP_FSUB_S, OP_FMUL_S, OP_FDIV_S, OP_FSQRT_S,
+    OP_FSGNJ_S, OP_FSGNJN_S, OP_FSGNJX_S, OP_FMIN_S, OP_FMAX_S,
+    OP_FCVT_W_S, OP_FCVT_WU_S, OP_FMV_X_W, OP_FCLASS_S,
+    OP_FEQ_S, OP_FLT_S, OP_FLE_S,
+    OP_FCVT_S_W, OP_FCVT_S_WU, OP_FMV_W_X,
+    // RV32D
+    OP_FLD, OP_FSD,
+    OP_FMADD_D, OP_FMSUB_D, OP_FNMSUB_D, OP_FNMADD_D,
+    OP_FADD_D, OP_FSUB_D, OP_FMUL_D, OP_FDIV_D, OP_FSQRT_D,
+    OP_FSGNJ_D, OP_FSGNJN_D, OP_FSGNJX_D, OP_FMIN_D, OP_FMAX_D,
+    OP_FCVT_S_D, OP_FCVT_D_S,
+    OP_FEQ_D, OP_FLT_D, OP_FLE_D, OP_FCLASS_D,
+    OP_FCVT_W_D, OP_FCVT_WU_D, OP_FCVT_D_W, OP_FCVT_D_WU,
+    OP_COUNT
+  };
+
+ private:
+  enum { PAGE_SHIFT = 12, PAGE_SIZE = 1 << PAGE_SHIFT, L2_SHIFT = 22 };
+
+  // ページ単位の変換表の2段目
+  // ページ全体がマップされている場合だけ登録し、それ以外は Region を探す
+  struct L2 {
+    unsigned char *read[1 << (L2_SHIFT - PAGE_SHIFT)];
+    unsigned char *write[1 << (L2_SHIFT - PAGE_SHIFT)];
+  };
+
+  struct Region {
+    uint32_t addr;
+    size_t size;
+    unsigned char *host;
+    bool writable;
+  };
+
+  struct HostCallEntry {
+    uint32_t addr;
+    HostCall fn;
+    void *user;
+  };
+
+  // ブロック単位で実行するための、デコード済みの命令
+  // fn はこの命令を実行して次に実行する Uop を返す
+  // (ブロックを抜ける場合は NULL)
+  struct Uop;
+  typedef const Uop *(*Handler)(Emulator &e, const Uop *u);
+  struct Uop {
+    Handler fn;
+    Decoded d;
+    uint32_t pc;
+    uint32_t left;  // この命令を含むブロックの残りの命令数
+  };
+
+  // 分岐命令までの命令の並び
+  struct Block {
+    uint32_t pc;
+    uint32_t n;       // 命令数
+    uint64_t cycles;  // 分岐成立の追加分を除いたサイクル数
+    Block *link[2];   // 続くブロック(0:次の命令 1:分岐先)
+    uint32_t count;   // 実行した回数(変換する場合だけ数える)
+    const unsigned char *native;  // 変換したコード
+    std::vector<Uop> uops;
+  };
+
+  enum {
+    MAX_BLOCK_INSNS = 64,
+    BLOCK_TABLE_SIZE = 4096,
+    TRANSLATE_COUNT = 32,  // この回数だけ実行したブロックを変換する
+  };
+
+  // 変換したコードの戻り値の上位32ビット
+  // 下位32ビットは次の pc (EXIT_INTERPRET の場合は Uop の番号)
+  enum NativeExit {
+    EXIT_NEXT,       // 次の命令のブロックに進む
+    EXIT_TAKEN,      // 分岐が成立した
+    EXIT_JUMP,       // jal
+    EXIT_INDIRECT,   // jalr
+    EXIT_STOP,       // 停止した
+    EXIT_INTERPRET,  // 変換しなかった命令から Uop を実行する
+  };
+  typedef uint64_t (*Native)(uint32_t *x, Emulator *e);
+
+  uint32_t x[33];  // x[32] は rd が x0 の命令の書き込み先
+  uint64_t f[32];  // 単精度の値は上位32ビットを1で埋めて(NaN-boxing)格納する
+  uint32_t pc;
+  uint32_t frm;
+  uint32_t fflags;
+  uint32_t reservation;  // lr.w で予約したアドレス
+  bool reserved;
+
+  uint64_t retired;
+  uint64_t cycles;
+  uint32_t faultAddress;
+  Timing timing;
+
+  L2 *l1[1 << (32 - L2_SHIFT)];
+  std::vector<std::unique_ptr<L2> > l2s;  // l1 が指す L2 を所有する
+  std::vector<Region> regions;
+  std::vector<std::unique_ptr<unsigned char[]> > owned;
+  std::vector<HostCallEntry> hostCalls;
+
+  std::unordered_map<uint32_t, std::unique_ptr<Block> > blocks;
+  Block *blockTable[BLOCK_TABLE_SIZE];  // pc で引くブロックのキャッシュ
+  Block *current;                       // 実行中のブロック
+  uint64_t retiredEnd;  // ブロックに入ってよい retired の上限
+  Stop blockStop;
+  bool blockStopped;
+  bool flushRequested;
+  bool translation;     // ブロックを x86-64 の命令に変換するか
+  size_t translated;    // 変換したブロックの数
+#if RV32_ASM_EMU_X64
+  std::unique_ptr<CodeArena> arena;
+  X64Code x64;
+#endif
+
+  Emulator(const Emulator &);
+  void operator=(const Emulator &);
+
+  static uint32_t bits(uint32_t v, int lsb, int width, int shift = 0) {
+    return internal::bits(v, lsb, width, shift);
+  }
+  static int32_t sext(uint32_t v, int width) {
+    return internal::sext(v, width);
+  }
+
+  // 乗除算(0での除算とオーバーフローの結果は仕様に従う)
+  static uint32_t mulh(uint32_t a, uint32_t b) {
+    return uint32_t((int64_t(int32_t(a)) * int64_t(int32_t(b))) >> 32);
+  }
+  static uint32_t mulhsu(uint32_t a, uint32_t b) {
+    return uint32_t((int64_t(int32_t(a)) * int64_t(uint64_t(b))) >> 32);
+  }
+  static uint32_t mulhu(uint32_t a, uint32_t b) {
+    return uint32_t((uint64_t(a) * uint64_t(b)) >> 32);
+  }
+  static uint32_t div(uint32_t a, uint32_t b) {
+    return (b == 0) ? 0xffffffff
+           : (a == 0x80000000 && b == 0xffffffff)
+               ? a
+               : uint32_t(int32_t(a) / int32_t(b));
+  }
+  static uint32_t divu(uint32_t a, uint32_t b) {
+    return (b == 0) ? 0xffffffff : a / b;
+  }
+  static uint32_t rem(uint32_t a, uint32_t b) {
+    return (b == 0) ? a
+           : (a == 0x80000000 && b == 0xffffffff)
+               ? 0
+               : uint32_t(int32_t(a) % int32_t(b));
+  }
+  static uint32_t remu(uint32_t a, uint32_t b) {
+    return (b == 0) ? a : a % b;
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // メモリ
+
+  // ゲストのアドレスに対応するホストのアドレス(アクセスできない場合は NULL)
+  unsigned char *hostPtr(uint32_t addr, size_t size, bool write) {
+    L2 *t = l1[addr >> L2_SHIFT];
+    if (t != NULL) {
+      const uint32_t idx =
+          (addr >> PAGE_SHIFT) & ((1 << (L2_SHIFT - PAGE_SHIFT)) - 1);
+      unsigned char *page = write ? t->write[idx] : t->read[idx];
+      const uint32_t in = addr & (PAGE_SIZE - 1);
+      if (page != NULL && in + size <= PAGE_SIZE) {
+        return page + in;
+      }
+    }
+    return findRegion(addr, size, write);
+  }
+
+  // ページの途中で終わる領域や、ページをまたぐアクセスの場合
+  unsigned char *findRegion(uint32_t addr, size_t size, bool write) const {
+    for (const Region &r : regions) {
+      if (r.addr <= addr && uint64_t(addr - r.addr) + size <= r.size) {
+        return (write && !r.writable) ? NULL : r.host + (addr - r.addr);
+      }
+    }
+    return NULL;
+  }
+
+  template <typename T>
+  bool load(uint32_t addr, T &v) {
+    const unsigned char *p = hostPtr(addr, sizeof(T), false);
+    if (p == NULL) {
+      faultAddress = addr;
+      return false;
+    }
+    memcpy(&v, p, sizeof(T));
+    return true;
+  }
+
+  template <typename T>
+  bool store(uint32_t addr, T v) {
+    unsigned char *p = hostPtr(addr, sizeof(T), true);
+    if (p == NULL) {
+      faultAddress = addr;
+      return false;
+    }
+    memcpy(p, &v, sizeof(T));
+    return true;
+  }
+
+  const HostCallEntry *findHostCall(uint32_t addr) const {
+    for (const HostCallEntry &h : hostCalls) {
+      if (h.addr == addr) {
+        return &h;
+      }
+    }
+    return NULL;
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 浮動小数点数
+
+  static uint32_t asBits(float v) {
+    uint32_t b;
+    memcpy(&b, &v, 4);
+    return b;
+  }
+  static uint64_t asBits(double v) {
+    uint64_t b;
+    memcpy(&b, &v, 8);
+    return b;
+  }
+  static float asFloat(uint32_t b) {
+    float v;
+    memcpy(&v, &b, 4);
+    return v;
+  }
+  static double asDouble(uint64_t b) {
+    double v;
+    memcpy(&v, &b, 8);
+    return v;
+  }
+
+  // NaN-boxing されていない値は正規化された NaN として読む
+  uint32_t getSBits(int r) const {
+    return ((f[r] >> 32) == 0xffffffff) ? uint32_t(f[r]) : 0x7fc00000;
+  }
+  float getS(int r) const { return asFloat(getSBits(r)); }
+  double getD(int r) const { return asDouble(f[r]); }
+  void setSBits(int r, uint32_t b) { f[r] = 0xffffffff00000000ull | b; }
+  void setS(int r, float v) {
+    setSBits(r, std::isnan(v) ? 0x7fc00000 : asBits(v));
+  }
+  void setD(int r, double v) {
+    f[r] = std::isnan(v) ? 0x7ff8000000000000ull : asBits(v);
+  }
+
+  template <typename F>
+  static F fmin_(F a, F b) {
+    if (std::isnan(a)) return b;
+    if (std::isnan(b)) return a;
+    if (a == b) return std::signbit(a) ? a : b;  // -0.0 < +0.0
+    return a < b ? a : b;
+  }
+  template <typename F>
+  static F fmax_(F a, F b) {
+    if (std::isnan(a)) return b;
+    if (std::isnan(b)) return a;
+    if (a == b) return std::signbit(a) ? b : a;
+    return a < b ? b : a;
+  }
+
+  // 丸めモードに従って整数に丸める
+  static double roundBy(double v, uint32_t rm) {
+    switch (rm) {
+      case 1:  // rtz
+        return std::trunc(v);
+      case 2:  // rdn
+        return std::floor(v);
+      case 3:  // rup
+        return std::ceil(v);
+      case 4:  // rmm
+        return std::round(v);
+      default:  // rne
+        return std::nearbyint(v);
+    }
+  }
+
+  // 範囲外の値は飽和させ、NaN は最大値にする
+  static uint32_t toInt32(double v, uint32_t rm) {
+    if (std::isnan(v)) return 0x7fffffff;
+    v = roundBy(v, rm);
+    if (v >= 2147483648.0) return 0x7fffffff;
+    if (v < -2147483648.0) return 0x80000000;
+    return uint32_t(int32_t(v));
+  }
+  static uint32_t toUInt32(double v, uint32_t rm) {
+    if (std::isnan(v)) return 0xffffffff;
+    v = roundBy(v, rm);
+    if (v >= 4294967296.0) return 0xffffffff;
+    if (v <= 0.0) return 0;
+    return uint32_t(v);
+  }
+
+  template <typename F>
+  static uint32_t fclass(F v) {
+    const bool neg = std::signbit(v);
+    switch (std::fpclassify(v)) {
+      case FP_INFINITE:
+        return neg ? 1 << 0 : 1 << 7;
+      case FP_NORMAL:
+        return neg ? 1 << 1 : 1 << 6;
+      case FP_SUBNORMAL:
+        return neg ? 1 << 2 : 1 << 5;
+      case FP_ZERO:
+        return neg ? 1 << 3 : 1 << 4;
+      default:
+        return isSignalingNaN(v) ? 1 << 8 : 1 << 9;
+    }
+  }
+  static bool isSignalingNaN(float v) { return !(asBits(v) & 0x00400000); }
+  static bool isSignalingNaN(double v) {
+    return !(asBits(v) & 0x0008000000000000ull);
+  }
+
+  uint32_t roundingMode(const Decoded &d) const {
+    return (d.rm == 7) ? frm : d.rm;
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // デコード
+
+  void setCycles(Decoded &d) const {
+    const unsigned int op = d.op;
+    if (op >= OP_MUL && op <= OP_MULHU) {
+      d.cycles = timing.mul;
+    } else if (op >= OP_DIV && op <= OP_REMU) {
+      d.cycles = timing.div;
+    } else if ((op >= OP_LB && op <= OP_LHU) || op == OP_FLW || op == OP_FLD ||
+               (op >= OP_LR_W && op <= OP_AMOMAXU_W)) {
+      d.cycles = timing.load;
+    } else if ((op >= OP_SB && op <= OP_SW) || op == OP_FSW || op == OP_FSD) {
+      d.cycles = timing.store;
+    } else if (op >= OP_BEQ && op <= OP_BGEU) {
+      d.cycles = timing.branch;
+    } else if (op == OP_JAL || op == OP_JALR) {
+      d.cycles = timing.alu + timing.taken;
+    } else if (op == OP_FDIV_S || op == OP_FSQRT_S || op == OP_FDIV_D ||
+               op == OP_FSQRT_D) {
+      d.cycles = timing.fdiv;
+    } else if (op >= OP_FMADD_S) {
+      d.cycles = timing.fpu;
+    } else {
+      d.cycles = timing.alu;
+    }
+  }
+
+  static void set(Decoded &d, int op, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                  int32_t imm) {
+    d.op = uint16_t(op);
+    d.rd = uint8_t(rd);
+    d.rs1 = uint8_t(rs1);
+    d.rs2 = uint8_t(rs2);
+    d.rs3 = 0;
+    d.rm = 0;
+    d.imm = imm;
+  }
+
+  // 16ビット命令を対応する32ビット命令に展開する
+  static void decode16(uint32_t c, Decoded &d) {
+    const uint32_t rd = bits(c, 7, 5);
+    const uint32_t rs2 = bits(c, 2, 5);
+    const uint32_t rdc = bits(c, 7, 3) + 8;
+    const uint32_t rs2c = bits(c, 2, 3) + 8;
+    const int32_t imm6 = sext(bits(c, 12, 1, 5) | bits(c, 2, 5), 6);
+    const int32_t uimmW =
+        bits(c, 10, 3, 3) | bits(c, 6, 1, 2) | bits(c, 5, 1, 6);
+    const int32_t uimmD = bits(c, 10, 3, 3) | bits(c, 5, 2, 6);
+    const int32_t offCJ =
+        sext(bits(c, 12, 1, 11) | bits(c, 11, 1, 4) | bits(c, 9, 2, 8) |
+                 bits(c, 8, 1, 10) | bits(c, 7, 1, 6) | bits(c, 6, 1, 7) |
+                 bits(c, 3, 3, 1) | bits(c, 2, 1, 5),
+             12);
+    const int32_t offCB =
+        sext(bits(c, 12, 1, 8) | bits(c, 10, 2, 3) | bits(c, 5, 2, 6) |
+                 bits(c, 3, 2, 1) | bits(c, 2, 1, 5),
+             9);
+    d.size = 2;
+    switch (((c & 3) << 3) | bits(c, 13, 3)) {
+      case 0b00000: {  // c.addi4spn
+        const int32_t imm = bits(c, 11, 2, 4) | bits(c, 7, 4, 6) |
+                            bits(c, 6, 1, 2) | bits(c, 5, 1, 3);
+        set(d, imm != 0 ? OP_ADDI : OP_ILLEGAL, rs2c, 2, 0, imm);
+        break;
+      }
+      case 0b00001:  // c.fld
+        set(d, OP_FLD, rs2c, rdc, 0, uimmD);
+        break;
+      case 0b00010:  // c.lw
+        set(d, OP_LW, rs2c, rdc, 0, uimmW);
+        break;
+      case 0b00011:  // c.flw
+        set(d, OP_FLW, rs2c, rdc, 0, uimmW);
+        break;
+      case 0b00101:  // c.fsd
+        set(d, OP_FSD, 0, rdc, rs2c, uimmD);
+        break;
+      case 0b00110:  // c.sw
+        set(d, OP_SW, 0, rdc, rs2c, uimmW);
+        break;
+      case 0b00111:  // c.fsw
+        set(d, OP_FSW, 0, rdc, rs2c, uimmW);
+        break;
+      case 0b01000:  // c.addi
+        set(d, OP_ADDI, rd, rd, 0, imm6);
+        break;
+      case 0b01001:  // c.jal
+        set(d, OP_JAL, 1, 0, 0, offCJ);
+        break;
+      case 0b01010:  // c.li
+        set(d, OP_ADDI, rd, 0, 0, imm6);
+        break;
+      case 0b01011:
+        if (rd == 2) {  // c.addi16sp
+          const int32_t imm =
+              sext(bits(c, 12, 1, 9) | bits(c, 6, 1, 4) | bits(c, 5, 1, 6) |
+                       bits(c, 3, 2, 7) | bits(c, 2, 1, 5),
+                   10);
+          set(d, imm != 0 ? OP_ADDI : OP_ILLEGAL, 2, 2, 0, imm);
+        } else {  // c.lui
+          set(d, imm6 != 0 ? OP_LUI : OP_ILLEGAL, rd, 0, 0,
+              int32_t(uint32_t(imm6) << 12));
+        }
+        break;
+      case 0b01100:
+        switch (bits(c, 10, 2)) {
+          case 0b00:  // c.srli
+            set(d, OP_SRLI, rdc, rdc, 0, imm6 & 31);
+            break;
+          case 0b01:  // c.srai
+            set(d, OP_SRAI, rdc, rdc, 0, imm6 & 31);
+            break;
+          case 0b10:  // c.andi
+            set(d, OP_ANDI, rdc, rdc, 0, imm6);
+            break;
+          default: {
+            static const uint16_t ops[4] = {OP_SUB, OP_XOR, OP_OR, OP_AND};
+            set(d, (c & 0x1000) ? int(OP_ILLEGAL) : ops[bits(c, 5, 2)],
+                rdc, rdc, rs2c, 0);
+            break;
+          }
+        }
+        break;
+      case 0b01101:  // c.j
+        set(d, OP_JAL, 0, 0, 0, offCJ);
+        break;
+      case 0b01110:  // c.beqz
+        set(d, OP_BEQ, 0, rdc, 0, offCB);
+        break;
+      case 0b01111:  // c.bnez
+        set(d, OP_BNE, 0, rdc, 0, offCB);
+        break;
+      case 0b10000:  // c.slli
+        set(d, OP_SLLI, rd, rd, 0, imm6 & 31);
+        break;
+      case 0b10001:  // c.fldsp
+        set(d, OP_FLD, rd, 2, 0,
+            bits(c, 12, 1, 5) | bits(c, 5, 2, 3) | bits(c, 2, 3, 6));
+        break;
+      case 0b10010:  // c.lwsp
+      case 0b10011:  // c.flwsp
+        set(d, (c & 0x2000) ? OP_FLW : (rd != 0 ? OP_LW : OP_ILLEGAL), rd, 2,
+            0, bits(c, 12, 1, 5) | bits(c, 4, 3, 2) | bits(c, 2, 2, 6));
+        break;
+      case 0b10100:
+        if ((c & 0x1000) == 0) {
+          if (rs2 == 0) {  // c.jr
+            set(d, rd != 0 ? OP_JALR : OP_ILLEGAL, 0, rd, 0, 0);
+          } else {  // c.mv
+            set(d, OP_ADD, rd, 0, rs2, 0);
+          }
+        } else if (rs2 == 0) {
+          if (rd == 0) {  // c.ebreak
+            set(d, OP_EBREAK, 0, 0, 0, 0);
+          } else {  // c.jalr
+            set(d, OP_JALR, 1, rd, 0, 0);
+          }
+        } else {  // c.add
+          set(d, OP_ADD, rd, rd, rs2, 0);
+        }
+        break;
+      case 0b10101:  // c.fsdsp
+        set(d, OP_FSD, 0, 2, rs2, bits(c, 10, 3, 3) | bits(c, 7, 3, 6));
+        break;
+      case 0b10110:  // c.swsp
+      case 0b10111:  // c.fswsp
+        set(d, (c & 0x2000) ? OP_FSW : OP_SW, 0, 2, rs2,
+            bits(c, 9, 4, 2) | bits(c, 7, 2, 6));
+        break;
+      default:
+        set(d, OP_ILLEGAL, 0, 0, 0, 0);
+        break;
+    }
+  }
+
+  static void decodeFP(uint32_t c, Decoded &d) {
+    const uint32_t f7 = bits(c, 25, 7);
+    const uint32_t f3 = bits(c, 12, 3);
+    const uint32_t rs2 = bits(c, 20, 5);
+    const bool dbl = (f7 & 1) != 0;
+    int op = OP_ILLEGAL;
+    switch (f7 >> 2) {
+      case 0b00000:
+        op = dbl ? OP_FADD_D : OP_FADD_S;
+        break;
+      case 0b00001:
+        op = dbl ? OP_FSUB_D : OP_FSUB_S;
+        break;
+      case 0b00010:
+        op = dbl ? OP_FMUL_D : OP_FMUL_S;
+        break;
+      case 0b00011:
+        op = dbl ? OP_FDIV_D : OP_FDIV_S;
+        break;
+      case 0b01011:
+        op = dbl ? OP_FSQRT_D : OP_FSQRT_S;
+        break;
+      case 0b00100:
+        if (f3 <= 2) {
+          op = (dbl ? OP_FSGNJ_D : OP_FSGNJ_S) + f3;
+        }
+        break;
+      case 0b00101:
+        if (f3 <= 1) {
+          op = (dbl ? OP_FMIN_D : OP_FMIN_S) + f3;
+        }
+        break;
+      case 0b01000:
+        if (f7 == 0b0100000 && rs2 == 1) {
+          op = OP_FCVT_S_D;
+        } else if (f7 == 0b0100001 && rs2 == 0) {
+          op = OP_FCVT_D_S;
+        }
+        break;
+      case 0b10100:
+        if (f3 <= 2) {
+          static const uint16_t s[3] = {OP_FLE_S, OP_FLT_S, OP_FEQ_S};
+          static const uint16_t dd[3] = {OP_FLE_D, OP_FLT_D, OP_FEQ_D};
+          op = dbl ? dd[f3] : s[f3];
+        }
+        break;
+      case 0b11000:
+        if (rs2 <= 1) {
+          op = (dbl ? OP_FCVT_W_D : OP_FCVT_W_S) + rs2;
+        }
+        break;
+      case 0b11010:
+        if (rs2 <= 1) {
+          op = dbl ? OP_FCVT_D_W + rs2 : OP_FCVT_S_W + rs2;
+        }
+        break;
+      case 0b11100:
+        if (f3 == 0 && !dbl) {
+          op = OP_FMV_X_W;
+        } else if (f3 == 1) {
+          op = dbl ? OP_FCLASS_D : OP_FCLASS_S;
+        }
+        break;
+      case 0b11110:
+        if (f3 == 0 && !dbl) {
+          op = OP_FMV_W_X;
+        }
+        break;
+      default:
+        break;
+    }
+    set(d, op, bits(c, 7, 5), bits(c, 15, 5), rs2, 0);
+    d.rm = uint8_t(f3);
+  }
+
+  static void decode32(uint32_t c, Decoded &d) {
+    const uint32_t rd = bits(c, 7, 5);
+    const uint32_t rs1 = bits(c, 15, 5);
+    const uint32_t rs2 = bits(c, 20, 5);
+    const uint32_t f3 = bits(c, 12, 3);
+    const uint32_t f7 = bits(c, 25, 7);
+    const int32_t immI = sext(bits(c, 20, 12), 12);
+    const int32_t immS = sext(bits(c, 25, 7, 5) | bits(c, 7, 5), 12);
+    d.size = 4;
+    set(d, OP_ILLEGAL, rd, rs1, rs2, 0);
+    switch (c & 0x7f) {
+      case 0b0110111:
+        set(d, OP_LUI, rd, 0, 0, int32_t(c & 0xfffff000));
+        break;
+      case 0b0010111:
+        set(d, OP_AUIPC, rd, 0, 0, int32_t(c & 0xfffff000));
+        break;
+      case 0b1101111:
+        set(d, OP_JAL, rd, 0, 0,
+            sext(bits(c, 31, 1, 20) | bits(c, 12, 8, 12) | bits(c, 20, 1, 11) |
+                     bits(c, 21, 10, 1),
+                 21));
+        break;
+      case 0b1100111:
+        if (f3 == 0) {
+          set(d, OP_JALR, rd, rs1, 0, immI);
+        }
+        break;
+      case 0b1100011:
+        if (f3 != 2 && f3 != 3) {
+          static const uint16_t ops[8] = {OP_BEQ, OP_BNE,  0,      0,
+                                          OP_BLT, OP_BGE, OP_BLTU, OP_BGEU};
+          set(d, ops[f3], 0, rs1, rs2,
+              sext(bits(c, 31, 1, 12) | bits(c, 7, 1, 11) |
+                       bits(c, 25, 6, 5) | bits(c, 8, 4, 1),
+                   13));
+        }
+        break;
+      case 0b0000011: {
+        static const uint16_t ops[8] = {OP_LB,  OP_LH,  OP_LW,      OP_ILLEGAL,
+                                        OP_LBU, OP_LHU, OP_ILLEGAL, OP_ILLEGAL};
+        set(d, ops[f3], rd, rs1, 0, immI);
+        break;
+      }
+      case 0b0100011:
+        if (f3 <= 2) {
+          set(d, OP_SB + f3, 0, rs1, rs2, immS);
+        }
+        break;
+      case 0b0000111:
+        if (f3 == 2 || f3 == 3) {
+          set(d, f3 == 2 ? OP_FLW : OP_FLD, rd, rs1, 0, immI);
+        }
+        break;
+      case 0b0100111:
+        if (f3 == 2 || f3 == 3) {
+          set(d, f3 == 2 ? OP_FSW : OP_FSD, 0, rs1, rs2, immS);
+        }
+        break;
+      case 0b0010011:
+        switch (f3) {
+          case 0b000:
+            set(d, OP_ADDI, rd, rs1, 0, immI);
+            break;
+          case 0b010:
+            set(d, OP_SLTI, rd, rs1, 0, immI);
+            break;
+          case 0b011:
+            set(d, OP_SLTIU, rd, rs1, 0, immI);
+            break;
+          case 0b100:
+            set(d, OP_XORI, rd, rs1, 0, immI);
+            break;
+          case 0b110:
+            set(d, OP_ORI, rd, rs1, 0, immI);
+            break;
+          case 0b111:
+            set(d, OP_ANDI, rd, rs1, 0, immI);
+            break;
+          case 0b001:
+            if (f7 == 0) {
+              set(d, OP_SLLI, rd, rs1, 0, rs2);
+            }
+            break;
+          default:
+            if (f7 == 0 || f7 == 0b0100000) {
+              set(d, f7 ? OP_SRAI : OP_SRLI, rd, rs1, 0, rs2);
+            }
+            break;
+        }
+        break;
+      case 0b0110011:
+        if (f7 == 0) {
+          static const uint16_t ops[8] = {OP_ADD, OP_SLL, OP_SLT, OP_SLTU,
+                                          OP_XOR, OP_SRL, OP_OR,  OP_AND};
+          d.op = ops[f3];
+        } else if (f7 == 0b0100000 && (f3 == 0 || f3 == 5)) {
+          d.op = (f3 == 0) ? OP_SUB : OP_SRA;
+        } else if (f7 == 1) {
+          d.op = uint16_t(OP_MUL + f3);
+        }
+        break;
+      case 0b0001111:
+        if (f3 == 0) {
+          d.op = OP_FENCE;
+        } else if (f3 == 1) {
+          d.op = OP_FENCE_I;
+        }
+        break;
+      case 0b1110011:
+        if (f3 == 0) {
+          if (c == 0x00000073) {
+            d.op = OP_ECALL;
+          } else if (c == 0x00100073) {
+            d.op = OP_EBREAK;
+          }
+        } else if (f3 != 4) {
+          static const uint16_t ops[8] = {0,           OP_CSRRW,  OP_CSRRS,
+                                          OP_CSRRC,    0,         OP_CSRRWI,
+                                          OP_CSRRSI,   OP_CSRRCI};
+          set(d, ops[f3], rd, rs1, 0, int32_t(c >> 20));
+        }
+        break;
+      case 0b0101111:
+        if (f3 == 2) {
+          switch (c >> 27) {
+            case 0b00010:
+              d.op = (rs2 == 0) ? OP_LR_W : OP_ILLEGAL;
+              break;
+            case 0b00011:
+              d.op = OP_SC_W;
+              break;
+            case 0b00001:
+              d.op = OP_AMOSWAP_W;
+              break;
+            case 0b00000:
+              d.op = OP_AMOADD_W;
+              break;
+            case 0b00100:
+              d.op = OP_AMOXOR_W;
+              break;
+            case 0b01100:
+              d.op = OP_AMOAND_W;
+              break;
+            case 0b01000:
+              d.op = OP_AMOOR_W;
+              break;
+            case 0b10000:
+              d.op = OP_AMOMIN_W;
+              break;
+            case 0b10100:
+              d.op = OP_AMOMAX_W;
+              break;
+            case 0b11000:
+              d.op = OP_AMOMINU_W;
+              break;
+            case 0b11100:
+              d.op = OP_AMOMAXU_W;
+              break;
+            default:
+              break;
+          }
+        }
+        break;
+      case 0b1000011:
+      case 0b1000111:
+      case 0b1001011:
+      case 0b1001111: {
+        const uint32_t fmt = bits(c, 25, 2);
+        if (fmt <= 1) {
+          d.op = uint16_t((fmt ? OP_FMADD_D : OP_FMADD_S) + bits(c, 2, 2));
+          d.rs3 = uint8_t(c >> 27);
+          d.rm = uint8_t(f3);
+        }
+        break;
+      }
+      case 0b1010011:
+        decodeFP(c, d);
+        break;
+      default:
+        break;
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 実行
+
+  // 1命令を実行する
+  // 停止する場合は stop に理由を入れて false を返す
+  // retired と cycles は呼び出し側で数える(分岐成立の追加分だけはここで数える)
+  bool execute(const Decoded &d, Stop &stop) {
+    uint32_t next = pc + d.size;
+    const uint32_t a = x[d.rs1];
+    const uint32_t b = x[d.rs2];
+    const int32_t imm = d.imm;
+    uint32_t v = 0;
+
+#define RV32_EMU_LOAD(T)                  \
+  {                                       \
+    T t;                                  \
+    if (!load(a + imm, t)) {              \
+      stop = STOP_FAULT;                  \
+      return false;                       \
+    }                                     \
+    v = uint32_t(t);                      \
+  }
+#define RV32_EMU_STORE(T, val)            \
+  if (!store(a + imm, T(val))) {          \
+    stop = STOP_FAULT;                    \
+    return false;                         \
+  }
+#define RV32_EMU_BRANCH(cond) \
+  if (cond) {                 \
+    next = pc + imm;          \
+    cycles += timing.taken;   \
+  }                           \
+  break;
+
+    switch (d.op) {
+      case OP_LUI:
+        v = uint32_t(imm);
+        break;
+      case OP_AUIPC:
+        v = pc + imm;
+        break;
+      case OP_JAL:
+        v = next;
+        next = pc + imm;
+        break;
+      case OP_JALR:
+        v = next;
+        next = (a + imm) & ~1u;
+        break;
+      case OP_BEQ:
+        RV32_EMU_BRANCH(a == b)
+      case OP_BNE:
+        RV32_EMU_BRANCH(a != b)
+      case OP_BLT:
+        RV32_EMU_BRANCH(int32_t(a) < int32_t(b))
+      case OP_BGE:
+        RV32_EMU_BRANCH(int32_t(a) >= int32_t(b))
+      case OP_BLTU:
+        RV32_EMU_BRANCH(a < b)
+      case OP_BGEU:
+        RV32_EMU_BRANCH(a >= b)
+      case OP_LB:
+        RV32_EMU_LOAD(int8_t)
+        break;
+      case OP_LH:
+        RV32_EMU_LOAD(int16_t)
+        break;
+      case OP_LW:
+        RV32_EMU_LOAD(uint32_t)
+        break;
+      case OP_LBU:
+        RV32_EMU_LOAD(uint8_t)
+        break;
+      case OP_LHU:
+        RV32_EMU_LOAD(uint16_t)
+        break;
+      case OP_SB:
+        RV32_EMU_STORE(uint8_t, b)
+        break;
+      case OP_SH:
+        RV32_EMU_STORE(uint16_t, b)
+        break;
+      case OP_SW:
+        RV32_EMU_STORE(uint32_t, b)
+        break;
+      case OP_ADDI:
+        v = a + imm;
+        break;
+      case OP_SLTI:
+        v = int32_t(a) < imm;
+        break;
+      case OP_SLTIU:
+        v = a < uint32_t(imm);
+        break;
+      case OP_XORI:
+        v = a ^ imm;
+        break;
+      case OP_ORI:
+        v = a | imm;
+        break;
+      case OP_ANDI:
+        v = a & imm;
+        break;
+      case OP_SLLI:
+        v = a << imm;
+        break;
+      case OP_SRLI:
+        v = a >> imm;
+        break;
+      case OP_SRAI:
+        v = uint32_t(int32_t(a) >> imm);
+        break;
+      case OP_ADD:
+        v = a + b;
+        break;
+      case OP_SUB:
+        v = a - b;
+        break;
+      case OP_SLL:
+        v = a << (b & 31);
+        break;
+      case OP_SLT:
+        v = int32_t(a) < int32_t(b);
+        break;
+      case OP_SLTU:
+        v = a < b;
+        break;
+      case OP_XOR:
+        v = a ^ b;
+        break;
+      case OP_SRL:
+        v = a >> (b & 31);
+        break;
+      case OP_SRA:
+        v = uint32_t(int32_t(a) >> (b & 31));
+        break;
+      case OP_OR:
+        v = a | b;
+        break;
+      case OP_AND:
+        v = a & b;
+        break;
+      case OP_FENCE:
+      case OP_FENCE_I:
+        break;
+      case OP_ECALL:
+        stop = STOP_ECALL;
+        return false;
+      case OP_EBREAK:
+        stop = STOP_EBREAK;
+        return false;
+      case OP_CSRRW:
+      case OP_CSRRS:
+      case OP_CSRRC:
+      case OP_CSRRWI:
+      case OP_CSRRSI:
+      case OP_CSRRCI: {
+        const uint32_t src = (d.op >= OP_CSRRWI) ? d.rs1 : a;
+        const int kind = (d.op - OP_CSRRW) % 3;  // 0:W 1:S 2:C
+        if (!csr(uint32_t(imm), kind, src, d.rs1 != 0 || kind == 0, v)) {
+          stop = STOP_ILLEGAL;
+          return false;
+        }
+        break;
+      }
+      case OP_MUL:
+        v = a * b;
+        break;
+      case OP_MULH:
+        v = mulh(a, b);
+        break;
+      case OP_MULHSU:
+        v = mulhsu(a, b);
+        break;
+      case OP_MULHU:
+        v = mulhu(a, b);
+        break;
+      case OP_DIV:
+        v = div(a, b);
+        break;
+      case OP_DIVU:
+        v = divu(a, b);
+        break;
+      case OP_REM:
+        v = rem(a, b);
+        break;
+      case OP_REMU:
+        v = remu(a, b);
+        break;
+      case OP_LR_W:
+        if (!load(a, v)) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        reservation = a;
+        reserved = true;
+        break;
+      case OP_SC_W:
+        if (reserved && reservation == a) {
+          if (!store(a, b)) {
+            stop = STOP_FAULT;
+            return false;
+          }
+          v = 0;
+        } else {
+          v = 1;
+        }
+        reserved = false;
+        break;
+      case OP_AMOSWAP_W:
+      case OP_AMOADD_W:
+      case OP_AMOXOR_W:
+      case OP_AMOAND_W:
+      case OP_AMOOR_W:
+      case OP_AMOMIN_W:
+      case OP_AMOMAX_W:
+      case OP_AMOMINU_W:
+      case OP_AMOMAXU_W: {
+        if (!load(a, v)) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        uint32_t w = b;
+        switch (d.op) {
+          case OP_AMOADD_W:
+            w = v + b;
+            break;
+          case OP_AMOXOR_W:
+            w = v ^ b;
+            break;
+          case OP_AMOAND_W:
+            w = v & b;
+            break;
+          case OP_AMOOR_W:
+            w = v | b;
+            break;
+          case OP_AMOMIN_W:
+            w = (int32_t(v) < int32_t(b)) ? v : b;
+            break;
+          case OP_AMOMAX_W:
+            w = (int32_t(v) > int32_t(b)) ? v : b;
+            break;
+          case OP_AMOMINU_W:
+            w = (v < b) ? v : b;
+            break;
+          case OP_AMOMAXU_W:
+            w = (v > b) ? v : b;
+            break;
+          default:
+            break;
+        }
+        if (!store(a, w)) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        break;
+      }
+      default:
+        if (!executeFP(d, v, stop)) {
+          return false;
+        }
+        break;
+    }
+#undef RV32_EMU_LOAD
+#undef RV32_EMU_STORE
+#undef RV32_EMU_BRANCH
+
+    x[d.rd] = v;
+    x[0] = 0;
+    pc = next;
+    return true;
+  }
+
+  // 浮動小数点数の命令
+  // 整数レジスタに書き込む命令の場合は v に結果を入れる
+  // (それ以外は x[rd] を保つ)
+  bool executeFP(const Decoded &d, uint32_t &v, Stop &stop) {
+    const uint32_t a = x[d.rs1];
+    v = x[d.rd];
+    switch (d.op) {
+      case OP_FLW: {
+        uint32_t t;
+        if (!load(a + d.imm, t)) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        setSBits(d.rd, t);
+        break;
+      }
+      case OP_FLD:
+        if (!load(a + d.imm, f[d.rd])) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        break;
+      case OP_FSW:
+        if (!store(a + d.imm, uint32_t(f[d.rs2]))) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        break;
+      case OP_FSD:
+        if (!store(a + d.imm, f[d.rs2])) {
+          stop = STOP_FAULT;
+          return false;
+        }
+        break;
+
+      // 単精度
+      case OP_FMADD_S:
+        setS(d.rd, std::fma(getS(d.rs1), getS(d.rs2), getS(d.rs3)));
+        break;
+      case OP_FMSUB_S:
+        setS(d.rd, std::fma(getS(d.rs1), getS(d.rs2), -getS(d.rs3)));
+        break;
+      case OP_FNMSUB_S:
+        setS(d.rd, std::fma(-getS(d.rs1), getS(d.rs2), getS(d.rs3)));
+        break;
+      case OP_FNMADD_S:
+        setS(d.rd, std::fma(-getS(d.rs1), getS(d.rs2), -getS(d.rs3)));
+        break;
+      case OP_FADD_S:
+        setS(d.rd, getS(d.rs1) + getS(d.rs2));
+        break;
+      case OP_FSUB_S:
+        setS(d.rd, getS(d.rs1) - getS(d.rs2));
+        break;
+      case OP_FMUL_S:
+        setS(d.rd, getS(d.rs1) * getS(d.rs2));
+        break;
+      case OP_FDIV_S:
+        setS(d.rd, getS(d.rs1) / getS(d.rs2));
+        break;
+      case OP_FSQRT_S:
+        setS(d.rd, std::sqrt(getS(d.rs1)));
+        break;
+      case OP_FSGNJ_S:
+        setSBits(d.rd, (getSBits(d.rs1) & 0x7fffffff) |
+                           (getSBits(d.rs2) & 0x80000000));
+        break;
+      case OP_FSGNJN_S:
+        setSBits(d.rd, (getSBits(d.rs1) & 0x7fffffff) |
+                           (~getSBits(d.rs2) & 0x80000000));
+        break;
+      case OP_FSGNJX_S:
+        setSBits(d.rd, getSBits(d.rs1) ^ (getSBits(d.rs2) & 0x80000000));
+        break;
+      case OP_FMIN_S:
+        setS(d.rd, fmin_(getS(d.rs1), getS(d.rs2)));
+        break;
+      case OP_FMAX_S:
+        setS(d.rd, fmax_(getS(d.rs1), getS(d.rs2)));
+        break;
+      case OP_FCVT_W_S:
+        v = toInt32(getS(d.rs1), roundingMode(d));
+        break;
+      case OP_FCVT_WU_S:
+        v = toUInt32(getS(d.rs1), roundingMode(d));
+        break;
+      case OP_FMV_X_W:
+        v = uint32_t(f[d.rs1]);
+        break;
+      case OP_FCLASS_S:
+        v = fclass(getS(d.rs1));
+        break;
+      case OP_FEQ_S:
+        v = getS(d.rs1) == getS(d.rs2);
+        break;
+      case OP_FLT_S:
+        v = getS(d.rs1) < getS(d.rs2);
+        break;
+      case OP_FLE_S:
+        v = getS(d.rs1) <= getS(d.rs2);
+        break;
+      case OP_FCVT_S_W:
+        setS(d.rd, float(int32_t(a)));
+        break;
+      case OP_FCVT_S_WU:
+        setS(d.rd, float(a));
+        break;
+      case OP_FMV_W_X:
+        setSBits(d.rd, a);
+        break;
+
+      // 倍精度
+      case OP_FMADD_D:
+        setD(d.rd, std::fma(getD(d.rs1), getD(d.rs2), getD(d.rs3)));
+        break;
+      case OP_FMSUB_D:
+        setD(d.rd, std::fma(getD(d.rs1), getD(d.rs2), -getD(d.rs3)));
+        break;
+      case OP_FNMSUB_D:
+        setD(d.rd, std::fma(-getD(d.rs1), getD(d.rs2), getD(d.rs3)));
+        break;
+      case OP_FNMADD_D:
+        setD(d.rd, std::fma(-getD(d.rs1), getD(d.rs2), -getD(d.rs3)));
+        break;
+      case OP_FADD_D:
+        setD(d.rd, getD(d.rs1) + getD(d.rs2));
+        break;
+      case OP_FSUB_D:
+        setD(d.rd, getD(d.rs1) - getD(d.rs2));
+        break;
+      case OP_FMUL_D:
+        setD(d.rd, getD(d.rs1) * getD(d.rs2));
+        break;
+      case OP_FDIV_D:
+        setD(d.rd, getD(d.rs1) / getD(d.rs2));
+        break;
+      case OP_FSQRT_D:
+        setD(d.rd, std::sqrt(getD(d.rs1)));
+        break;
+      case OP_FSGNJ_D:
+        f[d.rd] = (f[d.rs1] & ~(1ull << 63)) | (f[d.rs2] & (1ull << 63));
+        break;
+      case OP_FSGNJN_D:
+        f[d.rd] = (f[d.rs1] & ~(1ull << 63)) | (~f[d.rs2] & (1ull << 63));
+        break;
+      case OP_FSGNJX_D:
+        f[d.rd] = f[d.rs1] ^ (f[d.rs2] & (1ull << 63));
+        break;
+      case OP_FMIN_D:
+        setD(d.rd, fmin_(getD(d.rs1), getD(d.rs2)));
+        break;
+      case OP_FMAX_D:
+        setD(d.rd, fmax_(getD(d.rs1), getD(d.rs2)));
+        break;
+      case OP_FCVT_S_D:
+        setS(d.rd, float(getD(d.rs1)));
+        break;
+      case OP_FCVT_D_S:
+        setD(d.rd, double(getS(d.rs1)));
+        break;
+      case OP_FEQ_D:
+        v = getD(d.rs1) == getD(d.rs2);
+        break;
+      case OP_FLT_D:
+        v = getD(d.rs1) < getD(d.rs2);
+        break;
+      case OP_FLE_D:
+        v = getD(d.rs1) <= getD(d.rs2);
+        break;
+      case OP_FCLASS_D:
+        v = fclass(getD(d.rs1));
+        break;
+      case OP_FCVT_W_D:
+        v = toInt32(getD(d.rs1), roundingMode(d));
+        break;
+      case OP_FCVT_WU_D:
+        v = toUInt32(getD(d.rs1), roundingMode(d));
+        break;
+      case OP_FCVT_D_W:
+        setD(d.rd, double(int32_t(a)));
+        break;
+      case OP_FCVT_D_WU:
+        setD(d.rd, double(a));
+        break;
+      default:
+        stop = STOP_ILLEGAL;
+        return false;
+    }
+    return true;
+  }
+
+  // CSR 命令
+  // kind は 0:書き込み 1:ビットのセット 2:ビットのクリア
+  bool csr(uint32_t num, int kind, uint32_t src, bool write, uint32_t &old) {
+    uint32_t *reg = NULL;
+    uint32_t mask = 0xffffffff;
+    switch (num) {
+      case 0x001:  // fflags
+        reg = &fflags;
+        mask = 0x1f;
+        break;
+      case 0x002:  // frm
+        reg = &frm;
+        mask = 0x7;
+        break;
+      case 0x003:  // fcsr
+        old = (frm << 5) | fflags;
+        if (write) {
+          const uint32_t v =
+              (kind == 0) ? src : (kind == 1) ? old | src : old & ~src;
+          frm = (v >> 5) & 7;
+          fflags = v & 0x1f;
+        }
+        return true;
+      case 0xc00:  // cycle
+      case 0xc01:  // time
+        old = uint32_t(cycles);
+        return !write;
+      case 0xc80:  // cycleh
+      case 0xc81:  // timeh
+        old = uint32_t(cycles >> 32);
+        return !write;
+      case 0xc02:  // instret
+        old = uint32_t(retired);
+        return !write;
+      case 0xc82:  // instreth
+        old = uint32_t(retired >> 32);
+        return !write;
+      default:
+        return false;
+    }
+    old = *reg;
+    if (write) {
+      const uint32_t v =
+          (kind == 0) ? src : (kind == 1) ? old | src : old & ~src;
+      *reg = v & mask;
+    }
+    return true;
+  }
+
+  // pc の命令をデコードする
+  // フェッチできない場合は false を返す
+  bool fetch(Decoded &d) {
+    const unsigned char *p = hostPtr(pc, 2, false);
+    if (p == NULL) {
+      faultAddress = pc;
+      return false;
+    }
+    uint16_t lo;
+    memcpy(&lo, p, 2);
+    if ((lo & 3) != 3) {
+      decode16(lo, d);
+    } else {
+      uint16_t hi;
+      if (!load(pc + 2, hi)) {
+        return false;
+      }
+      decode32(uint32_t(lo) | (uint32_t(hi) << 16), d);
+    }
+    setCycles(d);
+    return true;
+  }
+
+  // フェッチできないアドレスに来た場合の処理
+  // ホスト関数の呼び出しなら実行して戻り先に進み、 true を返す
+  bool leave(Stop &stop) {
+    if (pc == RETURN_ADDRESS) {
+      stop = STOP_RETURN;
+      return false;
+    }
+    const HostCallEntry *h = findHostCall(pc);
+    if (h == NULL) {
+      stop = STOP_FAULT;
+      return false;
+    }
+    h->fn(*this, h->user);
+    x[0] = 0;
+    pc = x[1];
+    return true;
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // ブロック単位の実行
+  //
+  // 分岐命令までの命令を一度だけデコードして Uop の配列にし、 pc ごとに
+  // キャッシュしておく。各 Uop は命令の種類に応じた関数を持ち、ブロックの
+  // 最後の命令は続くブロックの先頭の Uop を返すので、分岐しても switch や
+  // デコードを通らずに実行を続けられる。
+  // 直接分岐の飛び先のブロックは Block::link に覚えておく。
+  // retired と cycles はブロックに入るときにまとめて数え、途中で停止した
+  // 場合は残りの命令の分を戻す。
+
+  // 1命令ずつ実行する(ブロック単位では limit を超える場合など)
+  bool step(Stop &stop) {
+    Decoded d;
+    if (!fetch(d)) {
+      return leave(stop);
+    }
+    if (d.op == OP_ILLEGAL) {
+      stop = STOP_ILLEGAL;
+      return false;
+    }
+    if (!execute(d, stop)) {
+      return false;
+    }
+    ++retired;
+    cycles += d.cycles;
+    return true;
+  }
+
+  Block *findBlock(uint32_t addr) {
+    Block *&slot = blockTable[(addr >> 1) & (BLOCK_TABLE_SIZE - 1)];
+    if (slot != NULL && slot->pc == addr) {
+      return slot;
+    }
+    std::unordered_map<uint32_t, std::unique_ptr<Block> >::const_iterator it =
+        blocks.find(addr);
+    Block *b = (it != blocks.end()) ? it->second.get() : buildBlock(addr);
+    if (b != NULL) {
+      slot = b;
+    }
+    return b;
+  }
+
+  // addr から始まるブロックをデコードする
+  // 最初の命令をフェッチできない場合は NULL を返す
+  Block *buildBlock(uint32_t addr) {
+    std::unique_ptr<Block> b(new Block());
+    b->pc = addr;
+    b->n = 0;
+    b->cycles = 0;
+    b->link[0] = b->link[1] = NULL;
+    b->count = 0;
+    b->native = NULL;
+    const uint32_t save = pc;
+    pc = addr;
+    bool last = false;
+    Decoded d;
+    while (!last && b->n < MAX_BLOCK_INSNS && fetch(d)) {
+      Uop u;
+      u.d = d;
+      u.pc = pc;
+      u.fn = handler(u.d, last);
+      b->uops.push_back(u);
+      b->n++;
+      b->cycles += d.cycles;
+      pc += d.size;
+    }
+    if (!last) {
+      // 分岐で終わらない場合は次の命令のブロックに続ける
+      Uop u;
+      memset(&u, 0, sizeof(u));
+      u.fn = hNext;
+      u.pc = pc;
+      b->uops.push_back(u);
+    }
+    pc = save;
+    if (b->n == 0) {
+      return NULL;
+    }
+    for (uint32_t i = 0; i < b->n; i++) {
+      b->uops[i].left = b->n - i;
+    }
+    Block *p = b.get();
+    blocks[addr] = std::move(b);
+    return p;
+  }
+
+  const Uop *enterBlock(Block *b) {
+    if (retired + b->n > retiredEnd) {
+      return NULL;
+    }
+    retired += b->n;
+    cycles += b->cycles;
+    current = b;
+#if RV32_ASM_EMU_X64
+    if (translation && ++b->count == TRANSLATE_COUNT) {
+      translateBlock(b);
+    }
+#endif
+    return &b->uops[0];
+  }
+
+  // pc のブロックに進む(飛び先が一定の場合は link に覚える)
+  const Uop *enter(int i) {
+    Block *b = current->link[i];
+    if (b == NULL) {
+      b = findBlock(pc);
+      if (b == NULL) {
+        return NULL;
+      }
+      current->link[i] = b;
+    }
+    return enterBlock(b);
+  }
+  const Uop *enterIndirect() {
+    Block *b = findBlock(pc);
+    return (b == NULL) ? NULL : enterBlock(b);
+  }
+
+  // u の命令で停止する
+  const Uop *abort(const Uop *u, Stop stop) {
+    for (uint32_t i = 0; i < u->left; i++) {
+      retired--;
+      cycles -= u[i].d.cycles;
+    }
+    pc = u->pc;
+    blockStop = stop;
+    blockStopped = true;
+    return NULL;
+  }
+
+  const Uop *branch(const Uop *u, bool taken) {
+    if (taken) {
+      pc = u->pc + u->d.imm;
+      cycles += timing.taken;
+      return enter(1);
+    }
+    pc = u->pc + u->d.size;
+    return enter(0);
+  }
+
+  static const Uop *hNext(Emulator &e, const Uop *u) {
+    e.pc = u->pc;
+    return e.enter(0);
+  }
+
+  // 専用の関数がない命令は execute() で実行する
+  static const Uop *hGeneric(Emulator &e, const Uop *u) {
+    Stop stop;
+    e.pc = u->pc;
+    if (!e.execute(u->d, stop)) {
+      return e.abort(u, stop);
+    }
+    return u + 1;
+  }
+
+  // CSR 命令などブロックの最後に置く命令
+  // cycle や instret を読む場合に合わせて、この命令の分を数えずに実行する
+  static const Uop *hSystem(Emulator &e, const Uop *u) {
+    Stop stop;
+    e.pc = u->pc;
+    e.retired--;
+    e.cycles -= u->d.cycles;
+    if (!e.execute(u->d, stop)) {
+      e.blockStop = stop;
+      e.blockStopped = true;
+      return NULL;
+    }
+    e.retired++;
+    e.cycles += u->d.cycles;
+    if (u->d.op == OP_FENCE_I) {
+      e.flushRequested = true;
+      return NULL;
+    }
+    return e.enter(0);
+  }
+
+  template <typename T>
+  static const Uop *hLoad(Emulator &e, const Uop *u) {
+    T t;
+    if (!e.load(e.x[u->d.rs1] + u->d.imm, t)) {
+      return e.abort(u, STOP_FAULT);
+    }
+    e.x[u->d.rd] = uint32_t(t);
+    return u + 1;
+  }
+
+  template <typename T>
+  static const Uop *hStore(Emulator &e, const Uop *u) {
+    if (!e.store(e.x[u->d.rs1] + u->d.imm, T(e.x[u->d.rs2]))) {
+      return e.abort(u, STOP_FAULT);
+    }
+    return u + 1;
+  }
+
+  static const Uop *hJal(Emulator &e, const Uop *u) {
+    e.x[u->d.rd] = u->pc + u->d.size;
+    e.pc = u->pc + u->d.imm;
+    return e.enter(1);
+  }
+
+  static const Uop *hJalr(Emulator &e, const Uop *u) {
+    e.pc = (e.x[u->d.rs1] + u->d.imm) & ~1u;
+    e.x[u->d.rd] = u->pc + u->d.size;
+    return e.enterIndirect();
+  }
+
+#define RV32_EMU_UOP(name, expr)                     \
+  static const Uop *name(Emulator &e, const Uop *u) { \
+    const uint32_t a = e.x[u->d.rs1];                 \
+    const uint32_t b = e.x[u->d.rs2];                 \
+    const int32_t imm = u->d.imm;                     \
+    (void)a;                                          \
+    (void)b;                                          \
+    (void)imm;                                        \
+    e.x[u->d.rd] = (expr);                            \
+    return u + 1;                                     \
+  }
+#define RV32_EMU_UOP_BRANCH(name, cond)              \
+  static const Uop *name(Emulator &e, const Uop *u) { \
+    const uint32_t a = e.x[u->d.rs1];                 \
+    const uint32_t b = e.x[u->d.rs2];                 \
+    return e.branch(u, cond);                         \
+  }
+
+  RV32_EMU_UOP(hLui, uint32_t(imm))
+  RV32_EMU_UOP(hAuipc, u->pc + imm)
+  RV32_EMU_UOP(hAddi, a + imm)
+  RV32_EMU_UOP(hSlti, int32_t(a) < imm)
+  RV32_EMU_UOP(hSltiu, a < uint32_t(imm))
+  RV32_EMU_UOP(hXori, a ^ imm)
+  RV32_EMU_UOP(hOri, a | imm)
+  RV32_EMU_UOP(hAndi, a & imm)
+  RV32_EMU_UOP(hSlli, a << imm)
+  RV32_EMU_UOP(hSrli, a >> imm)
+  RV32_EMU_UOP(hSrai, uint32_t(int32_t(a) >> imm))
+  RV32_EMU_UOP(hAdd, a + b)
+  RV32_EMU_UOP(hSub, a - b)
+  RV32_EMU_UOP(hSll, a << (b & 31))
+  RV32_EMU_UOP(hSlt, int32_t(a) < int32_t(b))
+  RV32_EMU_UOP(hSltu, a < b)
+  RV32_EMU_UOP(hXor, a ^ b)
+  RV32_EMU_UOP(hSrl, a >> (b & 31))
+  RV32_EMU_UOP(hSra, uint32_t(int32_t(a) >> (b & 31)))
+  RV32_EMU_UOP(hOr, a | b)
+  RV32_EMU_UOP(hAnd, a & b)
+  RV32_EMU_UOP(hMul, a * b)
+  RV32_EMU_UOP(hMulh, mulh(a, b))
+  RV32_EMU_UOP(hMulhsu, mulhsu(a, b))
+  RV32_EMU_UOP(hMulhu, mulhu(a, b))
+  RV32_EMU_UOP(hDiv, div(a, b))
+  RV32_EMU_UOP(hDivu, divu(a, b))
+  RV32_EMU_UOP(hRem, rem(a, b))
+  RV32_EMU_UOP(hRemu, remu(a, b))
+  RV32_EMU_UOP_BRANCH(hBeq, a == b)
+  RV32_EMU_UOP_BRANCH(hBne, a != b)
+  RV32_EMU_UOP_BRANCH(hBlt, int32_t(a) < int32_t(b))
+  RV32_EMU_UOP_BRANCH(hBge, int32_t(a) >= int32_t(b))
+  RV32_EMU_UOP_BRANCH(hBltu, a < b)
+  RV32_EMU_UOP_BRANCH(hBgeu, a >= b)
+
+#undef RV32_EMU_UOP
+#undef RV32_EMU_UOP_BRANCH
+
+#if RV32_ASM_EMU_X64
+  //////////////////////////////////////////////////////////////////
+  // x86-64 の命令への変換
+  //
+  // 変換したコードは rbx にゲストのレジスタ x 、 r12 に Emulator を置き、
+  // ゲストのレジスタはメモリ上の x のまま読み書きする。
+  // 整数演算、ロード・ストア、分岐は x86-64 の命令にし、それ以外の命令は
+  // その Uop の関数を呼び出して実行する。 CSR 命令などブロックの最後に
+  // 置く命令は変換せず、 EXIT_INTERPRET で Uop の実行に戻る。
+  // 変換したブロックは先頭の Uop の関数を hNative に置き換える。
+  // 続くブロックも変換済みの場合は、 Emulator に戻らずにそのコードに進む。
+
+  typedef X64Code X;
+  enum { NATIVE_PROLOGUE = 10 };  // 続くブロックから進む場合に飛ばす入口
+
+  static const Uop *hNative(Emulator &e, const Uop *u) {
+    const uint64_t r = Native(e.current->native)(e.x, &e);
+    const uint32_t v = uint32_t(r);
+    (void)u;
+    switch (r >> 32) {
+      case EXIT_NEXT:
+        e.pc = v;
+        return e.enter(0);
+      case EXIT_TAKEN:
+        e.pc = v;
+        e.cycles += e.timing.taken;
+        return e.enter(1);
+      case EXIT_JUMP:
+        e.pc = v;
+        return e.enter(1);
+      case EXIT_INDIRECT:
+        e.pc = v;
+        return e.enterIndirect();
+      case EXIT_STOP:
+        return NULL;
+      default:
+        return &e.current->uops[v];
+    }
+  }
+
+  static X::Mem reg(int r) { return X::ptr(X::RBX, 4 * r); }
+  // 変換したコードから r12 で参照する Emulator のメンバー
+  X::Mem member(const void *p) const {
+    return X::ptr(X::R12, int32_t(static_cast<const char *>(p) -
+                                  reinterpret_cast<const char *>(this)));
+  }
+  static int32_t blockOffset(const Block &b, const void *p) {
+    return int32_t(static_cast<const char *>(p) -
+                   reinterpret_cast<const char *>(&b));
+  }
+
+  // kind と v を返してブロックを抜ける
+  static void exitNative(X64Code &c, uint32_t kind, uint32_t v,
+                         std::vector<size_t> &exits) {
+    c.movImm64(X::RAX, (uint64_t(kind) << 32) | v);
+    exits.push_back(c.jmp());
+  }
+
+  // rdx のブロックが変換済みで limit を超えなければ、そのコードに進む
+  // 進めない場合は slow に分岐する(rax は変更しない)
+  void chain(X64Code &c, const Block &b, uint32_t taken,
+             std::vector<size_t> &slow) {
+    c.test64(X::RDX, X::RDX);
+    slow.push_back(c.jcc(X::CC_E));
+    c.load64(X::RSI, X::ptr(X::RDX, blockOffset(b, &b.native)));
+    c.test64(X::RSI, X::RSI);
+    slow.push_back(c.jcc(X::CC_E));
+    c.load(X::RCX, X::ptr(X::RDX, blockOffset(b, &b.n)));
+    c.alu64(X::ADD, X::RCX, member(&retired));
+    c.alu64(X::CMP, X::RCX, member(&retiredEnd));
+    slow.push_back(c.jcc(X::CC_A));
+    c.store64(member(&retired), X::RCX);
+    c.load64(X::RCX, X::ptr(X::RDX, blockOffset(b, &b.cycles)));
+    if (taken != 0) {
+      c.aluImm64(X::ADD, X::RCX, int32_t(taken));
+    }
+    c.add64(member(&cycles), X::RCX);
+    c.store64(member(&current), X::RDX);
+    c.aluImm64(X::ADD, X::RSI, NATIVE_PROLOGUE);
+    c.jmp(X::RSI);
+  }
+
+  // 飛び先が一定の分岐で b のブロックを抜ける
+  void exitDirect(X64Code &c, Block *b, int link, uint32_t kind,
+                  uint32_t target, std::vector<size_t> &exits) {
+    std::vector<size_t> slow;
+    c.movImm64(X::RDX, uint64_t(uintptr_t(&b->link[link])));
+    c.load64(X::RDX, X::ptr(X::RDX));
+    chain(c, *b, (kind == EXIT_TAKEN) ? timing.taken : 0, slow);
+    for (size_t pos : slow) {
+      c.bind(pos);
+    }
+    exitNative(c, kind, target, exits);
+  }
+
+  // eax の pc に進む(jalr)
+  void exitIndirect(X64Code &c, const Block &b, std::vector<size_t> &exits) {
+    std::vector<size_t> slow;
+    c.mov(X::RCX, X::RAX);
+    c.shiftImm(X::SHR, X::RCX, 1);
+    c.aluImm(X::AND, X::RCX, BLOCK_TABLE_SIZE - 1);
+    c.load64(X::RDX, X::ptr(X::R12, X::RCX, 8, member(blockTable).disp));
+    c.test64(X::RDX, X::RDX);
+    slow.push_back(c.jcc(X::CC_E));
+    c.alu(X::CMP, X::RAX, X::ptr(X::RDX, blockOffset(b, &b.pc)));
+    slow.push_back(c.jcc(X::CC_NE));
+    chain(c, b, 0, slow);
+    for (size_t pos : slow) {
+      c.bind(pos);
+    }
+    c.movImm64(X::RCX, uint64_t(EXIT_INDIRECT) << 32);
+    c.or64(X::RAX, X::RCX);
+    exits.push_back(c.jmp());
+  }
+
+  // Uop の関数を呼び出す(NULL を返したら停止する)
+  static void callUop(X64Code &c, const Uop &u, std::vector<size_t> &exits) {
+    c.mov64(X::RDI, X::R12);
+    c.movImm64(X::RSI, uint64_t(uintptr_t(&u)));
+    c.movImm64(X::RAX, uint64_t(uintptr_t(u.fn)));
+    c.call(X::RAX);
+    c.test64(X::RAX, X::RAX);
+    const size_t next = c.jcc(X::CC_NE);
+    exitNative(c, EXIT_STOP, 0, exits);
+    c.bind(next);
+  }
+
+  // ロード・ストア
+  // ページ全体がマップされていれば変換表を引いて直接アクセスし、
+  // それ以外は Uop の関数を呼び出す
+  void translateMemory(X64Code &c, const Uop &u, int size, bool sign,
+                       bool write, std::vector<size_t> &exits) {
+    std::vector<size_t> slow;
+    c.load(X::RAX, reg(u.d.rs1));
+    if (u.d.imm != 0) {
+      c.aluImm(X::ADD, X::RAX, u.d.imm);
+    }
+    c.mov(X::RCX, X::RAX);
+    c.shiftImm(X::SHR, X::RCX, L2_SHIFT);
+    c.load64(X::RDX, X::ptr(X::R12, X::RCX, 8, member(l1).disp));
+    c.test64(X::RDX, X::RDX);
+    slow.push_back(c.jcc(X::CC_E));
+    c.mov(X::RCX, X::RAX);
+    c.shiftImm(X::SHR, X::RCX, PAGE_SHIFT);
+    c.aluImm(X::AND, X::RCX, (1 << (L2_SHIFT - PAGE_SHIFT)) - 1);
+    c.load64(X::RDX, X::ptr(X::RDX, X::RCX, 8,
+                            write ? int32_t(offsetof(L2, write)) : 0));
+    c.test64(X::RDX, X::RDX);
+    slow.push_back(c.jcc(X::CC_E));
+    c.mov(X::RCX, X::RAX);
+    c.aluImm(X::AND, X::RCX, PAGE_SIZE - 1);
+    if (size > 1) {
+      c.aluImm(X::CMP, X::RCX, PAGE_SIZE - size);
+      slow.push_back(c.jcc(X::CC_A));
+    }
+    const X::Mem m = X::ptr(X::RDX, X::RCX, 1);
+    if (write) {
+      c.load(X::RAX, reg(u.d.rs2));
+      if (size == 1) {
+        c.store8(m, X::RAX);
+      } else if (size == 2) {
+        c.store16(m, X::RAX);
+      } else {
+        c.store(m, X::RAX);
+      }
+    } else {
+      if (size == 1) {
+        c.load8(X::RAX, m, sign);
+      } else if (size == 2) {
+        c.load16(X::RAX, m, sign);
+      } else {
+        c.load(X::RAX, m);
+      }
+      c.store(reg(u.d.rd), X::RAX);
+    }
+    const size_t done = c.jmp();
+    for (size_t pos : slow) {
+      c.bind(pos);
+    }
+    callUop(c, u, exits);
+    c.bind(done);
+  }
+
+  // b の idx 番目の命令を変換する
+  // ブロックを抜ける命令の場合は true を返す
+  bool translateUop(X64Code &c, Block *b, uint32_t idx,
+                    std::vector<size_t> &exits) {
+    const Uop &u = b->uops[idx];
+    const X::Mem rd = reg(u.d.rd);
+    const X::Mem rs1 = reg(u.d.rs1);
+    const X::Mem rs2 = reg(u.d.rs2);
+    const int32_t imm = u.d.imm;
+    if (u.fn == hSystem) {
+      exitNative(c, EXIT_INTERPRET, idx, exits);
+      return true;
+    }
+    if (u.fn == hNext) {
+      exitDirect(c, b, 0, EXIT_NEXT, u.pc, exits);
+      return true;
+    }
+    static const X::Alu aluImm[] = {X::ADD, X::CMP, X::CMP,
+                                    X::XOR, X::OR,  X::AND};
+    static const X::Alu alu[] = {X::ADD, X::SUB, X::ADD, X::CMP, X::CMP,
+                                 X::XOR, X::ADD, X::ADD, X::OR,  X::AND};
+    static const X::Shift shift[] = {X::SHL, X::SHR, X::SAR};
+    static const X::Cond cond[] = {X::CC_E,  X::CC_NE, X::CC_L,
+                                   X::CC_GE, X::CC_B,  X::CC_AE};
+    switch (u.d.op) {
+      case OP_LUI:
+        c.storeImm(rd, uint32_t(imm));
+        return false;
+      case OP_AUIPC:
+        c.storeImm(rd, u.pc + imm);
+        return false;
+      case OP_ADDI:
+      case OP_XORI:
+      case OP_ORI:
+      case OP_ANDI:
+        c.load(X::RAX, rs1);
+        c.aluImm(aluImm[u.d.op - OP_ADDI], X::RAX, imm);
+        c.store(rd, X::RAX);
+        return false;
+      case OP_SLTI:
+      case OP_SLTIU:
+        c.load(X::RAX, rs1);
+        c.zero(X::RCX);
+        c.aluImm(X::CMP, X::RAX, imm);
+        c.setcc(u.d.op == OP_SLTI ? X::CC_L : X::CC_B, X::RCX);
+        c.store(rd, X::RCX);
+        return false;
+      case OP_SLLI:
+      case OP_SRLI:
+      case OP_SRAI:
+        c.load(X::RAX, rs1);
+        c.shiftImm(shift[u.d.op - OP_SLLI], X::RAX, imm);
+        c.store(rd, X::RAX);
+        return false;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_XOR:
+      case OP_OR:
+      case OP_AND:
+        c.load(X::RAX, rs1);
+        c.alu(alu[u.d.op - OP_ADD], X::RAX, rs2);
+        c.store(rd, X::RAX);
+        return false;
+      case OP_SLL:
+      case OP_SRL:
+      case OP_SRA:
+        c.load(X::RCX, rs2);
+        c.load(X::RAX, rs1);
+        c.shiftCl(u.d.op == OP_SLL   ? X::SHL
+                  : u.d.op == OP_SRL ? X::SHR
+                                     : X::SAR,
+                  X::RAX);
+        c.store(rd, X::RAX);
+        return false;
+      case OP_SLT:
+      case OP_SLTU:
+        c.load(X::RAX, rs1);
+        c.zero(X::RCX);
+        c.alu(X::CMP, X::RAX, rs2);
+        c.setcc(u.d.op == OP_SLT ? X::CC_L : X::CC_B, X::RCX);
+        c.store(rd, X::RCX);
+        return false;
+      case OP_MUL:
+        c.load(X::RAX, rs1);
+        c.imul(X::RAX, rs2);
+        c.store(rd, X::RAX);
+        return false;
+      case OP_MULH:
+      case OP_MULHU:
+        c.load(X::RAX, rs1);
+        c.mulWide(u.d.op == OP_MULH, rs2);
+        c.store(rd, X::RDX);
+        return false;
+      case OP_LB:
+      case OP_LBU:
+        translateMemory(c, u, 1, u.d.op == OP_LB, false, exits);
+        return false;
+      case OP_LH:
+      case OP_LHU:
+        translateMemory(c, u, 2, u.d.op == OP_LH, false, exits);
+        return false;
+      case OP_LW:
+        translateMemory(c, u, 4, false, false, exits);
+        return false;
+      case OP_SB:
+        translateMemory(c, u, 1, false, true, exits);
+        return false;
+      case OP_SH:
+        translateMemory(c, u, 2, false, true, exits);
+        return false;
+      case OP_SW:
+        translateMemory(c, u, 4, false, true, exits);
+        return false;
+      case OP_BEQ:
+      case OP_BNE:
+      case OP_BLT:
+      case OP_BGE:
+      case OP_BLTU:
+      case OP_BGEU: {
+        c.load(X::RAX, rs1);
+        c.alu(X::CMP, X::RAX, rs2);
+        const size_t taken = c.jcc(cond[u.d.op - OP_BEQ]);
+        exitDirect(c, b, 0, EXIT_NEXT, u.pc + u.d.size, exits);
+        c.bind(taken);
+        exitDirect(c, b, 1, EXIT_TAKEN, u.pc + imm, exits);
+        return true;
+      }
+      case OP_JAL:
+        c.storeImm(rd, u.pc + u.d.size);
+        exitDirect(c, b, 1, EXIT_JUMP, u.pc + imm, exits);
+        return true;
+      case OP_JALR:
+        c.load(X::RAX, rs1);
+        c.aluImm(X::ADD, X::RAX, imm);
+        c.aluImm(X::AND, X::RAX, -2);
+        c.storeImm(rd, u.pc + u.d.size);
+        exitIndirect(c, *b, exits);
+        return true;
+      default:
+        callUop(c, u, exits);
+        return false;
+    }
+  }
+
+  void translateBlock(Block *b) {
+    if (b->uops[0].fn == hSystem) {
+      return;
+    }
+    X64Code &c = x64;
+    std::vector<size_t> exits;
+    c.clear();
+    // 関数の入口で rsp は 16 の倍数 + 8 なので、3つ積むと揃う
+    c.push(X::RBX);
+    c.push(X::R12);
+    c.push(X::RBP);
+    c.mov64(X::RBX, X::RDI);
+    c.mov64(X::R12, X::RSI);
+    assert(c.size() == NATIVE_PROLOGUE);
+    for (uint32_t i = 0; i < b->uops.size(); i++) {
+      if (translateUop(c, b, i, exits)) {
+        break;
+      }
+    }
+    for (size_t pos : exits) {
+      c.bind(pos);
+    }
+    c.pop(X::RBP);
+    c.pop(X::R12);
+    c.pop(X::RBX);
+    c.ret();
+
+    const CodeArena::Block mem = arena->allocate(c.size());
+    if (mem.exec == NULL) {
+      return;
+    }
+    arena->beginWrite(mem);
+    memcpy(mem.code, c.data(), c.size());
+    arena->endWrite(mem);
+    b->native = mem.exec;
+    b->uops[0].fn = hNative;
+    translated++;
+  }
+#endif
+
+  // 命令を実行する関数を選ぶ
+  // ブロックの最後に置く命令の場合は last を true にする
+  static Handler handler(Decoded &d, bool &last) {
+    static const Handler table[] = {
+        hLui, hAuipc, hJal, hJalr,
+        hBeq, hBne, hBlt, hBge, hBltu, hBgeu,
+        hLoad<int8_t>, hLoad<int16_t>, hLoad<uint32_t>,
+        hLoad<uint8_t>, hLoad<uint16_t>,
+        hStore<uint8_t>, hStore<uint16_t>, hStore<uint32_t>,
+        hAddi, hSlti, hSltiu, hXori, hOri, hAndi,
+        hSlli, hSrli, hSrai,
+        hAdd, hSub, hSll, hSlt, hSltu,
+        hXor, hSrl, hSra, hOr, hAnd,
+    };
+    static_assert(sizeof(table) / sizeof(table[0]) == OP_AND - OP_LUI + 1,
+                  "table must follow Op");
+    static const Handler mulTable[] = {
+        hMul, hMulh, hMulhsu, hMulhu, hDiv, hDivu, hRem, hRemu,
+    };
+    const unsigned int op = d.op;
+    last = (op >= OP_JAL && op <= OP_BGEU) ||
+           (op >= OP_FENCE_I && op <= OP_CSRRCI) || op == OP_ILLEGAL;
+    if (last && op > OP_BGEU) {
+      return hSystem;
+    }
+    Handler h = hGeneric;
+    if (op >= OP_LUI && op <= OP_AND) {
+      h = table[op - OP_LUI];
+    } else if (op >= OP_MUL && op <= OP_REMU) {
+      h = mulTable[op - OP_MUL];
+    }
+    // 専用の関数では x0 への書き込みを x[32] に向ける
+    if (h != hGeneric && d.rd == 0) {
+      d.rd = 32;
+    }
+    return h;
+  }
+
+ public:
+  Emulator()
+      : pc(0),
+        frm(0),
+        fflags(0),
+        reservation(0),
+        reserved(false),
+        retired(0),
+        cycles(0),
+        faultAddress(0),
+        current(NULL),
+        retiredEnd(0),
+        blockStop(STOP_LIMIT),
+        blockStopped(false),
+        flushRequested(false),
+        translation(false),
+        translated(0) {
+    const Timing t = {1, 3, 34, 2, 1, 1, 2, 4, 20};
+    timing = t;
+    memset(x, 0, sizeof(x));
+    memset(f, 0, sizeof(f));
+    memset(blockTable, 0, sizeof(blockTable));
+    memset(l1, 0, sizeof(l1));
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // メモリのマップ
+
+  // ホストの size バイトの領域 host をゲストのアドレス addr にマップする
+  // 領域はエミュレータより長く存在している必要がある
+  bool map(uint32_t addr, void *host, size_t size, bool writable = true) {
+    if (size == 0 || uint64_t(addr) + size > (uint64_t(1) << 32)) {
+      return false;
+    }
+    const Region r = {addr, size, static_cast<unsigned char *>(host), writable};
+    regions.push_back(r);
+    flush();
+
+    // ページ全体を覆う部分だけ変換表に登録する
+    const uint64_t end = uint64_t(addr) + size;
+    const uint64_t first =
+        (uint64_t(addr) + PAGE_SIZE - 1) & ~uint64_t(PAGE_SIZE - 1);
+    for (uint64_t page = first; page + PAGE_SIZE <= end; page += PAGE_SIZE) {
+      L2 *&t = l1[page >> L2_SHIFT];
+      if (t == NULL) {
+        t = new L2();
+        l2s.push_back(std::unique_ptr<L2>(t));
+      }
+      const uint32_t idx =
+          (page >> PAGE_SHIFT) & ((1 << (L2_SHIFT - PAGE_SHIFT)) - 1);
+      t->read[idx] = r.host + (page - addr);
+      t->write[idx] = writable ? t->read[idx] : NULL;
+    }
+    return true;
+  }
+
+  // ゲストのアドレス addr に size バイトの領域を確保して、
+  // 先頭のホストのアドレスを返す
+  // 確保した領域は0で初期化され、エミュレータと共に解放される
+  unsigned char *allocate(uint32_t addr, size_t size, bool writable = true) {
+    std::unique_ptr<unsigned char[]> mem(new unsigned char[size]());
+    unsigned char *p = mem.get();
+    if (!map(addr, p, size, writable)) {
+      return NULL;
+    }
+    owned.push_back(std::move(mem));
+    return p;
+  }
+
+  // code をコピーした読み出し専用の領域をゲストのアドレス addr に用意する
+  bool load(uint32_t addr, const void *code, size_t size) {
+    unsigned char *p = allocate(addr, size, false);
+    if (p == NULL) {
+      return false;
+    }
+    memcpy(p, code, size);
+    return true;
+  }
+
+  // スタックを確保して sp を設定する
+  bool setStack(uint32_t top, size_t size) {
+    if (allocate(top - uint32_t(size), size) == NULL) {
+      return false;
+    }
+    x[2] = top;
+    return true;
+  }
+
+  // ゲストのアドレス addr へのジャンプでホストの関数 fn を呼び出すようにする
+  // addr はマップされていないアドレスにすること
+  void addHostCall(uint32_t addr, HostCall fn, void *user = NULL) {
+    const HostCallEntry h = {addr, fn, user};
+    hostCalls.push_back(h);
+    flush();
+  }
+
+  // ゲストのアドレスに対応するホストのアドレス(マップされていない場合は NULL)
+  unsigned char *translate(uint32_t addr, size_t size = 1) {
+    return hostPtr(addr, size, false);
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // レジスタ
+
+  uint32_t getReg(int idx) const { return x[idx & 31]; }
+  void setReg(int idx, uint32_t v) {
+    x[idx & 31] = v;
+    x[0] = 0;
+  }
+  uint32_t getReg(const Reg &r) const { return getReg(r.getIdx()); }
+  void setReg(const Reg &r, uint32_t v) { setReg(r.getIdx(), v); }
+
+  float getFloat(int idx) const { return getS(idx & 31); }
+  double getDouble(int idx) const { return getD(idx & 31); }
+  void setFloat(int idx, float v) { setSBits(idx & 31, asBits(v)); }
+  void setDouble(int idx, double v) { f[idx & 31] = asBits(v); }
+
+  uint32_t getPC() const { return pc; }
+  void setPC(uint32_t addr) { pc = addr; }
+
+  //////////////////////////////////////////////////////////////////
+  // 実行
+
+  // 命令の種類ごとのサイクル数を設定する
+  void setTiming(const Timing &t) {
+    timing = t;
+    flush();
+  }
+  const Timing &getTiming() const { return timing; }
+
+  // pc から最大 limit 命令を実行する(0 の場合は停止するまで)
+  Stop run(uint64_t limit = 0) {
+    Stop stop = STOP_LIMIT;
+    retiredEnd = (limit == 0) ? std::numeric_limits<uint64_t>::max()
+                              : retired + limit;
+    while (retired < retiredEnd) {
+      Block *b = findBlock(pc);
+      if (b == NULL || retired + b->n > retiredEnd) {
+        // ホスト関数の呼び出しと、 limit までの残りの命令は1命令ずつ処理する
+        if (!step(stop)) {
+          return stop;
+        }
+        continue;
+      }
+      blockStopped = false;
+      const Uop *u = enterBlock(b);
+      while (u != NULL) {
+        u = u->fn(*this, u);
+      }
+      if (blockStopped) {
+        return blockStop;
+      }
+      if (flushRequested) {
+        flush();
+      }
+    }
+    return STOP_LIMIT;
+  }
+
+  // キャッシュしたデコード済みの命令を捨てる
+  // 書き込みできる領域のコードを書き換えた場合に呼ぶこと
+  // (ゲストが fence.i を実行した場合も捨てる)
+  void flush() {
+#if RV32_ASM_EMU_X64
+    for (auto &it : blocks) {
+      if (it.second->native != NULL) {
+        arena->release(it.second->native);
+      }
+    }
+#endif
+    blocks.clear();
+    memset(blockTable, 0, sizeof(blockTable));
+    current = NULL;
+    flushRequested = false;
+  }
+
+  // entry の関数を呼び出し、戻るまで実行する
+  // 引数はあらかじめ setReg() で a0 以降に設定しておくこと
+  Stop call(uint32_t entry, uint64_t limit = 0) {
+    x[1] = RETURN_ADDRESS;
+    pc = entry;
+    return run(limit);
+  }
+
+  // よく実行するブロックを x86-64 の命令に変換して実行するか
+  // x86-64 以外のホストでは変換できないので false を返す
+  bool setTranslation(bool enable) {
+#if RV32_ASM_EMU_X64
+    if (enable && !arena) {
+      arena.reset(new CodeArena());
+    }
+    translation = enable;
+    flush();
+    return true;
+#else
+    return !enable;
+#endif
+  }
+  bool getTranslation() const { return translation; }
+  // 変換したブロックの数
+  size_t getTranslated() const { return translated; }
+
+  // 実行した命令の数
+  uint64_t getRetired() const { return retired; }
+  // Timing に従って数えたサイクル数
+  uint64_t getCycles() const { return cycles; }
+  void resetCounters() {
+    retired = 0;
+    cycles = 0;
+  }
+
+  // STOP_FAULT で停止した場合の、アクセスしようとしたアドレス
+  uint32_t getFaultAddress() const { return faultAddress; }
+
+  // pc の命令をデコードする(デバッグ用)
+  bool decode(uint32_t addr, Decoded &d) {
+    const uint32_t save = pc;
+    pc = addr;
+    const bool ok = fetch(d);
+    pc = save;
+    return ok;
+  }
+};
+
+};  // namespace RV32_asm
+
+#endif
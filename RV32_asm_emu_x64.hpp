@@ -0,0 +1,283 @@
+#ifndef RV32_ASM_EMU_X64_HPP_INCLUDED
+#define RV32_ASM_EMU_X64_HPP_INCLUDED
+
+#include <cstdint>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// エミュレータでゲストのコードを x86-64 の命令に変換するための、
+// 最小限の x86-64 のアセンブラ
+//
+// 変換で使う形の命令だけを用意している。
+
+namespace RV32_asm {
+namespace internal {
+
+class X64Code {
+ public:
+  enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    NONE = -1
+  };
+  // 0x81 /n と 0x03 + 8 * n の n
+  enum Alu { ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+  // 0xc1 /n と 0xd3 /n の n
+  enum Shift { SHL = 4, SHR = 5, SAR = 7 };
+  // 条件コード
+  enum Cond {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+    CC_L = 0xc, CC_GE = 0xd
+  };
+
+  // [base + index * scale + disp] のメモリのオペランド
+  struct Mem {
+    Reg base;
+    Reg index;
+    int scale;  // 1, 2, 4, 8
+    int32_t disp;
+  };
+  static Mem ptr(Reg base, int32_t disp = 0) {
+    const Mem m = {base, NONE, 1, disp};
+    return m;
+  }
+  static Mem ptr(Reg base, Reg index, int scale, int32_t disp = 0) {
+    const Mem m = {base, index, scale, disp};
+    return m;
+  }
+
+ private:
+  std::vector<uint8_t> buf;
+
+  X64Code(const X64Code &);
+  void operator=(const X64Code &);
+
+  void rex(bool w, int reg, int index, int base) {
+    const uint8_t r = uint8_t(0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) |
+                              ((index >> 3) << 1) | (base >> 3));
+    if (r != 0x40) {
+      db(r);
+    }
+  }
+  void rex(bool w, int reg, const Mem &m) {
+    rex(w, reg, m.index == NONE ? 0 : m.index, m.base);
+  }
+  // m を指す ModR/M と SIB と変位
+  void modrm(int reg, const Mem &m) {
+    const uint8_t r = uint8_t((reg & 7) << 3);
+    const bool sib = m.index != NONE || (m.base & 7) == RSP;
+    const bool noDisp = m.disp == 0 && (m.base & 7) != RBP;
+    const bool disp8 = m.disp >= -128 && m.disp <= 127;
+    const uint8_t mod = noDisp ? 0x00 : disp8 ? 0x40 : 0x80;
+    db(mod | r | (sib ? 4 : (m.base & 7)));
+    if (sib) {
+      static const uint8_t ss[] = {0, 0, 1, 0, 2, 0, 0, 0, 3};
+      const int index = (m.index == NONE) ? RSP : m.index;
+      db(uint8_t((ss[m.scale] << 6) | ((index & 7) << 3) | (m.base & 7)));
+    }
+    if (noDisp) {
+      return;
+    }
+    if (disp8) {
+      db(uint8_t(m.disp));
+    } else {
+      dd(uint32_t(m.disp));
+    }
+  }
+  void modrmReg(int reg, int rm) {
+    db(uint8_t(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+  }
+  // op reg, m (op は1バイトまたは 0x0f に続く2バイト)
+  void opMem(bool w, int op, int reg, const Mem &m) {
+    rex(w, reg, m);
+    if (op > 0xff) {
+      db(uint8_t(op >> 8));
+    }
+    db(uint8_t(op));
+    modrm(reg, m);
+  }
+
+ public:
+  X64Code() {}
+
+  void clear() { buf.clear(); }
+  size_t size() const { return buf.size(); }
+  const uint8_t *data() const { return buf.data(); }
+
+  void db(uint8_t v) { buf.push_back(v); }
+  void dd(uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+      db(uint8_t(v >> (i * 8)));
+    }
+  }
+  void dq(uint64_t v) {
+    dd(uint32_t(v));
+    dd(uint32_t(v >> 32));
+  }
+
+  // mov r32, m
+  void load(Reg r, const Mem &m) { opMem(false, 0x8b, r, m); }
+  // mov r64, m
+  void load64(Reg r, const Mem &m) { opMem(true, 0x8b, r, m); }
+  // movzx / movsx r32, byte / word m
+  void load8(Reg r, const Mem &m, bool sign) {
+    opMem(false, sign ? 0x0fbe : 0x0fb6, r, m);
+  }
+  void load16(Reg r, const Mem &m, bool sign) {
+    opMem(false, sign ? 0x0fbf : 0x0fb7, r, m);
+  }
+  // mov m, r32 / r64
+  void store(const Mem &m, Reg r) { opMem(false, 0x89, r, m); }
+  void store64(const Mem &m, Reg r) { opMem(true, 0x89, r, m); }
+  // mov m, r8 / r16 (r は RAX から RBX まで)
+  void store8(const Mem &m, Reg r) { opMem(false, 0x88, r, m); }
+  void store16(const Mem &m, Reg r) {
+    db(0x66);
+    opMem(false, 0x89, r, m);
+  }
+  // mov dword m, imm
+  void storeImm(const Mem &m, uint32_t imm) {
+    opMem(false, 0xc7, 0, m);
+    dd(imm);
+  }
+  // op r32, m
+  void alu(Alu op, Reg r, const Mem &m) { opMem(false, 0x03 + 8 * op, r, m); }
+  // op r64, m
+  void alu64(Alu op, Reg r, const Mem &m) {
+    opMem(true, 0x03 + 8 * op, r, m);
+  }
+  // add m, r64
+  void add64(const Mem &m, Reg r) { opMem(true, 0x01, r, m); }
+  // op r32, imm
+  void aluImm(Alu op, Reg r, int32_t imm) {
+    rex(false, 0, 0, r);
+    if (imm >= -128 && imm <= 127) {
+      db(0x83);
+      modrmReg(op, r);
+      db(uint8_t(imm));
+    } else {
+      db(0x81);
+      modrmReg(op, r);
+      dd(uint32_t(imm));
+    }
+  }
+  // op r64, imm
+  void aluImm64(Alu op, Reg r, int32_t imm) {
+    rex(true, 0, 0, r);
+    db(0x81);
+    modrmReg(op, r);
+    dd(uint32_t(imm));
+  }
+  // shift r32, imm
+  void shiftImm(Shift op, Reg r, int imm) {
+    rex(false, 0, 0, r);
+    db(0xc1);
+    modrmReg(op, r);
+    db(uint8_t(imm));
+  }
+  // shift r32, cl
+  void shiftCl(Shift op, Reg r) {
+    rex(false, 0, 0, r);
+    db(0xd3);
+    modrmReg(op, r);
+  }
+  // mov r32, r32
+  void mov(Reg dst, Reg src) {
+    rex(false, src, 0, dst);
+    db(0x89);
+    modrmReg(src, dst);
+  }
+  // mov r32, imm
+  void movImm(Reg r, uint32_t imm) {
+    rex(false, 0, 0, r);
+    db(uint8_t(0xb8 + (r & 7)));
+    dd(imm);
+  }
+  // mov r64, imm
+  void movImm64(Reg r, uint64_t imm) {
+    rex(true, 0, 0, r);
+    db(uint8_t(0xb8 + (r & 7)));
+    dq(imm);
+  }
+  // mov r64, r64
+  void mov64(Reg dst, Reg src) {
+    rex(true, src, 0, dst);
+    db(0x89);
+    modrmReg(src, dst);
+  }
+  // or r64, r64
+  void or64(Reg dst, Reg src) {
+    rex(true, src, 0, dst);
+    db(0x09);
+    modrmReg(src, dst);
+  }
+  // test r64, r64
+  void test64(Reg a, Reg b) {
+    rex(true, b, 0, a);
+    db(0x85);
+    modrmReg(b, a);
+  }
+  // xor r32, r32
+  void zero(Reg r) {
+    rex(false, r, 0, r);
+    db(0x31);
+    modrmReg(r, r);
+  }
+  // setcc r8 (RAX から RBX まで)
+  void setcc(Cond cc, Reg r) {
+    db(0x0f);
+    db(uint8_t(0x90 + cc));
+    modrmReg(0, r);
+  }
+  // imul r32, m
+  void imul(Reg r, const Mem &m) { opMem(false, 0x0faf, r, m); }
+  // mul / imul dword m (edx:eax = eax * m)
+  void mulWide(bool sign, const Mem &m) { opMem(false, 0xf7, sign ? 5 : 4, m); }
+  void push(Reg r) {
+    rex(false, 0, 0, r);
+    db(uint8_t(0x50 + (r & 7)));
+  }
+  void pop(Reg r) {
+    rex(false, 0, 0, r);
+    db(uint8_t(0x58 + (r & 7)));
+  }
+  // call r64
+  void call(Reg r) {
+    rex(false, 0, 0, r);
+    db(0xff);
+    modrmReg(2, r);
+  }
+  // jmp r64
+  void jmp(Reg r) {
+    rex(false, 0, 0, r);
+    db(0xff);
+    modrmReg(4, r);
+  }
+  void ret() { db(0xc3); }
+
+  // 飛び先を後で決める分岐
+  // 戻り値の位置を bind() に渡して飛び先を決める
+  size_t jcc(Cond cc) {
+    db(0x0f);
+    db(uint8_t(0x80 + cc));
+    dd(0);
+    return buf.size();
+  }
+  size_t jmp() {
+    db(0xe9);
+    dd(0);
+    return buf.size();
+  }
+  // jcc() / jmp() の飛び先を現在の位置にする
+  void bind(size_t pos) {
+    const uint32_t rel = uint32_t(buf.size() - pos);
+    for (int i = 0; i < 4; i++) {
+      buf[pos - 4 + i] = uint8_t(rel >> (i * 8));
+    }
+  }
+};
+
+}  // namespace internal
+}  // namespace RV32_asm
+
+#endif
@@ -65,7 +65,7 @@ class CodeGenerator32Float : public virtual Base, public T {
     assert(-2048 <= imm && imm <= 2047);
     uint32_t op =
         (imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | 0b0000111;
-    env << [=](Env &e) { e.dw(op, s); };
+    env.dw(op, s);
   }
 
   // メモリ<-レジスタ
@@ -74,7 +74,7 @@ class CodeGenerator32Float : public virtual Base, public T {
     assert(-2048 <= imm && imm <= 2047);
     uint32_t op = ((imm & 0xfe0) << 20) | (rs2 << 20) | (rs1 << 15) |
                   (funct3 << 12) | ((imm & 0x01f) << 7) | 0b0100111;
-    env << [=](Env &e) { e.dw(op, s); };
+    env.dw(op, s);
   }
 
   // 浮動小数点系の演算命令
@@ -82,7 +82,7 @@ class CodeGenerator32Float : public virtual Base, public T {
           const int rs2, const int rs3, RoundingMode rm, const char *s) {
     uint32_t op = (rs3 << 27) | (pr << 25) | (rs2 << 20) | (rs1 << 15) |
                   (rm & 0b111) << 12 | (rd << 7) | opcode;
-    env << [=](Env &e) { e.dw(op, s); };
+    env.dw(op, s);
   }
 
   // rdが浮動小数点数レジスタのケース
@@ -138,14 +138,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1000011, rd, rs1, rs2, rs3, rm, "FMADD.S");
+      parent().F(0b1000011, rd, rs1, rs2, rs3, rm, "FMADD.S");
     }
 
     // fmadd.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1000011, rd, rs1, rs2, rs3, rm, "FMADD.D");
+      parent().D(0b1000011, rd, rs1, rs2, rs3, rm, "FMADD.D");
     }
   };
 
@@ -157,14 +157,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1000111, rd, rs1, rs2, rs3, rm, "FMSUB.S");
+      parent().F(0b1000111, rd, rs1, rs2, rs3, rm, "FMSUB.S");
     }
 
     // fmsub.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1000111, rd, rs1, rs2, rs3, rm, "FMSUB.D");
+      parent().D(0b1000111, rd, rs1, rs2, rs3, rm, "FMSUB.D");
     }
   };
 
@@ -176,14 +176,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1001011, rd, rs1, rs2, rs3, rm, "FNMSUB.S");
+      parent().F(0b1001011, rd, rs1, rs2, rs3, rm, "FNMSUB.S");
     }
 
     // fnmsub.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1001011, rd, rs1, rs2, rs3, rm, "FNMSUB.D");
+      parent().D(0b1001011, rd, rs1, rs2, rs3, rm, "FNMSUB.D");
     }
   };
 
@@ -195,14 +195,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1001111, rd, rs1, rs2, rs3, rm, "FNMADD.S");
+      parent().F(0b1001111, rd, rs1, rs2, rs3, rm, "FNMADD.S");
     }
 
     // fnmadd.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2, const FReg &rs3,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1001111, rd, rs1, rs2, rs3, rm, "FNMADD.D");
+      parent().D(0b1001111, rd, rs1, rs2, rs3, rm, "FNMADD.D");
     }
   };
 
@@ -214,14 +214,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, rs2, parent.f0, rm, "FADD.S");
+      parent().F(0b1010011, rd, rs1, rs2, f0, rm, "FADD.S");
     }
 
     // fadd.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, rs2, parent.f0, rm, "FADD.D");
+      parent().D(0b1010011, rd, rs1, rs2, f0, rm, "FADD.D");
     }
   };
 
@@ -233,14 +233,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, rs2, parent.f1, rm, "FSUB.S");
+      parent().F(0b1010011, rd, rs1, rs2, f1, rm, "FSUB.S");
     }
 
     // fsub.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, rs2, parent.f1, rm, "FSUB.D");
+      parent().D(0b1010011, rd, rs1, rs2, f1, rm, "FSUB.D");
     }
   };
 
@@ -252,14 +252,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, rs2, parent.f2, rm, "FMUL.S");
+      parent().F(0b1010011, rd, rs1, rs2, f2, rm, "FMUL.S");
     }
 
     // fmul.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, rs2, parent.f2, rm, "FMUL.D");
+      parent().D(0b1010011, rd, rs1, rs2, f2, rm, "FMUL.D");
     }
   };
 
@@ -271,14 +271,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, rs2, parent.f3, rm, "FDIV.S");
+      parent().F(0b1010011, rd, rs1, rs2, f3, rm, "FDIV.S");
     }
 
     // fdiv.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, rs2, parent.f3, rm, "FDIV.D");
+      parent().D(0b1010011, rd, rs1, rs2, f3, rm, "FDIV.D");
     }
   };
 
@@ -290,14 +290,14 @@ class CodeGenerator32Float : public virtual Base, public T {
     void s(const FReg &rd, const FReg &rs1,
            RoundingMode rm = RoundingMode::dyn) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, parent.f0, parent.f11, rm, "FSQRT.S");
+      parent().F(0b1010011, rd, rs1, f0, f11, rm, "FSQRT.S");
     }
 
     // fsqrt.d
     void d(const FReg &rd, const FReg &rs1,
            RoundingMode rm = RoundingMode::dyn) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, parent.f0, parent.f11, rm, "FSQRT.D");
+      parent().D(0b1010011, rd, rs1, f0, f11, rm, "FSQRT.D");
     }
   };
 
@@ -312,7 +312,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       if (rs1 == rs2) {
         msg = "FMV.S";
       }
-      parent.F(0b1010011, rd, rs1, rs2, parent.f4, rne, msg);
+      parent().F(0b1010011, rd, rs1, rs2, f4, rne, msg);
     }
 
     // fsgnj.d
@@ -323,7 +323,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       if (rs1 == rs2) {
         msg = "FMV.D";
       }
-      parent.D(0b1010011, rd, rs1, rs2, parent.f4, rne, msg);
+      parent().D(0b1010011, rd, rs1, rs2, f4, rne, msg);
     }
   };
 
@@ -338,7 +338,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       if (rs1 == rs2) {
         msg = "FNEG.S";
       }
-      parent.F(0b1010011, rd, rs1, rs2, parent.f4, rtz, msg);
+      parent().F(0b1010011, rd, rs1, rs2, f4, rtz, msg);
     }
 
     // fsgnjn.d
@@ -348,7 +348,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       if (rs1 == rs2) {
         msg = "FNEG.D";
       }
-      parent.D(0b1010011, rd, rs1, rs2, parent.f4, rtz, msg);
+      parent().D(0b1010011, rd, rs1, rs2, f4, rtz, msg);
     }
   };
 
@@ -363,7 +363,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       if (rs1 == rs2) {
         msg = "FABS.S";
       }
-      parent.F(0b1010011, rd, rs1, rs2, parent.f4, rdn, msg);
+      parent().F(0b1010011, rd, rs1, rs2, f4, rdn, msg);
     }
 
     // fsgnjx.d
@@ -373,7 +373,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       if (rs1 == rs2) {
         msg = "FABS.D";
       }
-      parent.D(0b1010011, rd, rs1, rs2, parent.f4, rdn, msg);
+      parent().D(0b1010011, rd, rs1, rs2, f4, rdn, msg);
     }
   };
 
@@ -384,13 +384,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     // fmin.s
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, rs2, parent.f5, rne, "FMIN.S");
+      parent().F(0b1010011, rd, rs1, rs2, f5, rne, "FMIN.S");
     }
 
     // fmin.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, rs2, parent.f5, rne, "FMIN.D");
+      parent().D(0b1010011, rd, rs1, rs2, f5, rne, "FMIN.D");
     }
   };
 
@@ -401,13 +401,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     // fmax.s
     void s(const FReg &rd, const FReg &rs1, const FReg &rs2) {
       IS_FLOAT_ONLY;
-      parent.F(0b1010011, rd, rs1, rs2, parent.f5, rtz, "FMAX.S");
+      parent().F(0b1010011, rd, rs1, rs2, f5, rtz, "FMAX.S");
     }
 
     // fmax.d
     void d(const FReg &rd, const FReg &rs1, const FReg &rs2) {
       IS_DOUBLE_ONLY;
-      parent.D(0b1010011, rd, rs1, rs2, parent.f5, rtz, "FMAX.D");
+      parent().D(0b1010011, rd, rs1, rs2, f5, rtz, "FMAX.D");
     }
   };
 
@@ -423,14 +423,14 @@ class CodeGenerator32Float : public virtual Base, public T {
       void s(const Reg &rd, const FReg &rs1,
              RoundingMode rm = RoundingMode::dyn) {
         IS_FLOAT_ONLY;
-        parent.Fr(0b1010011, rd, rs1, parent.f0, parent.f24, rm, "FCVT.W.S");
+        parent().Fr(0b1010011, rd, rs1, f0, f24, rm, "FCVT.W.S");
       }
 
       // fcvt.w.d
       void d(const Reg &rd, const FReg &rs1,
              RoundingMode rm = RoundingMode::dyn) {
         IS_DOUBLE_ONLY;
-        parent.Dr(0b1010011, rd, rs1, parent.f0, parent.f24, rm, "FCVT.W.D");
+        parent().Dr(0b1010011, rd, rs1, f0, f24, rm, "FCVT.W.D");
       }
     };
 
@@ -442,14 +442,14 @@ class CodeGenerator32Float : public virtual Base, public T {
       void s(const Reg &rd, const FReg &rs1,
              RoundingMode rm = RoundingMode::dyn) {
         IS_FLOAT_ONLY;
-        parent.Fr(0b1010011, rd, rs1, parent.f1, parent.f24, rm, "FCVT.WU.S");
+        parent().Fr(0b1010011, rd, rs1, f1, f24, rm, "FCVT.WU.S");
       }
 
       // fcvt.wu.d
       void d(const Reg &rd, const FReg &rs1,
              RoundingMode rm = RoundingMode::dyn) {
         IS_DOUBLE_ONLY;
-        parent.Dr(0b1010011, rd, rs1, parent.f1, parent.f24, rm, "FCVT.WU.D");
+        parent().Dr(0b1010011, rd, rs1, f1, f24, rm, "FCVT.WU.D");
       }
     };
 
@@ -461,21 +461,21 @@ class CodeGenerator32Float : public virtual Base, public T {
       void w(const FReg &rd, const Reg &rs1,
              RoundingMode rm = RoundingMode::dyn) {
         IS_FLOAT_ONLY;
-        parent.Ff(0b1010011, rd, rs1, parent.f0, parent.f26, rm, "FCVT.S.W");
+        parent().Ff(0b1010011, rd, rs1, f0, f26, rm, "FCVT.S.W");
       }
 
       // fcvt.s.wu
       void wu(const FReg &rd, const Reg &rs1,
               RoundingMode rm = RoundingMode::dyn) {
         IS_FLOAT_ONLY;
-        parent.Ff(0b1010011, rd, rs1, parent.f1, parent.f26, rm, "FCVT.S.WU");
+        parent().Ff(0b1010011, rd, rs1, f1, f26, rm, "FCVT.S.WU");
       }
 
       // fcvt.s.d
       void d(const FReg &rd, const FReg &rs1,
              RoundingMode rm = RoundingMode::dyn) {
         IS_DOUBLE_ONLY;
-        parent.F(0b1010011, rd, rs1, parent.f1, parent.f8, rm, "FCVT.S.D");
+        parent().F(0b1010011, rd, rs1, f1, f8, rm, "FCVT.S.D");
       }
     };
 
@@ -501,22 +501,19 @@ class CodeGenerator32Float : public virtual Base, public T {
       // fcvt.d.w
       void w(const FReg &rd, const Reg &rs1) {
         IS_DOUBLE_ONLY;
-        parent.Df(0b1010011, rd, rs1, parent.f0, parent.f26, parent.rne,
-                  "FCVT.D.W");
+        parent().Df(0b1010011, rd, rs1, f0, f26, rne, "FCVT.D.W");
       }
 
       // fcvt.d.wu
       void wu(const FReg &rd, const Reg &rs1) {
         IS_DOUBLE_ONLY;
-        parent.Df(0b1010011, rd, rs1, parent.f1, parent.f26, parent.rne,
-                  "FCVT.D.WU");
+        parent().Df(0b1010011, rd, rs1, f1, f26, rne, "FCVT.D.WU");
       }
 
       // fcvt.d.s
       void s(const FReg &rd, const FReg &rs1) {
         IS_DOUBLE_ONLY;
-        parent.D(0b1010011, rd, rs1, parent.f0, parent.f8, parent.rne,
-                 "FCVT.D.S");
+        parent().D(0b1010011, rd, rs1, f0, f8, rne, "FCVT.D.S");
       }
     };
 
@@ -532,14 +529,14 @@ class CodeGenerator32Float : public virtual Base, public T {
 
   // fmv.**
   class FMV {
-    friend self_t;
-    self_t &parent;
+    DOT_CLASS_PARENT(FMV)
+
     // fmv.x.w
     class FMV_X {
       DOT_CLASS_SETUP(FMV_X);
       void w(const Reg &rd, const FReg &rs1) {
         IS_FLOAT_ONLY;
-        parent.Fr(0b1010011, rd, rs1, parent.f0, parent.f28, rne, "FMV.X.W");
+        parent().Fr(0b1010011, rd, rs1, f0, f28, rne, "FMV.X.W");
       }
     };
 
@@ -548,7 +545,7 @@ class CodeGenerator32Float : public virtual Base, public T {
       DOT_CLASS_SETUP(FMV_W);
       void x(const FReg &rd, const Reg &rs1) {
         IS_FLOAT_ONLY;
-        parent.Ff(0b1010011, rd, rs1, parent.f0, parent.f30, rne, "FMV.W.X");
+        parent().Ff(0b1010011, rd, rs1, f0, f30, rne, "FMV.W.X");
       }
     };
 
@@ -557,13 +554,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     FMV_W w;
 
     // fmv.s 疑似命令
-    void s(const FReg &rd, const FReg &rs1) { parent.fsgnj.s(rd, rs1, rs1); }
+    void s(const FReg &rd, const FReg &rs1) { parent().fsgnj.s(rd, rs1, rs1); }
 
     // fmv.d 疑似命令
-    void d(const FReg &rd, const FReg &rs1) { parent.fsgnj.d(rd, rs1, rs1); }
+    void d(const FReg &rd, const FReg &rs1) { parent().fsgnj.d(rd, rs1, rs1); }
 
    private:
-    FMV(self_t &parent) : parent(parent), x(parent), w(parent) {}
+    FMV(self_t &p) : x(p), w(p) { setParent(p); }
   };
 
   // feq.*
@@ -573,13 +570,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     // feq.s
     void s(const Reg &rd, const FReg &rs1, const FReg &rs2) {
       IS_FLOAT_ONLY;
-      parent.Fr(0b1010011, rd, rs1, rs2, parent.f20, rdn, "FEQ.S");
+      parent().Fr(0b1010011, rd, rs1, rs2, f20, rdn, "FEQ.S");
     }
 
     // feq.d
     void d(const Reg &rd, const FReg &rs1, const FReg &rs2) {
       IS_DOUBLE_ONLY;
-      parent.Dr(0b1010011, rd, rs1, rs2, parent.f20, rdn, "FEQ.D");
+      parent().Dr(0b1010011, rd, rs1, rs2, f20, rdn, "FEQ.D");
     }
   };
 
@@ -590,13 +587,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     // flt.s
     void s(const Reg &rd, const FReg &rs1, const FReg &rs2) {
       IS_FLOAT_ONLY;
-      parent.Fr(0b1010011, rd, rs1, rs2, parent.f20, rtz, "FLT.S");
+      parent().Fr(0b1010011, rd, rs1, rs2, f20, rtz, "FLT.S");
     }
 
     // flt.d
     void d(const Reg &rd, const FReg &rs1, const FReg &rs2) {
       IS_DOUBLE_ONLY;
-      parent.Dr(0b1010011, rd, rs1, rs2, parent.f20, rtz, "FLT.D");
+      parent().Dr(0b1010011, rd, rs1, rs2, f20, rtz, "FLT.D");
     }
   };
 
@@ -607,13 +604,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     // fle.s
     void s(const Reg &rd, const FReg &rs1, const FReg &rs2) {
       IS_FLOAT_ONLY;
-      parent.Fr(0b1010011, rd, rs1, rs2, parent.f20, rne, "FLE.S");
+      parent().Fr(0b1010011, rd, rs1, rs2, f20, rne, "FLE.S");
     }
 
     // fle.d
     void d(const Reg &rd, const FReg &rs1, const FReg &rs2) {
       IS_DOUBLE_ONLY;
-      parent.Dr(0b1010011, rd, rs1, rs2, parent.f20, rne, "FLE.D");
+      parent().Dr(0b1010011, rd, rs1, rs2, f20, rne, "FLE.D");
     }
   };
 
@@ -624,13 +621,13 @@ class CodeGenerator32Float : public virtual Base, public T {
     // flcss.s
     void s(const Reg &rd, const FReg &rs1) {
       IS_FLOAT_ONLY;
-      parent.Fr(0b1010011, rd, rs1, parent.f0, parent.f28, rtz, "FCLASS.S");
+      parent().Fr(0b1010011, rd, rs1, f0, f28, rtz, "FCLASS.S");
     }
 
     // flcss.d
     void d(const Reg &rd, const FReg &rs1) {
       IS_DOUBLE_ONLY;
-      parent.Dr(0b1010011, rd, rs1, parent.f0, parent.f28, rtz, "FCLASS.D");
+      parent().Dr(0b1010011, rd, rs1, f0, f28, rtz, "FCLASS.D");
     }
   };
 
@@ -642,10 +639,10 @@ class CodeGenerator32Float : public virtual Base, public T {
     DOT_CLASS_SETUP(FABS);
 
     // fabs.s 疑似命令
-    void s(const FReg &rd, const FReg &rs1) { parent.fsgnjx.s(rd, rs1, rs1); }
+    void s(const FReg &rd, const FReg &rs1) { parent().fsgnjx.s(rd, rs1, rs1); }
 
     // fabs.d 疑似命令
-    void d(const FReg &rd, const FReg &rs1) { parent.fsgnjx.d(rd, rs1, rs1); }
+    void d(const FReg &rd, const FReg &rs1) { parent().fsgnjx.d(rd, rs1, rs1); }
   };
 
   // fneg.*
@@ -653,10 +650,10 @@ class CodeGenerator32Float : public virtual Base, public T {
     DOT_CLASS_SETUP(FNEG);
 
     // fneg.s 疑似命令
-    void s(const FReg &rd, const FReg &rs1) { parent.fsgnjn.s(rd, rs1, rs1); }
+    void s(const FReg &rd, const FReg &rs1) { parent().fsgnjn.s(rd, rs1, rs1); }
 
     // fneg.d 疑似命令
-    void d(const FReg &rd, const FReg &rs1) { parent.fsgnjn.d(rd, rs1, rs1); }
+    void d(const FReg &rd, const FReg &rs1) { parent().fsgnjn.d(rd, rs1, rs1); }
   };
 
  public:
@@ -748,7 +745,7 @@ class CodeGenerator32Float : public virtual Base, public T {
     } else if (SUPPORT_COMP && or1.getReg() == sp && ((imm & 0x0fc) == imm)) {
       imm &= 0x0fc;
       unsigned int op = (0b111 << 13) | ((imm & 0x3c) << 7) |
-                        ((imm & 0xc0) << 1) | (rs2.getCIdx()) << 2 | 0b10;
+                        ((imm & 0xc0) << 1) | (rs2.getIdx() << 2) | 0b10;
       T::C(op, "C.FSWSP");
     } else {
       ST(or1.getOffset(), rs2.getIdx(), or1.getIdx(), 0b010, "FSW");
@@ -799,6 +796,26 @@ class CodeGenerator32Float : public virtual Base, public T {
     }
   }
 
+  // 単精度の定数 value をリテラルプールに置いて auipc + flw で読み込む
+  // tmp は auipc でアドレスを作るのに使う
+  using T::loadConst;
+  void loadConst(const FReg &rd, float value, const Reg &tmp) {
+    IS_FLOAT_ONLY;
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    env.loadLiteral(bits, 4, U_(0b0010111, tmp, 0),
+                    Env::loadOp(0b0000111, 0b010, rd.getIdx()), "AUIPC");
+  }
+
+  // 倍精度の定数 value をリテラルプールに置いて auipc + fld で読み込む
+  void loadConst(const FReg &rd, double value, const Reg &tmp) {
+    IS_DOUBLE_ONLY;
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    env.loadLiteral(bits, 8, U_(0b0010111, tmp, 0),
+                    Env::loadOp(0b0000111, 0b011, rd.getIdx()), "AUIPC");
+  }
+
 #undef IS_FLOAT_ONLY
 #undef IS_DOUBLE_ONLY
 #undef IS_QUADRUPLE_ONLY
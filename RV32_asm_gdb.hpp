@@ -0,0 +1,325 @@
+#ifndef RV32_ASM_GDB_HPP_INCLUDED
+#define RV32_ASM_GDB_HPP_INCLUDED
+
+#include <cstdio>
+#include <memory>
+#include <type_traits>
+
+#include "RV32_asm_base.hpp"
+#include "RV32_asm_elf.hpp"
+#include "RV32_asm_listing.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// GDB の JIT インターフェースへの生成したコードの登録
+//
+// 生成したコードごとに、関数とラベルのシンボルだけを持つ ELF を
+// メモリ上に組み立てて __jit_debug_register_code() で GDB に知らせる。
+// 生成したコードの中でクラッシュした場合でも、バックトレースや
+// disassemble で関数名とラベル名が表示されるようになる。
+//
+// 既定では、GdbJit を作った時点でデバッガが接続されている場合だけ
+// 登録するので、デバッガを使わない場合のコード生成の時間は変わらない。
+//
+// 使用例
+//   RV32_asm::GdbJit gdb;  // 常に登録する場合は GdbJit::ON
+//   RV32_asm::GdbJitListing listing(gdb);
+//   gen.setListing(&listing);
+//   listing.setName("filter");
+//   auto *f = gen.generate<int (*)(int)>();  // ここで登録される
+//
+// GDB の JIT インターフェースのシンボルは、他のライブラリ(LLVM など)と
+// 共有できるように弱いシンボルとして定義する。
+
+// GCC 互換のコンパイラでだけ使える
+#if COMPILER == COMPILER_GCC
+#define RV32_ASM_GDB_JIT 1
+#else
+#define RV32_ASM_GDB_JIT 0
+#endif
+
+#if RV32_ASM_GDB_JIT
+extern "C" {
+
+// GDB が読むデータ構造(名前と並びは GDB の定義に合わせる)
+struct jit_code_entry {
+  struct jit_code_entry *next_entry;
+  struct jit_code_entry *prev_entry;
+  const char *symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;  // 0: なし, 1: 登録, 2: 削除
+  struct jit_code_entry *relevant_entry;
+  struct jit_code_entry *first_entry;
+};
+
+// GDB はこの関数にブレークポイントを置いて、呼び出しのたびに
+// __jit_debug_descriptor を読む
+__attribute__((weak, noinline)) void __jit_debug_register_code() {
+  __asm__ volatile("" ::: "memory");
+}
+
+__attribute__((weak)) struct jit_descriptor __jit_debug_descriptor = {
+    1, 0, NULL, NULL};
+
+}  // extern "C"
+#endif
+
+namespace RV32_asm {
+
+// 生成したコードを GDB に登録するクラス
+// 複数のスレッドの生成器から同時に使ってよい。
+// 破棄すると、登録したコードを全て削除する。
+class GdbJit {
+ public:
+  enum Mode {
+    OFF,   // 登録しない
+    AUTO,  // 作った時点でデバッガが接続されている場合だけ登録する
+    ON,    // 常に登録する
+  };
+
+  struct Symbol {
+    address_offset_t offset;  // code からのオフセット
+    const char *name;
+  };
+
+ private:
+  enum { JIT_NOACTION = 0, JIT_REGISTER_FN = 1, JIT_UNREGISTER_FN = 2 };
+
+#if RV32_ASM_GDB_JIT
+  // 登録した1つ分のコード
+  struct Entry {
+    jit_code_entry entry;
+    const void *code;
+    size_t size;
+    std::vector<uint8_t> image;  // ELF の内容
+  };
+
+  std::vector<std::unique_ptr<Entry> > entries;
+#endif
+  bool enabled;
+
+  GdbJit(const GdbJit &);
+  void operator=(const GdbJit &);
+
+  // __jit_debug_descriptor はプロセスで1つなので、全てのオブジェクトで
+  // 同じ mutex を使う
+  static std::mutex &globalMutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  // デバッガ(ptrace しているプロセス)が接続されているか
+  static bool isTraced() {
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+      return false;
+    }
+    char line[128];
+    int tracer = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (sscanf(line, "TracerPid: %d", &tracer) == 1) {
+        break;
+      }
+    }
+    fclose(fp);
+    return tracer != 0;
+#else
+    return false;
+#endif
+  }
+
+#if RV32_ASM_GDB_JIT
+  // code, size のシンボルだけを持つ ELF を組み立てる
+  // .text は内容を持たない SHT_NOBITS にして、アドレスだけを知らせる
+  static void buildImage(std::vector<uint8_t> &image, const void *code,
+                         size_t size, const char *name,
+                         const Symbol *symbols, size_t count) {
+    typedef uintptr_t Addr;
+    typedef internal::elf::Builder<Addr> Builder;
+    typedef typename std::conditional<sizeof(Addr) == 4, internal::elf::Sym32,
+                                      internal::elf::Sym64>::type Sym;
+    using namespace internal::elf;
+
+    Builder elf;
+    StringTable strtab;
+    std::vector<Sym> syms(count + 2);
+    memset(&syms[0], 0, sizeof(Sym) * syms.size());
+    const uint16_t text =
+        elf.add(".text", SHT_NOBITS, SHF_ALLOC | SHF_EXECINSTR,
+                Addr(uintptr_t(code)), NULL, size, 0, 0, 2);
+    // ラベルは局所シンボル、関数全体は大域シンボルにする
+    for (size_t i = 0; i < count; i++) {
+      Sym &s = syms[i + 1];
+      s.st_name = strtab.add(symbols[i].name);
+      s.st_value = Addr(symbols[i].offset);
+      s.st_info = symInfo(STB_LOCAL, STT_NOTYPE);
+      s.st_shndx = text;
+    }
+    Sym &f = syms[count + 1];
+    f.st_name = strtab.add(name);
+    f.st_size = Addr(size);
+    f.st_info = symInfo(STB_GLOBAL, STT_FUNC);
+    f.st_shndx = text;
+    const uint16_t str =
+        elf.add(".strtab", SHT_STRTAB, 0, 0, strtab.data(), strtab.size());
+    elf.add(".symtab", SHT_SYMTAB, 0, 0, &syms[0], sizeof(Sym) * syms.size(),
+            str, uint32_t(count + 1), sizeof(Addr), sizeof(Sym));
+
+    image.clear();
+    image.reserve(elf.size());
+    elf.write(
+        [&image](const void *p, size_t n) {
+          const uint8_t *b = static_cast<const uint8_t *>(p);
+          image.insert(image.end(), b, b + n);
+          return true;
+        },
+        ET_REL, EM_RISCV, 0);
+  }
+
+  // GDB に通知する(globalMutex() を取った状態で呼ぶ)
+  static void notify(jit_code_entry *e, uint32_t action) {
+    __jit_debug_descriptor.relevant_entry = e;
+    __jit_debug_descriptor.action_flag = action;
+    __jit_debug_register_code();
+    __jit_debug_descriptor.action_flag = JIT_NOACTION;
+  }
+
+  void unlink(Entry &e) {
+    jit_code_entry *p = &e.entry;
+    if (p->prev_entry != NULL) {
+      p->prev_entry->next_entry = p->next_entry;
+    } else {
+      __jit_debug_descriptor.first_entry = p->next_entry;
+    }
+    if (p->next_entry != NULL) {
+      p->next_entry->prev_entry = p->prev_entry;
+    }
+    notify(p, JIT_UNREGISTER_FN);
+  }
+#endif
+
+ public:
+  explicit GdbJit(Mode mode = AUTO)
+      : enabled(RV32_ASM_GDB_JIT &&
+                (mode == ON || (mode == AUTO && isTraced()))) {}
+
+  ~GdbJit() { clear(); }
+
+  // 登録する状態か
+  bool isEnabled() const { return enabled; }
+
+  // code から size バイトのコードを name という名前で登録する
+  // symbols は code の中のラベル(count 個)
+  // 登録済みのコードと範囲が重なる場合は、古い方を削除してから登録する。
+  void add(const void *code, size_t size, const char *name,
+           const Symbol *symbols = NULL, size_t count = 0) {
+#if RV32_ASM_GDB_JIT
+    if (!enabled) {
+      return;
+    }
+    std::unique_ptr<Entry> e(new Entry);
+    e->code = code;
+    e->size = size;
+    buildImage(e->image, code, size, name, symbols, count);
+    e->entry.symfile_addr = reinterpret_cast<const char *>(e->image.data());
+    e->entry.symfile_size = e->image.size();
+
+    std::lock_guard<std::mutex> lock(globalMutex());
+    remove(code, size, false);
+    jit_code_entry *p = &e->entry;
+    p->prev_entry = NULL;
+    p->next_entry = __jit_debug_descriptor.first_entry;
+    if (p->next_entry != NULL) {
+      p->next_entry->prev_entry = p;
+    }
+    __jit_debug_descriptor.first_entry = p;
+    entries.push_back(std::move(e));
+    notify(p, JIT_REGISTER_FN);
+#else
+    (void)code, (void)size, (void)name, (void)symbols, (void)count;
+#endif
+  }
+
+  // code から size バイトの範囲と重なる登録を削除する
+  // コードの領域を解放する前に呼ぶこと
+  void remove(const void *code, size_t size) { remove(code, size, true); }
+
+  // 全ての登録を削除する
+  void clear() {
+#if RV32_ASM_GDB_JIT
+    std::lock_guard<std::mutex> lock(globalMutex());
+    for (size_t i = 0; i < entries.size(); i++) {
+      unlink(*entries[i]);
+    }
+    entries.clear();
+#endif
+  }
+
+  // 登録しているコードの数
+  size_t size() const {
+#if RV32_ASM_GDB_JIT
+    return entries.size();
+#else
+    return 0;
+#endif
+  }
+
+ private:
+  void remove(const void *code, size_t size, bool lock) {
+#if RV32_ASM_GDB_JIT
+    std::unique_lock<std::mutex> guard(globalMutex(), std::defer_lock);
+    if (lock) {
+      guard.lock();
+    }
+    const uintptr_t begin = uintptr_t(code);
+    const uintptr_t end = begin + size;
+    size_t n = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+      Entry &e = *entries[i];
+      const uintptr_t b = uintptr_t(e.code);
+      if (b < end && begin < b + e.size) {
+        unlink(e);
+      } else {
+        entries[n++] = std::move(entries[i]);
+      }
+    }
+    entries.resize(n);
+#else
+    (void)code, (void)size, (void)lock;
+#endif
+  }
+};
+
+// 生成した関数とラベルを GdbJit に登録する sink
+// GdbJit が登録しない状態の場合は、ラベルも集めない。
+class GdbJitListing : public SymbolListing {
+  GdbJit &gdb;
+  std::vector<GdbJit::Symbol> work;
+
+  void operator=(const GdbJitListing &);
+
+ protected:
+  bool isEnabled() const { return gdb.isEnabled(); }
+
+  void addCode(const unsigned char *code, size_t size, const std::string &name,
+               const std::vector<Symbol> &symbols) {
+    work.resize(symbols.size());
+    for (size_t i = 0; i < symbols.size(); i++) {
+      work[i].offset = symbols[i].offset;
+      work[i].name = symbols[i].name.c_str();
+    }
+    gdb.add(code, size, name.c_str(), work.data(), work.size());
+  }
+
+ public:
+  explicit GdbJitListing(GdbJit &gdb, ListingSink *next = NULL)
+      : SymbolListing(next), gdb(gdb) {}
+};
+
+};  // namespace RV32_asm
+
+#endif
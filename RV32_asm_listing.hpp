@@ -0,0 +1,254 @@
+#ifndef RV32_ASM_LISTING_HPP_INCLUDED
+#define RV32_ASM_LISTING_HPP_INCLUDED
+
+#include <cstdio>
+#include <cstring>
+
+#include "RV32_asm_base.hpp"
+#include "RV32_asm_disasm.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// 生成した命令のリスト出力
+//
+// ListingSink の実装と、命令のオペコードからオペランドの文字列を
+// 組み立てる関数を定義する。オペコードの解釈は Disassembler で行う。
+// 生成器に setListing() で設定した場合だけ呼ばれるので、
+// 設定していない場合はコード生成の速度に影響しない。
+
+namespace RV32_asm {
+
+// rec のオペランドを "a0, a1, 12" のような文字列にして buf に書き込む
+// 分岐先は先頭からのオフセットを16進数で表す。
+// オペランドは逆アセンブルした命令の形なので、生成器が記録した疑似命令の
+// ニーモニック(MV など)とは並びが合わない場合がある。
+// 戻り値は snprintf と同じく、書き込もうとした文字数。
+inline int formatOperands(char *buf, size_t size, const ListingRecord &rec) {
+  if (rec.mnemonic != NULL && rec.mnemonic[0] == '.') {
+    // dw(), dh() で埋め込んだデータ
+    return snprintf(buf, size, "0x%x", rec.code);
+  }
+  Disassembler::Insn insn;
+  Disassembler::decode(rec.code, insn);
+  return Disassembler::operands(buf, size, insn, rec.offset);
+}
+
+// rec を "ADDI         a5, a0, 0  # MV" のような1行にして buf に書き込む
+// ニーモニックとオペランドはどちらも逆アセンブルした命令から組み立て、
+// 生成器が記録したニーモニックが異なる場合(疑似命令など)は後ろに付ける。
+// 戻り値は snprintf と同じく、書き込もうとした文字数。
+inline int formatInsn(char *buf, size_t size, const ListingRecord &rec) {
+  if (rec.mnemonic != NULL && rec.mnemonic[0] == '.') {
+    // dw(), dh() で埋め込んだデータ
+    return snprintf(buf, size, "%-12s 0x%x", rec.mnemonic, rec.code);
+  }
+  Disassembler::Insn insn;
+  Disassembler::decode(rec.code, insn);
+  char line[80];
+  Disassembler::format(line, sizeof(line), insn, rec.offset);
+  if (rec.mnemonic == NULL || rec.mnemonic[0] == '\0' ||
+      (insn.mnemonic != NULL && strcmp(rec.mnemonic, insn.mnemonic) == 0)) {
+    return snprintf(buf, size, "%s", line);
+  }
+  return snprintf(buf, size, "%-32s # %s", line, rec.mnemonic);
+}
+
+// FILE にリストを出力する sink
+//
+// 例
+//   RV32_asm::StdioListing listing(stdout);
+//   gen.setListing(&listing);
+class StdioListing : public ListingSink {
+  FILE *fp;
+
+ public:
+  explicit StdioListing(FILE *fp) : fp(fp) {}
+
+  void insn(const ListingRecord &rec) {
+    char line[96];
+    formatInsn(line, sizeof(line), rec);
+    if (rec.size == 2) {
+      fprintf(fp, "%6x:     %04x  %s\n", rec.offset, rec.code, line);
+    } else {
+      fprintf(fp, "%6x: %08x  %s\n", rec.offset, rec.code, line);
+    }
+  }
+
+  void label(label_id_t id, const char *name, address_offset_t) {
+    if (name != NULL) {
+      fprintf(fp, "%s:\n", name);
+    } else {
+      fprintf(fp, ".L#%u:\n", (unsigned int)id);
+    }
+  }
+
+  void generated(const unsigned char *code, size_t size) {
+    fprintf(fp, "%d byte code generated at %p.\n", (int)size, code);
+  }
+};
+
+// 生成した命令を逆アセンブルして、生成器が記録したニーモニックと比べる sink
+// 符号化の誤りを見つけるためのもので、合わない命令は fp に出力する。
+//
+// 例
+//   RV32_asm::VerifyListing verify(stderr);
+//   gen.setListing(&verify);
+//   ... // コードを生成する
+//   assert(verify.getErrors() == 0);
+class VerifyListing : public ListingSink {
+  FILE *fp;
+  size_t checked;
+  size_t errors;
+
+ public:
+  explicit VerifyListing(FILE *fp = NULL) : fp(fp), checked(0), errors(0) {}
+
+  void insn(const ListingRecord &rec) {
+    if (rec.mnemonic != NULL && rec.mnemonic[0] == '.') {
+      return;  // dw(), dh() で埋め込んだデータ
+    }
+    Disassembler::Insn insn;
+    Disassembler::decode(rec.code, insn);
+    ++checked;
+    if (insn.size == rec.size && Disassembler::matches(rec.mnemonic, insn)) {
+      return;
+    }
+    ++errors;
+    if (fp != NULL) {
+      char line[96];
+      Disassembler::format(line, sizeof(line), insn, rec.offset);
+      fprintf(fp, "%6x: %08x  %s (recorded as %s)\n", rec.offset, rec.code,
+              line, rec.mnemonic != NULL ? rec.mnemonic : "?");
+    }
+  }
+
+  // 比べた命令の数
+  size_t getChecked() const { return checked; }
+  // 合わなかった命令の数
+  size_t getErrors() const { return errors; }
+
+  void clear() { checked = errors = 0; }
+};
+
+// 生成した関数の名前とラベルを集めて、生成の完了時に addCode() に渡す sink
+// プロファイラやデバッガに生成したコードを登録するクラスの基底クラス。
+// 命令のリストも必要な場合は next に別の sink を渡すと、全ての通知を転送する。
+class SymbolListing : public ListingSink {
+ public:
+  // 名前付きのラベル
+  struct Symbol {
+    address_offset_t offset;
+    std::string name;
+  };
+
+ private:
+  ListingSink *next;
+  std::string name;
+  std::vector<Symbol> symbols;  // 生成中の関数のラベル
+  unsigned int count;           // 名前を指定せずに生成した関数の数
+
+  void operator=(const SymbolListing &);
+
+ protected:
+  // 生成したコードを登録する(symbols はオフセットの順に並んでいる)
+  virtual void addCode(const unsigned char *code, size_t size,
+                       const std::string &name,
+                       const std::vector<Symbol> &symbols) = 0;
+
+  // false の場合は登録せず、ラベルも集めない
+  virtual bool isEnabled() const { return true; }
+
+ public:
+  explicit SymbolListing(ListingSink *next = NULL) : next(next), count(0) {}
+
+  // 次に生成する関数の名前(生成が完了すると空に戻る)
+  // 設定しない場合は "rv32_jit_<番号>" になる
+  void setName(const char *name) { this->name = name; }
+
+  void insn(const ListingRecord &rec) {
+    if (next != NULL) {
+      next->insn(rec);
+    }
+  }
+
+  void label(label_id_t id, const char *name, address_offset_t offset) {
+    if (next != NULL) {
+      next->label(id, name, offset);
+    }
+    if (name != NULL && isEnabled()) {
+      Symbol s = {offset, name};
+      symbols.push_back(s);
+    }
+  }
+
+  void generated(const unsigned char *code, size_t size) {
+    if (next != NULL) {
+      next->generated(code, size);
+    }
+    if (isEnabled()) {
+      if (name.empty()) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "rv32_jit_%u", count++);
+        name = buf;
+      }
+      std::stable_sort(symbols.begin(), symbols.end(),
+                       [](const Symbol &a, const Symbol &b) {
+                         return a.offset < b.offset;
+                       });
+      addCode(code, size, name, symbols);
+    }
+    symbols.clear();
+    name.clear();
+  }
+};
+
+// 直近の N 件の命令だけを覚えておく sink
+// 遅い JIT を調べる場合など、普段は出力せずに後から内容を確認したいときに使う。
+template <size_t N>
+class RingListing : public ListingSink {
+ public:
+  // bytes はコールバックの後は無効になるので、内容をコピーして覚えておく
+  struct Entry {
+    address_offset_t offset;
+    uint32_t code;
+    int size;
+    const char *mnemonic;
+  };
+
+ private:
+  Entry entries[N];
+  size_t count;  // これまでに受け取った命令の数
+
+ public:
+  RingListing() : count(0) {}
+
+  void insn(const ListingRecord &rec) {
+    const Entry e = {rec.offset, rec.code, rec.size, rec.mnemonic};
+    entries[count % N] = e;
+    ++count;
+  }
+
+  // 覚えている命令の数
+  size_t size() const { return count < N ? count : N; }
+
+  // 古い順に i 番目の命令
+  const Entry &operator[](size_t i) const {
+    assert(i < size());
+    return entries[(count - size() + i) % N];
+  }
+
+  void clear() { count = 0; }
+
+  // 覚えている命令を fp に出力する
+  void dump(FILE *fp) const {
+    StdioListing out(fp);
+    for (size_t i = 0; i < size(); ++i) {
+      const Entry &e = (*this)[i];
+      const ListingRecord rec = {e.offset, NULL, e.size, e.code, e.mnemonic};
+      out.insn(rec);
+    }
+  }
+};
+
+};  // namespace RV32_asm
+
+#endif
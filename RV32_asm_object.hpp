@@ -0,0 +1,252 @@
+#ifndef RV32_ASM_OBJECT_HPP_INCLUDED
+#define RV32_ASM_OBJECT_HPP_INCLUDED
+
+#include "RV32_asm_base.hpp"
+#include "RV32_asm_elf.hpp"
+
+#if !RV32_ASM_USE_MMAP
+#include <io.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// 生成したコードのファイルへの書き出し
+//
+// ビルド時に生成したコードをファームウェアなどにリンクするためのもの。
+// ELF32 の再配置可能オブジェクト、バイナリ、Intel HEX の形式で、
+// ファイルディスクリプタに少しずつ書き出す(ファイル全体をメモリ上に
+// 組み立てることはしない)。
+// 生成器からは writeObject() / writeBinary() / writeHex() で使う。
+
+namespace RV32_asm {
+
+// ELF の e_flags に入れる浮動小数点数の ABI
+// リンクする他のオブジェクトの -mabi に合わせる
+enum FloatAbi {
+  FLOAT_ABI_SOFT = 0x0,    // ilp32
+  FLOAT_ABI_SINGLE = 0x2,  // ilp32f
+  FLOAT_ABI_DOUBLE = 0x4,  // ilp32d
+};
+
+namespace internal {
+
+// ファイルディスクリプタへの書き出しをまとめて行うバッファ
+class FdStream {
+  int fd;
+  bool ok;
+  size_t used;
+  char buf[4096];
+
+  FdStream(const FdStream &);
+  void operator=(const FdStream &);
+
+  bool writeAll(const char *p, size_t size) {
+    while (ok && size != 0) {
+#if RV32_ASM_USE_MMAP
+      const ssize_t n = ::write(fd, p, size);
+#else
+      const int n = ::_write(fd, p, unsigned(size));
+#endif
+      if (n <= 0) {
+        ok = false;
+        break;
+      }
+      p += n;
+      size -= size_t(n);
+    }
+    return ok;
+  }
+
+ public:
+  explicit FdStream(int fd) : fd(fd), ok(fd >= 0), used(0) {}
+  ~FdStream() { flush(); }
+
+  bool write(const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    if (used + size > sizeof(buf)) {
+      flush();
+      if (size > sizeof(buf)) {
+        return writeAll(p, size);  // 大きなものはそのまま書き出す
+      }
+    }
+    memcpy(buf + used, p, size);
+    used += size;
+    return ok;
+  }
+
+  bool flush() {
+    writeAll(buf, used);
+    used = 0;
+    return ok;
+  }
+};
+
+// ELF32 の再配置可能オブジェクトを書き出す
+// code の先頭に name という大域シンボルを置き、名前付きのラベルを
+// シンボルにする("." で始まるラベルは局所シンボル、それ以外は大域シンボル)。
+// relocs の参照先のラベルは、未定義の外部シンボルとして出力する。
+// 名前の無いラベルへの外部参照がある場合は false を返す。
+inline bool writeElfObject(int fd, const unsigned char *code, size_t size,
+                           const char *name, const Env &env,
+                           const std::vector<Relocation> &relocs,
+                           uint32_t flags) {
+  using namespace elf;
+  enum {
+    R_RISCV_BRANCH = 16,
+    R_RISCV_JAL = 17,
+    R_RISCV_CALL_PLT = 19,
+    R_RISCV_PCREL_HI20 = 23,
+  };
+
+  StringTable strtab;
+  std::vector<Sym32> syms;
+  std::vector<uint32_t> symOf(env.getLabelCount(), 0);  // ラベル -> シンボル
+  const Sym32 null = {0, 0, 0, 0, 0, 0};
+  syms.push_back(null);
+  const uint16_t TEXT = 1;  // .text のセクション番号
+  const Sym32 section = {0, 0, 0, symInfo(STB_LOCAL, STT_SECTION), 0, TEXT};
+  syms.push_back(section);
+
+  // 局所シンボル、大域シンボルの順に並べる
+  uint32_t firstGlobal = 0;
+  for (int global = 0; global < 2; global++) {
+    if (global) {
+      firstGlobal = uint32_t(syms.size());
+      const Sym32 f = {strtab.add(name), 0, uint32_t(size),
+                       symInfo(STB_GLOBAL, STT_FUNC), 0, TEXT};
+      syms.push_back(f);
+    }
+    for (label_id_t id = 0; id < env.getLabelCount(); ++id) {
+      const char *label = env.getLabelName(id);
+      const address_offset_t offset = env.getLabelOffset(id);
+      if (label == NULL || offset < 0 || (label[0] != '.') != bool(global)) {
+        continue;
+      }
+      const Sym32 s = {strtab.add(label), uint32_t(offset), 0,
+                       symInfo(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE),
+                       0, TEXT};
+      symOf[id] = uint32_t(syms.size());
+      syms.push_back(s);
+    }
+  }
+
+  std::vector<Rela32> relas;
+  for (const Relocation &r : relocs) {
+    uint32_t &sym = symOf[r.label];
+    if (sym == 0) {
+      const char *label = env.getLabelName(r.label);
+      if (label == NULL) {
+        return false;
+      }
+      const Sym32 s = {strtab.add(label), 0, 0,
+                       symInfo(STB_GLOBAL, STT_NOTYPE), 0, SHN_UNDEF};
+      sym = uint32_t(syms.size());
+      syms.push_back(s);
+    }
+    uint32_t type = R_RISCV_BRANCH;
+    switch (r.kind) {
+      case FIX_JAL:
+      case FIX_CJ:
+        type = R_RISCV_JAL;
+        break;
+      case FIX_CALL:
+        type = R_RISCV_CALL_PLT;
+        break;
+      case FIX_AUIPC:
+        type = R_RISCV_PCREL_HI20;
+        break;
+      default:
+        break;
+    }
+    const Rela32 rela = {uint32_t(r.offset), relaInfo32(sym, type), 0};
+    relas.push_back(rela);
+  }
+
+  // 圧縮命令を使っている場合は EF_RISCV_RVC を付ける
+  for (size_t pos = 0; pos < size; pos += ((code[pos] & 3) == 3) ? 4 : 2) {
+    if ((code[pos] & 3) != 3) {
+      flags |= EF_RISCV_RVC;
+      break;
+    }
+  }
+
+  Builder<uint32_t> elf;
+  elf.add(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, code, size, 0,
+          0, 4);
+  const uint16_t symtab = 2, str = 3;
+  elf.add(".symtab", SHT_SYMTAB, 0, 0, syms.data(), sizeof(Sym32) * syms.size(),
+          str, firstGlobal, 4, sizeof(Sym32));
+  elf.add(".strtab", SHT_STRTAB, 0, 0, strtab.data(), strtab.size());
+  if (!relas.empty()) {
+    elf.add(".rela.text", SHT_RELA, SHF_INFO_LINK, 0, relas.data(),
+            sizeof(Rela32) * relas.size(), symtab, TEXT, 4, sizeof(Rela32));
+  }
+
+  FdStream out(fd);
+  return elf.write(
+             [&out](const void *p, size_t n) { return out.write(p, n); },
+             ET_REL, EM_RISCV, flags) &&
+         out.flush();
+}
+
+// バイナリをそのまま書き出す
+inline bool writeRawBinary(int fd, const unsigned char *code, size_t size) {
+  FdStream out(fd);
+  return out.write(code, size) && out.flush();
+}
+
+// Intel HEX の形式で書き出す
+// base はコードを置くアドレス(64KiB を超える場合は拡張リニアアドレスを使う)
+inline bool writeIntelHex(int fd, const unsigned char *code, size_t size,
+                          uint32_t base) {
+  FdStream out(fd);
+  // 1レコードを ":LLAAAATT<データ>CC\r\n" の形で出力する
+  auto record = [&out](uint32_t type, uint32_t addr, const unsigned char *p,
+                       size_t n) {
+    static const char hex[] = "0123456789ABCDEF";
+    char line[64];
+    size_t len = 0;
+    uint8_t sum = 0;
+    auto put = [&](uint8_t b) {
+      line[len++] = hex[b >> 4];
+      line[len++] = hex[b & 15];
+      sum = uint8_t(sum + b);
+    };
+    line[len++] = ':';
+    put(uint8_t(n));
+    put(uint8_t(addr >> 8));
+    put(uint8_t(addr));
+    put(uint8_t(type));
+    for (size_t i = 0; i < n; i++) {
+      put(p[i]);
+    }
+    put(uint8_t(-sum));
+    line[len++] = '\r';
+    line[len++] = '\n';
+    return out.write(line, len);
+  };
+
+  uint32_t upper = 0;
+  for (size_t pos = 0; pos < size;) {
+    const uint32_t addr = base + uint32_t(pos);
+    if ((addr >> 16) != upper || pos == 0) {
+      upper = addr >> 16;
+      const unsigned char ext[2] = {uint8_t(upper >> 8), uint8_t(upper)};
+      if (upper != 0 && !record(0x04, 0, ext, 2)) {
+        return false;
+      }
+    }
+    // 1行は 16 バイトまでで、64KiB の境界をまたがない
+    size_t n = std::min<size_t>(16, size - pos);
+    n = std::min<size_t>(n, 0x10000 - (addr & 0xffff));
+    if (!record(0x00, addr & 0xffff, code + pos, n)) {
+      return false;
+    }
+    pos += n;
+  }
+  return record(0x01, 0, NULL, 0) && out.flush();
+}
+
+}  // namespace internal
+};  // namespace RV32_asm
+
+#endif
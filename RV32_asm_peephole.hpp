@@ -0,0 +1,418 @@
+#ifndef RV32_ASM_PEEPHOLE_HPP_INCLUDED
+#define RV32_ASM_PEEPHOLE_HPP_INCLUDED
+
+#include "RV32_asm_base.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// 記録した命令列の覗き穴最適化
+//
+// フロントエンドが素直に命令を並べた場合に残る無駄を、 generate() で
+// 配置する前の命令レコードの上で取り除く。
+// 次の規則を、変化が無くなるまで繰り返し適用する。
+//   - 連続する addi を1つにまとめる
+//       addi a0, a0, 3 / addi a0, a0, -2  ->  addi a0, a0, 1
+//       li a0, 5 / addi a0, a0, 1         ->  li a0, 6
+//   - 自分自身への mv (addi rd, rd, 0 など)を削除する
+//   - 直後の命令への j や条件分岐を削除する
+//   - 同じ場所への sb / sw の直後の lbu / lw を、レジスタの操作に置き換える
+//       sb a0, 0(s1) / lbu a0, 0(s1)  ->  sb a0, 0(s1) / andi a0, a0, 255
+//       sw a0, 0(s1) / lw a0, 0(s1)   ->  sw a0, 0(s1)
+//   - 間にレジスタの演算しか無い、同じ場所への2回のストアの前の方を削除する
+//
+// ラベルの位置をまたいだ変換はしない(ストアの削除を除く)。
+// メモリは通常のメモリとして扱うので、デバイスのレジスタのように
+// 読み書きに副作用のある領域を操作するコードには使わないこと。
+// dh() / dw() で埋め込んだデータ(".word" / ".long")は変更しない。
+// 置き換えた命令は、元の命令のどちらかが圧縮命令だった場合だけ圧縮命令にする
+// (圧縮命令が使えない命令セットで圧縮命令を生成しないため)。
+
+namespace RV32_asm {
+namespace internal {
+
+class Peephole {
+  // 規則の判定に使う、命令の種類とオペランド
+  struct Op {
+    enum Type {
+      OTHER,  // 下記以外(メモリの読み込みや分岐を含む可能性がある)
+      ALU,    // レジスタ rd に書き込むだけの演算
+      ADDI,   // rd = rs1 + imm (mv, li, c.mv などを含む)
+      LOAD,   // rd = mem[rs1 + imm] (width は funct3)
+      STORE,  // mem[rs1 + imm] = rs2 (width は funct3)
+    };
+    Type type;
+    int width;
+    int rd, rs1, rs2;
+    int32_t imm;
+  };
+
+  enum { WINDOW = 16 };  // ストアの削除で先を調べる命令数の上限
+
+  Env &env;
+  std::vector<Insn> &insns;
+  std::vector<bool> labelAt;  // 命令番号の位置にラベルが定義されているか
+  std::vector<bool> dead;     // 削除した命令
+  size_t removed;
+
+  Peephole(const Peephole &);
+  void operator=(const Peephole &);
+
+  static int32_t sext(uint32_t v, int bits) {
+    return int32_t(v << (32 - bits)) >> (32 - bits);
+  }
+
+  static Op make(Op::Type type, int rd, int rs1 = 0, int32_t imm = 0) {
+    const Op op = {type, 0, rd, rs1, 0, imm};
+    return op;
+  }
+
+  static Op decode32(uint32_t op) {
+    const int rd = (op >> 7) & 31, f3 = (op >> 12) & 7;
+    const int rs1 = (op >> 15) & 31, rs2 = (op >> 20) & 31;
+    const int32_t immI = int32_t(op) >> 20;
+    switch (op & 0x7f) {
+      case 0b0010011:  // OP-IMM
+        return (f3 == 0) ? make(Op::ADDI, rd, rs1, immI) : make(Op::ALU, rd);
+      case 0b0110011:  // OP
+        if (f3 == 0 && (op >> 25) == 0 && (rs1 == 0 || rs2 == 0)) {
+          return make(Op::ADDI, rd, rs1 | rs2, 0);  // add rd, x0, rs
+        }
+        return make(Op::ALU, rd);
+      case 0b0110111:  // LUI
+        return make(Op::ALU, rd);
+      case 0b0000011: {  // LOAD
+        Op r = make(Op::LOAD, rd, rs1, immI);
+        r.width = f3;
+        return r;
+      }
+      case 0b0100011: {  // STORE
+        Op r = make(Op::STORE, 0, rs1, (int32_t(op) >> 25 << 5) | rd);
+        r.width = f3;
+        r.rs2 = rs2;
+        return r;
+      }
+      default:
+        return make(Op::OTHER, 0);
+    }
+  }
+
+  static Op decode16(uint32_t c) {
+    const int f3 = (c >> 13) & 7;
+    const int rd = (c >> 7) & 31, rs2 = (c >> 2) & 31;
+    const int rdc = 8 + ((c >> 7) & 7), rs2c = 8 + ((c >> 2) & 7);
+    const int32_t imm6 = sext(((c >> 7) & 0x20) | ((c >> 2) & 0x1f), 6);
+    switch (((c & 3) << 3) | f3) {
+      case 0b00000: {  // c.addi4spn
+        const int32_t imm = ((c >> 7) & 0x30) | ((c >> 1) & 0x3c0) |
+                            ((c >> 4) & 0x4) | ((c >> 2) & 0x8);
+        return (imm != 0) ? make(Op::ADDI, rs2c, 2, imm) : make(Op::OTHER, 0);
+      }
+      case 0b00010:    // c.lw
+      case 0b00110: {  // c.sw
+        const int32_t off =
+            ((c >> 7) & 0x38) | ((c >> 4) & 0x4) | ((c << 1) & 0x40);
+        Op r = make(f3 == 0b010 ? Op::LOAD : Op::STORE, rs2c, rdc, off);
+        r.width = 2;
+        r.rs2 = rs2c;
+        return r;
+      }
+      case 0b01000:  // c.addi
+        return (rd != 0) ? make(Op::ADDI, rd, rd, imm6) : make(Op::OTHER, 0);
+      case 0b01010:  // c.li
+        return (rd != 0) ? make(Op::ADDI, rd, 0, imm6) : make(Op::OTHER, 0);
+      case 0b01011:  // c.addi16sp / c.lui
+        if (rd == 2) {
+          const int32_t imm =
+              sext(((c >> 3) & 0x200) | ((c >> 2) & 0x10) | ((c << 1) & 0x40) |
+                       ((c << 4) & 0x180) | ((c << 3) & 0x20),
+                   10);
+          return make(Op::ADDI, 2, 2, imm);
+        }
+        return make(Op::ALU, rd);
+      case 0b01100:  // c.srli / c.srai / c.andi / c.sub / c.xor / c.or / c.and
+        return make(Op::ALU, rdc);
+      case 0b10000:  // c.slli
+        return make(Op::ALU, rd);
+      case 0b10010: {  // c.lwsp
+        Op r = make(Op::LOAD, rd, 2,
+                    ((c >> 7) & 0x20) | ((c >> 2) & 0x1c) | ((c << 4) & 0xc0));
+        r.width = 2;
+        return (rd != 0) ? r : make(Op::OTHER, 0);
+      }
+      case 0b10110: {  // c.swsp
+        Op r = make(Op::STORE, 0, 2, ((c >> 7) & 0x3c) | ((c >> 1) & 0xc0));
+        r.width = 2;
+        r.rs2 = rs2;
+        return r;
+      }
+      case 0b10100:  // c.mv / c.add (rs2 が 0 の場合は c.jr / c.jalr)
+        if (rs2 == 0) {
+          return make(Op::OTHER, 0);
+        }
+        return (c & 0x1000) ? make(Op::ALU, rd) : make(Op::ADDI, rd, rs2, 0);
+      default:
+        return make(Op::OTHER, 0);
+    }
+  }
+
+  static Op decode(const Insn &insn) {
+    if (insn.msg != NULL && insn.msg[0] == '.') {
+      return make(Op::OTHER, 0);  // dh() / dw() で埋め込んだデータ
+    }
+    switch (insn.kind) {
+      case FIX_NONE32:
+        return decode32(insn.op);
+      case FIX_NONE16:
+        return decode16(insn.cop);
+      default:
+        return make(Op::OTHER, 0);
+    }
+  }
+
+  static void set32(Insn &insn, uint32_t op, const char *msg) {
+    insn.op = op;
+    insn.cop = 0;
+    insn.kind = FIX_NONE32;
+    insn.size = 4;
+    insn.msg = msg;
+  }
+
+  static void set16(Insn &insn, uint32_t op, const char *msg) {
+    insn.op = 0;
+    insn.cop = uint16_t(op);
+    insn.kind = FIX_NONE16;
+    insn.size = 2;
+    insn.msg = msg;
+  }
+
+  static bool isCReg(int r) { return 8 <= r && r < 16; }
+
+  // insn を addi rd, rs1, imm に書き換える
+  // compress が true なら、表せる場合は圧縮命令にする
+  static bool setAddi(Insn &insn, int rd, int rs1, int32_t imm,
+                      bool compress) {
+    if (compress && rd != 0) {
+      if (rd == rs1 && imm != 0 && -32 <= imm && imm <= 31 &&
+          !(rd == 2 && (imm % 16) == 0)) {
+        set16(insn,
+              ((imm & 0x20) << 7) | (rd << 7) | ((imm & 0x1f) << 2) | 0b01,
+              "C.ADDI");
+        return true;
+      }
+      if (rs1 == 0 && -32 <= imm && imm <= 31) {
+        set16(insn,
+              (0b010 << 13) | ((imm & 0x20) << 7) | (rd << 7) |
+                  ((imm & 0x1f) << 2) | 0b01,
+              "C.LI");
+        return true;
+      }
+      if (imm == 0 && rs1 != 0) {
+        set16(insn, (0b100 << 13) | (rd << 7) | (rs1 << 2) | 0b10, "C.MV");
+        return true;
+      }
+      if (rd == 2 && rs1 == 2 && imm != 0 && -512 <= imm && imm <= 496 &&
+          (imm % 16) == 0) {
+        set16(insn,
+              (0b011 << 13) | ((imm & 0x200) << 3) | (2 << 7) |
+                  ((imm & 0x010) << 2) | ((imm & 0x040) >> 1) |
+                  ((imm & 0x180) >> 4) | ((imm & 0x020) >> 3) | 0b01,
+              "C.ADDI16SP");
+        return true;
+      }
+      if (isCReg(rd) && rs1 == 2 && imm != 0 && (imm & 0x3fc) == imm) {
+        set16(insn,
+              (((imm & 0x3c0) >> 4 | (imm & 0x30) << 2 | (imm & 0x8) >> 3 |
+                (imm & 0x4) >> 1)
+               << 5) |
+                  ((rd - 8) << 2),
+              "C.ADDI4SPN");
+        return true;
+      }
+    }
+    if (imm < -2048 || 2047 < imm) {
+      return false;
+    }
+    set32(insn,
+          (uint32_t(imm) << 20) | (rs1 << 15) | (rd << 7) | 0b0010011,
+          (imm != 0) ? "ADDI" : "MV");
+    return true;
+  }
+
+  // i の次の、削除していない命令の番号
+  size_t next(size_t i) const {
+    do {
+      ++i;
+    } while (i < insns.size() && dead[i]);
+    return i;
+  }
+
+  // from の後から to までの位置にラベルが定義されているか
+  bool hasLabel(size_t from, size_t to) const {
+    for (size_t i = from + 1; i <= to; ++i) {
+      if (labelAt[i]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void remove(size_t i) {
+    dead[i] = true;
+    ++removed;
+  }
+
+  // i 番目の命令から始まる規則を適用する
+  bool apply(size_t i) {
+    Insn &insn = insns[i];
+    const size_t j = next(i);
+
+    // 直後の命令への j / 条件分岐
+    if (insn.kind != FIX_NONE32 && insn.kind != FIX_NONE16 &&
+        insn.kind != FIX_AUIPC && insn.kind != FIX_CALL &&
+        insn.kind != FIX_LOAD && insn.kind != FIX_ALIGN) {
+      const uint32_t pos = env.labelPos[insn.label];
+      const bool link = (insn.kind == FIX_JAL || insn.kind == FIX_CJ) &&
+                        ((insn.op >> 7) & 31) != 0;
+      if (!link && pos != Env::UNDEFINED_POS && i < pos && next(i) >= pos) {
+        remove(i);
+        return true;
+      }
+      return false;
+    }
+
+    const Op a = decode(insn);
+    if (a.type == Op::ADDI && a.rd == a.rs1 && a.imm == 0 && a.rd != 0) {
+      remove(i);  // 自分自身への mv
+      return true;
+    }
+    if (j == insns.size()) {
+      return false;
+    }
+    Insn &insn2 = insns[j];
+    const Op b = decode(insn2);
+    const bool compress = insn.size == 2 || insn2.size == 2;
+
+    // addi rd, rs1, a / addi rd, rd, b -> addi rd, rs1, a + b
+    if (a.type == Op::ADDI && b.type == Op::ADDI && a.rd == b.rd &&
+        b.rs1 == a.rd && a.rd != 0 && !hasLabel(i, j)) {
+      Insn merged = insn;
+      if (setAddi(merged, a.rd, a.rs1, a.imm + b.imm, compress)) {
+        insn = merged;
+        remove(j);
+        return true;
+      }
+    }
+
+    // 同じ場所へのストアの直後のロード
+    if (a.type == Op::STORE && b.type == Op::LOAD && a.rs1 == b.rs1 &&
+        a.imm == b.imm && b.rd != 0 && !hasLabel(i, j)) {
+      if (a.width == 2 && b.width == 2) {  // sw / lw
+        if (b.rd == a.rs2) {
+          remove(j);
+        } else {
+          setAddi(insn2, b.rd, a.rs2, 0, compress);
+        }
+        return true;
+      }
+      if (a.width == 0 && b.width == 4) {  // sb / lbu
+        set32(insn2,
+              (0xffu << 20) | (a.rs2 << 15) | (0b111 << 12) | (b.rd << 7) |
+                  0b0010011,
+              "ANDI");
+        return true;
+      }
+    }
+
+    // 同じ場所への2回のストアの前の方
+    // 途中でレジスタの演算しかしていなければ、前のストアは読まれない
+    if (a.type == Op::STORE) {
+      size_t k = j;
+      for (int n = 0; n < WINDOW && k < insns.size(); ++n, k = next(k)) {
+        const Op c = decode(insns[k]);
+        if (c.type == Op::STORE) {
+          if (c.width == a.width && c.rs1 == a.rs1 && c.imm == a.imm) {
+            remove(i);
+            return true;
+          }
+          break;
+        }
+        if ((c.type != Op::ALU && c.type != Op::ADDI) || c.rd == a.rs1) {
+          break;
+        }
+      }
+    }
+    return false;
+  }
+
+ public:
+  explicit Peephole(Env &env)
+      : env(env), insns(env.insns), labelAt(), dead(), removed(0) {}
+
+  // 最適化して、削除した命令の数を返す
+  size_t run() {
+    if (env.direct) {
+      return 0;
+    }
+    env.flushCold();  // cold の命令を移動した後の並びで変換する
+    if (insns.empty()) {
+      return 0;
+    }
+    labelAt.assign(insns.size() + 1, false);
+    for (uint32_t pos : env.labelPos) {
+      if (pos != Env::UNDEFINED_POS) {
+        labelAt[pos] = true;
+      }
+    }
+    dead.assign(insns.size(), false);
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < insns.size(); i = next(i)) {
+        if (!dead[i] && apply(i)) {
+          changed = true;
+        }
+      }
+    }
+    if (removed != 0) {
+      compact();
+    }
+    return removed;
+  }
+
+ private:
+  // 削除した命令を詰めて、ラベルの位置と配置を作り直す
+  void compact() {
+    std::vector<uint32_t> newPos(insns.size() + 1);
+    size_t n = 0;
+    for (size_t i = 0; i < insns.size(); ++i) {
+      newPos[i] = uint32_t(n);
+      if (!dead[i]) {
+        insns[n++] = insns[i];
+      }
+    }
+    newPos[insns.size()] = uint32_t(n);
+    insns.resize(n);
+    for (uint32_t &pos : env.labelPos) {
+      if (pos != Env::UNDEFINED_POS) {
+        pos = newPos[pos];
+      }
+    }
+
+    // 分岐の長さは配置し直すので、最短の長さに戻しておく
+    env.relaxCount = 0;
+    env.offset = 0;
+    for (Insn &insn : insns) {
+      if (Env::isRelaxable(insn.kind)) {
+        insn.size = uint8_t(Env::sizeFor(insn.kind, 0));
+        ++env.relaxCount;
+      }
+      env.offset += insn.size;
+    }
+    env.laidOut = false;
+  }
+};
+
+}  // namespace internal
+};  // namespace RV32_asm
+
+#endif
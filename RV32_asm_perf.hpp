@@ -0,0 +1,255 @@
+#ifndef RV32_ASM_PERF_HPP_INCLUDED
+#define RV32_ASM_PERF_HPP_INCLUDED
+
+#include <cstdio>
+#include <ctime>
+
+#include "RV32_asm_base.hpp"
+#include "RV32_asm_listing.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/syscall.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Linux の perf への生成したコードの登録
+//
+// 生成したコードは perf からは名前の無いアドレスに見えるので、
+// /tmp/perf-<pid>.map に関数とラベルのアドレスと名前を書き出して
+// perf report でシンボルとして表示できるようにする。
+// JITDUMP を指定した場合は、コードのバイト列を含む jit-<pid>.dump も
+// 書き出すので、 perf inject --jit を通すと perf annotate で
+// 命令ごとの内訳まで確認できる。
+//
+// 使用例
+//   RV32_asm::PerfJit perf(RV32_asm::PerfJit::PERF_MAP |
+//                          RV32_asm::PerfJit::JITDUMP);
+//   RV32_asm::PerfListing listing(perf);
+//   gen.setListing(&listing);
+//   listing.setName("filter");
+//   auto *f = gen.generate<int (*)(int)>();  // ここで登録される
+//
+// jitdump を使う場合は次のように記録する。
+//   perf record -k mono ./a.out
+//   perf inject --jit -i perf.data -o perf.jit.data
+//   perf report -i perf.jit.data
+
+namespace RV32_asm {
+
+// perf に生成したコードを登録するためのファイルを書き出すクラス
+// 複数のスレッドの生成器から同時に使ってよい。
+class PerfJit {
+ public:
+  enum {
+    PERF_MAP = 1,  // /tmp/perf-<pid>.map を書き出す
+    JITDUMP = 2,   // <dir>/jit-<pid>.dump を書き出す
+  };
+
+ private:
+  enum {
+    JITDUMP_MAGIC = 0x4A695444,
+    JITDUMP_VERSION = 1,
+    JIT_CODE_LOAD = 0,
+    EM_RISCV = 243,
+  };
+
+  // jitdump のファイルヘッダ
+  struct DumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+  };
+
+  // JIT_CODE_LOAD レコード(この後に名前とコードのバイト列が続く)
+  struct CodeLoad {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+  };
+
+  std::mutex mutex;
+  FILE *map;
+  FILE *dump;
+  void *marker;  // perf が jitdump を見つけるための mmap
+  size_t markerSize;
+  uint64_t codeIndex;
+
+  PerfJit(const PerfJit &);
+  void operator=(const PerfJit &);
+
+  static uint32_t pid() {
+#if RV32_ASM_USE_MMAP
+    return uint32_t(getpid());
+#else
+    return 0;
+#endif
+  }
+
+  static uint32_t tid() {
+#ifdef __linux__
+    return uint32_t(syscall(SYS_gettid));
+#else
+    return pid();
+#endif
+  }
+
+  // perf record -k mono の時刻と合わせる
+  static uint64_t timestamp() {
+#ifdef __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+#else
+    return 0;
+#endif
+  }
+
+  void openDump(const char *dir) {
+#ifdef __linux__
+    char path[256];
+    snprintf(path, sizeof(path), "%s/jit-%u.dump", dir, pid());
+    const int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0) {
+      return;
+    }
+    // perf は実行可能として mmap されたファイルを jitdump として扱う
+    markerSize = size_t(sysconf(_SC_PAGESIZE));
+    marker = mmap(NULL, markerSize, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (marker == MAP_FAILED) {
+      marker = NULL;
+      close(fd);
+      return;
+    }
+    dump = fdopen(fd, "wb");
+    if (dump == NULL) {
+      close(fd);
+      return;
+    }
+    const DumpHeader h = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(DumpHeader),
+                          EM_RISCV, 0, pid(), timestamp(), 0};
+    fwrite(&h, sizeof(h), 1, dump);
+    fflush(dump);
+#else
+    (void)dir;
+#endif
+  }
+
+ public:
+  // flags は PERF_MAP と JITDUMP の組み合わせ
+  // dir は jitdump を書き出すディレクトリ(perf-<pid>.map は常に /tmp)
+  explicit PerfJit(int flags = PERF_MAP, const char *dir = "/tmp")
+      : map(NULL), dump(NULL), marker(NULL), markerSize(0), codeIndex(0) {
+    if (flags & PERF_MAP) {
+      char path[64];
+      snprintf(path, sizeof(path), "/tmp/perf-%u.map", pid());
+      map = fopen(path, "a");
+    }
+    if (flags & JITDUMP) {
+      openDump(dir);
+    }
+  }
+
+  ~PerfJit() {
+    if (map != NULL) {
+      fclose(map);
+    }
+    if (dump != NULL) {
+      fclose(dump);
+    }
+#if RV32_ASM_USE_MMAP
+    if (marker != NULL) {
+      munmap(marker, markerSize);
+    }
+#endif
+  }
+
+  // 指定したファイルを書き出せる状態か
+  bool hasMap() const { return map != NULL; }
+  bool hasDump() const { return dump != NULL; }
+
+  // code から size バイトのコードを name という名前で登録する
+  // jitdump にはこの時点のコードの内容を書き出すので、
+  // 実行可能になった後のコードを渡すこと。
+  void add(const void *code, size_t size, const char *name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (map != NULL) {
+      fprintf(map, "%llx %llx %s\n", (unsigned long long)(uintptr_t)code,
+              (unsigned long long)size, name);
+      fflush(map);
+    }
+    if (dump != NULL) {
+      const size_t nameSize = strlen(name) + 1;
+      const uint64_t addr = uint64_t(uintptr_t(code));
+      const CodeLoad r = {JIT_CODE_LOAD,
+                          uint32_t(sizeof(CodeLoad) + nameSize + size),
+                          timestamp(),
+                          pid(),
+                          tid(),
+                          addr,
+                          addr,
+                          uint64_t(size),
+                          codeIndex++};
+      fwrite(&r, sizeof(r), 1, dump);
+      fwrite(name, nameSize, 1, dump);
+      fwrite(code, size, 1, dump);
+      fflush(dump);
+    }
+  }
+};
+
+// 生成した関数とラベルを PerfJit に登録する sink
+// 名前付きのラベルがある場合は、ラベルから次のラベルまでの範囲を
+// "関数名:ラベル名" として分けて登録する。
+class PerfListing : public SymbolListing {
+  PerfJit &perf;
+  bool useLabels;
+  std::string symbol;  // 登録する名前の作業用
+
+  void operator=(const PerfListing &);
+
+ protected:
+  void addCode(const unsigned char *code, size_t size, const std::string &name,
+               const std::vector<Symbol> &symbols) {
+    // perf はシンボルが重なると扱えないので、ラベルで区切って登録する
+    const size_t n = useLabels ? symbols.size() : 0;
+    size_t start = 0;
+    const char *label = NULL;
+    for (size_t i = 0; i <= n; i++) {
+      const size_t end = (i < n) ? size_t(symbols[i].offset) : size;
+      if (end > start) {
+        symbol = name;
+        if (label != NULL) {
+          symbol += ':';
+          symbol += label;
+        }
+        perf.add(code + start, end - start, symbol.c_str());
+        start = end;
+      }
+      if (i < n && size_t(symbols[i].offset) < size) {
+        label = symbols[i].name.c_str();
+      }
+    }
+  }
+
+ public:
+  // labels が false の場合はラベルを登録せず、関数全体だけを登録する
+  explicit PerfListing(PerfJit &perf, ListingSink *next = NULL,
+                       bool labels = true)
+      : SymbolListing(next), perf(perf), useLabels(labels) {}
+};
+
+};  // namespace RV32_asm
+
+#endif
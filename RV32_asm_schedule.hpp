@@ -0,0 +1,517 @@
+#ifndef RV32_ASM_SCHEDULE_HPP_INCLUDED
+#define RV32_ASM_SCHEDULE_HPP_INCLUDED
+
+#include "RV32_asm_base.hpp"
+#include "RV32_asm_disasm.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// 記録した命令列の命令スケジューリング
+//
+// インオーダーのコアでは、ロードの結果をすぐ次の命令で使うと結果が
+// 出るまで止まってしまう。
+//   lbu a0, 0(s1) / addi a0, a0, 1 / addi s1, s1, 1
+//     ->  lbu a0, 0(s1) / addi s1, s1, 1 / addi a0, a0, 1
+// のように、依存関係の無い命令を間に移して待ち時間を埋める。
+//
+// ラベルと分岐、ジャンプ、ラベルを参照する命令、 CSR や fence などの
+// 命令で区切った直線的な区間ごとに、リストスケジューリングで並べ替える。
+// 優先度は区間の末尾までの最長の待ち時間で、コアの性質は Latency で指定する。
+// 並べ替えた方が待ち時間が短くなる区間だけを書き換える。
+// 命令レコードの順番を入れ替えるだけで命令の内容は変えないので、
+// 圧縮命令の形もそのまま保たれ、区間全体の長さも変わらない。
+// メモリの読み書きは、同じベースレジスタで範囲が重ならないと判る場合を除いて、
+// ストアをまたいで入れ替えない(ロード同士は入れ替える)。
+// dh() / dw() で埋め込んだデータ(".word" / ".long")は区間を区切る。
+
+namespace RV32_asm {
+
+// 命令スケジューリングで想定するコアの性質
+// 結果を使えるまでのサイクル数と、1サイクルに発行できる命令数で表す。
+// ロード・ストア、乗除算、浮動小数点数の演算はそれぞれ1サイクルに1命令とする。
+struct Latency {
+  unsigned int width;  // 1サイクルに発行できる命令数
+  unsigned int alu;    // 整数演算
+  unsigned int load;   // ロード(ロードした値を使えるまで)
+  unsigned int mul;    // 乗算
+  unsigned int div;    // 除算・剰余
+  unsigned int fpu;    // 浮動小数点数の演算・変換・比較
+  unsigned int fdiv;   // 浮動小数点数の除算・平方根
+};
+
+// 2命令を同時に発行できるインオーダーのコアを想定した値
+const Latency LATENCY_IN_ORDER_DUAL = {2, 1, 3, 3, 20, 4, 20};
+
+namespace internal {
+
+class Scheduler {
+  // 命令の種類(使う演算器)
+  enum Unit { ALU, MEM, MULDIV, FPU, BARRIER };
+
+  // スケジューリングの単位になる命令
+  struct Node {
+    int def;      // 書き込むレジスタ(x0 - x31 、浮動小数点数は 32 - 63)
+    int use[3];   // 読み込むレジスタ(無ければ -1)
+    Unit unit;
+    unsigned int latency;
+    bool load, store;
+    int base;              // ロード・ストアのベースレジスタ
+    int version;           // ベースレジスタの値の世代(書き込むたびに増える)
+    int32_t lo, hi;        // ロード・ストアの範囲 [lo, hi)
+    std::vector<std::pair<size_t, unsigned int> > succ;  // (後続, 待ち時間)
+    size_t preds;          // まだ並べていない先行命令の数
+    unsigned int height;   // 区間の末尾までの最長の待ち時間
+    unsigned int ready;    // 発行できる最も早いサイクル
+  };
+
+  Env &env;
+  std::vector<Insn> &insns;
+  const Latency &lat;
+  std::vector<bool> labelAt;  // 命令番号の位置にラベルが定義されているか
+  size_t saved;
+
+  Scheduler(const Scheduler &);
+  void operator=(const Scheduler &);
+
+  static int32_t offset32(uint32_t c, bool store) {
+    return store ? sext(bits(c, 25, 7, 5) | bits(c, 7, 5), 12)
+                 : sext(bits(c, 20, 12), 12);
+  }
+
+  // ロード・ストアで読み書きするバイト数
+  static int accessSize(uint32_t c, Disassembler::Format format) {
+    switch (format) {
+      case Disassembler::LOAD:
+      case Disassembler::STORE:
+      case Disassembler::FLOAD:
+      case Disassembler::FSTORE:
+        return 1 << bits(c, 12, 2);  // funct3 の下位2ビット
+      case Disassembler::C_FLD:
+      case Disassembler::C_FLDSP:
+      case Disassembler::C_FSDSP:
+        return 8;
+      default:
+        return 4;
+    }
+  }
+
+  // 命令レコードを解釈して、読み書きするレジスタと種類を求める
+  // 並べ替えられない命令は BARRIER にする
+  Node decode(const Insn &insn) const {
+    Node n;
+    n.def = -1;
+    n.use[0] = n.use[1] = n.use[2] = -1;
+    n.unit = BARRIER;
+    n.latency = 0;
+    n.load = n.store = false;
+    n.base = -1;
+    n.version = 0;
+    n.lo = n.hi = 0;
+    n.preds = 0;
+    n.height = 0;
+    n.ready = 0;
+    if ((insn.kind != FIX_NONE32 && insn.kind != FIX_NONE16) ||
+        (insn.msg != NULL && insn.msg[0] == '.')) {
+      return n;  // ラベルを参照する命令と、 dh() / dw() で埋め込んだデータ
+    }
+    const uint32_t c = insn.kind == FIX_NONE32 ? insn.op : insn.cop;
+    Disassembler::Insn d;
+    if (!Disassembler::decode(c, d)) {
+      return n;
+    }
+    const char *m = d.mnemonic;
+    const int rd = int(bits(c, 7, 5)), rs1 = int(bits(c, 15, 5));
+    const int rs2 = int(bits(c, 20, 5)), rs3 = int(bits(c, 27, 5));
+    const int crd = int(bits(c, 2, 3)) + 8, crs1 = int(bits(c, 7, 3)) + 8;
+    const int c2 = int(bits(c, 2, 5));  // 16ビット命令の rs2
+    const int F = 32;
+    Unit unit = ALU;
+    int32_t offset = 0;
+    switch (d.format) {
+      case Disassembler::U:
+        if (strcmp(m, "LUI") != 0) {
+          return n;  // auipc は位置によって値が変わる
+        }
+        n.def = rd;
+        break;
+      case Disassembler::I:
+      case Disassembler::SHIFT:
+        n.def = rd;
+        n.use[0] = rs1;
+        break;
+      case Disassembler::R:
+        n.def = rd;
+        n.use[0] = rs1;
+        n.use[1] = rs2;
+        if (m[0] == 'M') {
+          unit = MULDIV;
+          n.latency = lat.mul;
+        } else if (m[0] == 'D' || m[0] == 'R') {
+          unit = MULDIV;
+          n.latency = lat.div;
+        }
+        break;
+      case Disassembler::LOAD:
+        if (strcmp(m, "JALR") == 0) {
+          return n;
+        }
+        n.def = rd;
+        n.use[0] = rs1;
+        n.load = true;
+        offset = offset32(c, false);
+        break;
+      case Disassembler::STORE:
+        n.use[0] = rs1;
+        n.use[1] = rs2;
+        n.store = true;
+        offset = offset32(c, true);
+        break;
+      case Disassembler::FLOAD:
+        n.def = F + rd;
+        n.use[0] = rs1;
+        n.load = true;
+        offset = offset32(c, false);
+        break;
+      case Disassembler::FSTORE:
+        n.use[0] = rs1;
+        n.use[1] = F + rs2;
+        n.store = true;
+        offset = offset32(c, true);
+        break;
+      case Disassembler::FR4:
+        n.use[2] = F + rs3;
+        // fall through
+      case Disassembler::FR:
+        n.use[1] = F + rs2;
+        // fall through
+      case Disassembler::FR1:
+        n.def = F + rd;
+        n.use[0] = F + rs1;
+        unit = FPU;
+        break;
+      case Disassembler::FCMP:
+        n.use[1] = F + rs2;
+        // fall through
+      case Disassembler::F2X:
+        n.def = rd;
+        n.use[0] = F + rs1;
+        unit = FPU;
+        break;
+      case Disassembler::X2F:
+        n.def = F + rd;
+        n.use[0] = rs1;
+        unit = FPU;
+        break;
+      case Disassembler::C_ADDI4SPN:
+        n.def = crd;
+        n.use[0] = 2;
+        break;
+      case Disassembler::C_LW:
+      case Disassembler::C_FLW:
+      case Disassembler::C_FLD: {
+        const bool fp = d.format != Disassembler::C_LW;
+        n.store = bits(c, 15, 1) != 0;  // c.sw / c.fsw / c.fsd
+        n.load = !n.store;
+        n.use[0] = crs1;
+        if (n.load) {
+          n.def = (fp ? F : 0) + crd;
+        } else {
+          n.use[1] = (fp ? F : 0) + crd;
+        }
+        offset = int32_t(bits(c, 10, 3, 3) |
+                         (d.format == Disassembler::C_FLD
+                              ? bits(c, 5, 2, 6)
+                              : bits(c, 6, 1, 2) | bits(c, 5, 1, 6)));
+        break;
+      }
+      case Disassembler::C_RI:
+        n.def = rd;
+        if (strcmp(m, "C.ADDI") == 0) {
+          n.use[0] = rd;
+        }
+        break;
+      case Disassembler::C_ADDI16SP:
+        n.def = n.use[0] = 2;
+        break;
+      case Disassembler::C_LUI:
+        n.def = rd;
+        break;
+      case Disassembler::C_SHIFTC:
+      case Disassembler::C_ANDI:
+        n.def = n.use[0] = crs1;
+        break;
+      case Disassembler::C_CA:
+        n.def = n.use[0] = crs1;
+        n.use[1] = crd;
+        break;
+      case Disassembler::C_SLLI:
+        n.def = n.use[0] = rd;
+        break;
+      case Disassembler::C_LWSP:
+      case Disassembler::C_FLWSP:
+        n.def = (d.format == Disassembler::C_FLWSP ? F : 0) + rd;
+        n.use[0] = 2;
+        n.load = true;
+        offset = int32_t(bits(c, 12, 1, 5) | bits(c, 4, 3, 2) |
+                         bits(c, 2, 2, 6));
+        break;
+      case Disassembler::C_FLDSP:
+        n.def = F + rd;
+        n.use[0] = 2;
+        n.load = true;
+        offset = int32_t(bits(c, 12, 1, 5) | bits(c, 5, 2, 3) |
+                         bits(c, 2, 3, 6));
+        break;
+      case Disassembler::C_MV:
+        n.def = rd;
+        n.use[0] = c2;
+        if (strcmp(m, "C.ADD") == 0) {
+          n.use[1] = rd;
+        }
+        break;
+      case Disassembler::C_SWSP:
+      case Disassembler::C_FSWSP:
+        n.use[0] = 2;
+        n.use[1] = (d.format == Disassembler::C_FSWSP ? F : 0) + c2;
+        n.store = true;
+        offset = int32_t(bits(c, 9, 4, 2) | bits(c, 7, 2, 6));
+        break;
+      case Disassembler::C_FSDSP:
+        n.use[0] = 2;
+        n.use[1] = F + c2;
+        n.store = true;
+        offset = int32_t(bits(c, 10, 3, 3) | bits(c, 7, 3, 6));
+        break;
+      default:
+        return n;  // 分岐、ジャンプ、 CSR 、 fence 、アトミック命令など
+    }
+
+    n.unit = unit;
+    if (n.load || n.store) {
+      n.unit = MEM;
+      n.base = n.use[0];
+      n.lo = offset;
+      n.hi = offset + accessSize(c, d.format);
+    }
+    if (unit == FPU) {
+      const bool divide = strncmp(m, "FDIV", 4) == 0 ||
+                          strncmp(m, "FSQRT", 5) == 0;
+      n.latency = divide ? lat.fdiv : lat.fpu;
+    } else if (n.load) {
+      n.latency = lat.load;
+    } else if (unit == ALU) {
+      n.latency = lat.alu;
+    }
+    if (n.def == 0) {
+      n.def = -1;  // x0 への書き込みは依存関係を作らない
+    }
+    for (int &u : n.use) {
+      if (u == 0) {
+        u = -1;
+      }
+    }
+    return n;
+  }
+
+  // 2つのロード・ストアが同じ場所を読み書きする可能性があるか
+  static bool mayAlias(const Node &a, const Node &b) {
+    if (a.base == b.base && a.version == b.version) {
+      return a.lo < b.hi && b.lo < a.hi;
+    }
+    return true;
+  }
+
+  // 依存関係のグラフを作る
+  static void build(std::vector<Node> &nodes) {
+    int lastDef[64];
+    int version[64] = {0};
+    std::vector<size_t> readers[64];  // 最後の書き込みの後で読んだ命令
+    std::fill(lastDef, lastDef + 64, -1);
+    auto edge = [&nodes](size_t from, size_t to, unsigned int latency) {
+      nodes[from].succ.push_back(std::make_pair(to, latency));
+      ++nodes[to].preds;
+    };
+    for (size_t j = 0; j < nodes.size(); ++j) {
+      Node &n = nodes[j];
+      if (n.base >= 0) {
+        n.version = version[n.base];
+      }
+      for (int u : n.use) {
+        if (u >= 0) {
+          if (lastDef[u] >= 0) {
+            edge(size_t(lastDef[u]), j, nodes[size_t(lastDef[u])].latency);
+          }
+          readers[u].push_back(j);
+        }
+      }
+      if (n.load || n.store) {
+        for (size_t i = 0; i < j; ++i) {
+          const Node &m = nodes[i];
+          if ((m.store || (m.load && n.store)) && mayAlias(m, n)) {
+            edge(i, j, 0);
+          }
+        }
+      }
+      if (n.def >= 0) {
+        for (size_t r : readers[n.def]) {
+          if (r != j) {
+            edge(r, j, 0);  // 読み込みより前に書き込まない
+          }
+        }
+        if (lastDef[n.def] >= 0) {
+          edge(size_t(lastDef[n.def]), j, 0);
+        }
+        readers[n.def].clear();
+        lastDef[n.def] = int(j);
+        ++version[n.def];
+      }
+    }
+    // 末尾までの最長の待ち時間(後ろから求める)
+    for (size_t j = nodes.size(); j-- > 0;) {
+      Node &n = nodes[j];
+      n.height = n.latency;
+      for (const auto &s : n.succ) {
+        n.height = std::max(n.height, s.second + nodes[s.first].height);
+      }
+    }
+  }
+
+  // order の順にインオーダーで発行した場合のサイクル数を見積もる
+  unsigned int estimate(const std::vector<Node> &nodes,
+                        const std::vector<size_t> &order) const {
+    unsigned int ready[64] = {0};
+    unsigned int cycle = 0, issued = 0;
+    bool busy[BARRIER] = {false};
+    unsigned int end = 0;
+    for (size_t i : order) {
+      const Node &n = nodes[i];
+      unsigned int t = cycle;
+      for (int u : n.use) {
+        if (u >= 0) {
+          t = std::max(t, ready[u]);
+        }
+      }
+      const bool full = issued == lat.width || (n.unit != ALU && busy[n.unit]);
+      if (t == cycle && full) {
+        ++t;
+      }
+      if (t != cycle) {
+        cycle = t;
+        issued = 0;
+        std::fill(busy, busy + BARRIER, false);
+      }
+      ++issued;
+      busy[n.unit] = true;
+      if (n.def >= 0) {
+        ready[n.def] = cycle + n.latency;
+      }
+      end = std::max(end, cycle + 1);
+    }
+    return end;
+  }
+
+  // nodes をリストスケジューリングで並べた順番を返す
+  std::vector<size_t> schedule(std::vector<Node> &nodes) const {
+    std::vector<size_t> order;
+    std::vector<bool> done(nodes.size(), false);
+    unsigned int cycle = 0;
+    while (order.size() < nodes.size()) {
+      unsigned int issued = 0;
+      bool busy[BARRIER] = {false};
+      for (;;) {
+        // 発行できる命令のうち、優先度の最も高いもの(同じなら元の順番)
+        size_t best = nodes.size();
+        for (size_t i = 0; i < nodes.size(); ++i) {
+          const Node &n = nodes[i];
+          if (done[i] || n.preds != 0 || n.ready > cycle ||
+              (n.unit != ALU && busy[n.unit])) {
+            continue;
+          }
+          if (best == nodes.size() || n.height > nodes[best].height) {
+            best = i;
+          }
+        }
+        if (best == nodes.size() || issued == lat.width) {
+          break;
+        }
+        done[best] = true;
+        order.push_back(best);
+        ++issued;
+        busy[nodes[best].unit] = true;
+        for (const auto &s : nodes[best].succ) {
+          Node &n = nodes[s.first];
+          --n.preds;
+          n.ready = std::max(n.ready, cycle + s.second);
+        }
+      }
+      ++cycle;
+    }
+    return order;
+  }
+
+  // 命令番号 [begin, end) の区間を並べ替える
+  void region(size_t begin, size_t end, std::vector<Node> &nodes) {
+    if (end - begin < 2) {
+      return;
+    }
+    build(nodes);
+    std::vector<size_t> original(nodes.size());
+    for (size_t i = 0; i < original.size(); ++i) {
+      original[i] = i;
+    }
+    const std::vector<size_t> order = schedule(nodes);
+    const unsigned int before = estimate(nodes, original);
+    const unsigned int after = estimate(nodes, order);
+    if (after >= before) {
+      return;
+    }
+    std::vector<Insn> copy(insns.begin() + begin, insns.begin() + end);
+    for (size_t i = 0; i < order.size(); ++i) {
+      insns[begin + i] = copy[order[i]];
+    }
+    saved += before - after;
+  }
+
+ public:
+  Scheduler(Env &env, const Latency &lat)
+      : env(env), insns(env.insns), lat(lat), labelAt(), saved(0) {}
+
+  // 並べ替えて、見積もりで減ったサイクル数の合計を返す
+  size_t run() {
+    if (env.direct) {
+      return 0;
+    }
+    env.flushCold();  // cold の命令を移動した後の並びで変換する
+    if (insns.empty() || lat.width == 0) {
+      return 0;
+    }
+    labelAt.assign(insns.size() + 1, false);
+    for (uint32_t pos : env.labelPos) {
+      if (pos != Env::UNDEFINED_POS) {
+        labelAt[pos] = true;
+      }
+    }
+
+    std::vector<Node> nodes;
+    size_t begin = 0;
+    for (size_t i = 0; i <= insns.size(); ++i) {
+      Node n;
+      const bool barrier =
+          i == insns.size() || (n = decode(insns[i])).unit == BARRIER;
+      if (barrier || labelAt[i]) {
+        region(begin, i, nodes);
+        nodes.clear();
+        begin = barrier ? i + 1 : i;
+      }
+      if (!barrier) {
+        nodes.push_back(n);
+      }
+    }
+    env.laidOut = false;
+    return saved;
+  }
+};
+
+}  // namespace internal
+};  // namespace RV32_asm
+
+#endif
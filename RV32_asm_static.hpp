@@ -0,0 +1,508 @@
+#ifndef RV32_ASM_STATIC_HPP_INCLUDED
+#define RV32_ASM_STATIC_HPP_INCLUDED
+
+#include <array>
+#include <utility>
+
+#include "RV32_asm_base.hpp"
+
+namespace RV32_asm {
+
+////////////////////////////////////////////////////////////////////////////////
+// コンパイル時に命令列を組み立てるための定義
+//
+// 固定のスタブやトランポリンをコンパイル時にオペコードの配列にしておき、
+// 実行時はコピーして必要な即値を埋めるだけで済ませるためのもの。
+// 使用できるのは RV32I と RV32M の命令、およびそれらの疑似命令で、
+// Compressed が true の場合は実行時の RV32GC と同じ Format の関数で
+// 圧縮命令を選択する(同じ命令列からは同じオペコードになる)。
+//
+// 使用例
+//   struct Stub : RV32_asm::StaticGenerator<16> {
+//     constexpr Stub() {
+//       StaticLabel l = newLabel();
+//       L(l);
+//       addi(a0, a0, -1);
+//       bnez(a0, l);
+//       ret();
+//     }
+//   };
+//   constexpr Stub stub;
+//   constexpr auto code = stub.halfwords<stub.size()>();
+
+// StaticGenerator で使うラベル
+struct StaticLabel {
+  label_id_t id;
+};
+
+template <size_t N, bool Compressed = true>
+class StaticGenerator : protected Format, public Registers<> {
+  static const label_id_t UNDEFINED_POS = 0xffffffff;
+
+  Insn insns[N];
+  size_t count;
+  label_id_t labelPos[N];  // ラベルの直後の命令のインデックス
+  size_t labelCount;
+
+  // 分岐の緩和を行った結果
+  struct Layout {
+    uint8_t size[N];
+    address_offset_t offset[N + 1];
+  };
+
+  // オペコードを2バイト単位で書き出す
+  struct Writer {
+    uint16_t *buf;
+    size_t *pos;
+    constexpr void operator()(uint32_t op, int size, const char *) const {
+      buf[(*pos)++] = uint16_t(op);
+      if (size == 4) {
+        buf[(*pos)++] = uint16_t(op >> 16);
+      }
+    }
+  };
+
+  template <size_t M>
+  struct Buffer {
+    uint16_t h[M];
+  };
+
+  constexpr void push(uint32_t op, uint16_t cop, FixupKind kind, int size,
+                      label_id_t label, const char *msg) {
+    assert(count < N);
+    insns[count] = Insn{op, 0, label, cop, uint8_t(kind), uint8_t(size), msg};
+    ++count;
+  }
+
+  // Env::layout() と同じく、範囲外の分岐だけを伸ばしていく
+  constexpr Layout layout() const {
+    Layout l{};
+    for (size_t i = 0; i < count; ++i) {
+      l.size[i] = insns[i].size;
+    }
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      address_offset_t off = 0;
+      for (size_t i = 0; i < count; ++i) {
+        l.offset[i] = off;
+        off += l.size[i];
+      }
+      l.offset[count] = off;
+      for (size_t i = 0; i < count; ++i) {
+        const Insn &insn = insns[i];
+        if (!Env::isRelaxable(insn.kind)) {
+          continue;
+        }
+        const int size =
+            Env::sizeFor(insn.kind, target(l, insn.label) - l.offset[i]);
+        if (size > l.size[i]) {
+          l.size[i] = uint8_t(size);
+          changed = true;
+        }
+      }
+    }
+    return l;
+  }
+
+  constexpr address_offset_t target(const Layout &l, label_id_t id) const {
+    assert(id < labelCount && labelPos[id] != UNDEFINED_POS);
+    return l.offset[labelPos[id]];
+  }
+
+  template <size_t M>
+  constexpr Buffer<M> encode() const {
+    Buffer<M> buf{};
+    size_t pos = 0;
+    const Writer out = {buf.h, &pos};
+    const Layout l = layout();
+    for (size_t i = 0; i < count; ++i) {
+      Insn insn = insns[i];
+      insn.size = l.size[i];
+      if (insn.kind == FIX_NONE32 || insn.kind == FIX_NONE16) {
+        out(insn.op, insn.size, insn.msg);
+      } else {
+        Env::encode(insn, target(l, insn.label) - l.offset[i], out);
+      }
+    }
+    assert(pos == M);
+    return buf;
+  }
+
+  template <size_t M, size_t... Is>
+  constexpr static std::array<uint16_t, sizeof...(Is)> toHalfwords(
+      const Buffer<M> &buf, std::index_sequence<Is...>) {
+    return std::array<uint16_t, sizeof...(Is)>{{buf.h[Is]...}};
+  }
+
+  template <size_t M, size_t... Is>
+  constexpr static std::array<uint32_t, sizeof...(Is)> toWords(
+      const Buffer<M> &buf, std::index_sequence<Is...>) {
+    return std::array<uint32_t, sizeof...(Is)>{
+        {(buf.h[Is * 2] | (uint32_t(buf.h[Is * 2 + 1]) << 16))...}};
+  }
+
+ public:
+  constexpr StaticGenerator()
+      : Format(), Registers<>(), insns{}, count(0), labelPos{}, labelCount(0) {}
+
+  //////////////////////////////////////////////////////////////////
+  // 生成結果の取得
+
+  // 命令列のバイト数
+  constexpr size_t size() const { return layout().offset[count]; }
+
+  // ラベルのオフセット(即値を後から埋める位置を調べるのに使う)
+  constexpr address_offset_t offsetOf(const StaticLabel &label) const {
+    return target(layout(), label.id);
+  }
+
+  // 2バイト単位の配列として取得する
+  // Size には size() を指定する
+  template <size_t Size>
+  constexpr std::array<uint16_t, Size / 2> halfwords() const {
+    static_assert(Size % 2 == 0, "size must be a multiple of 2");
+    return toHalfwords(encode<Size / 2>(),
+                       std::make_index_sequence<Size / 2>());
+  }
+
+  // 4バイト単位の配列として取得する
+  // Size には size() を指定する
+  template <size_t Size>
+  constexpr std::array<uint32_t, Size / 4> words() const {
+    static_assert(Size % 4 == 0, "size must be a multiple of 4");
+    return toWords(encode<Size / 2>(), std::make_index_sequence<Size / 4>());
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 命令・ラベルの登録関数
+
+  constexpr void dw(uint32_t op, const char *msg = ".long") {
+    push(op, 0, FIX_NONE32, 4, 0, msg);
+  }
+  constexpr void dh(uint32_t op, const char *msg = ".word") {
+    push(op, 0, FIX_NONE16, 2, 0, msg);
+  }
+
+  constexpr StaticLabel newLabel() {
+    assert(labelCount < N);
+    labelPos[labelCount] = UNDEFINED_POS;
+    return StaticLabel{label_id_t(labelCount++)};
+  }
+  constexpr void L(const StaticLabel &label) {
+    assert(label.id < labelCount);
+    labelPos[label.id] = label_id_t(count);
+  }
+
+ protected:
+  constexpr void ref(FixupKind kind, uint32_t op, uint16_t cop,
+                     const StaticLabel &label, const char *msg) {
+    push(op, cop, kind, Env::sizeFor(kind, 0), label.id, msg);
+  }
+
+  constexpr void R(int opcode, int funct7, int funct3, const Reg &rd,
+                   const Reg &rs1, const Reg &rs2, const char *msg) {
+    dw(R_(opcode, funct7, funct3, rd, rs1, rs2), msg);
+  }
+  constexpr void I(int opcode, int funct3, const Reg &rd, const Reg &rs1,
+                   address_offset_t imm, const char *msg) {
+    dw(I_(opcode, funct3, rd, rs1, imm), msg);
+  }
+  constexpr void S(int opcode, int funct3, const Reg &rs1, const Reg &rs2,
+                   address_offset_t imm, const char *msg) {
+    dw(S_(opcode, funct3, rs1, rs2, imm), msg);
+  }
+  // 圧縮命令を選べた場合は書き出して true を返す
+  constexpr bool C(const CInsn &c) {
+    if (!Compressed || c.op == 0) {
+      return false;
+    }
+    dh(c.op, c.msg);
+    return true;
+  }
+  constexpr void B(int funct3, const Reg &rs1, const Reg &rs2,
+                   const StaticLabel &label, const char *msg) {
+    if (Compressed && rs1.isCReg() && rs2 == zero &&
+        (funct3 == 0b000 || funct3 == 0b001)) {
+      // c.beqz / c.bnez
+      const int cop = (funct3 == 0b000) ? 0b110 : 0b111;
+      ref(FIX_CBZ, B_(0b1100011, funct3, rs1, zero, 0),
+          uint16_t((cop << 13) | (rs1.getCIdx() << 7) | 0b01), label,
+          (funct3 == 0b000) ? "C.BEQZ" : "C.BNEZ");
+    } else {
+      ref(FIX_BRANCH, B_(0b1100011, funct3, rs1, rs2, 0), 0, label, msg);
+    }
+  }
+
+ public:
+  //////////////////////////////////////////////////////////////////
+  // RV32I
+
+  constexpr void lui(const Reg &rd, uint32_t imm) {
+    assert(imm <= 1048575);
+    if (!C(cLui(rd, imm))) {
+      dw(U_(0b0110111, rd, imm << 12), "LUI");
+    }
+  }
+
+  constexpr void auipc(const Reg &rd, const StaticLabel &label) {
+    ref(FIX_AUIPC, U_(0b0010111, rd, 0), 0, label, "AUIPC");
+  }
+
+  constexpr void jal(const Reg &rd, const StaticLabel &label) {
+    if (Compressed && (rd == x0 || rd == x1)) {
+      const int bits = (rd == x0) ? 0b101 : 0b001;
+      ref(FIX_CJ, U_(0b1101111, rd, 0), uint16_t((bits << 13) | 0b01), label,
+          (rd == x0) ? "C.J" : "C.JAL");
+    } else {
+      ref(FIX_JAL, U_(0b1101111, rd, 0), 0, label, "JAL");
+    }
+  }
+
+  constexpr void jalr(const Reg &rd, const OffsetReg32 &or1) {
+    if (!C(cJalr(rd, or1))) {
+      I(0b1100111, 0b000, rd, or1.getReg(), or1.getOffset(), "JALR");
+    }
+  }
+
+  constexpr void beq(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    B(0b000, rs1, rs2, l, "BEQ");
+  }
+  constexpr void bne(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    B(0b001, rs1, rs2, l, "BNE");
+  }
+  constexpr void blt(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    B(0b100, rs1, rs2, l, "BLT");
+  }
+  constexpr void bge(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    B(0b101, rs1, rs2, l, "BGE");
+  }
+  constexpr void bltu(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    B(0b110, rs1, rs2, l, "BLTU");
+  }
+  constexpr void bgeu(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    B(0b111, rs1, rs2, l, "BGEU");
+  }
+
+  constexpr void lb(const Reg &rd, const OffsetReg32 &or1) {
+    I(0b0000011, 0b000, rd, or1.getReg(), or1.getOffset(), "LB");
+  }
+  constexpr void lh(const Reg &rd, const OffsetReg32 &or1) {
+    I(0b0000011, 0b001, rd, or1.getReg(), or1.getOffset(), "LH");
+  }
+  constexpr void lw(const Reg &rd, const OffsetReg32 &or1) {
+    if (!C(cLw(rd, or1))) {
+      I(0b0000011, 0b010, rd, or1.getReg(), or1.getOffset(), "LW");
+    }
+  }
+  constexpr void lbu(const Reg &rd, const OffsetReg32 &or1) {
+    I(0b0000011, 0b100, rd, or1.getReg(), or1.getOffset(), "LBU");
+  }
+  constexpr void lhu(const Reg &rd, const OffsetReg32 &or1) {
+    I(0b0000011, 0b101, rd, or1.getReg(), or1.getOffset(), "LHU");
+  }
+
+  constexpr void sb(const Reg &rs2, const OffsetReg32 &or1) {
+    S(0b0100011, 0b000, or1.getReg(), rs2, or1.getOffset(), "SB");
+  }
+  constexpr void sh(const Reg &rs2, const OffsetReg32 &or1) {
+    S(0b0100011, 0b001, or1.getReg(), rs2, or1.getOffset(), "SH");
+  }
+  constexpr void sw(const Reg &rs2, const OffsetReg32 &or1) {
+    if (!C(cSw(rs2, or1))) {
+      S(0b0100011, 0b010, or1.getReg(), rs2, or1.getOffset(), "SW");
+    }
+  }
+
+  constexpr void addi(const Reg &rd, const Reg &rs1, int32_t imm) {
+    if (!C(cAddi(rd, rs1, imm))) {
+      I(0b0010011, 0b000, rd, rs1, imm,
+        (imm != 0) ? "ADDI" : (rd == zero && rs1 == zero) ? "NOP" : "MV");
+    }
+  }
+  constexpr void slti(const Reg &rd, const Reg &rs1, int32_t imm) {
+    I(0b0010011, 0b010, rd, rs1, imm, "SLTI");
+  }
+  constexpr void sltiu(const Reg &rd, const Reg &rs1, int32_t imm) {
+    I(0b0010011, 0b011, rd, rs1, imm, "SLTIU");
+  }
+  constexpr void xori(const Reg &rd, const Reg &rs1, int32_t imm) {
+    I(0b0010011, 0b100, rd, rs1, imm, "XORI");
+  }
+  constexpr void ori(const Reg &rd, const Reg &rs1, int32_t imm) {
+    I(0b0010011, 0b110, rd, rs1, imm, "ORI");
+  }
+  constexpr void andi(const Reg &rd, const Reg &rs1, int32_t imm) {
+    if (!C(cShiftAndi(0b10, rd, rs1, imm, "C.ANDI"))) {
+      I(0b0010011, 0b111, rd, rs1, imm, "ANDI");
+    }
+  }
+  constexpr void slli(const Reg &rd, const Reg &rs1, int32_t imm) {
+    assert((imm & 0x1f) == imm);
+    if (!C(cSlli(rd, rs1, imm))) {
+      I(0b0010011, 0b001, rd, rs1, imm, "SLLI");
+    }
+  }
+  constexpr void srli(const Reg &rd, const Reg &rs1, int32_t imm) {
+    assert((imm & 0x1f) == imm);
+    if (!C(cShiftAndi(0b00, rd, rs1, imm, "C.SRLI"))) {
+      I(0b0010011, 0b101, rd, rs1, imm, "SRLI");
+    }
+  }
+  constexpr void srai(const Reg &rd, const Reg &rs1, int32_t imm) {
+    assert((imm & 0x1f) == imm);
+    if (!C(cShiftAndi(0b01, rd, rs1, imm, "C.SRAI"))) {
+      I(0b0010011, 0b101, rd, rs1, 0b010000000000 | imm, "SRAI");
+    }
+  }
+
+  constexpr void add(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    if (!C(cAdd(rd, rs1, rs2))) {
+      R(0b0110011, 0b0000000, 0b000, rd, rs1, rs2, "ADD");
+    }
+  }
+  constexpr void sub(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    if (!C(cArith(0b00, rd, rs1, rs2, "C.SUB"))) {
+      R(0b0110011, 0b0100000, 0b000, rd, rs1, rs2, "SUB");
+    }
+  }
+  constexpr void sll(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000000, 0b001, rd, rs1, rs2, "SLL");
+  }
+  constexpr void slt(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000000, 0b010, rd, rs1, rs2, "SLT");
+  }
+  constexpr void sltu(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000000, 0b011, rd, rs1, rs2, "SLTU");
+  }
+  constexpr void x\
+or(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    if (!C(cArith(0b01, rd, rs1, rs2, "C.XOR"))) {
+      R(0b0110011, 0b0000000, 0b100, rd, rs1, rs2, "XOR");
+    }
+  }
+  constexpr void srl(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000000, 0b101, rd, rs1, rs2, "SRL");
+  }
+  constexpr void sra(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0100000, 0b101, rd, rs1, rs2, "SRA");
+  }
+  constexpr void or (const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    if (!C(cArith(0b10, rd, rs1, rs2, "C.OR"))) {
+      R(0b0110011, 0b0000000, 0b110, rd, rs1, rs2, "OR");
+    }
+  }
+  constexpr void and (const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    if (!C(cArith(0b11, rd, rs1, rs2, "C.AND"))) {
+      R(0b0110011, 0b0000000, 0b111, rd, rs1, rs2, "AND");
+    }
+  }
+
+  constexpr void ecall() { dw(0x00000073, "ECALL"); }
+  constexpr void ebreak() { dw(0x00100073, "EBREAK"); }
+
+  //////////////////////////////////////////////////////////////////
+  // RV32M
+
+  constexpr void mul(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b000, rd, rs1, rs2, "MUL");
+  }
+  constexpr void mulh(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b001, rd, rs1, rs2, "MULH");
+  }
+  constexpr void mulhsu(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b010, rd, rs1, rs2, "MULHSU");
+  }
+  constexpr void mulhu(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b011, rd, rs1, rs2, "MULHU");
+  }
+  constexpr void div(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b100, rd, rs1, rs2, "DIV");
+  }
+  constexpr void divu(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b101, rd, rs1, rs2, "DIVU");
+  }
+  constexpr void rem(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b110, rd, rs1, rs2, "REM");
+  }
+  constexpr void remu(const Reg &rd, const Reg &rs1, const Reg &rs2) {
+    R(0b0110011, 0b0000001, 0b111, rd, rs1, rs2, "REMU");
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 疑似命令
+
+  constexpr void nop() {
+    if (Compressed) {
+      dh(0x0001, "C.NOP");
+    } else {
+      I(0b0010011, 0b000, zero, zero, 0, "NOP");
+    }
+  }
+  constexpr void li(const Reg &rd, uint32_t imm) {
+    const LiPlan plan = planLi(imm, Compressed && rd != zero, rd.isCReg());
+    for (int i = 0; i < plan.count; ++i) {
+      const int32_t v = plan.imm[i];
+      switch (plan.step[i]) {
+        case LI_ADDI0:
+          addi(rd, zero, v);
+          break;
+        case LI_LUI:
+          lui(rd, uint32_t(v));
+          break;
+        case LI_ADDI:
+          addi(rd, rd, v);
+          break;
+        case LI_SLLI:
+          slli(rd, rd, v);
+          break;
+        case LI_SRLI:
+          srli(rd, rd, v);
+          break;
+        case LI_SRAI:
+          srai(rd, rd, v);
+          break;
+      }
+    }
+  }
+  constexpr void mv(const Reg &rd, const Reg &rs1) { addi(rd, rs1, 0); }
+  constexpr void not(const Reg &rd, const Reg &rs1) { xori(rd, rs1, -1); }
+  constexpr void neg(const Reg &rd, const Reg &rs1) { sub(rd, zero, rs1); }
+  constexpr void seqz(const Reg &rd, const Reg &rs1) { sltiu(rd, rs1, 1); }
+  constexpr void snez(const Reg &rd, const Reg &rs1) { sltu(rd, zero, rs1); }
+  constexpr void beqz(const Reg &rs, const StaticLabel &l) { beq(rs, zero, l); }
+  constexpr void bnez(const Reg &rs, const StaticLabel &l) { bne(rs, zero, l); }
+  constexpr void blez(const Reg &rs, const StaticLabel &l) { bge(zero, rs, l); }
+  constexpr void bgez(const Reg &rs, const StaticLabel &l) { bge(rs, zero, l); }
+  constexpr void bltz(const Reg &rs, const StaticLabel &l) { blt(rs, zero, l); }
+  constexpr void bgtz(const Reg &rs, const StaticLabel &l) { blt(zero, rs, l); }
+  constexpr void bgt(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    blt(rs2, rs1, l);
+  }
+  constexpr void ble(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    bge(rs2, rs1, l);
+  }
+  constexpr void bgtu(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    bltu(rs2, rs1, l);
+  }
+  constexpr void bleu(const Reg &rs1, const Reg &rs2, const StaticLabel &l) {
+    bgeu(rs2, rs1, l);
+  }
+  constexpr void j(const StaticLabel &label) { jal(x0, label); }
+  constexpr void jal(const StaticLabel &label) { jal(x1, label); }
+  constexpr void jr(const Reg &rs) { jalr(x0, rs[0]); }
+  constexpr void jalr(const Reg &rs) { jalr(x1, rs[0]); }
+  constexpr void ret() { jalr(x0, x1[0]); }
+  constexpr void call(const StaticLabel &label) {
+    // cop には jalr 命令の rd を指定する
+    ref(FIX_CALL, U_(0b0010111, x1, 0), uint16_t(x1.getIdx()), label, "CALL");
+  }
+  constexpr void tail(const StaticLabel &label) {
+    ref(FIX_CALL, U_(0b0010111, x6, 0), uint16_t(x0.getIdx()), label, "TAIL");
+  }
+
+};
+
+};  // namespace RV32_asm
+
+#endif
@@ -0,0 +1,1105 @@
+#ifndef RV32_ASM_VREG_HPP_INCLUDED
+#define RV32_ASM_VREG_HPP_INCLUDED
+
+#include <climits>
+#include <initializer_list>
+#include <string>
+
+#include "RV32_asm_base.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// 仮想レジスタとレジスタ割り当て
+//
+// 物理レジスタの代わりに仮想レジスタで命令を記述しておき、 allocate() で
+// 線形走査法によって物理レジスタを割り当ててから生成器に命令を出力する。
+// 割り当てきれない仮想レジスタはスタックに置き、必要な大きさのスタック
+// フレームと、使用した退避が必要なレジスタの保存・復元も生成する。
+// 圧縮命令を使えるように、 x8 - x15 (f8 - f15) から優先して割り当てる。
+//
+// 使用例(配列の合計)
+//   struct Sum : RV32_asm::RV32GC {
+//     Sum() {
+//       RV32_asm::VRegAlloc<RV32_asm::RV32GC> v(*this);
+//       RV32_asm::VReg p = v.arg(0), n = v.arg(1), sum = v.newReg();
+//       RV32_asm::VReg t = v.newReg();
+//       RV32_asm::Label loop = newLabel(), done = newLabel();
+//       v.li(sum, 0);
+//       v.L(loop);
+//       v.beqz(n, done);
+//       v.lw(t, p[0]);
+//       v.add(sum, sum, t);
+//       v.addi(p, p, 4);
+//       v.addi(n, n, -1);
+//       v.j(loop);
+//       v.L(done);
+//       v.ret(sum);
+//       v.allocate();  // ここで生成器に命令を出力する
+//     }
+//   };
+//
+// 記述できるのは関数全体で、 allocate() の時点で先頭にプロローグを置く。
+// 物理レジスタもそのままオペランドに指定でき、指定した物理レジスタは
+// 割り当てに使わない。 t5, t6, ft10, ft11 はスタックに置いた仮想レジスタの
+// 読み書きに使うので、オペランドに指定しないこと。
+// 浮動小数点数レジスタは呼び出し先で保存が必要なもの(fs0 - fs11)を使わず、
+// 関数呼び出しをまたいで使う仮想レジスタはスタックに置く。
+// 浮動小数点数命令は fadd.s を fadd_s のように、 . を _ にした名前で記述する。
+
+namespace RV32_asm {
+
+class VAddr;
+
+// 整数の仮想レジスタ
+class VReg {
+  template <class G>
+  friend class VRegAlloc;
+  uint32_t id;  // 0 - 31 は物理レジスタ、 64 以降は仮想レジスタ
+  explicit VReg(uint32_t id, int) : id(id) {}
+
+ public:
+  VReg(const Reg &r) : id(uint32_t(r.getIdx())) {}
+  VAddr operator[](address_offset_t offset) const;
+  VAddr operator()(address_offset_t offset) const;
+};
+
+// 浮動小数点数の仮想レジスタ
+class FVReg {
+  template <class G>
+  friend class VRegAlloc;
+  uint32_t id;  // 32 - 63 は物理レジスタ、 64 以降は仮想レジスタ
+  explicit FVReg(uint32_t id, int) : id(id) {}
+
+ public:
+  FVReg(const FReg &r) : id(32 + uint32_t(r.getIdx())) {}
+};
+
+// ロード・ストアのアドレス
+class VAddr {
+  template <class G>
+  friend class VRegAlloc;
+  VReg base;
+  address_offset_t offset;
+
+ public:
+  VAddr(const VReg &base, address_offset_t offset)
+      : base(base), offset(offset) {}
+};
+
+inline VAddr VReg::operator[](address_offset_t offset) const {
+  return VAddr(*this, offset);
+}
+inline VAddr VReg::operator()(address_offset_t offset) const {
+  return VAddr(*this, offset);
+}
+
+// 仮想レジスタで命令を記述して、 allocate() で G 型の生成器に出力するクラス
+template <class G>
+class VRegAlloc {
+  static const uint32_t NONE = 0xffffffff;  // オペランドが無い
+  enum {
+    FIRST_VIRTUAL = 64,  // 仮想レジスタの識別子の始まり
+    FP = 32,             // 浮動小数点数レジスタの番号に足す値
+    SCRATCH0 = 30,       // t5 / ft10
+    SCRATCH1 = 31,       // t6 / ft11
+    MAX_ARGS = 8,
+    MAX_OFFSET = 2047,
+  };
+
+  // 仮想レジスタの種類
+  enum Kind { KIND_INT, KIND_SINGLE, KIND_DOUBLE, KIND_MAX };
+
+  // 割り当て後の物理レジスタを保持して命令の出力に渡すもの
+  struct Ops {
+    int r[3];  // 物理レジスタの番号(浮動小数点数レジスタは FP を足した値)
+    int32_t imm;
+    const Label *label;
+
+    Reg x(int k) const { return xreg(r[k]); }
+    FReg f(int k) const { return freg(r[k] - FP); }
+  };
+  typedef void (*Emit)(G &g, const Ops &o);
+
+  // 種類ごとのレジスタの読み書き
+  // 使った種類の分だけ設定して、使わない命令セットの命令を参照しないようにする
+  struct KindOps {
+    void (*load)(G &g, int reg, address_offset_t offset);
+    void (*store)(G &g, int reg, address_offset_t offset);
+    void (*copy)(G &g, int dst, int src);
+    int size;  // スタック上のバイト数
+  };
+
+  // 記録した命令
+  struct Rec {
+    enum Type { INSN, LABEL, JUMP, CALL, RET };
+    Emit emit;
+    uint32_t reg[3];
+    uint8_t type;
+    uint8_t uses;  // 読み込むオペランドのビット
+    uint8_t defs;  // 書き込むオペランドのビット
+    int32_t imm;
+    Label label;
+    uint32_t args;  // CALL の引数の callArgs 中の位置
+    uint32_t argc;
+  };
+
+  // 仮想レジスタの情報
+  struct Var {
+    uint8_t kind;
+    int arg;       // 引数の番号(引数でなければ -1)
+    int start;     // 生存区間(位置は命令 i の読み込みが 2i+2, 書き込みが 2i+3)
+    int end;
+    int reg;        // 割り当てた物理レジスタ(スタックに置く場合は -1)
+    int slot;       // スタック上の位置
+    uint32_t hint;  // mv の元の仮想レジスタ
+  };
+
+  G &g;
+  std::vector<Rec> recs;
+  std::vector<Var> vars;
+  std::vector<uint32_t> callArgs;
+  uint32_t args[2][MAX_ARGS];  // 整数・浮動小数点数の引数の仮想レジスタ
+  KindOps kinds[KIND_MAX];
+  bool fixed[64];  // オペランドに直接指定された物理レジスタ
+  int frameSize;
+  size_t spillCount;
+
+  VRegAlloc(const VRegAlloc &);
+  void operator=(const VRegAlloc &);
+
+  static Reg xreg(int i) { return Reg(i, (8 <= i && i < 16) ? i - 8 : 15); }
+  static FReg freg(int i) { return FReg(i, (8 <= i && i < 16) ? i - 8 : 15); }
+
+  static bool isVirtual(uint32_t id) {
+    return id != NONE && id >= FIRST_VIRTUAL;
+  }
+  static bool isCalleeSaved(int r) {
+    return r == 8 || r == 9 || (18 <= r && r <= 27);
+  }
+  static bool isCallerSaved(int r) {
+    return r >= FP || r == 1 || (5 <= r && r <= 7) || (10 <= r && r <= 17) ||
+           28 <= r;
+  }
+
+  Var &var(uint32_t id) { return vars[id - FIRST_VIRTUAL]; }
+  bool isFloat(uint32_t id) {
+    return isVirtual(id) ? var(id).kind != KIND_INT : id >= FP;
+  }
+
+  uint32_t newVar(Kind kind, int arg = -1) {
+    const Var v = {uint8_t(kind), arg, INT_MAX, INT_MIN, -1, -1, NONE};
+    vars.push_back(v);
+    return uint32_t(FIRST_VIRTUAL + vars.size() - 1);
+  }
+
+  Rec &push(uint8_t type, Emit emit, uint32_t r0 = NONE, uint32_t r1 = NONE,
+            uint32_t r2 = NONE, uint8_t uses = 0, uint8_t defs = 0,
+            int32_t imm = 0) {
+    const Rec r = {emit, {r0, r1, r2}, type, uses, defs, imm, Label(), 0, 0};
+    recs.push_back(r);
+    return recs.back();
+  }
+  void insn(Emit emit, uint32_t r0, uint32_t r1, uint32_t r2, uint8_t uses,
+            uint8_t defs, int32_t imm = 0) {
+    push(Rec::INSN, emit, r0, r1, r2, uses, defs, imm);
+  }
+
+  // 種類ごとの読み書きの関数を設定する
+  void setupInt() {
+    KindOps &k = kinds[KIND_INT];
+    k.load = [](G &g, int r, address_offset_t o) { g.lw(xreg(r), sp[o]); };
+    k.store = [](G &g, int r, address_offset_t o) { g.sw(xreg(r), sp[o]); };
+    k.copy = [](G &g, int d, int s) { g.add(xreg(d), zero, xreg(s)); };
+    k.size = 4;
+  }
+  void setupSingle() {
+    KindOps &k = kinds[KIND_SINGLE];
+    k.load = [](G &g, int r, address_offset_t o) {
+      g.flw(freg(r - FP), sp[o]);
+    };
+    k.store = [](G &g, int r, address_offset_t o) {
+      g.fsw(freg(r - FP), sp[o]);
+    };
+    k.copy = [](G &g, int d, int s) { g.fmv.s(freg(d - FP), freg(s - FP)); };
+    k.size = 4;
+  }
+  void setupDouble() {
+    KindOps &k = kinds[KIND_DOUBLE];
+    k.load = [](G &g, int r, address_offset_t o) {
+      g.fld(freg(r - FP), sp[o]);
+    };
+    k.store = [](G &g, int r, address_offset_t o) {
+      g.fsd(freg(r - FP), sp[o]);
+    };
+    k.copy = [](G &g, int d, int s) { g.fmv.d(freg(d - FP), freg(s - FP)); };
+    k.size = 8;
+  }
+
+  // 物理レジスタ id の種類(浮動小数点数は使った種類のうち広い方)
+  Kind kindOf(uint32_t id) {
+    if (isVirtual(id)) {
+      return Kind(var(id).kind);
+    }
+    if (id < FP) {
+      return KIND_INT;
+    }
+    return (kinds[KIND_DOUBLE].copy != NULL) ? KIND_DOUBLE : KIND_SINGLE;
+  }
+
+  static const Reg sp, zero;
+
+ public:
+  explicit VRegAlloc(G &g)
+      : g(g), frameSize(0), spillCount(0) {
+    memset(args, 0xff, sizeof(args));
+    memset(kinds, 0, sizeof(kinds));
+    memset(fixed, 0, sizeof(fixed));
+    setupInt();
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 仮想レジスタの確保
+
+  VReg newReg() { return VReg(newVar(KIND_INT), 0); }
+
+  // 単精度の浮動小数点数
+  FVReg newFReg() {
+    setupSingle();
+    return FVReg(newVar(KIND_SINGLE), 0);
+  }
+
+  // 倍精度の浮動小数点数
+  FVReg newDReg() {
+    setupDouble();
+    return FVReg(newVar(KIND_DOUBLE), 0);
+  }
+
+  // i 番目の整数の引数(a0 - a7)
+  VReg arg(int i) {
+    assert(0 <= i && i < MAX_ARGS);
+    if (args[0][i] == NONE) {
+      args[0][i] = newVar(KIND_INT, i);
+    }
+    return VReg(args[0][i], 0);
+  }
+
+  // i 番目の浮動小数点数の引数(fa0 - fa7)
+  FVReg farg(int i) { return fpArg(i, KIND_SINGLE); }
+  FVReg darg(int i) { return fpArg(i, KIND_DOUBLE); }
+
+  Label newLabel() { return g.newLabel(); }
+
+  // スタックフレームのバイト数(allocate() の後で有効)
+  int getFrameSize() const { return frameSize; }
+
+  // スタックに置いた仮想レジスタの数(allocate() の後で有効)
+  size_t getSpillCount() const { return spillCount; }
+
+ private:
+  FVReg fpArg(int i, Kind kind) {
+    assert(0 <= i && i < MAX_ARGS);
+    if (args[1][i] == NONE) {
+      if (kind == KIND_SINGLE) {
+        setupSingle();
+      } else {
+        setupDouble();
+      }
+      args[1][i] = newVar(kind, i);
+    }
+    assert(var(args[1][i]).kind == kind);
+    return FVReg(args[1][i], 0);
+  }
+
+ public:
+  //////////////////////////////////////////////////////////////////
+  // 命令の記述
+
+#define RV32_ASM_VREG_R(name)                                                \
+  void name(const VReg &rd, const VReg &rs1, const VReg &rs2) {              \
+    insn([](G &g, const Ops &o) { g.name(o.x(0), o.x(1), o.x(2)); }, rd.id,  \
+         rs1.id, rs2.id, 6, 1);                                              \
+  }
+#define RV32_ASM_VREG_I(name)                                                \
+  void name(const VReg &rd, const VReg &rs1, int32_t imm) {                  \
+    insn([](G &g, const Ops &o) { g.name(o.x(0), o.x(1), o.imm); }, rd.id,   \
+         rs1.id, NONE, 2, 1, imm);                                           \
+  }
+#define RV32_ASM_VREG_LOAD(name)                                             \
+  void name(const VReg &rd, const VAddr &a) {                                \
+    insn([](G &g, const Ops &o) { g.name(o.x(0), o.x(1)[o.imm]); }, rd.id,   \
+         a.base.id, NONE, 2, 1, a.offset);                                   \
+  }
+#define RV32_ASM_VREG_STORE(name)                                            \
+  void name(const VReg &rs2, const VAddr &a) {                               \
+    insn([](G &g, const Ops &o) { g.name(o.x(0), o.x(1)[o.imm]); }, rs2.id,  \
+         a.base.id, NONE, 3, 0, a.offset);                                   \
+  }
+#define RV32_ASM_VREG_B(name)                                                \
+  void name(const VReg &rs1, const VReg &rs2, const Label &label) {          \
+    push(Rec::JUMP,                                                          \
+         [](G &g, const Ops &o) { g.name(o.x(0), o.x(1), *o.label); },       \
+         rs1.id, rs2.id, NONE, 3)                                            \
+        .label = label;                                                      \
+  }
+#define RV32_ASM_VREG_BZ(name)                                               \
+  void name(const VReg &rs, const Label &label) {                            \
+    push(Rec::JUMP, [](G &g, const Ops &o) { g.name(o.x(0), *o.label); },    \
+         rs.id, NONE, NONE, 1)                                               \
+        .label = label;                                                      \
+  }
+#define RV32_ASM_VREG_FR(name, insn_)                                        \
+  void name(const FVReg &rd, const FVReg &rs1, const FVReg &rs2) {           \
+    insn([](G &g, const Ops &o) { g.insn_(o.f(0), o.f(1), o.f(2)); },        \
+         rd.id, rs1.id, rs2.id, 6, 1);                                       \
+  }
+#define RV32_ASM_VREG_FR1(name, insn_)                                       \
+  void name(const FVReg &rd, const FVReg &rs1) {                             \
+    insn([](G &g, const Ops &o) { g.insn_(o.f(0), o.f(1)); }, rd.id,         \
+         rs1.id, NONE, 2, 1);                                                \
+  }
+#define RV32_ASM_VREG_FCMP(name, insn_)                                      \
+  void name(const VReg &rd, const FVReg &rs1, const FVReg &rs2) {            \
+    insn([](G &g, const Ops &o) { g.insn_(o.x(0), o.f(1), o.f(2)); },        \
+         rd.id, rs1.id, rs2.id, 6, 1);                                       \
+  }
+#define RV32_ASM_VREG_FX(name, insn_)                                        \
+  void name(const VReg &rd, const FVReg &rs1) {                              \
+    insn([](G &g, const Ops &o) { g.insn_(o.x(0), o.f(1)); }, rd.id,         \
+         rs1.id, NONE, 2, 1);                                                \
+  }
+#define RV32_ASM_VREG_XF(name, insn_)                                        \
+  void name(const FVReg &rd, const VReg &rs1) {                              \
+    insn([](G &g, const Ops &o) { g.insn_(o.f(0), o.x(1)); }, rd.id,         \
+         rs1.id, NONE, 2, 1);                                                \
+  }
+
+  // RV32I
+  RV32_ASM_VREG_R(add)
+  RV32_ASM_VREG_R(sub)
+  RV32_ASM_VREG_R(sll)
+  RV32_ASM_VREG_R(slt)
+  RV32_ASM_VREG_R(sltu)
+  RV32_ASM_VREG_R(xor)
+  RV32_ASM_VREG_R(srl)
+  RV32_ASM_VREG_R(sra)
+  RV32_ASM_VREG_R(or)
+  RV32_ASM_VREG_R(and)
+  RV32_ASM_VREG_I(addi)
+  RV32_ASM_VREG_I(slti)
+  RV32_ASM_VREG_I(sltiu)
+  RV32_ASM_VREG_I(xori)
+  RV32_ASM_VREG_I(ori)
+  RV32_ASM_VREG_I(andi)
+  RV32_ASM_VREG_I(slli)
+  RV32_ASM_VREG_I(srli)
+  RV32_ASM_VREG_I(srai)
+  RV32_ASM_VREG_LOAD(lb)
+  RV32_ASM_VREG_LOAD(lh)
+  RV32_ASM_VREG_LOAD(lw)
+  RV32_ASM_VREG_LOAD(lbu)
+  RV32_ASM_VREG_LOAD(lhu)
+  RV32_ASM_VREG_STORE(sb)
+  RV32_ASM_VREG_STORE(sh)
+  RV32_ASM_VREG_STORE(sw)
+  RV32_ASM_VREG_B(beq)
+  RV32_ASM_VREG_B(bne)
+  RV32_ASM_VREG_B(blt)
+  RV32_ASM_VREG_B(bge)
+  RV32_ASM_VREG_B(bltu)
+  RV32_ASM_VREG_B(bgeu)
+  RV32_ASM_VREG_BZ(beqz)
+  RV32_ASM_VREG_BZ(bnez)
+  RV32_ASM_VREG_BZ(bltz)
+  RV32_ASM_VREG_BZ(bgez)
+  RV32_ASM_VREG_BZ(blez)
+  RV32_ASM_VREG_BZ(bgtz)
+
+  // RV32M
+  RV32_ASM_VREG_R(mul)
+  RV32_ASM_VREG_R(mulh)
+  RV32_ASM_VREG_R(mulhsu)
+  RV32_ASM_VREG_R(mulhu)
+  RV32_ASM_VREG_R(div)
+  RV32_ASM_VREG_R(divu)
+  RV32_ASM_VREG_R(rem)
+  RV32_ASM_VREG_R(remu)
+
+  // RV32F / RV32D
+  RV32_ASM_VREG_FR(fadd_s, fadd.s)
+  RV32_ASM_VREG_FR(fsub_s, fsub.s)
+  RV32_ASM_VREG_FR(fmul_s, fmul.s)
+  RV32_ASM_VREG_FR(fdiv_s, fdiv.s)
+  RV32_ASM_VREG_FR(fmin_s, fmin.s)
+  RV32_ASM_VREG_FR(fmax_s, fmax.s)
+  RV32_ASM_VREG_FR1(fsqrt_s, fsqrt.s)
+  RV32_ASM_VREG_FR1(fneg_s, fneg.s)
+  RV32_ASM_VREG_FR1(fabs_s, fabs.s)
+  RV32_ASM_VREG_FCMP(feq_s, feq.s)
+  RV32_ASM_VREG_FCMP(flt_s, flt.s)
+  RV32_ASM_VREG_FCMP(fle_s, fle.s)
+  RV32_ASM_VREG_FX(fcvt_w_s, fcvt.w.s)
+  RV32_ASM_VREG_FX(fmv_x_w, fmv.x.w)
+  RV32_ASM_VREG_XF(fcvt_s_w, fcvt.s.w)
+  RV32_ASM_VREG_XF(fmv_w_x, fmv.w.x)
+  RV32_ASM_VREG_FR(fadd_d, fadd.d)
+  RV32_ASM_VREG_FR(fsub_d, fsub.d)
+  RV32_ASM_VREG_FR(fmul_d, fmul.d)
+  RV32_ASM_VREG_FR(fdiv_d, fdiv.d)
+  RV32_ASM_VREG_FR(fmin_d, fmin.d)
+  RV32_ASM_VREG_FR(fmax_d, fmax.d)
+  RV32_ASM_VREG_FR1(fsqrt_d, fsqrt.d)
+  RV32_ASM_VREG_FR1(fneg_d, fneg.d)
+  RV32_ASM_VREG_FR1(fabs_d, fabs.d)
+  RV32_ASM_VREG_FR1(fcvt_s_d, fcvt.s.d)
+  RV32_ASM_VREG_FR1(fcvt_d_s, fcvt.d.s)
+  RV32_ASM_VREG_FCMP(feq_d, feq.d)
+  RV32_ASM_VREG_FCMP(flt_d, flt.d)
+  RV32_ASM_VREG_FCMP(fle_d, fle.d)
+  RV32_ASM_VREG_FX(fcvt_w_d, fcvt.w.d)
+  RV32_ASM_VREG_XF(fcvt_d_w, fcvt.d.w)
+
+#undef RV32_ASM_VREG_R
+#undef RV32_ASM_VREG_I
+#undef RV32_ASM_VREG_LOAD
+#undef RV32_ASM_VREG_STORE
+#undef RV32_ASM_VREG_B
+#undef RV32_ASM_VREG_BZ
+#undef RV32_ASM_VREG_FR
+#undef RV32_ASM_VREG_FR1
+#undef RV32_ASM_VREG_FCMP
+#undef RV32_ASM_VREG_FX
+#undef RV32_ASM_VREG_XF
+
+  void flw(const FVReg &rd, const VAddr &a) {
+    insn([](G &g, const Ops &o) { g.flw(o.f(0), o.x(1)[o.imm]); }, rd.id,
+         a.base.id, NONE, 2, 1, a.offset);
+  }
+  void fsw(const FVReg &rs2, const VAddr &a) {
+    insn([](G &g, const Ops &o) { g.fsw(o.f(0), o.x(1)[o.imm]); }, rs2.id,
+         a.base.id, NONE, 3, 0, a.offset);
+  }
+  void fld(const FVReg &rd, const VAddr &a) {
+    insn([](G &g, const Ops &o) { g.fld(o.f(0), o.x(1)[o.imm]); }, rd.id,
+         a.base.id, NONE, 2, 1, a.offset);
+  }
+  void fsd(const FVReg &rs2, const VAddr &a) {
+    insn([](G &g, const Ops &o) { g.fsd(o.f(0), o.x(1)[o.imm]); }, rs2.id,
+         a.base.id, NONE, 3, 0, a.offset);
+  }
+
+  // 疑似命令
+  void li(const VReg &rd, int32_t imm) {
+    insn([](G &g, const Ops &o) { g.li(o.x(0), o.imm); }, rd.id, NONE, NONE,
+         0, 1, imm);
+  }
+  void mv(const VReg &rd, const VReg &rs) {
+    insn(
+        [](G &g, const Ops &o) {
+          if (o.r[0] != o.r[1]) {
+            g.add(o.x(0), zero, o.x(1));  // 圧縮命令では c.mv になる
+          }
+        },
+        rd.id, rs.id, NONE, 2, 1);
+    hint(rd.id, rs.id);
+  }
+  void fmv_s(const FVReg &rd, const FVReg &rs) {
+    insn(
+        [](G &g, const Ops &o) {
+          if (o.r[0] != o.r[1]) {
+            g.fmv.s(o.f(0), o.f(1));
+          }
+        },
+        rd.id, rs.id, NONE, 2, 1);
+    hint(rd.id, rs.id);
+  }
+  void fmv_d(const FVReg &rd, const FVReg &rs) {
+    insn(
+        [](G &g, const Ops &o) {
+          if (o.r[0] != o.r[1]) {
+            g.fmv.d(o.f(0), o.f(1));
+          }
+        },
+        rd.id, rs.id, NONE, 2, 1);
+    hint(rd.id, rs.id);
+  }
+  void neg(const VReg &rd, const VReg &rs) { sub(rd, zero, rs); }
+  void not(const VReg &rd, const VReg &rs) { xori(rd, rs, -1); }
+  void seqz(const VReg &rd, const VReg &rs) { sltiu(rd, rs, 1); }
+  void snez(const VReg &rd, const VReg &rs) { sltu(rd, zero, rs); }
+
+  // 制御
+  void L(const Label &label) { push(Rec::LABEL, NULL).label = label; }
+  void j(const Label &label) {
+    push(Rec::JUMP, [](G &g, const Ops &o) { g.j(*o.label); }).label = label;
+  }
+
+  // label の関数を args を引数にして呼び出し、戻り値を result に入れる
+  // 引数と戻り値は整数だけ
+  void call(const Label &label, std::initializer_list<VReg> args = {},
+            const VReg &result = zero) {
+    pushCall(NONE, args, result).label = label;
+  }
+
+  // fn のアドレスの関数を呼び出す
+  void call(const VReg &fn, std::initializer_list<VReg> args = {},
+            const VReg &result = zero) {
+    pushCall(fn.id, args, result);
+  }
+
+  // value を戻り値にして関数から戻る
+  void ret() { push(Rec::RET, NULL); }
+  void ret(const VReg &value) { push(Rec::RET, NULL, value.id, NONE, NONE, 1); }
+  void ret(const FVReg &value) {
+    push(Rec::RET, NULL, value.id, NONE, NONE, 1);
+  }
+
+ private:
+  Rec &pushCall(uint32_t fn, std::initializer_list<VReg> list,
+                const VReg &result) {
+    assert(list.size() <= MAX_ARGS);
+    const uint32_t first = uint32_t(callArgs.size());
+    for (const VReg &a : list) {
+      callArgs.push_back(a.id);
+    }
+    Rec &r = push(Rec::CALL, NULL, fn, result.id, NONE, 1, 2);
+    r.args = first;
+    r.argc = uint32_t(list.size());
+    return r;
+  }
+
+  void hint(uint32_t rd, uint32_t rs) {
+    if (isVirtual(rd)) {
+      var(rd).hint = rs;
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 生存区間の計算
+
+  void touch(uint32_t id, int pos) {
+    if (!isVirtual(id)) {
+      if (id != NONE) {
+        fixed[id] = true;
+      }
+      return;
+    }
+    Var &v = var(id);
+    v.start = std::min(v.start, pos);
+    v.end = std::max(v.end, pos);
+  }
+
+  static int usePos(size_t i) { return int(2 * i + 2); }
+  static int defPos(size_t i) { return int(2 * i + 3); }
+
+  static std::string labelKey(const Label &label) {
+    if (label.isValid()) {
+      return "#" + std::to_string(label.getId());
+    }
+    return label.getName() != NULL ? label.getName() : "";
+  }
+
+  // 各命令の読み込み・書き込みの位置に加えて、命令の間で値が生きている
+  // 位置も区間に含める。生きているかはラベルと分岐でつないだ命令の流れに
+  // 沿って後ろから求めるので、ループの先頭や出口の先で読む値も、
+  // 読まれるまでの全ての位置を覆う区間になる。
+  void computeIntervals(std::vector<int> &calls) {
+    // 引数は関数の入り口で書き込まれる
+    for (int f = 0; f < 2; ++f) {
+      for (int i = 0; i < MAX_ARGS; ++i) {
+        if (args[f][i] != NONE) {
+          touch(args[f][i], 1);
+        }
+      }
+    }
+    std::unordered_map<std::string, size_t> labels;
+    for (size_t i = 0; i < recs.size(); ++i) {
+      const Rec &r = recs[i];
+      for (int k = 0; k < 3; ++k) {
+        if ((r.uses >> k) & 1) {
+          touch(r.reg[k], usePos(i));
+        }
+      }
+      if (r.type == Rec::CALL) {
+        for (uint32_t k = 0; k < r.argc; ++k) {
+          touch(callArgs[r.args + k], usePos(i));
+        }
+        calls.push_back(usePos(i));
+      }
+      for (int k = 0; k < 3; ++k) {
+        if ((r.defs >> k) & 1) {
+          touch(r.reg[k], defPos(i));
+        }
+      }
+      if (r.type == Rec::LABEL) {
+        labels[labelKey(r.label)] = i;
+      }
+    }
+
+    // 命令ごとの、直後で生きている仮想レジスタの集合(64個ずつのビット列)
+    const size_t n = recs.size();
+    const size_t words = (vars.size() + 63) / 64;
+    if (n == 0 || words == 0) {
+      return;
+    }
+    std::vector<size_t> target(n, n);  // 分岐先の命令(無ければ n)
+    for (size_t i = 0; i < n; ++i) {
+      if (recs[i].type == Rec::JUMP) {
+        auto it = labels.find(labelKey(recs[i].label));
+        if (it != labels.end()) {
+          target[i] = it->second;
+        }
+      }
+    }
+    std::vector<uint64_t> liveIn(n * words, 0), liveOut(n * words, 0);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = n; i-- > 0;) {
+        const Rec &r = recs[i];
+        uint64_t *out = &liveOut[i * words];
+        // j は次の命令に進まない(条件分岐はオペランドを読む)
+        const bool next = r.type != Rec::RET &&
+                          !(r.type == Rec::JUMP && r.uses == 0 &&
+                            target[i] != n);
+        for (size_t w = 0; w < words; ++w) {
+          uint64_t v = out[w];
+          if (next && i + 1 < n) {
+            v |= liveIn[(i + 1) * words + w];
+          }
+          if (target[i] != n) {
+            v |= liveIn[target[i] * words + w];
+          }
+          if (v != out[w]) {
+            out[w] = v;
+            changed = true;
+          }
+        }
+        uint64_t *in = &liveIn[i * words];
+        for (size_t w = 0; w < words; ++w) {
+          in[w] = out[w];
+        }
+        for (int k = 0; k < 3; ++k) {
+          if (((r.defs >> k) & 1) && isVirtual(r.reg[k])) {
+            const size_t id = r.reg[k] - FIRST_VIRTUAL;
+            in[id / 64] &= ~(uint64_t(1) << (id % 64));
+          }
+        }
+        for (int k = 0; k < 3; ++k) {
+          if (((r.uses >> k) & 1) && isVirtual(r.reg[k])) {
+            const size_t id = r.reg[k] - FIRST_VIRTUAL;
+            in[id / 64] |= uint64_t(1) << (id % 64);
+          }
+        }
+        if (r.type == Rec::CALL) {
+          for (uint32_t k = 0; k < r.argc; ++k) {
+            const uint32_t a = callArgs[r.args + k];
+            if (isVirtual(a)) {
+              const size_t id = a - FIRST_VIRTUAL;
+              in[id / 64] |= uint64_t(1) << (id % 64);
+            }
+          }
+        }
+      }
+    }
+
+    // 命令の前後で生きている位置を区間に加える
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t w = 0; w < words; ++w) {
+        const uint64_t in = liveIn[i * words + w];
+        const uint64_t out = liveOut[i * words + w];
+        if ((in | out) == 0) {
+          continue;
+        }
+        for (size_t b = 0; b < 64; ++b) {
+          const uint64_t bit = uint64_t(1) << b;
+          const uint32_t id = uint32_t(FIRST_VIRTUAL + w * 64 + b);
+          if (in & bit) {
+            touch(id, usePos(i));
+          }
+          if (out & bit) {
+            touch(id, defPos(i));
+          }
+        }
+      }
+    }
+  }
+
+
+  //////////////////////////////////////////////////////////////////
+  // 線形走査法による割り当て
+
+  // 割り当てに使う物理レジスタ(優先する順)
+  static const int *pool(bool fp, bool acrossCall, size_t &n) {
+    // 圧縮命令で使える x8 - x15 を優先し、退避が必要なレジスタは後にする
+    static const int xregs[] = {10, 11, 12, 13, 14, 15, 8,  9,  5,  6, 7,
+                                28, 29, 16, 17, 18, 19, 20, 21, 22, 23,
+                                24, 25, 26, 27};
+    static const int xsaved[] = {8,  9,  18, 19, 20, 21,
+                                 22, 23, 24, 25, 26, 27};
+    static const int fregs[] = {10, 11, 12, 13, 14, 15, 0,  1,  2,
+                                3,  4,  5,  6,  7,  16, 17, 28, 29};
+    if (fp) {
+      n = acrossCall ? 0 : sizeof(fregs) / sizeof(fregs[0]);
+      return fregs;
+    }
+    if (acrossCall) {
+      n = sizeof(xsaved) / sizeof(xsaved[0]);
+      return xsaved;
+    }
+    n = sizeof(xregs) / sizeof(xregs[0]);
+    return xregs;
+  }
+
+  bool crossesCall(const Var &v, const std::vector<int> &calls) const {
+    for (int c : calls) {
+      if (v.start < c && c < v.end) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void linearScan(const std::vector<int> &calls) {
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < vars.size(); ++i) {
+      if (vars[i].start != INT_MAX) {
+        order.push_back(i);
+      }
+    }
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+      return vars[a].start < vars[b].start;
+    });
+
+    std::vector<uint32_t> active;
+    std::vector<bool> free(64, true);
+    for (uint32_t idx : order) {
+      Var &cur = vars[idx];
+      // 終わった区間のレジスタを空ける
+      size_t n = 0;
+      for (uint32_t a : active) {
+        if (vars[a].end < cur.start) {
+          free[vars[a].reg] = true;
+        } else {
+          active[n++] = a;
+        }
+      }
+      active.resize(n);
+
+      const bool fp = cur.kind != KIND_INT;
+      const int base = fp ? FP : 0;
+      const bool across = crossesCall(cur, calls);
+      size_t count = 0;
+      const int *regs = pool(fp, across, count);
+      auto usable = [&](int r) {
+        return free[base + r] && !fixed[base + r] &&
+               (!across || !isCallerSaved(base + r));
+      };
+
+      // 引数のレジスタ、 mv の元のレジスタ、優先順の順に探す
+      int reg = -1;
+      if (cur.arg >= 0 && count != 0 && usable(10 + cur.arg)) {
+        reg = 10 + cur.arg;
+      } else if (isVirtual(cur.hint) && var(cur.hint).reg >= 0 &&
+                 count != 0 && usable(var(cur.hint).reg - base)) {
+        reg = var(cur.hint).reg - base;
+      } else {
+        for (size_t i = 0; i < count; ++i) {
+          if (usable(regs[i])) {
+            reg = regs[i];
+            break;
+          }
+        }
+      }
+      if (reg >= 0) {
+        cur.reg = base + reg;
+        free[cur.reg] = false;
+        active.push_back(idx);
+        continue;
+      }
+
+      // 空きが無い場合は、使用中で最も後まで生きるものと比べて
+      // 後まで生きる方をスタックに置く
+      size_t victim = active.size();
+      for (size_t i = 0; i < active.size(); ++i) {
+        const Var &v = vars[active[i]];
+        if ((v.kind != KIND_INT) != fp || (across && isCallerSaved(v.reg))) {
+          continue;
+        }
+        if (victim == active.size() || v.end > vars[active[victim]].end) {
+          victim = i;
+        }
+      }
+      if (victim != active.size() && vars[active[victim]].end > cur.end) {
+        Var &v = vars[active[victim]];
+        cur.reg = v.reg;
+        v.reg = -1;
+        active[victim] = idx;
+      }
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // 命令の出力
+
+  // 並列の移動 dst[i] <- src[i] を、 tmp を使って順番に行う
+  void parallelMove(std::vector<std::pair<int, int> > &moves, int tmp) {
+    size_t n = 0;
+    for (const auto &m : moves) {
+      if (m.first != m.second) {
+        moves[n++] = m;
+      }
+    }
+    moves.resize(n);
+    while (!moves.empty()) {
+      bool progress = false;
+      for (size_t i = 0; i < moves.size(); ++i) {
+        bool blocked = false;
+        for (size_t k = 0; k < moves.size(); ++k) {
+          blocked |= (k != i && moves[k].second == moves[i].first);
+        }
+        if (!blocked) {
+          copy(moves[i].first, moves[i].second);
+          moves.erase(moves.begin() + i);
+          progress = true;
+          break;
+        }
+      }
+      if (!progress) {
+        // 循環しているので、1つを tmp に逃がす
+        const int src = moves[0].second;
+        copy(tmp, src);
+        for (auto &m : moves) {
+          if (m.second == src) {
+            m.second = tmp;
+          }
+        }
+      }
+    }
+  }
+
+  void copy(int dst, int src) {
+    const Kind kind = kindOf(uint32_t(dst >= FP ? FP : 0));
+    kinds[kind].copy(g, dst, src);
+  }
+
+  // 仮想レジスタ id の値を物理レジスタ dst に読み込む
+  void loadTo(int dst, uint32_t id) {
+    if (!isVirtual(id)) {
+      if (int(id) != dst) {
+        copy(dst, int(id));
+      }
+      return;
+    }
+    const Var &v = var(id);
+    if (v.reg >= 0) {
+      if (v.reg != dst) {
+        kinds[v.kind].copy(g, dst, v.reg);
+      }
+    } else {
+      kinds[v.kind].load(g, dst, v.slot);
+    }
+  }
+
+  // 物理レジスタ src の値を仮想レジスタ id に書き込む
+  void storeFrom(uint32_t id, int src) {
+    if (!isVirtual(id)) {
+      if (int(id) != src && id != 0) {
+        copy(int(id), src);
+      }
+      return;
+    }
+    const Var &v = var(id);
+    if (v.reg >= 0) {
+      if (v.reg != src) {
+        kinds[v.kind].copy(g, v.reg, src);
+      }
+    } else {
+      kinds[v.kind].store(g, src, v.slot);
+    }
+  }
+
+  // 引数の a0 - a7 / fa0 - fa7 を割り当てた場所に移す
+  void moveArgs() {
+    std::vector<std::pair<int, int> > moves[2];
+    for (int f = 0; f < 2; ++f) {
+      for (int i = 0; i < MAX_ARGS; ++i) {
+        const uint32_t id = args[f][i];
+        if (id == NONE || var(id).start == INT_MAX) {
+          continue;
+        }
+        const int src = f * FP + 10 + i;
+        if (var(id).reg < 0) {
+          storeFrom(id, src);  // スタックへの書き込みを先に行う
+        } else {
+          moves[f].push_back(std::make_pair(var(id).reg, src));
+        }
+      }
+    }
+    parallelMove(moves[0], SCRATCH1);
+    parallelMove(moves[1], FP + SCRATCH1);
+  }
+
+  void emitCall(const Rec &r) {
+    if (r.reg[0] != NONE) {
+      loadTo(SCRATCH0, r.reg[0]);  // 引数の設定で上書きされないように
+    }
+    std::vector<std::pair<int, int> > moves;
+    std::vector<std::pair<int, uint32_t> > loads;
+    for (uint32_t k = 0; k < r.argc; ++k) {
+      const uint32_t id = callArgs[r.args + k];
+      const int dst = 10 + int(k);
+      if (isVirtual(id) && var(id).reg < 0) {
+        loads.push_back(std::make_pair(dst, id));
+      } else {
+        moves.push_back(
+            std::make_pair(dst, isVirtual(id) ? var(id).reg : int(id)));
+      }
+    }
+    parallelMove(moves, SCRATCH1);
+    for (const auto &l : loads) {
+      loadTo(l.first, l.second);
+    }
+    if (r.reg[0] != NONE) {
+      g.jalr(xreg(SCRATCH0));
+    } else {
+      g.call(r.label);
+    }
+    if (r.reg[1] != NONE && r.reg[1] != 0) {
+      storeFrom(r.reg[1], 10);
+    }
+  }
+
+  // 保存したレジスタを戻してスタックフレームを解放する
+  void epilogue(const std::vector<std::pair<int, int> > &saved) {
+    for (const auto &s : saved) {
+      g.lw(xreg(s.first), sp[s.second]);
+    }
+    if (frameSize != 0) {
+      g.addi(sp, sp, frameSize);
+    }
+  }
+
+  void emitInsn(const Rec &r) {
+    Ops o;
+    o.imm = r.imm;
+    o.label = &r.label;
+    int scratch[2] = {0, 0};  // 整数・浮動小数点数で使った数
+    for (int k = 0; k < 3; ++k) {
+      const uint32_t id = r.reg[k];
+      o.r[k] = 0;
+      if (id == NONE) {
+        continue;
+      }
+      if (!isVirtual(id)) {
+        o.r[k] = int(id);
+        continue;
+      }
+      const Var &v = var(id);
+      if (v.reg >= 0) {
+        o.r[k] = v.reg;
+        continue;
+      }
+      // スタックに置いた仮想レジスタは作業用のレジスタを経由する
+      const int f = (v.kind != KIND_INT) ? 1 : 0;
+      if ((r.uses >> k) & 1) {
+        o.r[k] = f * FP + SCRATCH0 + scratch[f]++;
+        kinds[v.kind].load(g, o.r[k], v.slot);
+      } else {
+        o.r[k] = f * FP + SCRATCH0;
+      }
+    }
+    r.emit(g, o);
+    for (int k = 0; k < 3; ++k) {
+      if (((r.defs >> k) & 1) && isVirtual(r.reg[k]) &&
+          var(r.reg[k]).reg < 0) {
+        storeFrom(r.reg[k], o.r[k]);
+      }
+    }
+  }
+
+ public:
+  // 物理レジスタを割り当てて、記述した命令を生成器に出力する
+  // スタックフレームが大きすぎる場合は何も出力せずに false を返す
+  bool allocate() {
+    std::vector<int> calls;
+    computeIntervals(calls);
+    linearScan(calls);
+
+    // スタックフレームの配置
+    // スタックに置く仮想レジスタ、保存するレジスタの順に並べる
+    int size = 0;
+    spillCount = 0;
+    for (Var &v : vars) {
+      if (v.start != INT_MAX && v.reg < 0) {
+        const int bytes = kinds[v.kind].size;
+        size = (size + bytes - 1) / bytes * bytes;
+        v.slot = size;
+        size += bytes;
+        ++spillCount;
+      }
+    }
+    std::vector<std::pair<int, int> > saved;  // (レジスタ, オフセット)
+    bool used[32] = {false};
+    for (const Var &v : vars) {
+      if (v.reg >= 0 && v.reg < FP) {
+        used[v.reg] = true;
+      }
+    }
+    if (!calls.empty()) {
+      saved.push_back(std::make_pair(1, 0));
+    }
+    for (int r = 0; r < 32; ++r) {
+      if (used[r] && isCalleeSaved(r)) {
+        saved.push_back(std::make_pair(r, 0));
+      }
+    }
+    size = (size + 3) & ~3;
+    for (auto &s : saved) {
+      s.second = size;
+      size += 4;
+    }
+    frameSize = (size + 15) & ~15;
+    if (frameSize > MAX_OFFSET) {
+      return false;
+    }
+
+    // プロローグ
+    if (frameSize != 0) {
+      g.addi(sp, sp, -frameSize);
+    }
+    for (const auto &s : saved) {
+      g.sw(xreg(s.first), sp[s.second]);
+    }
+    moveArgs();
+
+    for (const Rec &r : recs) {
+      switch (r.type) {
+        case Rec::LABEL:
+          g.L(r.label);
+          break;
+        case Rec::CALL:
+          emitCall(r);
+          break;
+        case Rec::RET:
+          if (r.reg[0] != NONE) {
+            loadTo(isFloat(r.reg[0]) ? FP + 10 : 10, r.reg[0]);
+          }
+          epilogue(saved);
+          g.ret();
+          break;
+        default:
+          emitInsn(r);
+          break;
+      }
+    }
+    return true;
+  }
+};
+
+template <class G>
+const Reg VRegAlloc<G>::sp = Reg(2);
+template <class G>
+const Reg VRegAlloc<G>::zero = Reg(0);
+
+};  // namespace RV32_asm
+
+#endif
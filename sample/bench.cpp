@@ -0,0 +1,213 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "RV32_asm.hpp"
+#include "RV32_asm_emu.hpp"
+
+// コード生成速度の計測用サンプル
+// 実際の JIT でよく現れる命令の組み合わせを大量に生成し、
+// 1秒あたりに生成できる命令数を表示する。
+// 小さな関数を大量に JIT する場合に効いてくる、生成器オブジェクトの
+// 構築と破棄の速度もあわせて表示する。
+// 生成したコードの逆アセンブルの速度も表示する。
+// 最後に生成したコードの実行速度を表示する。
+// (RISC-V 以外の環境ではエミュレータで実行する)
+
+using namespace std;
+
+class Bench : public RV32_asm::RV32GC {
+  void operator=(const Bench &);
+
+ public:
+  explicit Bench(int blocks) : RV32_asm::RV32GC(blocks * 64 + 64, 0) {}
+
+  // names が NULL の場合は newLabel() で確保したラベルを使う
+  void emit(int blocks, const vector<string> *names, bool direct) {
+    beginFunction(direct);
+    // 1ブロックあたり 12 命令
+    for (int i = 0; i < blocks; ++i) {
+      RV32_asm::Label l =
+          (names != NULL) ? RV32_asm::Label((*names)[i]) : newLabel();
+      L(l);
+      lw(a0, s1[16]);
+      addi(a0, a0, 100);
+      add(a1, a0, s2);
+      sw(a1, s1[20]);
+      lbu(t0, a2[-1]);
+      slli(t0, t0, 2);
+      addi(a2, a2, -1);
+      xori(t1, t0, 0x55);
+      sub(a3, a3, t1);
+      sb(a3, a4[3]);
+      bne(a2, zero, l);
+      beqz(a0, l);
+    }
+    ret();
+  }
+};
+
+static const int blocks = 2000;
+static const int insns_per_block = 12;
+static const int repeat = 50;
+
+// reuse が true の場合は1つの生成器を reset して使い回す
+static void run(const char *title, const vector<string> *names, bool direct,
+                bool reuse = false) {
+  size_t total = 0;
+  Bench shared(blocks);
+  auto start = chrono::steady_clock::now();
+  for (int r = 0; r < repeat; ++r) {
+    size_t size = 0;
+    if (reuse) {
+      shared.emit(blocks, names, direct);
+      shared.getCode(&size);
+    } else {
+      Bench b(blocks);
+      b.emit(blocks, names, direct);
+      b.getCode(&size);
+    }
+    total += size;
+  }
+  auto end = chrono::steady_clock::now();
+
+  double sec = chrono::duration<double>(end - start).count();
+  double insns = double(blocks) * insns_per_block * repeat;
+  printf("%s: %.0f insns in %.3f sec (%.2f M insns/sec, %d bytes)\n", title,
+         insns, sec, insns / sec / 1e6, int(total / repeat));
+}
+
+static void runConstruct() {
+  const int n = 1000000;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i) {
+    RV32_asm::RV32GC g(0, RV32_asm::AutoGrow);
+    // 最適化でループごと消されないようにする
+    asm volatile("" : : "r"(&g) : "memory");
+  }
+  auto end = chrono::steady_clock::now();
+
+  double sec = chrono::duration<double>(end - start).count();
+  printf("construct+destruct: %d objects in %.3f sec (%.2f M/sec, %d bytes)\n",
+         n, sec, n / sec / 1e6, int(sizeof(RV32_asm::RV32GC)));
+}
+
+// 生成したコードを逆アセンブルする速度
+// 解釈だけの場合と、オペランドの文字列まで作る場合を計測する。
+// あわせて、逆アセンブルしたニーモニックが生成器の記録と合うかを確かめる。
+static void runDisasm() {
+  RV32_asm::VerifyListing verify(stderr);
+  Bench b(blocks);
+  b.setListing(&verify);
+  b.emit(blocks, NULL, false);
+  size_t size = 0;
+  const unsigned char *code = b.getCode(&size);
+  printf("disasm verify: %d insns, %d errors\n", int(verify.getChecked()),
+         int(verify.getErrors()));
+
+  for (int withText = 0; withText < 2; ++withText) {
+    size_t insns = 0;
+    uint32_t sum = 0;
+    char line[96];
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; ++r) {
+      size_t pos = 0;
+      while (pos < size) {
+        RV32_asm::Disassembler::Insn insn;
+        pos += RV32_asm::Disassembler::decode(code + pos, size - pos, insn);
+        if (withText) {
+          RV32_asm::Disassembler::format(line, sizeof(line), insn,
+                                         uint32_t(pos));
+          sum += uint8_t(line[0]);
+        } else {
+          sum += uint32_t(insn.format);
+        }
+        ++insns;
+      }
+    }
+    auto end = chrono::steady_clock::now();
+    asm volatile("" : : "r"(sum));
+
+    double sec = chrono::duration<double>(end - start).count();
+    printf("disasm (%s): %d insns in %.3f sec (%.2f M insns/sec, %.1f MB/sec)"
+           "\n",
+           withText ? "decode+format" : "decode", int(insns), sec,
+           insns / sec / 1e6, double(size) * repeat / sec / 1e6);
+  }
+}
+
+// 1バイトずつコピーする memcpy
+class Memcpy : public RV32_asm::RV32GC {
+ public:
+  Memcpy() : RV32_asm::RV32GC(0, RV32_asm::AutoGrow) {
+    RV32_asm::Label loop = newLabel(), done = newLabel();
+    add(a2, a0, a2);
+    L(loop);
+    beq(a0, a2, done);
+    lbu(a4, a1[0]);
+    addi(a1, a1, 1);
+    sb(a4, a0[0]);
+    addi(a0, a0, 1);
+    j(loop);
+    L(done);
+    ret();
+  }
+};
+
+static void runExecute(bool translation = false) {
+  static unsigned char src[1 << 20], dst[1 << 20];
+  Memcpy m;
+  size_t size = 0;
+  const unsigned char *code = m.getCode(&size);
+  auto start = chrono::steady_clock::now();
+#if TARGET == TARGET_RISCV
+  (void)translation;
+  auto *func = (void (*)(void *, const void *, size_t))code;
+  func(dst, src, sizeof(src));
+  auto end = chrono::steady_clock::now();
+  double sec = chrono::duration<double>(end - start).count();
+  printf("execute memcpy: %d bytes in %.3f sec\n", int(sizeof(src)), sec);
+#else
+  RV32_asm::Emulator emu;
+  if (!emu.setTranslation(translation)) {
+    return;
+  }
+  emu.load(0x10000, code, size);
+  emu.map(0x100000, dst, sizeof(dst));
+  emu.map(0x200000, src, sizeof(src));
+  emu.setReg(10, 0x100000);
+  emu.setReg(11, 0x200000);
+  emu.setReg(12, sizeof(src));
+  emu.call(0x10000);
+  auto end = chrono::steady_clock::now();
+  double sec = chrono::duration<double>(end - start).count();
+  printf("execute memcpy (emulator%s): %llu insns, %llu cycles in %.3f sec "
+         "(%.2f MIPS)\n",
+         translation ? ", translated" : "",
+         (unsigned long long)emu.getRetired(),
+         (unsigned long long)emu.getCycles(), sec,
+         emu.getRetired() / sec / 1e6);
+#endif
+}
+
+int main(void) {
+  vector<string> names;
+  for (int i = 0; i < blocks; ++i) {
+    char buf[16];
+    sprintf(buf, ".L%d", i);
+    names.push_back(buf);
+  }
+
+  run("emit+generate (string labels)", &names, false);
+  run("emit+generate (label handles)", NULL, false);
+  run("emit+generate (direct mode)", NULL, true);
+  run("emit+generate (label handles, reused)", NULL, false, true);
+  run("emit+generate (direct mode, reused)", NULL, true, true);
+  runConstruct();
+  runDisasm();
+  runExecute();
+#if TARGET != TARGET_RISCV
+  runExecute(true);
+#endif
+}
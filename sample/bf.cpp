@@ -1,9 +1,11 @@
-#define DEBUG 1
+#include <chrono>
 #include <cstdio>
 #include <stack>
 #include <string>
+#include <utility>
 
 #include "RV32_asm.hpp"
+#include "RV32_asm_emu.hpp"
 
 using namespace std;
 
@@ -17,23 +19,32 @@ static int getch(void) {
   }
 }
 
-class Bf : public RV32_asm::RV32GC {
-  void operator=(const Bf &);
+// RISC-V 以外の環境でエミュレータから呼び出す put / getch
+static void emuPut(RV32_asm::Emulator &emu, void *) { put(emu.getReg(10)); }
+static void emuGetch(RV32_asm::Emulator &emu, void *) {
+  emu.setReg(10, getch());
+}
 
-  int label_count;
-  uchar mem[10000];
+static uchar mem[10000];
 
-  string getLabel() {
-    char buf[16];
-    sprintf(buf, ".L%d", label_count++);
-    return buf;
-  }
+// エミュレータで実行する場合のゲストのアドレス
+enum : uint32_t {
+  EMU_CODE = 0x00010000,
+  EMU_MEM = 0x00100000,
+  EMU_PUT = 0x00200000,  // ホスト関数の呼び出し用(マップしない)
+  EMU_GETCH = 0x00200004,
+  EMU_STACK = 0x80000000,
+};
+
+class Bf : public RV32_asm::RV32GC {
+  void operator=(const Bf &);
 
  public:
-  Bf(const char *src)
-      : RV32_asm::RV32GC(RV32_asm::DEFAULT_MAX_CODE_SIZE, 0),
-        label_count(0),
-        mem{0} {
+  // memAddr, putAddr, getchAddr には生成したコードから見た
+  // メモリ、 put 関数、 getch 関数のアドレスを指定する
+  Bf(const char *src, intptr_t memAddr, intptr_t putAddr, intptr_t getchAddr)
+      : RV32_asm::RV32GC(RV32_asm::DEFAULT_MAX_CODE_SIZE,
+                         RV32_asm::AutoGrow) {
     // レジスタの使い方
     // a0 : メモリアクセス用一時領域・関数呼び出しの引数/戻り値
     // s1 : ポインタ
@@ -41,7 +52,8 @@ class Bf : public RV32_asm::RV32GC {
     // s3 : get 関数
 
     // [ ] 命令の入れ子管理用スタック
-    stack<string> par;
+    // ループの先頭と末尾のラベルの組を積む
+    stack<pair<RV32_asm::Label, RV32_asm::Label> > par;
 
     // 保存しておく必要があるレジスタの内容をスタックに退避する
     addi(sp, sp, -32);
@@ -52,9 +64,9 @@ class Bf : public RV32_asm::RV32GC {
     sw(s3, sp[8]);
     addi(s0, sp, 32);
 
-    li(s1, (intptr_t) & (this->mem[0]));
-    li(s2, (intptr_t)put);
-    li(s3, (intptr_t)getch);
+    li(s1, memAddr);
+    li(s2, putAddr);
+    li(s3, getchAddr);
 
     /** 現在ポインタが指しているメモリと a0
      * レジスタの内容が一致しているかを表すフラグ*/
@@ -118,21 +130,21 @@ class Bf : public RV32_asm::RV32GC {
           count++;
           break;
         case '[': {
-          string l = getLabel();
+          auto l = make_pair(newLabel(), newLabel());
           par.push(l);
 
-          L(l + "B");
+          L(l.first);
           lbu(a0, s1[0]);
-          beqz(a0, (l + "E").c_str());
+          beqz(a0, l.second);
 
           store = false;
           break;
         }
         case ']': {
-          string l = par.top();
+          auto l = par.top();
           par.pop();
-          j((l + "B").c_str());
-          L(l + "E");
+          j(l.first);
+          L(l.second);
 
           store = false;
           break;
@@ -166,17 +178,75 @@ class Bf : public RV32_asm::RV32GC {
     ret();
   }
 
+#if TARGET == TARGET_RISCV
   void exec() {
     auto *func = this->generate<void (*)(void)>();
     func();
   }
+#else
+  // RISC-V 以外の環境ではエミュレータで実行する
+  void exec() {
+    size_t size = 0;
+    const unsigned char *code = getCode(&size);
+    RV32_asm::Emulator emu;
+    // x86-64 ではよく実行する部分を x86-64 の命令に変換して実行する
+    emu.setTranslation(true);
+    emu.load(EMU_CODE, code, size);
+    emu.map(EMU_MEM, mem, sizeof(mem));
+    emu.setStack(EMU_STACK, 0x10000);
+    emu.addHostCall(EMU_PUT, emuPut);
+    emu.addHostCall(EMU_GETCH, emuGetch);
+    auto start = chrono::steady_clock::now();
+    const RV32_asm::Emulator::Stop stop = emu.call(EMU_CODE);
+    auto end = chrono::steady_clock::now();
+    double sec = chrono::duration<double>(end - start).count();
+    printf("\nstop=%d, %llu instructions, %llu cycles in %.3f sec "
+           "(%.2f MIPS)\n",
+           int(stop), (unsigned long long)emu.getRetired(),
+           (unsigned long long)emu.getCycles(), sec,
+           emu.getRetired() / sec / 1e6);
+  }
+#endif
 };
 
-int main(void) {
+// 引数にファイルを指定した場合はその Brainfuck のプログラムを実行する
+int main(int argc, char *argv[]) {
   const char *hello_world =
       "+++++++++[>++++++++>+++++++++++>+++>+<<<<-]>.>++.+++++++..+++.>+++++.<<+"
       "++++++++++++++.>.+++.------.--------.>+.>+.";
-  Bf *o = new Bf(hello_world);
+  string src;
+  if (argc > 1) {
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "can't open %s\n", argv[1]);
+      return 1;
+    }
+    int ch;
+    while ((ch = fgetc(fp)) != EOF) {
+      src += char(ch);
+    }
+    fclose(fp);
+  } else {
+    src = hello_world;
+  }
+#if TARGET == TARGET_RISCV
+  Bf *o = new Bf(src.c_str(), (intptr_t)mem, (intptr_t)put, (intptr_t)getch);
+#else
+  Bf *o = new Bf(src.c_str(), EMU_MEM, EMU_PUT, EMU_GETCH);
+#endif
+  // 命令の並びに残った無駄を覗き穴最適化で取り除く
+  const size_t removed = o->peephole();
+  fprintf(stderr, "peephole: %d instructions removed\n", int(removed));
+  // ロードの待ち時間を埋めるように命令を並べ替える
+  const size_t saved = o->schedule();
+  fprintf(stderr, "schedule: %d cycles saved (estimated)\n", int(saved));
+  // 生成した命令のリストを標準出力に表示する
+  RV32_asm::StdioListing listing(stdout);
+  if (argc <= 1) {
+    o->setListing(&listing);
+  }
   o->exec();
-  printf("INPUT:%s\n", hello_world);
+  if (argc <= 1) {
+    printf("INPUT:%s\n", hello_world);
+  }
 }
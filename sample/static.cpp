@@ -0,0 +1,105 @@
+#include <cstdio>
+#include <cstring>
+
+#include "RV32_asm.hpp"
+#include "RV32_asm_emu.hpp"
+#include "RV32_asm_static.hpp"
+
+// コンパイル時に命令列を生成するサンプル
+// test.cpp と同じ memcpy をコンパイル時に組み立てておき、
+// 実行時は生成器に埋め込むだけにする。
+// 実行時に同じ命令を記述した場合と同じオペコードになることも確かめる。
+
+struct Memcpy : RV32_asm::StaticGenerator<16> {
+  constexpr Memcpy() {
+    RV32_asm::StaticLabel loop = newLabel();
+    RV32_asm::StaticLabel body = newLabel();
+    add(a2, a0, a2);
+    mv(a5, a0);
+    L(loop);
+    bne(a5, a2, body);
+    ret();
+    L(body);
+    addi(a1, a1, 1);
+    lbu(a4, a1[-1]);
+    addi(a5, a5, 1);
+    sb(a4, a5[-1]);
+    j(loop);
+  }
+};
+
+constexpr Memcpy stub;
+constexpr auto memcpy_code = stub.halfwords<stub.size()>();
+
+class Test : public RV32_asm::RV32GC {
+  void operator=(const Test &);
+
+ public:
+  Test() { dh(memcpy_code); }
+};
+
+// 同じ memcpy を実行時に記述したもの
+class Runtime : public RV32_asm::RV32GC {
+  void operator=(const Runtime &);
+
+ public:
+  Runtime() {
+    add(a2, a0, a2);
+    mv(a5, a0);
+    L(".L59");
+    bne(a5, a2, ".L60");
+    ret();
+    L(".L60");
+    addi(a1, a1, 1);
+    lbu(a4, a1[-1]);
+    addi(a5, a5, 1);
+    sb(a4, a5[-1]);
+    j(".L59");
+  }
+};
+
+int main(void) {
+  printf("%d bytes:", int(memcpy_code.size() * 2));
+  for (auto h : memcpy_code) {
+    printf(" %04x", h);
+  }
+  puts("");
+
+  Runtime r;
+  size_t rsize = 0;
+  const unsigned char *rcode = r.getCode(&rsize);
+  const bool same = rcode != NULL && rsize == memcpy_code.size() * 2 &&
+                    memcmp(rcode, memcpy_code.data(), rsize) == 0;
+  printf("runtime: %d bytes, %s\n", int(rsize), same ? "same" : "DIFFERENT");
+
+  Test t;
+#if TARGET == TARGET_RISCV
+  auto *func = t.generate<void (*)(void *, void *, size_t)>();
+#else
+  size_t size = 0;
+  const unsigned char *code = t.getCode(&size);
+#endif
+
+  char a[] = "0123456789ABCDEF";
+  char b[] = "abcdefghijklmnopqrstuvwxyz";
+  printf("a[]=%s\nb[]=%s\n", a, b);
+#if TARGET == TARGET_RISCV
+  printf("Execute generated code.\n");
+  func(b, a, sizeof(a));
+#else
+  // RISC-V 以外の環境ではエミュレータで実行する
+  RV32_asm::Emulator emu;
+  emu.load(0x10000, code, size);
+  emu.map(0x20000, b, sizeof(b));
+  emu.map(0x30000, a, sizeof(a));
+  emu.setReg(10, 0x20000);
+  emu.setReg(11, 0x30000);
+  emu.setReg(12, sizeof(a));
+  printf("Execute generated code on the emulator.\n");
+  const RV32_asm::Emulator::Stop stop = emu.call(0x10000);
+  printf("stop=%d, %llu instructions\n", int(stop),
+         (unsigned long long)emu.getRetired());
+#endif
+  printf("a[]=%s\nb[]=%s\n", a, b);
+  return (same && strcmp(b, a) == 0) ? 0 : 1;
+}
@@ -1,5 +1,5 @@
-#define DEBUG 1
 #include "RV32_asm.hpp"
+#include "RV32_asm_emu.hpp"
 
 class Test : public RV32_asm::RV32GC {
   void operator=(const Test &);
@@ -25,7 +25,15 @@ class Test : public RV32_asm::RV32GC {
 int main(void) {
   Test t;
   printf("Version=%04x\n", t.getVersion());
+  // 生成した命令のリストを標準出力に表示する
+  RV32_asm::StdioListing listing(stdout);
+  t.setListing(&listing);
+#if TARGET == TARGET_RISCV
   auto *func = t.generate<void (*)(void *, void *, size_t)>();
+#else
+  size_t size = 0;
+  const unsigned char *code = t.getCode(&size);
+#endif
 
   char a[] = "0123456789ABCDEF";
   char b[] = "abcdefghijklmnopqrstuvwxyz";
@@ -34,7 +42,19 @@ int main(void) {
   printf("Execute generated code.\n");
   func(b, a, sizeof(a));
 #else
-  printf("Skip execution %p.\n", func);
+  // RISC-V 以外の環境ではエミュレータで実行する
+  RV32_asm::Emulator emu;
+  emu.load(0x10000, code, size);
+  emu.map(0x20000, b, sizeof(b));
+  emu.map(0x30000, a, sizeof(a));
+  emu.setReg(10, 0x20000);
+  emu.setReg(11, 0x30000);
+  emu.setReg(12, sizeof(a));
+  printf("Execute generated code on the emulator.\n");
+  const RV32_asm::Emulator::Stop stop = emu.call(0x10000);
+  printf("stop=%d, %llu instructions, %llu cycles\n", int(stop),
+         (unsigned long long)emu.getRetired(),
+         (unsigned long long)emu.getCycles());
 #endif
   printf("a[]=%s\nb[]=%s\n", a, b);
 }
@@ -0,0 +1,335 @@
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "RV32_asm.hpp"
+#include "RV32_asm_emu.hpp"
+
+// エミュレータの x86-64 への変換(setTranslation(true))が、
+// 変換しない場合と同じ結果になることを確かめるサンプル
+// RV32IM の命令をランダムに並べたループを、変換しない場合と変換する場合の
+// 両方で実行し、レジスタ・メモリ・実行した命令数・サイクル数と、
+// 停止した理由・ pc ・アクセスできなかったアドレスを比べる。
+// ループは何度も回るので、途中からブロックが変換されて実行される。
+// x86-64 のホストで g++ を使ってビルドして実行する。
+//   g++ -std=c++14 -I.. -O2 -fno-operator-names translate.cpp
+
+using RV32_asm::Emulator;
+using RV32_asm::Label;
+using RV32_asm::Reg;
+
+enum {
+  CODE_ADDR = 0x10000,
+  DATA_ADDR = 0x20000,
+  DATA_SIZE = 256,
+  FAULT_ADDR = 0x70000000,
+  STACK_TOP = 0x80000000,
+  LOOPS = 100,
+};
+
+// ランダムな命令を並べたループ
+// s11 をループの回数、 t6 をデータ領域の先頭に使い、他のレジスタを壊す。
+// fault が true の場合は、途中の周回でマップしていないアドレスを読む。
+// void f(void)
+class Random : public RV32_asm::RV32GC {
+  void operator=(const Random &);
+
+  std::mt19937 &rnd;
+
+  uint32_t next(uint32_t n) { return uint32_t(rnd() % n); }
+
+  // 書き込み先のレジスタ(ra, sp, gp, tp, s11, t6 以外)
+  Reg dst() {
+    static const Reg regs[] = {t0, t1, t2, s0, s1, a0, a1, a2, a3, a4, a5,
+                               a6, a7, s2, s3, s4, s5, s6, s7, s8, s9, s10,
+                               t3, t4, t5};
+    return regs[next(sizeof(regs) / sizeof(regs[0]))];
+  }
+  // 読み出すレジスタ(zero も使う)
+  Reg src() { return next(8) == 0 ? zero : dst(); }
+
+  // 即値(小さい値が出やすいようにする)
+  int32_t imm12() {
+    return next(2) == 0 ? int32_t(next(64)) - 32 : int32_t(next(4096)) - 2048;
+  }
+
+  // データ領域の size バイト境界のオフセット
+  int32_t offset(int size) { return int32_t(next(DATA_SIZE / size)) * size; }
+
+  void insn() {
+    const Reg rd = dst(), rs1 = src(), rs2 = src();
+    switch (next(36)) {
+      case 0:
+        add(rd, rs1, rs2);
+        break;
+      case 1:
+        sub(rd, rs1, rs2);
+        break;
+      case 2:
+        sll(rd, rs1, rs2);
+        break;
+      case 3:
+        slt(rd, rs1, rs2);
+        break;
+      case 4:
+        sltu(rd, rs1, rs2);
+        break;
+      case 5:
+        x\
+or(rd, rs1, rs2);
+        break;
+      case 6:
+        srl(rd, rs1, rs2);
+        break;
+      case 7:
+        sra(rd, rs1, rs2);
+        break;
+      case 8:
+        or (rd, rs1, rs2);
+        break;
+      case 9:
+        and (rd, rs1, rs2);
+        break;
+      case 10:
+        addi(rd, rs1, imm12());
+        break;
+      case 11:
+        slti(rd, rs1, imm12());
+        break;
+      case 12:
+        sltiu(rd, rs1, imm12());
+        break;
+      case 13:
+        xori(rd, rs1, imm12());
+        break;
+      case 14:
+        ori(rd, rs1, imm12());
+        break;
+      case 15:
+        andi(rd, rs1, imm12());
+        break;
+      case 16:
+        slli(rd, rs1, next(32));
+        break;
+      case 17:
+        srli(rd, rs1, next(32));
+        break;
+      case 18:
+        srai(rd, rs1, next(32));
+        break;
+      case 19:
+        lui(rd, rnd() & 0xfffff);
+        break;
+      case 20:
+        li(rd, int32_t(rnd()));
+        break;
+      case 21:
+        mul(rd, rs1, rs2);
+        break;
+      case 22:
+        mulh(rd, rs1, rs2);
+        break;
+      case 23:
+        mulhsu(rd, rs1, rs2);
+        break;
+      case 24:
+        mulhu(rd, rs1, rs2);
+        break;
+      case 25:
+        div(rd, rs1, rs2);
+        break;
+      case 26:
+        divu(rd, rs1, rs2);
+        break;
+      case 27:
+        rem(rd, rs1, rs2);
+        break;
+      case 28:
+        remu(rd, rs1, rs2);
+        break;
+      case 29:
+        lb(rd, t6[offset(1)]);
+        break;
+      case 30:
+        lbu(rd, t6[offset(1)]);
+        break;
+      case 31:
+        lh(rd, t6[offset(2)]);
+        break;
+      case 32:
+        lhu(rd, t6[offset(2)]);
+        break;
+      case 33:
+        lw(rd, t6[offset(4)]);
+        break;
+      case 34:
+        sb(rs2, t6[offset(1)]);
+        break;
+      default:
+        if (next(2) == 0) {
+          sh(rs2, t6[offset(2)]);
+        } else {
+          sw(rs2, t6[offset(4)]);
+        }
+        break;
+    }
+  }
+
+  // 後ろの数命令を飛び越すかもしれない分岐
+  void branch(const Label &label) {
+    const Reg rs1 = src(), rs2 = src();
+    switch (next(6)) {
+      case 0:
+        beq(rs1, rs2, label);
+        break;
+      case 1:
+        bne(rs1, rs2, label);
+        break;
+      case 2:
+        blt(rs1, rs2, label);
+        break;
+      case 3:
+        bge(rs1, rs2, label);
+        break;
+      case 4:
+        bltu(rs1, rs2, label);
+        break;
+      default:
+        bgeu(rs1, rs2, label);
+        break;
+    }
+  }
+
+ public:
+  Random(std::mt19937 &rnd, bool fault) : rnd(rnd) {
+    Label loop = newLabel();
+    li(s11, LOOPS);
+    L(loop);
+    const int n = 20 + int(next(60));
+    for (int i = 0; i < n; ++i) {
+      if (next(6) == 0) {
+        Label skip = newLabel();
+        branch(skip);
+        for (int j = int(next(4)); j >= 0; --j) {
+          insn();
+        }
+        L(skip);
+      } else {
+        insn();
+      }
+    }
+    if (fault) {
+      // 変換した後の周回で読む
+      Label skip = newLabel();
+      addi(t5, s11, -int32_t(next(LOOPS / 2)) - 1);
+      bnez(t5, skip);
+      li(t5, FAULT_ADDR);
+      lw(t5, t5[0]);
+      L(skip);
+    }
+    addi(s11, s11, -1);
+    bnez(s11, loop);
+    ret();
+  }
+};
+
+// 1回分の実行結果
+struct Result {
+  Emulator::Stop stop;
+  uint32_t x[32];
+  unsigned char data[DATA_SIZE];
+  uint64_t retired;
+  uint64_t cycles;
+  uint32_t pc;
+  uint32_t faultAddress;
+  size_t translated;
+};
+
+static void run(const unsigned char *code, size_t size, const uint32_t *x,
+                const unsigned char *data, bool translation, Result &r) {
+  memcpy(r.data, data, DATA_SIZE);
+  Emulator emu;
+  emu.setTranslation(translation);
+  emu.load(CODE_ADDR, code, size);
+  emu.map(DATA_ADDR, r.data, DATA_SIZE);
+  emu.setStack(STACK_TOP, 0x1000);
+  for (int i = 3; i < 32; ++i) {
+    emu.setReg(i, x[i]);
+  }
+  emu.setReg(31, DATA_ADDR);
+  r.stop = emu.call(CODE_ADDR);
+  for (int i = 0; i < 32; ++i) {
+    r.x[i] = emu.getReg(i);
+  }
+  r.retired = emu.getRetired();
+  r.cycles = emu.getCycles();
+  r.pc = emu.getPC();
+  r.faultAddress = emu.getFaultAddress();
+  r.translated = emu.getTranslated();
+}
+
+// 違っていた最初の項目の名前を返す(同じ場合は NULL)
+static const char *compare(const Result &a, const Result &b) {
+  if (a.stop != b.stop) {
+    return "stop";
+  }
+  if (memcmp(a.x, b.x, sizeof(a.x)) != 0) {
+    return "registers";
+  }
+  if (memcmp(a.data, b.data, sizeof(a.data)) != 0) {
+    return "memory";
+  }
+  if (a.retired != b.retired) {
+    return "retired";
+  }
+  if (a.cycles != b.cycles) {
+    return "cycles";
+  }
+  if (a.stop == Emulator::STOP_FAULT &&
+      (a.pc != b.pc || a.faultAddress != b.faultAddress)) {
+    return "fault";
+  }
+  return NULL;
+}
+
+int main(void) {
+#if RV32_ASM_EMU_X64
+  const int programs = 300;
+  int failed = 0;
+  size_t translated = 0;
+  for (int seed = 0; seed < programs; ++seed) {
+    std::mt19937 rnd(seed);
+    uint32_t x[32];
+    for (int i = 0; i < 32; ++i) {
+      x[i] = (rnd() % 4 == 0) ? uint32_t(rnd() % 64) - 32 : uint32_t(rnd());
+    }
+    unsigned char data[DATA_SIZE];
+    for (unsigned char &d : data) {
+      d = (unsigned char)rnd();
+    }
+    Random g(rnd, seed % 4 == 3);
+    size_t size = 0;
+    const unsigned char *code = g.getCode(&size);
+    if (code == NULL) {
+      printf("seed %d: error %d\n", seed, int(g.getError()));
+      ++failed;
+      continue;
+    }
+    Result interp, native;
+    run(code, size, x, data, false, interp);
+    run(code, size, x, data, true, native);
+    translated += native.translated;
+    const char *diff = compare(interp, native);
+    if (diff != NULL) {
+      printf("seed %d: %s differs\n", seed, diff);
+      ++failed;
+    }
+  }
+  printf("%d programs, %d translated blocks, %s\n", programs, int(translated),
+         failed == 0 ? "ok" : "NG");
+  return failed == 0 ? 0 : 1;
+#else
+  puts("translation is only available on x86-64 hosts");
+  return 0;
+#endif
+}
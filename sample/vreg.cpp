@@ -0,0 +1,258 @@
+#include <cstdio>
+
+#include "RV32_asm.hpp"
+#include "RV32_asm_emu.hpp"
+#include "RV32_asm_vreg.hpp"
+
+// 仮想レジスタで記述した関数を生成して実行し、結果を確かめるサンプル
+// RISC-V 以外の環境ではエミュレータで実行し、呼び出し先で保存が必要な
+// レジスタ(s0 - s11)と sp が元に戻っていることも確かめる。
+
+using RV32_asm::Label;
+using RV32_asm::VReg;
+using RV32_asm::VRegAlloc;
+
+static uint32_t data[64];
+
+// 配列の合計に、ループをまたいで生きている extra 個の値を足す
+// extra が大きいとレジスタが足りなくなり、スタックに置く値が出る。
+// uint32_t f(const uint32_t *p, uint32_t n)
+class Sum : public RV32_asm::RV32GC {
+  void operator=(const Sum &);
+
+ public:
+  size_t spills;
+
+  explicit Sum(int extra) {
+    VRegAlloc<RV32_asm::RV32GC> v(*this);
+    VReg p = v.arg(0), n = v.arg(1), sum = v.newReg(), t = v.newReg();
+    std::vector<VReg> e;
+    for (int i = 0; i < extra; ++i) {
+      e.push_back(v.newReg());
+      v.addi(e[i], n, i);
+    }
+    Label loop = newLabel(), done = newLabel();
+    v.li(sum, 0);
+    v.L(loop);
+    v.beqz(n, done);
+    v.lw(t, p[0]);
+    v.add(sum, sum, t);
+    v.addi(p, p, 4);
+    v.addi(n, n, -1);
+    v.j(loop);
+    v.L(done);
+    for (int i = 0; i < extra; ++i) {
+      v.add(sum, sum, e[i]);
+    }
+    v.ret(sum);
+    v.allocate();
+    spills = v.getSpillCount();
+  }
+};
+
+// 関数呼び出しをまたいで値を使う
+// 呼び出し先は呼び出し元で保存が必要なレジスタを全て壊すので、
+// 呼び出しをまたぐ値は s0 - s11 かスタックに置かないと結果が合わない。
+// 1回目の呼び出しは引数を入れ替えて渡すので、 a0 と a1 の交換になる。
+// uint32_t f(uint32_t a, uint32_t b)
+class Call : public RV32_asm::RV32GC {
+  void operator=(const Call &);
+
+ public:
+  Call() {
+    VRegAlloc<RV32_asm::RV32GC> v(*this);
+    VReg a = v.arg(0), b = v.arg(1), r = v.newReg(), s = v.newReg();
+    std::vector<VReg> x;
+    for (int i = 0; i < 6; ++i) {
+      x.push_back(v.newReg());
+      v.addi(x[i], a, i * 10);
+    }
+    Label callee = newLabel();
+    v.call(callee, {b, a}, r);     // r = b - a
+    v.call(callee, {r, x[5]}, s);  // s = r - (a + 50)
+    for (int i = 0; i < 6; ++i) {
+      v.add(s, s, x[i]);
+    }
+    v.ret(s);
+    v.allocate();
+
+    // a0 = a0 - a1 を返し、呼び出し元で保存が必要なレジスタを壊す
+    L(callee);
+    sub(a0, a0, a1);
+    const RV32_asm::Reg clobber[] = {t0, t1, t2, t3, t4, t5, t6, a1,
+                                     a2, a3, a4, a5, a6, a7};
+    for (const RV32_asm::Reg &r : clobber) {
+      li(r, 0x5a5a5a5a);
+    }
+    ret();
+  }
+
+  static uint32_t expect(uint32_t a, uint32_t b) {
+    uint32_t s = (b - a) - (a + 50);
+    for (uint32_t i = 0; i < 6; ++i) {
+      s += a + i * 10;
+    }
+    return s;
+  }
+};
+
+// ループの先頭でしか読まない値
+// 生存区間をループの末尾まで伸ばさないと、ループの中で後から定義した
+// 値に同じレジスタが割り当てられ、次の周回で k が壊れる。
+// uint32_t f(uint32_t k, uint32_t n)
+class Loop : public RV32_asm::RV32GC {
+  void operator=(const Loop &);
+
+ public:
+  Loop() {
+    VRegAlloc<RV32_asm::RV32GC> v(*this);
+    VReg k = v.arg(0), n = v.arg(1), acc = v.newReg();
+    VReg c0 = v.newReg(), c1 = v.newReg(), c2 = v.newReg();
+    Label loop = newLabel(), done = newLabel();
+    v.li(acc, 0);
+    v.L(loop);
+    v.beqz(n, done);
+    v.add(acc, acc, k);
+    v.li(c0, 1000);
+    v.li(c1, 200);
+    v.li(c2, 30);
+    v.add(c0, c0, c1);
+    v.add(c0, c0, c2);
+    v.add(acc, acc, c0);
+    v.addi(n, n, -1);
+    v.j(loop);
+    v.L(done);
+    v.ret(acc);
+    v.allocate();
+  }
+};
+
+// ループの途中の出口の先で読む値
+// t はループの中で書き込んでから出口の先で読むので、次の周回で出口に
+// 分岐するまで生きている。ループの中で後から定義する u に同じレジスタを
+// 割り当てると、出口で読む t が壊れる。
+// uint32_t f(uint32_t i)(i は 1 以上)
+class Exit : public RV32_asm::RV32GC {
+  void operator=(const Exit &);
+
+ public:
+  Exit() {
+    VRegAlloc<RV32_asm::RV32GC> v(*this);
+    VReg i = v.arg(0), acc = v.newReg(), t = v.newReg(), u = v.newReg();
+    Label top = newLabel(), exit = newLabel();
+    v.li(acc, 0);
+    v.L(top);
+    v.li(u, 100);
+    v.add(acc, acc, u);
+    v.beqz(i, exit);
+    v.addi(t, i, 0);
+    v.addi(i, i, -1);
+    v.j(top);
+    v.L(exit);
+    v.add(acc, acc, t);
+    v.ret(acc);
+    v.allocate();
+  }
+};
+
+#if TARGET == TARGET_RISCV
+static uint32_t dataAddr() { return uint32_t(uintptr_t(data)); }
+#else
+enum { DATA_ADDR = 0x20000, STACK_TOP = 0x80000000 };
+static uint32_t dataAddr() { return DATA_ADDR; }
+#endif
+
+// 生成した関数 f(x, y) を呼び出して a0 を result に返す
+static bool run(RV32_asm::RV32GC &g, uint32_t x, uint32_t y,
+                uint32_t &result) {
+  RV32_asm::VerifyListing verify(stderr);
+  g.setListing(&verify);
+#if TARGET == TARGET_RISCV
+  auto *func = g.generate<uint32_t (*)(uint32_t, uint32_t)>();
+  if (func == NULL || verify.getErrors() != 0) {
+    return false;
+  }
+  result = func(x, y);
+  return true;
+#else
+  size_t size = 0;
+  const unsigned char *code = g.getCode(&size);
+  if (code == NULL || verify.getErrors() != 0) {
+    return false;
+  }
+  RV32_asm::Emulator emu;
+  emu.load(0x10000, code, size);
+  emu.map(DATA_ADDR, data, sizeof(data));
+  emu.setStack(STACK_TOP, 0x10000);
+  const int saved[] = {8, 9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27};
+  for (int r : saved) {
+    emu.setReg(r, 0x1000 + r);
+  }
+  emu.setReg(10, x);
+  emu.setReg(11, y);
+  if (emu.call(0x10000) != RV32_asm::Emulator::STOP_RETURN) {
+    return false;
+  }
+  for (int r : saved) {
+    if (emu.getReg(r) != uint32_t(0x1000 + r)) {
+      printf("  s-register x%d is not restored\n", r);
+      return false;
+    }
+  }
+  if (emu.getReg(2) != STACK_TOP) {
+    printf("  sp is not restored\n");
+    return false;
+  }
+  result = emu.getReg(10);
+  return true;
+#endif
+}
+
+static bool check(const char *name, bool ok, uint32_t result,
+                  uint32_t expect) {
+  ok = ok && result == expect;
+  printf("%-12s %s (result=%u, expect=%u)\n", name, ok ? "ok" : "NG", result,
+         expect);
+  return ok;
+}
+
+int main(void) {
+  const uint32_t n = 20;
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    data[i] = i * 7 + 1;
+    total += data[i];
+  }
+
+  bool ok = true;
+  uint32_t result = 0;
+  const int extras[] = {0, 5, 20, 30};
+  for (int extra : extras) {
+    Sum g(extra);
+    char name[32];
+    snprintf(name, sizeof(name), "sum+%d", extra);
+    const bool r = run(g, dataAddr(), n, result);
+    printf("%-12s %d values on the stack\n", name, int(g.spills));
+    uint32_t expect = total;
+    for (int i = 0; i < extra; ++i) {
+      expect += n + i;
+    }
+    ok = check(name, r, result, expect) && ok;
+  }
+  {
+    Call g;
+    const bool r = run(g, 1000, 77, result);
+    ok = check("call", r, result, Call::expect(1000, 77)) && ok;
+  }
+  {
+    Loop g;
+    const bool r = run(g, 5, 10, result);
+    ok = check("loop", r, result, 10 * (5 + 1230)) && ok;
+  }
+  {
+    Exit g;
+    const bool r = run(g, 3, 0, result);
+    ok = check("loop exit", r, result, 4 * 100 + 1) && ok;
+  }
+  return ok ? 0 : 1;
+}